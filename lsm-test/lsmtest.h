@@ -92,6 +92,7 @@ int test_lsm_zip_open(const char*, const char*, int bClear, TestDb **ppDb);
 int test_lsm_small_open(const char*, const char*, int bClear, TestDb **ppDb);
 int test_lsm_mt2(const char*, const char *zFile, int bClear, TestDb **ppDb);
 int test_lsm_mt3(const char*, const char *zFile, int bClear, TestDb **ppDb);
+int test_lsm_bg(const char*, const char *zFile, int bClear, TestDb **ppDb);
 
 int tdb_lsm_configure(lsm_db *, const char *);
 
@@ -13,6 +13,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/time.h>
 
 
 void test_failed(){ 
@@ -572,6 +573,22 @@ static void do_speed_write_hook2(
 #define ST_NSCAN   5
 #define ST_KEYSIZE 6
 #define ST_VALSIZE 7
+#define ST_LATENCY 8
+
+/*
+** Return the current time in microseconds.
+*/
+static lsm_i64 speedTimeUs(void){
+  struct timeval t;
+  gettimeofday(&t, 0);
+  return (lsm_i64)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static int speedCmpInt(const void *p1, const void *p2){
+  int i1 = *(const int *)p1;
+  int i2 = *(const int *)p2;
+  return (i1<i2) ? -1 : (i1>i2);
+}
 
 
 static void print_speed_test_help(){
@@ -592,8 +609,13 @@ static void print_speed_test_help(){
 "  -fetch   $fetch                  (default value 0)\n"
 "  -keysize $keysize                (default value 12)\n"
 "  -valsize $valsize                (default value 100)\n"
+"  -latency $latency                (default value 0)\n"
 "  -system  $system                 (default value \"lsm\")\n"
 "\n"
+"If $latency is non-zero, each write is timed separately and the 99th\n"
+"percentile and maximum write latencies (in microseconds) are reported\n"
+"for each repetition.\n"
+"\n"
 );
 }
 
@@ -611,15 +633,17 @@ int do_speed_test2(int nArg, char **azArg){
     { "-nscan",   ST_NSCAN,      0},
     { "-keysize", ST_KEYSIZE,   12},
     { "-valsize", ST_VALSIZE,  100},
+    { "-latency", ST_LATENCY,    0},
     { "-system",  -1,            0},
     { "help",     -2,            0},
     {0, 0, 0}
   };
   int i;
-  int aParam[8];
+  int aParam[9];
   int rc = 0;
   int bReadonly = 0;
   int nContent = 0;
+  int *aLatency = 0;
 
   TestDb *pDb;
   Datasource *pData;
@@ -686,6 +710,8 @@ int do_speed_test2(int nArg, char **azArg){
 
   if( aParam[ST_WRITE]==0 ){
     bReadonly = 1;
+  }else if( aParam[ST_LATENCY] ){
+    aLatency = (int *)testMalloc(sizeof(int) * aParam[ST_WRITE]);
   }
 
   if( bLsm ){
@@ -710,6 +736,17 @@ int do_speed_test2(int nArg, char **azArg){
 
     if( bReadonly ){
       msWrite = 0;
+    }else if( aLatency ){
+      int iWrite;
+      testTimeInit();
+      for(iWrite=0; iWrite<nWrite && rc==0; iWrite++){
+        lsm_i64 iStart = speedTimeUs();
+        testWriteDatasource(pDb, pData, i*nWrite+iWrite, &rc);
+        aLatency[iWrite] = (int)(speedTimeUs() - iStart);
+      }
+      msWrite = testTimeGet();
+      nContent += nWrite;
+      qsort(aLatency, nWrite, sizeof(int), speedCmpInt);
     }else{
       testTimeInit();
       testWriteDatasourceRange(pDb, pData, i*nWrite, nWrite, &rc);
@@ -749,12 +786,20 @@ int do_speed_test2(int nArg, char **azArg){
       msWrite += testTimeGet();
     }
 
-    printf("%d %d %d\n", i, msWrite, msFetch);
+    if( aLatency ){
+      int nWrite = aParam[ST_WRITE];
+      printf("%d %d %d %d %d\n", i, msWrite, msFetch, 
+          aLatency[(nWrite-1) * 99 / 100], aLatency[nWrite-1]
+      );
+    }else{
+      printf("%d %d %d\n", i, msWrite, msFetch);
+    }
     fflush(stdout);
   }
 
   testClose(&pDb);
   testDatasourceFree(pData);
+  testFree(aLatency);
 
   if( pLog ){
     flushPrev(pLog);
@@ -1436,6 +1481,18 @@ static int do_insert(int nArg, char **azArg){
       }
     }
 
+    if( tdb_lsm(pDb) ){
+      /* Report write and space amplification. These are useful when
+      ** comparing merge policies (the "merge_policy" option).  */
+      int nWriteAmp = 0;
+      int nSpaceAmp = 0;
+      lsm_info(tdb_lsm(pDb), LSM_INFO_WRITE_AMP, &nWriteAmp);
+      lsm_info(tdb_lsm(pDb), LSM_INFO_SPACE_AMP, &nSpaceAmp);
+      printf("write amplification: %d.%02d  space amplification: %d.%02d\n",
+          nWriteAmp/100, nWriteAmp%100, nSpaceAmp/100, nSpaceAmp%100
+      );
+    }
+
     testDatasourceFree(pData);
     tdb_close(pDb);
     flushHook(&hook);
@@ -722,6 +722,7 @@ static struct Lib {
 #ifdef LSM_MUTEX_PTHREADS
   { "lsm_mt2",      "testdb.lsm_mt2",   test_lsm_mt2 },
   { "lsm_mt3",      "testdb.lsm_mt3",   test_lsm_mt3 },
+  { "lsm_bg",       "testdb.lsm_bg",    test_lsm_bg },
 #endif
 #ifdef HAVE_LEVELDB
   { "leveldb",      "testdb.leveldb",   test_leveldb_open },
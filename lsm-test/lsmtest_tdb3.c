@@ -771,6 +771,11 @@ int test_lsm_config_str(
     { "automerge",        0, LSM_CONFIG_AUTOMERGE },
     { "max_freelist",     0, LSM_CONFIG_MAX_FREELIST },
     { "multi_proc",       0, LSM_CONFIG_MULTIPLE_PROCESSES },
+    { "worker_thread",    0, LSM_CONFIG_WORKER_THREAD },
+    { "page_cache",       0, LSM_CONFIG_PAGE_CACHE },
+    { "merge_policy",     0, LSM_CONFIG_MERGE_POLICY },
+    { "merge_window",     0, LSM_CONFIG_MERGE_WINDOW },
+    { "commit_delay",     0, LSM_CONFIG_COMMIT_DELAY },
     { "worker_automerge", 1, LSM_CONFIG_AUTOMERGE },
     { "test_no_recovery", 0, TEST_NO_RECOVERY },
     { "bg_min_ckpt",      0, TEST_NO_RECOVERY },
@@ -1349,6 +1354,16 @@ int test_lsm_mt3(
   return testLsmOpen(zCfg, zFilename, bClear, ppDb);
 }
 
+int test_lsm_bg(
+  const char *zSpec, 
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = "worker_thread=1";
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
 #else
 static void mt_shutdown(LsmDb *pDb) { 
   unused_parameter(pDb); 
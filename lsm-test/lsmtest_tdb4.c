@@ -641,6 +641,8 @@ static int testBtConfigure(BtDb *pDb, const char *zCfg, int *pbMt){
       { "multiproc",      BT_CONTROL_MULTIPROC },
       { "blksz",          BT_CONTROL_BLKSZ },
       { "pagesz",         BT_CONTROL_PAGESZ },
+      { "merge_thread",   BT_CONTROL_MERGE_THREAD },
+      { "merge_backlog",  BT_CONTROL_MERGE_BACKLOG },
       { "mt",             -1 },
       { "fastinsert",     -2 },
       { 0, 0 }
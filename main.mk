@@ -84,7 +84,7 @@ LIBOBJ+= vdbe.o parse.o \
          tokenize.o trigger.o \
          update.o util.o varint.o \
          vdbeapi.o vdbeaux.o vdbecodec.o vdbecursor.o \
-         vdbemem.o vdbetrace.o \
+         vdbemem.o vdbesort.o vdbetrace.o \
          walker.o where.o utf.o
 
 LIBOBJ += bt_unix.o bt_pager.o bt_main.o bt_varint.o kvbt.o bt_lock.o bt_log.o
@@ -184,6 +184,7 @@ SRC = \
   $(TOP)/src/vdbecodec.c \
   $(TOP)/src/vdbecursor.c \
   $(TOP)/src/vdbemem.c \
+  $(TOP)/src/vdbesort.c \
   $(TOP)/src/vdbetrace.c \
   $(TOP)/src/vdbeInt.h \
   $(TOP)/src/walker.c \
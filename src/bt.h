@@ -167,6 +167,51 @@ int sqlite4BtGetCookie(bt_db*, unsigned int *piVal);
 ** BT_CONTROL_LOGSIZECB:
 **
 ** BT_CONTROL_CHECKPOINT:
+**   The third argument is interpreted as a pointer to an instance of type
+**   bt_checkpoint. Frames are copied from the log into the database file,
+**   oldest first, leaving at least nFrameBuffer frames in the log. If
+**   nFrameMax is greater than zero, at most nFrameMax frames are copied.
+**   This allows a large log to be drained incrementally by a series of 
+**   checkpoints. Before returning, nCkpt is set to the number of frames
+**   copied.
+**
+** BT_CONTROL_CKPTSLICE:
+**   The third argument is interpreted as a pointer to type (int). If the
+**   indicated value is greater than or equal to zero, it is used as the
+**   maximum number of frames copied by each auto-checkpoint (or 0 for no
+**   limit - the default). Otherwise, it is set to the current value. 
+**   Setting this option means that each transaction that triggers an 
+**   auto-checkpoint does a bounded amount of checkpoint work, instead of
+**   the committer being stalled while the whole log is drained.
+**
+** BT_CONTROL_CKPTBATCH:
+**   The third argument is interpreted as a pointer to type (int). If the
+**   indicated value is greater than zero, it is used as the maximum number
+**   of consecutive pages written to the database file using a single 
+**   call to bt_env.xWrite() during a checkpoint. Values larger than 1024
+**   are treated as 1024. Otherwise, it is set to the current value. The
+**   default value is 32.
+**
+** BT_CONTROL_SHAREDCACHE:
+**   The third argument is interpreted as a pointer to type (int). If the
+**   indicated value is greater than or equal to zero, it is used as the
+**   maximum amount of memory, in KB, used by the page cache shared by all
+**   connections to all databases within the process. Otherwise, it is set
+**   to the current value. The default value is 0, which disables the 
+**   shared cache.
+**
+**   If the shared cache is enabled, each page read from the log or 
+**   database file by any connection is added to it, so that it need not be
+**   read from disk by other connections that require the same version of
+**   the page. Each connection continues to use a private cache as well,
+**   but a smaller private cache may be configured if the shared cache is
+**   in use.
+**
+** BT_CONTROL_SHAREDCACHE_STATS:
+**   The third argument is interpreted as a pointer to an instance of type
+**   bt_cachestats. Before returning, the nHit and nMiss fields are set to
+**   the number of times a page required by this connection was or was not
+**   found in the shared cache.
 **
 ** BT_CONTROL_FAST_INSERT_OP:
 **   The third argument is currently unused. This file-control causes the 
@@ -177,6 +222,66 @@ int sqlite4BtGetCookie(bt_db*, unsigned int *piVal);
 **   In other words, an app that uses the fast-insert tree exclusively 
 **   must execute this file-control before every call to CsrOpen() or 
 **   Replace().
+**
+** BT_CONTROL_MERGE_THREAD:
+**   The third argument is interpreted as a pointer to type (int). If the
+**   indicated value is 1, a background thread is started to checkpoint
+**   the database. Each checkpoint also runs any fast-insert merge 
+**   described by the schedule page. If it is 0, the thread is stopped.
+**   Otherwise, the value is unchanged. Before returning, the value is set
+**   to 1 if the thread is enabled, or 0 otherwise. The thread is only
+**   available in threadsafe builds on unix.
+**
+**   This control may be used before or after sqlite4BtOpen() is called. 
+**   While the thread is running, the connection does not checkpoint the
+**   log itself. Instead, a commit that leaves the log larger than the
+**   BT_CONTROL_AUTOCKPT value, or that leaves a fast-insert merge 
+**   outstanding, wakes the thread. The thread uses a second connection
+**   to the same database, opened and closed along with this one.
+**
+** BT_CONTROL_MERGE_BACKLOG:
+**   The third argument is interpreted as a pointer to type (int). If the
+**   indicated value is greater than or equal to zero, it is used as the
+**   maximum number of level-0 fast-insert sub-trees that may accumulate
+**   while the merge thread falls behind. Otherwise, it is set to the 
+**   current value. When a write transaction that starts a new sub-tree 
+**   is committed while there are more than this many, the commit does not
+**   return until the merge thread has finished its next pass. Zero means
+**   no limit. The default value is 16.
+**
+** BT_CONTROL_CKSUM:
+**   The third argument is interpreted as a pointer to type (int). If the
+**   indicated value is BT_CKSUM_FLETCHER or BT_CKSUM_CRC32C, it is used as
+**   the checksum algorithm for log frames. Otherwise, it is set to the 
+**   current value. The default is BT_CKSUM_FLETCHER.
+**
+**   The algorithm used is recorded in the log file header. A log file that
+**   already contains frames continues to use the algorithm it was started
+**   with - the new setting takes effect the next time a connection begins
+**   writing to an empty log file.
+**
+** BT_CONTROL_RECOVER_THREADS:
+**   The third argument is interpreted as a pointer to type (int). If the
+**   indicated value is greater than zero, it is used as the maximum number
+**   of threads used to verify log frame checksums when the database is 
+**   recovered, including the thread running recovery. Otherwise, it is set
+**   to the current value. The default value is 1 (no additional threads).
+**   Additional threads are only used in threadsafe builds on unix, never 
+**   more than there are processors online, and only if the log file 
+**   contains enough frames to make them worthwhile.
+**
+**   Recovery is run by sqlite4BtOpen(), so this control must be used 
+**   before it is called to have any effect.
+**
+** BT_CONTROL_RECOVERCB:
+**   The third argument is interpreted as a pointer to an instance of type
+**   bt_recovercb. If the xRecover member is not NULL, it is invoked 
+**   periodically while the connection recovers the database from the log
+**   file. The second argument passed to it is the number of frames 
+**   recovered so far. The third is the number of frames that the log 
+**   file has space for - an upper bound on the number that will be 
+**   recovered. Like BT_CONTROL_RECOVER_THREADS, this control must be used
+**   before sqlite4BtOpen() is called.
 */
 #define BT_CONTROL_INFO           7706389
 #define BT_CONTROL_SETVFS         7706390
@@ -190,6 +295,15 @@ int sqlite4BtGetCookie(bt_db*, unsigned int *piVal);
 #define BT_CONTROL_FAST_INSERT_OP 7706498
 #define BT_CONTROL_BLKSZ          7706499
 #define BT_CONTROL_PAGESZ         7706500
+#define BT_CONTROL_CKPTSLICE      7706501
+#define BT_CONTROL_CKPTBATCH      7706502
+#define BT_CONTROL_SHAREDCACHE    7706503
+#define BT_CONTROL_SHAREDCACHE_STATS 7706504
+#define BT_CONTROL_MERGE_THREAD   7706505
+#define BT_CONTROL_MERGE_BACKLOG  7706506
+#define BT_CONTROL_CKSUM          7706507
+#define BT_CONTROL_RECOVER_THREADS 7706508
+#define BT_CONTROL_RECOVERCB      7706509
 
 int sqlite4BtControl(bt_db*, int op, void *pArg);
 
@@ -197,6 +311,9 @@ int sqlite4BtControl(bt_db*, int op, void *pArg);
 #define BT_SAFETY_NORMAL 1
 #define BT_SAFETY_FULL   2
 
+#define BT_CKSUM_FLETCHER 0
+#define BT_CKSUM_CRC32C   1
+
 typedef struct bt_info bt_info;
 struct bt_info {
   int eType;
@@ -211,6 +328,7 @@ struct bt_info {
 #define BT_INFO_BLOCK_FREELIST 5
 #define BT_INFO_PAGE_FREELIST  6
 #define BT_INFO_PAGE_LEAKS     7
+#define BT_INFO_SUMMARY        8
 
 typedef struct bt_logsizecb bt_logsizecb;
 struct bt_logsizecb {
@@ -218,12 +336,25 @@ struct bt_logsizecb {
   void (*xLogsize)(void*, int);   /* Callback function */
 };
 
+typedef struct bt_recovercb bt_recovercb;
+struct bt_recovercb {
+  void *pCtx;                     /* A copy of this is passed to xRecover() */
+  void (*xRecover)(void*, int, int);  /* Callback function */
+};
+
 typedef struct bt_checkpoint bt_checkpoint;
 struct bt_checkpoint {
   int nFrameBuffer;               /* Minimum number of frames to leave in log */
+  int nFrameMax;                  /* Max frames to checkpoint (0 for no limit) */
   int nCkpt;                      /* OUT: Number of frames checkpointed */
 };
 
+typedef struct bt_cachestats bt_cachestats;
+struct bt_cachestats {
+  int nHit;                       /* OUT: Pages found in shared cache */
+  int nMiss;                      /* OUT: Pages not found in shared cache */
+};
+
 /*
 ** File-system interface.
 */
@@ -254,11 +385,23 @@ struct bt_env {
 
 /*
 ** Flags for xOpen
+**
+** If the BT_OPEN_TEMP flag is set, the zFile argument passed to xOpen is 
+** NULL. In this case the environment should open an anonymous temporary
+** file that is deleted automatically when it is closed.
 */
 #define BT_OPEN_DATABASE   0x0001
 #define BT_OPEN_LOG        0x0002
 #define BT_OPEN_SHARED     0x0004
 #define BT_OPEN_READONLY   0x0008
+#define BT_OPEN_TEMP       0x0010
+
+/* Find the default VFS */
+bt_env *sqlite4BtEnvDefault(void);
+
+/* Compute a CRC32C using the portable (bHw==0) or hardware implementation.
+** For testing. */
+int sqlite4BtCrc32cTest(int bHw, const unsigned char*, int, unsigned int*);
 
 #endif /* ifndef __BT_H */
 
@@ -37,8 +37,21 @@ typedef struct BtDbHdr BtDbHdr;
 /* Number of elements in an array object. */
 #define array_size(x) (sizeof(x)/sizeof(x[0]))
 
-/* Number of read-lock slots in shared memory */
-#define BT_NREADER 4
+/* Number of read-lock slots in shared memory. Each slot is assigned one
+** bit of the BtLock.mExclLock and mSharedLock masks, which limits this
+** value to 26 (see BT_LOCK_READER0 in bt_lock.c).  */
+#define BT_NREADER 24
+
+/*
+** BT_THREADS is true if the bt module may use pthreads directly. Threads
+** are used for background merges, to wait on locks held by connections 
+** in the same process and to verify log checksums during recovery.
+*/
+#if defined(SQLITE4_THREADSAFE) && SQLITE4_THREADSAFE && SQLITE4_OS_UNIX
+# define BT_THREADS 1
+#else
+# define BT_THREADS 0
+#endif
 
 #ifndef MIN
 # define MIN(a,b) (((a)<(b))?(a):(b))
@@ -67,18 +80,15 @@ typedef struct BtDbHdr BtDbHdr;
 **   an integer multiple of the page-size.
 **
 ** iSubBlock, nSubPg:
-**   These are likely a stop-gap. When a user executes a 'fast-insert' write,
-**   the new key-value pair (or delete marker) is written into a b-tree 
-**   stored within block iSubBlock. The root of the tree is always the first
-**   page in the block. 
+**   Fast-insert writes (new key-value pairs and delete markers) are 
+**   accumulated in memory and, when the buffer fills or the transaction
+**   is committed, sorted and written out as a new level-0 sub-tree. The
+**   pages of each such sub-tree are written sequentially into block 
+**   iSubBlock, following those of any sub-trees already written there.
 **
-**   Variable nSubPg contains the number of pages currently used by the
-**   sub-tree, not including any overflow pages. Pages (except overflow 
-**   pages) are always allocated contiguously within the block.
-**
-**   The reason these are likely a stop-gap is that the write-magnification
-**   caused by using a b-tree for to populate level-0 sub-trees is too 
-**   expensive.
+**   Variable nSubPg contains the number of pages currently used within 
+**   the block, not including any overflow pages. Once the block is full,
+**   or a merge of level-0 sub-trees is scheduled, a new block is used.
 */
 #define BT_DBHDR_STRING "SQLite4 bt database 0001"
 struct BtDbHdr {
@@ -131,6 +141,7 @@ int sqlite4BtMerge(bt_db *db, BtDbHdr *pHdr, u8 *aSched);
 */
 typedef struct BtPage BtPage;
 typedef struct BtPager BtPager;
+typedef struct BtCachePage BtCachePage;
 
 /*
 ** Open and close a pager database connection.
@@ -171,6 +182,12 @@ void sqlite4BtPagerDbhdrDirty(BtPager*);
 */
 void sqlite4BtPagerSetDbhdr(BtPager *, BtDbHdr *);
 
+/*
+** Used by checkpointers to discard pages cached using an older snapshot
+** before running a merge.
+*/
+int sqlite4BtPagerInvalidate(BtPager *);
+
 /*
 ** Read, write and trim existing database pages.
 */
@@ -220,6 +237,11 @@ void sqlite4BtPagerSetEnv(BtPager*, bt_env*);
 
 void sqlite4BtPagerSetSafety(BtPager*, int*);
 void sqlite4BtPagerSetAutockpt(BtPager*, int*);
+void sqlite4BtPagerSetCkptSlice(BtPager*, int*);
+void sqlite4BtPagerSetCkptBatch(BtPager*, int*);
+void sqlite4BtPagerSetCksum(BtPager*, int*);
+void sqlite4BtPagerSetRecoverThreads(BtPager*, int*);
+void sqlite4BtPagerRecoverCb(BtPager*, bt_recovercb*);
 
 void sqlite4BtPagerLogsize(BtPager*, int*);
 void sqlite4BtPagerMultiproc(BtPager *pPager, int *piVal);
@@ -249,9 +271,6 @@ int sqlite4BtPagerRawWrite(BtPager *pPager, u32 pgno, u8 *aBuf);
 /* Size of shared-memory chunks - 48KB. */
 #define BT_SHM_CHUNK_SIZE (48*1024)
 
-/* Find the default VFS */
-bt_env *sqlite4BtEnvDefault(void);
-
 /*
 ** End of file system interface.
 *************************************************************************/
@@ -278,17 +297,17 @@ typedef struct BtLog BtLog;
 int sqlite4BtLogOpen(BtPager*, int bRecover, BtLog**);
 int sqlite4BtLogClose(BtLog*, int bCleanup);
 
-int sqlite4BtLogRead(BtLog*, u32 pgno, u8 *aData);
+int sqlite4BtLogRead(BtLog*, u32 pgno, u8 *aData, BtCachePage **ppCache);
 int sqlite4BtLogWrite(BtLog*, u32 pgno, u8 *aData, u32 nPg);
 
-int sqlite4BtLogSnapshotOpen(BtLog*);
+int sqlite4BtLogSnapshotOpen(BtLog*, int *pbChange, int *pbCkpt);
 int sqlite4BtLogSnapshotClose(BtLog*);
 
 int sqlite4BtLogSnapshotWrite(BtLog*);
 int sqlite4BtLogSnapshotEndWrite(BtLog*);
 
 int sqlite4BtLogSize(BtLog*);
-int sqlite4BtLogCheckpoint(BtLog*, int);
+int sqlite4BtLogCheckpoint(BtLog*, int, int, int*);
 
 int sqlite4BtLogFrameToIdx(u32 *aLog, u32 iFrame);
 
@@ -303,6 +322,9 @@ int sqlite4BtLogSetCookie(BtLog*, u32 iCookie);
 int sqlite4BtLogDbhdrFlush(BtLog*);
 void sqlite4BtLogReloadDbHdr(BtLog*);
 
+/* Vectorized log checksum shared with the LSM module (see lsm_log.c). */
+int lsmCksumAvx2(const u8 *, int, u32 *, u32 *);
+
 /*
 ** End of bt_log.c interface.
 *************************************************************************/
@@ -331,9 +353,34 @@ struct BtLock {
   **
   ** iSafetyLevel:
   **   Current safety level. 0==off, 1==normal, 2=full.
+  **
+  ** nCkptSlice:
+  **   Maximum number of frames copied into the database file by each
+  **   auto-checkpoint, or 0 for no limit.
+  **
+  ** nCkptBatch:
+  **   Maximum number of consecutive pages written to the database file
+  **   by a single xWrite() call during a checkpoint.
+  **
+  ** iCksumAlg:
+  **   Checksum algorithm (BT_CKSUM_FLETCHER or BT_CKSUM_CRC32C) used for
+  **   frames written to a new log file.
+  **
+  ** nRecoverThread:
+  **   Maximum number of threads used to verify log frame checksums during
+  **   recovery, including the thread running recovery.
+  **
+  ** xRecover/pRecoverCtx:
+  **   Recovery progress callback (see BT_CONTROL_RECOVERCB).
   */
   int iSafetyLevel;               /* 0==OFF, 1==NORMAL, 2==FULL */
   int nAutoCkpt;                  /* Auto-checkpoint when log is this large */
+  int nCkptSlice;                 /* Max frames per auto-checkpoint */
+  int nCkptBatch;                 /* Max pages per checkpoint write */
+  int iCksumAlg;                  /* Log checksum algorithm (BT_CKSUM_xxx) */
+  int nRecoverThread;             /* Max threads used by log recovery */
+  void *pRecoverCtx;              /* A copy of this is passed to xRecover() */
+  void (*xRecover)(void*, int, int);  /* Recovery progress callback */
   int bRequestMultiProc;          /* Request multi-proc support */
   int nBlksz;                     /* Requested block-size in bytes */
   int nPgsz;                      /* Requested page-size in bytes */
@@ -344,6 +391,8 @@ struct BtLock {
   u32 mExclLock;                  /* Mask of exclusive locks held */
   u32 mSharedLock;                /* Mask of shared locks held */
   BtFile *pBtFile;                /* Used to defer close if necessary */
+  int nCacheHit;                  /* Pages found in the shared cache */
+  int nCacheMiss;                 /* Pages not found in the shared cache */
 
   u8 *aUsed;
 };
@@ -375,6 +424,19 @@ int sqlite4BtLockReaderQuery(BtLock*, u32*, BtReadSlot*, u32*, int*);
 /* Obtain pointers to shared-memory chunks */
 int sqlite4BtLockShmMap(BtLock*, int iChunk, int nByte, u8 **ppOut);
 
+/* Shared page cache (see BT_CONTROL_SHAREDCACHE) */
+void sqlite4BtLockCacheConfig(BtLock*, int *piKB);
+int sqlite4BtLockCacheFetch(
+    BtLock*, u32 pgno, u32 iFrame, int nData, BtCachePage**, u32 *piGen
+);
+u8 *sqlite4BtLockCacheData(BtCachePage*);
+void sqlite4BtLockCacheRelease(BtLock*, BtCachePage*);
+void sqlite4BtLockCacheInsert(BtLock*, u32 pgno, u32 iFrame, u32, u8*, int);
+void sqlite4BtLockCacheDiscard(BtLock*, u32 pgno, u32 iFrame);
+void sqlite4BtLockCacheSnapshot(BtLock*, u32 *aCksum, u32, u32);
+void sqlite4BtLockCacheCommit(BtLock*, u32 *aCksum);
+void sqlite4BtLockCacheCheckpoint(BtLock*);
+
 /*
 ** End of bt_lock.c interface.
 *************************************************************************/
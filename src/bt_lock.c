@@ -19,6 +19,11 @@
 #include <assert.h>
 #include <stdio.h>
 
+#if BT_THREADS
+# include <pthread.h>
+# include <time.h>
+#endif
+
 #define BT_LOCK_DMS1          0   /* DMS1 */
 #define BT_LOCK_DMS2_RW       1   /* DMS2/rw */
 #define BT_LOCK_DMS2_RO       2   /* DMS2/ro */
@@ -31,6 +36,21 @@
 #define BT_LOCK_SHARED     1
 #define BT_LOCK_EXCL       2
 
+/* Mask of all BT_LOCK_READER_DBONLY and BT_LOCK_READER0.. locks */
+#define BT_LOCK_READER_MASK \
+  ((((u32)1 << (BT_NREADER+1)) - 1) << BT_LOCK_READER_DBONLY)
+
+/*
+** Limits on the time in microseconds a connection waits for another to
+** release a lock before trying again (see btLockWait()). In single-process
+** mode, a waiter is woken as soon as any lock is released, so the maximum
+** is seldom reached. In multi-process mode, locks released by other
+** processes cannot be detected, so the interval starts short and is
+** doubled on each attempt.
+*/
+#define BT_LOCK_MINWAIT      100
+#define BT_LOCK_MAXWAIT    10000
+
 /*
 ** Global data. All global variables used by code in this file are grouped
 ** into the following structure instance.
@@ -44,11 +64,45 @@
 **   Each new connection is assigned a "debug-id". This contributes 
 **   nothing to the operation of the library, but sometimes makes it 
 **   easier to debug various problems.
+**
+** aCache:
+**   The page cache shared by all connections within this process (see
+**   BT_CONTROL_SHAREDCACHE), divided into BT_CACHE_NSTRIPE stripes. Each 
+**   stripe is protected by its own mutex, not by the global mutex.
 */
+typedef struct BtCache BtCache;
+
+#define BT_CACHE_NSTRIPE 8
+
+struct BtCache {
+  i64 nByteMax;                   /* Maximum bytes of memory to use */
+  i64 nByte;                      /* Bytes of memory currently used */
+  int nEntry;                     /* Number of entries in hash table */
+  int nHash;                      /* Size of aHash[] array */
+  BtCachePage **aHash;            /* Hash array */
+  BtCachePage *pLru;              /* Least recently used page */
+  BtCachePage *pLruTail;          /* Most recently used page */
+#if BT_THREADS
+  pthread_mutex_t mutex;          /* Mutex protecting this stripe */
+#endif
+};
+
+#if BT_THREADS
+# define BT_CACHE_STRIPE_INIT {0, 0, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER}
+#else
+# define BT_CACHE_STRIPE_INIT {0, 0, 0, 0, 0, 0, 0}
+#endif
+
 static struct BtSharedData {
   BtShared *pDatabase;            /* Linked list of all Database objects */
   int iDebugId;                   /* Next free debugging id */
-} gBtShared = {0, 0};
+  BtCache aCache[BT_CACHE_NSTRIPE];   /* Shared page cache */
+} gBtShared = {0, 0, {
+  BT_CACHE_STRIPE_INIT, BT_CACHE_STRIPE_INIT, 
+  BT_CACHE_STRIPE_INIT, BT_CACHE_STRIPE_INIT, 
+  BT_CACHE_STRIPE_INIT, BT_CACHE_STRIPE_INIT, 
+  BT_CACHE_STRIPE_INIT, BT_CACHE_STRIPE_INIT
+}};
 
 struct BtFile {
   BtFile *pNext;
@@ -73,8 +127,27 @@ struct BtShared {
   int bReadonly;                  /* True if Database.pFile is read-only */
   bt_file *pFile;                 /* Used for locks/shm in multi-proc mode */
   BtFile *pBtFile;                /* List of deferred closes */
+
+  /* Shared page cache state. Modified only while holding the mutexes of
+  ** all cache stripes, so may be read while holding any one of them. */
+  u32 aCacheCksum[2];             /* Checksum of newest known shm-header */
+  u32 iCacheFirstRead;            /* Newest known BtCkptHdr.iFirstRead */
+  u32 iCacheWalHdr;               /* Newest known BtCkptHdr.iWalHdr */
+  u32 iLogGen;                    /* Generation of cached log frames */
+  u32 iDbGen;                     /* Generation of cached db file pages */
+
+  /* Used to wait for locks held by other connections in this process.
+  ** nWaiter is protected by pClientMutex, iWaitGen by waitMutex. */
+  int nWaiter;                    /* Number of connections waiting on a lock */
+  u32 iWaitGen;                   /* Incremented each time a lock is released */
+#if BT_THREADS
+  pthread_mutex_t waitMutex;      /* Mutex used with waitCond */
+  pthread_cond_t waitCond;        /* Signalled when a lock is released */
+#endif
 };
 
+static void btCachePurgeFile(sqlite4_env *pEnv, BtShared *pShared);
+
 /*
 ** Grab the global mutex that protects the linked list of BtShared
 ** objects.
@@ -106,6 +179,19 @@ static int btLockSharedFile(BtLock *p, int iLock, int eOp){
   return rc;
 }
 
+/*
+** Wake up any connections blocked in btLockWait() on the database 
+** identified by pShared. This is called after a lock is released.
+*/
+static void btLockWake(BtShared *pShared){
+#if BT_THREADS
+  pthread_mutex_lock(&pShared->waitMutex);
+  pShared->iWaitGen++;
+  pthread_cond_broadcast(&pShared->waitCond);
+  pthread_mutex_unlock(&pShared->waitMutex);
+#endif
+}
+
 static int btLockLockopNonblocking(
   BtLock *p,                      /* BtLock handle */
   int iLock,                      /* Slot to lock */
@@ -113,6 +199,7 @@ static int btLockLockopNonblocking(
 ){
   const u32 mask = ((u32)1 << iLock);
   int rc = SQLITE4_OK;
+  int bWake = 0;                  /* True to call btLockWake() */
   BtShared *pShared = p->pShared;
 
   assert( iLock>=0 && iLock<(BT_LOCK_READER0 + BT_NREADER) );
@@ -146,6 +233,14 @@ static int btLockLockopNonblocking(
     assert( nExcl==0 || nExcl==1 );
     assert( nExcl==0 || nShared==0 );
 
+    /* If this call releases a lock that another connection may be waiting
+    ** on, wake any waiters once the client mutex has been released.  */
+    if( pShared->nWaiter>0 && (eOp==BT_LOCK_UNLOCK 
+     || (eOp==BT_LOCK_SHARED && (mask & p->mExclLock)))
+    ){
+      bWake = 1;
+    }
+
     switch( eOp ){
       case BT_LOCK_UNLOCK:
         if( nShared==0 ){
@@ -186,18 +281,80 @@ static int btLockLockopNonblocking(
     }
 
     sqlite4_mutex_leave(pShared->pClientMutex);
+    if( bWake ) btLockWake(pShared);
   }
 
   return rc;
 }
 
-static void btLockDelay(void){
-  usleep(10000);
-#if 0
-  static int nCall = 0;
-  nCall++;
-  fprintf(stderr, "%d delay\n", nCall);
-  fflush(stderr);
+/*
+** Register connection p as waiting for a lock held by some other 
+** connection. Each call to this function must be matched by a call
+** to btLockWaitEnd().
+*/
+static void btLockWaitBegin(BtLock *p){
+  BtShared *pShared = p->pShared;
+  sqlite4_mutex_enter(pShared->pClientMutex);
+  pShared->nWaiter++;
+  sqlite4_mutex_leave(pShared->pClientMutex);
+}
+
+static void btLockWaitEnd(BtLock *p){
+  BtShared *pShared = p->pShared;
+  sqlite4_mutex_enter(pShared->pClientMutex);
+  pShared->nWaiter--;
+  sqlite4_mutex_leave(pShared->pClientMutex);
+}
+
+/*
+** Return the current lock-release generation of the database that 
+** connection p is connected to. The value returned should be passed
+** to btLockWait() if the lock attempt that follows fails.
+*/
+static u32 btLockWaitGen(BtLock *p){
+  u32 iGen = 0;
+#if BT_THREADS
+  BtShared *pShared = p->pShared;
+  pthread_mutex_lock(&pShared->waitMutex);
+  iGen = pShared->iWaitGen;
+  pthread_mutex_unlock(&pShared->waitMutex);
+#endif
+  return iGen;
+}
+
+/*
+** Block until some other connection in this process releases a lock 
+** (i.e. until the lock-release generation is no longer iGen), or for
+** at most *pnUsec microseconds. In multi-process mode, *pnUsec is
+** doubled before returning, up to a maximum of BT_LOCK_MAXWAIT.
+*/
+static void btLockWait(BtLock *p, u32 iGen, int *pnUsec){
+  BtShared *pShared = p->pShared;
+  int nUsec = BT_LOCK_MAXWAIT;
+
+  if( pShared->bMultiProc ){
+    nUsec = *pnUsec;
+    *pnUsec = MIN(nUsec*2, BT_LOCK_MAXWAIT);
+  }
+
+#if BT_THREADS
+  {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_nsec += (long)nUsec * 1000;
+    t.tv_sec += t.tv_nsec / 1000000000;
+    t.tv_nsec = t.tv_nsec % 1000000000;
+
+    pthread_mutex_lock(&pShared->waitMutex);
+    while( pShared->iWaitGen==iGen ){
+      if( pthread_cond_timedwait(&pShared->waitCond, &pShared->waitMutex, &t) ){
+        break;
+      }
+    }
+    pthread_mutex_unlock(&pShared->waitMutex);
+  }
+#else
+  usleep(nUsec);
 #endif
 }
 
@@ -217,11 +374,16 @@ static int btLockLockop(
   int bBlock                      /* True for a blocking lock */
 ){
   int rc;
-  while( 1 ){
-    rc = btLockLockopNonblocking(p, iLock, eOp);
-    if( rc!=SQLITE4_BUSY || bBlock==0 ) break;
-    /* todo: Fix blocking locks */
-    btLockDelay();
+  rc = btLockLockopNonblocking(p, iLock, eOp);
+  if( rc==SQLITE4_BUSY && bBlock ){
+    int nUsec = BT_LOCK_MINWAIT;
+    btLockWaitBegin(p);
+    do{
+      u32 iGen = btLockWaitGen(p);
+      rc = btLockLockopNonblocking(p, iLock, eOp);
+      if( rc==SQLITE4_BUSY ) btLockWait(p, iGen, &nUsec);
+    }while( rc==SQLITE4_BUSY );
+    btLockWaitEnd(p);
   }
   return rc;
 }
@@ -231,9 +393,12 @@ static void btLockSharedDeref(
   bt_env *pVfs, 
   BtShared *pShared
 ){
+  int bFree;
+
   btLockMutexEnter(pEnv);
   pShared->nRef--;
-  if( pShared->nRef==0 ){
+  bFree = (pShared->nRef==0);
+  if( bFree ){
     BtShared **ppS;
     for(ppS=&gBtShared.pDatabase; *ppS!=pShared; ppS=&(*ppS)->pNext);
     *ppS = (*ppS)->pNext;
@@ -244,6 +409,10 @@ static void btLockSharedDeref(
       sqlite4_free(pEnv, p);
     }
     sqlite4_mutex_free(pShared->pClientMutex);
+#if BT_THREADS
+    pthread_cond_destroy(&pShared->waitCond);
+    pthread_mutex_destroy(&pShared->waitMutex);
+#endif
 
     /* If they were allocated in heap space, free all "shared" memory chunks */
     if( pShared->pFile==0 ){
@@ -255,9 +424,17 @@ static void btLockSharedDeref(
       pVfs->xClose(pShared->pFile);
     }
     sqlite4_free(pEnv, pShared->apShmChunk);
-    sqlite4_free(pEnv, pShared);
   }
   btLockMutexLeave(pEnv);
+
+  /* Entries in the shared cache are keyed by the address of the BtShared
+  ** object, so they must be purged before it is freed. This is done after
+  ** releasing the global mutex, as in builds without pthreads support the
+  ** cache stripes are protected by the global mutex itself.  */
+  if( bFree ){
+    btCachePurgeFile(pEnv, pShared);
+    sqlite4_free(pEnv, pShared);
+  }
 }
 
 /*
@@ -306,6 +483,10 @@ int sqlite4BtLockConnect(BtLock *p, int (*xRecover)(BtLock*)){
       memcpy(pShared->zName, zName, nName+1);
       pShared->pNext = gBtShared.pDatabase;
       pShared->pClientMutex = pMutex;
+#if BT_THREADS
+      pthread_mutex_init(&pShared->waitMutex, 0);
+      pthread_cond_init(&pShared->waitCond, 0);
+#endif
       gBtShared.pDatabase = pShared;
     }
   }
@@ -449,8 +630,7 @@ int sqlite4BtLockDisconnect(
 
 #ifndef NDEBUG
 static void assertNoLockedSlots(BtLock *pLock){
-  u32 mask = (1 << (BT_LOCK_READER0+BT_NREADER+1)) - (1 << BT_LOCK_READER0);
-  assert( (pLock->mExclLock & mask)==0 );
+  assert( (pLock->mExclLock & BT_LOCK_READER_MASK)==0 );
 }
 #else
 # define assertNoLockedSlots(x)
@@ -493,13 +673,18 @@ int sqlite4BtLockReader(
   }else{
     const int nMaxRetry = 100;
     int nAttempt = 100;           /* Remaining lock attempts */
+    int nUsec = BT_LOCK_MINWAIT;  /* Argument for btLockWait() */
+    int bWait = 0;                /* True after btLockWaitBegin() */
+    u32 iGen = 0;                 /* Lock-release generation */
 
     for(nAttempt=0; rc==SQLITE4_BUSY && nAttempt<nMaxRetry; nAttempt++){
 
       int iIdxFirst = sqlite4BtLogFrameToIdx(aLog, iFirst);
       int iIdxLast = sqlite4BtLogFrameToIdx(aLog, iLast);
+      int bLockBusy = 1;          /* True if a slot lock was unavailable */
 
       assert( iIdxFirst>=0 && iIdxLast>=0 );
+      if( bWait ) iGen = btLockWaitGen(pLock);
 
       /* Try to find a slot populated with the values required. */
       for(i=0; i<BT_NREADER; i++){
@@ -520,6 +705,7 @@ int sqlite4BtLockReader(
             aSlot[i].iLast = iLast;
             break;
           }else if( rc!=SQLITE4_BUSY ){
+            if( bWait ) btLockWaitEnd(pLock);
             return rc;
           }
         }
@@ -545,16 +731,30 @@ int sqlite4BtLockReader(
           int iSF = sqlite4BtLogFrameToIdx(aLog, aSlot[i].iFirst);
           int iSL = sqlite4BtLogFrameToIdx(aLog, aSlot[i].iLast);
           if( iSF>iIdxFirst || iSL>iIdxLast || iSF<0 || iSL<0 ){
+            /* The slot was modified before the SHARED lock was obtained.
+            ** Try again immediately.  */
             btLockLockop(pLock, BT_LOCK_READER0 + i, BT_LOCK_UNLOCK, 0);
             rc = SQLITE4_BUSY;
+            bLockBusy = 0;
           }else{
             sqlite4BtDebugReadlock(pLock, aSlot[i].iFirst, aSlot[i].iLast);
           }
-        }else if( rc==SQLITE4_BUSY && nAttempt>(nMaxRetry/2) ){
-          btLockDelay();
+        }
+      }
+
+      /* If no slot could be locked because other connections hold 
+      ** conflicting locks, wait for one of them to release a lock before
+      ** trying again. The first retry is made without waiting.  */
+      if( rc==SQLITE4_BUSY && bLockBusy ){
+        if( bWait==0 ){
+          btLockWaitBegin(pLock);
+          bWait = 1;
+        }else{
+          btLockWait(pLock, iGen, &nUsec);
         }
       }
     }
+    if( bWait ) btLockWaitEnd(pLock);
   }
 
   assertNoLockedSlots(pLock);
@@ -565,12 +765,16 @@ int sqlite4BtLockReader(
 ** Release the READER lock currently held by connection pLock.
 */
 int sqlite4BtLockReaderUnlock(BtLock *pLock){
+  u32 mHeld = (pLock->mSharedLock|pLock->mExclLock) & BT_LOCK_READER_MASK;
   int i;
 
   /* Release any locks held on reader slots. */
   assert( (BT_LOCK_READER_DBONLY+1)==BT_LOCK_READER0 );
-  for(i=0; i<BT_NREADER+1; i++){
-    btLockLockop(pLock, BT_LOCK_READER_DBONLY + i, BT_LOCK_UNLOCK, 0);
+  for(i=BT_LOCK_READER_DBONLY; mHeld; i++){
+    if( mHeld & ((u32)1 << i) ){
+      btLockLockop(pLock, i, BT_LOCK_UNLOCK, 0);
+      mHeld &= ~((u32)1 << i);
+    }
   }
 
   return SQLITE4_OK;
@@ -722,3 +926,569 @@ int sqlite4BtLockWriterUnlock(BtLock *pLock){
   return btLockLockop(pLock, BT_LOCK_WRITER, BT_LOCK_UNLOCK, 0);
 }
 
+
+/*************************************************************************
+** Shared page cache.
+**
+** Pages read from the database or log file by any connection within this
+** process are stored in a single cache, subject to a process-wide limit 
+** on the memory used (see BT_CONTROL_SHAREDCACHE). A page read from the 
+** log file is identified by the database it belongs to and the log frame 
+** it was read from. Since a frame is never overwritten while there exists
+** a reader that may use it, the cached copy remains valid until the frame
+** is reused. A page read from the database file is identified by its page
+** number, and remains valid until the next checkpoint.
+**
+** Each BtShared object contains two "generation" counters - one for pages
+** read from the log file and one for pages read from the database file. 
+** An entry is only used if its generation matches the current value of 
+** the corresponding counter, so incrementing a counter invalidates all 
+** entries of that kind for the database. The counters are incremented:
+**
+**   iLogGen: Each time a connection opens a snapshot and finds that the 
+**            shared-memory header was last written by some other process,
+**            as that process may have overwritten cached frames.
+**
+**   iDbGen:  Each time a checkpoint is run within this process, and each
+**            time a connection opens a snapshot and finds that the 
+**            checkpoint header was last modified by some other process.
+**
+** Frames overwritten by writers within this process are removed from the
+** cache individually, as are database pages written directly to the 
+** database file.
+**
+** The cache is divided into BT_CACHE_NSTRIPE stripes, each with its own
+** hash table, LRU list, memory limit and mutex. An entry is stored in the
+** stripe selected by its hash key, so connections reading different pages
+** seldom contend for the same mutex. 
+**
+** The data belonging to an entry is never modified. Instead of copying 
+** it, the pager maps it directly into its page objects. Each such mapping
+** holds a reference (BtCachePage.nRef) on the entry, which is released by
+** sqlite4BtLockCacheRelease(). Entries with one or more references are not
+** on the LRU list and so are never evicted. If a referenced entry must be
+** removed from the cache because it is no longer valid, it is removed 
+** from the hash table and marked as an orphan (by setting pShared to 
+** NULL), then freed when its last reference is released.
+*/
+struct BtCachePage {
+  BtShared *pShared;              /* Database page belongs to (or orphan) */
+  u32 pgno;                       /* Page number */
+  u32 iFrame;                     /* Log frame read from, or 0 for db file */
+  u32 iGen;                       /* Generation when page was read */
+  int iStripe;                    /* Index of stripe in gBtShared.aCache[] */
+  int nRef;                       /* Number of pager references */
+  int nData;                      /* Size of aData[] in bytes */
+  u8 *aData;                      /* Page data */
+  BtCachePage *pNextHash;         /* Next entry with same hash key */
+  BtCachePage *pNextLru;          /* Next (more recently used) entry */
+  BtCachePage *pPrevLru;          /* Previous (less recently used) entry */
+};
+
+/*
+** Return the hash key for the entry identified by the (pgno, iFrame) pair.
+** The stripe an entry belongs to is (key % BT_CACHE_NSTRIPE), and the
+** bucket within that stripe's hash table ((key / BT_CACHE_NSTRIPE) % nHash).
+*/
+static u32 btCacheKey(u32 pgno, u32 iFrame){
+  return (iFrame ? iFrame : pgno);
+}
+static BtCache *btCacheStripe(u32 pgno, u32 iFrame){
+  return &gBtShared.aCache[btCacheKey(pgno, iFrame) % BT_CACHE_NSTRIPE];
+}
+static int btCacheHashkey(int nHash, u32 pgno, u32 iFrame){
+  return (int)((btCacheKey(pgno, iFrame) / BT_CACHE_NSTRIPE) % nHash);
+}
+
+/*
+** Obtain and release the mutex protecting cache stripe pCache. If there is
+** no pthreads support, all stripes are protected by the global mutex.
+*/
+static void btCacheEnter(sqlite4_env *pEnv, BtCache *pCache){
+#if BT_THREADS
+  pthread_mutex_lock(&pCache->mutex);
+#else
+  btLockMutexEnter(pEnv);
+#endif
+}
+static void btCacheLeave(sqlite4_env *pEnv, BtCache *pCache){
+#if BT_THREADS
+  pthread_mutex_unlock(&pCache->mutex);
+#else
+  btLockMutexLeave(pEnv);
+#endif
+}
+
+/*
+** Obtain and release the mutexes of all cache stripes. Mutexes are always
+** obtained in the order in which they appear in the aCache[] array.
+*/
+static void btCacheEnterAll(sqlite4_env *pEnv){
+#if BT_THREADS
+  int i;
+  for(i=0; i<BT_CACHE_NSTRIPE; i++){
+    pthread_mutex_lock(&gBtShared.aCache[i].mutex);
+  }
+#else
+  btLockMutexEnter(pEnv);
+#endif
+}
+static void btCacheLeaveAll(sqlite4_env *pEnv){
+#if BT_THREADS
+  int i;
+  for(i=BT_CACHE_NSTRIPE-1; i>=0; i--){
+    pthread_mutex_unlock(&gBtShared.aCache[i].mutex);
+  }
+#else
+  btLockMutexLeave(pEnv);
+#endif
+}
+
+/*
+** Return the entry for the page read from frame iFrame of the log file
+** of database pShared. Or, if iFrame is 0, for page pgno read from the 
+** database file. Return NULL if there is no such entry.
+*/
+static BtCachePage *btCacheFind(
+  BtCache *pCache, 
+  BtShared *pShared, 
+  u32 pgno, 
+  u32 iFrame
+){
+  BtCachePage *pPg = 0;
+  if( pCache->nHash ){
+    int h = btCacheHashkey(pCache->nHash, pgno, iFrame);
+    for(pPg=pCache->aHash[h]; pPg; pPg=pPg->pNextHash){
+      if( pPg->pShared==pShared && pPg->iFrame==iFrame 
+       && (iFrame!=0 || pPg->pgno==pgno)
+      ){
+        break;
+      }
+    }
+  }
+  return pPg;
+}
+
+static void btCacheLruAdd(BtCache *pCache, BtCachePage *pPg){
+  pPg->pNextLru = 0;
+  pPg->pPrevLru = pCache->pLruTail;
+  if( pCache->pLruTail ){
+    pCache->pLruTail->pNextLru = pPg;
+  }else{
+    pCache->pLru = pPg;
+  }
+  pCache->pLruTail = pPg;
+}
+
+static void btCacheLruRemove(BtCache *pCache, BtCachePage *pPg){
+  if( pPg->pNextLru ){
+    pPg->pNextLru->pPrevLru = pPg->pPrevLru;
+  }else{
+    pCache->pLruTail = pPg->pPrevLru;
+  }
+  if( pPg->pPrevLru ){
+    pPg->pPrevLru->pNextLru = pPg->pNextLru;
+  }else{
+    pCache->pLru = pPg->pNextLru;
+  }
+  pPg->pNextLru = 0;
+  pPg->pPrevLru = 0;
+}
+
+/*
+** Free entry pPg, which has already been removed from the hash table.
+*/
+static void btCacheFree(sqlite4_env *pEnv, BtCache *pCache, BtCachePage *pPg){
+  assert( pPg->nRef==0 );
+  pCache->nByte -= (sizeof(BtCachePage) + pPg->nData);
+  sqlite4_free(pEnv, pPg);
+}
+
+/*
+** Remove entry pPg from the cache. If there are no outstanding references
+** to it, free it. Otherwise, mark it as an orphan to be freed when the
+** last reference is released.
+*/
+static void btCacheRemove(sqlite4_env *pEnv, BtCache *pCache, BtCachePage *pPg){
+  BtCachePage **pp;
+  int h = btCacheHashkey(pCache->nHash, pPg->pgno, pPg->iFrame);
+
+  assert( pPg->pShared );
+  for(pp=&pCache->aHash[h]; *pp!=pPg; pp=&(*pp)->pNextHash);
+  *pp = pPg->pNextHash;
+  pPg->pNextHash = 0;
+  pCache->nEntry--;
+
+  if( pPg->nRef==0 ){
+    btCacheLruRemove(pCache, pPg);
+    btCacheFree(pEnv, pCache, pPg);
+  }else{
+    pPg->pShared = 0;
+  }
+
+  if( pCache->nEntry==0 ){
+    sqlite4_free(pEnv, pCache->aHash);
+    pCache->aHash = 0;
+    pCache->nHash = 0;
+  }
+}
+
+/*
+** Evict least recently used entries until the stripe uses no more than
+** nByte bytes of memory, or until all unreferenced entries have been 
+** evicted.
+*/
+static void btCacheEvict(sqlite4_env *pEnv, BtCache *pCache, i64 nByte){
+  while( pCache->pLru && pCache->nByte>nByte ){
+    btCacheRemove(pEnv, pCache, pCache->pLru);
+  }
+}
+
+/*
+** Remove all entries belonging to database pShared from stripe pCache, or
+** all entries if pShared is NULL. Since referenced entries are not on the
+** LRU list, the hash table is searched instead.
+*/
+static void btCachePurgeStripe(
+  sqlite4_env *pEnv, 
+  BtCache *pCache, 
+  BtShared *pShared
+){
+  int h;
+  for(h=0; h<pCache->nHash; h++){
+    BtCachePage *pPg;
+    BtCachePage *pNext;
+    for(pPg=pCache->aHash[h]; pPg; pPg=pNext){
+      pNext = pPg->pNextHash;
+      if( pShared==0 || pPg->pShared==pShared ){
+        /* If this removes the last entry, the hash table is freed. */
+        int bLast = (pCache->nEntry==1);
+        btCacheRemove(pEnv, pCache, pPg);
+        if( bLast ) return;
+      }
+    }
+  }
+}
+
+/*
+** Remove all entries belonging to database pShared from the cache. This
+** is called when the last connection to a database is closed.
+*/
+static void btCachePurgeFile(sqlite4_env *pEnv, BtShared *pShared){
+  int i;
+  for(i=0; i<BT_CACHE_NSTRIPE; i++){
+    BtCache *pCache = &gBtShared.aCache[i];
+    btCacheEnter(pEnv, pCache);
+    btCachePurgeStripe(pEnv, pCache, pShared);
+    btCacheLeave(pEnv, pCache);
+  }
+}
+
+/*
+** Increase the number of buckets in the hash table of stripe pCache if 
+** required. Return SQLITE4_OK if successful, or SQLITE4_NOMEM if an OOM 
+** occurs.
+*/
+static int btCacheHashGrow(sqlite4_env *pEnv, BtCache *pCache){
+  if( pCache->nEntry>=pCache->nHash/2 ){
+    int i;
+    int nNew = (pCache->nHash ? pCache->nHash*2 : 64);
+    BtCachePage **aNew;
+
+    aNew = (BtCachePage**)sqlite4_malloc(pEnv, nNew*sizeof(BtCachePage*));
+    if( aNew==0 ) return btErrorBkpt(SQLITE4_NOMEM);
+    memset(aNew, 0, nNew*sizeof(BtCachePage*));
+    for(i=0; i<pCache->nHash; i++){
+      while( pCache->aHash[i] ){
+        BtCachePage *pShift = pCache->aHash[i];
+        int h = btCacheHashkey(nNew, pShift->pgno, pShift->iFrame);
+        pCache->aHash[i] = pShift->pNextHash;
+        pShift->pNextHash = aNew[h];
+        aNew[h] = pShift;
+      }
+    }
+    sqlite4_free(pEnv, pCache->aHash);
+    pCache->aHash = aNew;
+    pCache->nHash = nNew;
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Query or configure the amount of memory used by the shared page cache.
+** If *piKB is zero or greater, the limit is set to *piKB KB. Either way,
+** *piKB is set to the current limit before returning. The limit is divided
+** evenly between the stripes.
+**
+** If the cache is disabled, all entries are removed from it, including
+** those that are still referenced. Since the generation counters are not
+** maintained while the cache is disabled, any such entries may become
+** out of date.
+*/
+void sqlite4BtLockCacheConfig(BtLock *pLock, int *piKB){
+  sqlite4_env *pEnv = pLock->pEnv;
+  i64 nByteMax = 0;
+  int i;
+
+  btCacheEnterAll(pEnv);
+  for(i=0; i<BT_CACHE_NSTRIPE; i++){
+    BtCache *pCache = &gBtShared.aCache[i];
+    if( *piKB>=0 ){
+      pCache->nByteMax = (i64)(*piKB) * 1024 / BT_CACHE_NSTRIPE;
+      if( pCache->nByteMax==0 ){
+        btCachePurgeStripe(pEnv, pCache, 0);
+      }else{
+        btCacheEvict(pEnv, pCache, pCache->nByteMax);
+      }
+    }
+    nByteMax += pCache->nByteMax;
+  }
+  btCacheLeaveAll(pEnv);
+  *piKB = (int)(nByteMax / 1024);
+}
+
+/*
+** Search the shared cache for a copy of page pgno read from frame iFrame 
+** of the log file, or from the database file if iFrame is 0. If one is 
+** found, set *ppPg to point to it and return SQLITE4_OK. The caller may
+** then use sqlite4BtLockCacheData() to access the page data, which remains
+** valid and unmodified until the caller passes the entry to 
+** sqlite4BtLockCacheRelease(). If no entry is found, set *ppPg to NULL 
+** and return SQLITE4_NOTFOUND.
+**
+** Either way, *piGen is set to a value that must be passed to 
+** sqlite4BtLockCacheInsert() along with the page data if the caller 
+** reads it from disk.
+*/
+int sqlite4BtLockCacheFetch(
+  BtLock *pLock,                  /* Connection reading the page */
+  u32 pgno,                       /* Page number to search for */
+  u32 iFrame,                     /* Log frame, or 0 for database file */
+  int nData,                      /* Required size of page (page size) */
+  BtCachePage **ppPg,             /* OUT: Cache entry */
+  u32 *piGen                      /* OUT: Generation for Insert() */
+){
+  BtShared *pShared = pLock->pShared;
+  BtCachePage *pRet = 0;
+
+  *piGen = 0;
+  if( pShared ){
+    BtCache *pCache = btCacheStripe(pgno, iFrame);
+    btCacheEnter(pLock->pEnv, pCache);
+    if( pCache->nByteMax>0 ){
+      u32 iGen = (iFrame ? pShared->iLogGen : pShared->iDbGen);
+      BtCachePage *pPg = btCacheFind(pCache, pShared, pgno, iFrame);
+      if( pPg ){
+        if( pPg->pgno==pgno && pPg->iGen==iGen && pPg->nData==nData ){
+          if( pPg->nRef==0 ) btCacheLruRemove(pCache, pPg);
+          pPg->nRef++;
+          pRet = pPg;
+        }else{
+          btCacheRemove(pLock->pEnv, pCache, pPg);
+        }
+      }
+      if( pRet ){
+        pLock->nCacheHit++;
+      }else{
+        pLock->nCacheMiss++;
+      }
+      *piGen = iGen;
+    }
+    btCacheLeave(pLock->pEnv, pCache);
+  }
+
+  *ppPg = pRet;
+  return (pRet ? SQLITE4_OK : SQLITE4_NOTFOUND);
+}
+
+/*
+** Return a pointer to the page data held by cache entry pPg.
+*/
+u8 *sqlite4BtLockCacheData(BtCachePage *pPg){
+  return pPg->aData;
+}
+
+/*
+** Release a reference to cache entry pPg obtained by an earlier call to
+** sqlite4BtLockCacheFetch().
+*/
+void sqlite4BtLockCacheRelease(BtLock *pLock, BtCachePage *pPg){
+  BtCache *pCache = &gBtShared.aCache[pPg->iStripe];
+  btCacheEnter(pLock->pEnv, pCache);
+  assert( pPg->nRef>0 );
+  pPg->nRef--;
+  if( pPg->nRef==0 ){
+    if( pPg->pShared==0 ){
+      btCacheFree(pLock->pEnv, pCache, pPg);
+    }else{
+      btCacheLruAdd(pCache, pPg);
+      btCacheEvict(pLock->pEnv, pCache, pCache->nByteMax);
+    }
+  }
+  btCacheLeave(pLock->pEnv, pCache);
+}
+
+/*
+** Add a copy of page pgno, read from frame iFrame of the log file (or from
+** the database file if iFrame is 0), to the shared cache. Parameter iGen
+** must be the value returned by the sqlite4BtLockCacheFetch() call that 
+** failed to find the page. If the cache has been invalidated since then,
+** the page is not added.
+*/
+void sqlite4BtLockCacheInsert(
+  BtLock *pLock,                  /* Connection that read the page */
+  u32 pgno,                       /* Page number */
+  u32 iFrame,                     /* Log frame, or 0 for database file */
+  u32 iGen,                       /* Value returned by CacheFetch() */
+  u8 *aData,                      /* Page data */
+  int nData                       /* Size of aData[] (page size) */
+){
+  BtShared *pShared = pLock->pShared;
+
+  if( pShared ){
+    sqlite4_env *pEnv = pLock->pEnv;
+    BtCache *pCache = btCacheStripe(pgno, iFrame);
+    int nReq = sizeof(BtCachePage) + nData;
+
+    btCacheEnter(pEnv, pCache);
+    if( iGen==(iFrame ? pShared->iLogGen : pShared->iDbGen) 
+     && nReq<=pCache->nByteMax
+    ){
+      BtCachePage *pPg = btCacheFind(pCache, pShared, pgno, iFrame);
+      if( pPg ){
+        btCacheRemove(pEnv, pCache, pPg);
+        pPg = 0;
+      }
+      btCacheEvict(pEnv, pCache, pCache->nByteMax - nReq);
+
+      if( btCacheHashGrow(pEnv, pCache)==SQLITE4_OK ){
+        pPg = (BtCachePage*)sqlite4_malloc(pEnv, nReq);
+      }
+      if( pPg ){
+        int h = btCacheHashkey(pCache->nHash, pgno, iFrame);
+        memset(pPg, 0, sizeof(BtCachePage));
+        pPg->pShared = pShared;
+        pPg->pgno = pgno;
+        pPg->iFrame = iFrame;
+        pPg->iGen = iGen;
+        pPg->iStripe = (int)(pCache - gBtShared.aCache);
+        pPg->nData = nData;
+        pPg->aData = (u8*)&pPg[1];
+        memcpy(pPg->aData, aData, nData);
+        pPg->pNextHash = pCache->aHash[h];
+        pCache->aHash[h] = pPg;
+        btCacheLruAdd(pCache, pPg);
+        pCache->nEntry++;
+        pCache->nByte += nReq;
+      }
+    }
+    btCacheLeave(pEnv, pCache);
+  }
+}
+
+/*
+** Remove the copy of the page read from frame iFrame of the log file from
+** the shared cache, if there is one. Or, if iFrame is 0, the copy of page
+** pgno read from the database file. This is called before the frame or
+** database page is overwritten.
+*/
+void sqlite4BtLockCacheDiscard(BtLock *pLock, u32 pgno, u32 iFrame){
+  BtShared *pShared = pLock->pShared;
+  if( pShared ){
+    BtCache *pCache = btCacheStripe(pgno, iFrame);
+    BtCachePage *pPg;
+    btCacheEnter(pLock->pEnv, pCache);
+    pPg = btCacheFind(pCache, pShared, pgno, iFrame);
+    if( pPg ) btCacheRemove(pLock->pEnv, pCache, pPg);
+    btCacheLeave(pLock->pEnv, pCache);
+  }
+}
+
+/*
+** This is called each time a connection opens a new snapshot. Array 
+** aCksum[] contains the checksum stored in the shared-memory header, and 
+** iFirstRead and iWalHdr the values of the corresponding checkpoint 
+** header fields. If either has been modified by some other process since 
+** it was last seen within this process, invalidate the affected entries.
+**
+** The BtShared fields are compared while holding a single stripe mutex.
+** Only if they must be updated are the mutexes of all stripes obtained.
+*/
+void sqlite4BtLockCacheSnapshot(
+  BtLock *pLock, 
+  u32 *aCksum, 
+  u32 iFirstRead, 
+  u32 iWalHdr
+){
+  BtShared *pShared = pLock->pShared;
+  if( pShared ){
+    sqlite4_env *pEnv = pLock->pEnv;
+    BtCache *pCache = &gBtShared.aCache[0];
+    int bChange;
+
+    btCacheEnter(pEnv, pCache);
+    bChange = pCache->nByteMax>0 && (
+        aCksum[0]!=pShared->aCacheCksum[0] 
+     || aCksum[1]!=pShared->aCacheCksum[1] 
+     || iFirstRead!=pShared->iCacheFirstRead 
+     || iWalHdr!=pShared->iCacheWalHdr 
+    );
+    btCacheLeave(pEnv, pCache);
+
+    if( bChange ){
+      btCacheEnterAll(pEnv);
+      if( aCksum[0]!=pShared->aCacheCksum[0] 
+       || aCksum[1]!=pShared->aCacheCksum[1] 
+      ){
+        pShared->iLogGen++;
+        pShared->aCacheCksum[0] = aCksum[0];
+        pShared->aCacheCksum[1] = aCksum[1];
+      }
+      if( iFirstRead!=pShared->iCacheFirstRead 
+       || iWalHdr!=pShared->iCacheWalHdr 
+      ){
+        pShared->iDbGen++;
+        pShared->iCacheFirstRead = iFirstRead;
+        pShared->iCacheWalHdr = iWalHdr;
+      }
+      btCacheLeaveAll(pEnv);
+    }
+  }
+}
+
+/*
+** This is called after a connection within this process has written a 
+** new shared-memory header with checksum aCksum[] to shared-memory.
+*/
+void sqlite4BtLockCacheCommit(BtLock *pLock, u32 *aCksum){
+  BtShared *pShared = pLock->pShared;
+  if( pShared ){
+    sqlite4_env *pEnv = pLock->pEnv;
+    BtCache *pCache = &gBtShared.aCache[0];
+    int bEnabled;
+
+    btCacheEnter(pEnv, pCache);
+    bEnabled = (pCache->nByteMax>0);
+    btCacheLeave(pEnv, pCache);
+
+    if( bEnabled ){
+      btCacheEnterAll(pEnv);
+      pShared->aCacheCksum[0] = aCksum[0];
+      pShared->aCacheCksum[1] = aCksum[1];
+      btCacheLeaveAll(pEnv);
+    }
+  }
+}
+
+/*
+** This is called by a checkpointer after it has written pages into the
+** database file, but before it allows new readers to read them.
+*/
+void sqlite4BtLockCacheCheckpoint(BtLock *pLock){
+  BtShared *pShared = pLock->pShared;
+  if( pShared ){
+    btCacheEnterAll(pLock->pEnv);
+    pShared->iDbGen++;
+    btCacheLeaveAll(pLock->pEnv);
+  }
+}
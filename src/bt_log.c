@@ -11,6 +11,7 @@
 *************************************************************************
 */
 
+#include "sqliteInt.h"
 #include "btInt.h"
 
 #include <string.h>
@@ -18,14 +19,47 @@
 #include <stdio.h>
 #include <stddef.h>
 
-/* Magic values identifying WAL file header */
-#define BT_WAL_MAGIC   0xBEE1CA62
-#define BT_WAL_VERSION 0x00000001
+#if BT_THREADS
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+/*
+** Where the compiler and CPU support them, CRC instructions (SSE4.2 or 
+** ARMv8) are used to compute CRC32C checksums. Define BT_NO_HWCKSUM to 
+** always use the portable C version. Fletcher checksums are computed
+** using the same vector (AVX2) implementation as LSM log checksums - see
+** lsmCksumAvx2() in lsm_log.c.
+*/
+#if !defined(BT_NO_HWCKSUM) && defined(__GNUC__) \
+ && (defined(__i386__) || defined(__x86_64__))
+# define BT_HWCKSUM_X86 1
+#elif !defined(BT_NO_HWCKSUM) && defined(__GNUC__) \
+ && defined(__ARM_FEATURE_CRC32)
+# include <arm_acle.h>
+# define BT_HWCKSUM_ARM 1
+#endif
+
+/* Magic values identifying WAL file header. Logs that use Fletcher frame
+** checksums are written with version BT_WAL_VERSION, and logs that use 
+** any other algorithm with BT_WAL_VERSION_CKSUM (see btLogVersion()). The 
+** iCksumAlg header field was padding in version 1, so older versions of
+** the library would read such a log's frames as invalid.  */
+#define BT_WAL_MAGIC         0xBEE1CA62
+#define BT_WAL_VERSION       0x00000001
+#define BT_WAL_VERSION_CKSUM 0x00000002
 
 /* Wrap the log around if there is a block of this many free frames at
 ** the start of the file.  */
 #define BT_NWRAPLOG    100
 
+/* Version of the shared-memory layout, stored in BtShmHdr.iVersion. This
+** must be incremented whenever the layout of the BtShm object or the 
+** locks used by bt_lock.c change (for example if BT_NREADER is modified),
+** so that connections using incompatible versions of the library cannot
+** use the same shared-memory region.  */
+#define BT_SHM_VERSION 2
+
 typedef struct BtCkptHdr BtCkptHdr;
 typedef struct BtDbHdrCksum BtDbHdrCksum;
 typedef struct BtFrameHdr BtFrameHdr;
@@ -49,7 +83,7 @@ struct BtWalHdr {
   u32 nPgsz;                      /* Database page size in bytes */
   u32 nPg;                        /* Database size in pages at last commit */
 
-  u32 padding;
+  u32 iCksumAlg;                  /* Frame checksum algorithm (BT_CKSUM_xxx) */
 
   u32 iSalt1;                     /* Initial frame cksum-0 value */
   u32 iSalt2;                     /* Initial frame cksum-1 value */
@@ -94,6 +128,7 @@ struct BtDbHdrCksum {
 ** this structure. All fields are stored in machine byte-order.
 */
 struct BtShmHdr {
+  u32 iVersion;                   /* Shared-memory version (BT_SHM_VERSION) */
   u32 aLog[6];                    /* First/last frames for each log region */
   int nSector;                    /* Sector size assumed for WAL file */
   int iHashSide;                  /* Hash table side for region (c) of log */
@@ -101,7 +136,7 @@ struct BtShmHdr {
   u32 iNextFrame;                 /* Location to write next log frame to */
   BtDbHdr dbhdr;                  /* Cached db-header values */
 
-  u32 padding;
+  u32 iCksumAlg;                  /* Frame checksum algorithm (BT_CKSUM_xxx) */
   u32 aCksum[2];                  /* Object checksum */
 };
 
@@ -145,6 +180,8 @@ struct BtLog {
   int nShm;                       /* Size of apShm[] array */
   u8 **apShm;                     /* Array of mapped shared-memory blocks */
   int nWrapLog;                   /* Wrap if this many free frames at start */
+  u32 aCacheCksum[2];             /* Snapshot pager cache is consistent with */
+  u32 iCacheFirstRead;            /* ckpt.iFirstRead at last snapshot */
 };
 
 typedef u16 ht_slot;
@@ -224,10 +261,11 @@ static void btLogChecksum(
   assert( (nByte&0x00000007)==0 );
 
   if( nativeCksum ){
-    do {
+    aData += lsmCksumAvx2(a, nByte, &s1, &s2) / 4;
+    while( aData<aEnd ){
       s1 += *aData++ + s2;
       s2 += *aData++ + s1;
-    }while( aData<aEnd );
+    }
   }else{
     do {
       s1 += BYTESWAP32(aData[0]) + s2;
@@ -256,6 +294,180 @@ static void btLogChecksum32(
   }
 }
 
+/*
+** Lookup table for the byte-at-a-time CRC32C (Castagnoli) implementation
+** used when CRC instructions are not available.
+*/
+static const u32 aCrc32cTable[256] = {
+  0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C,
+  0x26A1E7E8, 0xD4CA64EB, 0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+  0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24, 0x105EC76F, 0xE235446C,
+  0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+  0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC,
+  0xBC267848, 0x4E4DFB4B, 0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+  0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35, 0xAA64D611, 0x580F5512,
+  0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+  0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD,
+  0x1642AE59, 0xE4292D5A, 0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+  0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595, 0x417B1DBC, 0xB3109EBF,
+  0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+  0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F,
+  0xED03A29B, 0x1F682198, 0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+  0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38, 0xDBFC821C, 0x2997011F,
+  0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+  0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E,
+  0x4767748A, 0xB50CF789, 0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+  0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46, 0x7198540D, 0x83F3D70E,
+  0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+  0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE,
+  0xDDE0EB2A, 0x2F8B6829, 0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+  0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93, 0x082F63B7, 0xFA44E0B4,
+  0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+  0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B,
+  0xB4091BFF, 0x466298FC, 0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+  0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033, 0xA24BB5A6, 0x502036A5,
+  0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+  0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975,
+  0x0E330A81, 0xFC588982, 0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+  0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622, 0x38CC2A06, 0xCAA7A905,
+  0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+  0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8,
+  0xE52CC12C, 0x1747422F, 0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+  0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0, 0xD3D3E1AB, 0x21B862A8,
+  0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+  0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78,
+  0x7FAB5E8C, 0x8DC0DD8F, 0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+  0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1, 0x69E9F0D5, 0x9B8273D6,
+  0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+  0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69,
+  0xD5CF889D, 0x27A40B9E, 0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+  0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351
+};
+
+/*
+** Extend CRC32C value iCrc with the nByte bytes of data in buffer a[]
+** and return the result.
+*/
+static u32 btCrc32cSw(u32 iCrc, const u8 *a, int nByte){
+  u32 c = ~iCrc;
+  int i;
+  for(i=0; i<nByte; i++){
+    c = aCrc32cTable[(c ^ a[i]) & 0xFF] ^ (c >> 8);
+  }
+  return ~c;
+}
+
+#ifdef BT_HWCKSUM_X86
+__attribute__((target("sse4.2")))
+static u32 btCrc32cHw(u32 iCrc, const u8 *a, int nByte){
+  u32 c = ~iCrc;
+  int i = 0;
+#ifdef __x86_64__
+  u64 c64 = c;
+  for(; i+8<=nByte; i+=8){
+    u64 v;
+    memcpy(&v, &a[i], 8);
+    c64 = __builtin_ia32_crc32di(c64, v);
+  }
+  c = (u32)c64;
+#endif
+  for(; i+4<=nByte; i+=4){
+    u32 v;
+    memcpy(&v, &a[i], 4);
+    c = __builtin_ia32_crc32si(c, v);
+  }
+  for(; i<nByte; i++){
+    c = __builtin_ia32_crc32qi(c, a[i]);
+  }
+  return ~c;
+}
+#endif /* ifdef BT_HWCKSUM_X86 */
+
+#ifdef BT_HWCKSUM_ARM
+static u32 btCrc32cHw(u32 iCrc, const u8 *a, int nByte){
+  u32 c = ~iCrc;
+  int i = 0;
+  for(; i+8<=nByte; i+=8){
+    u64 v;
+    memcpy(&v, &a[i], 8);
+    c = __crc32cd(c, v);
+  }
+  for(; i<nByte; i++){
+    c = __crc32cb(c, a[i]);
+  }
+  return ~c;
+}
+#endif /* ifdef BT_HWCKSUM_ARM */
+
+/*
+** Extend CRC32C value iCrc with the nByte bytes of data in buffer a[]
+** and return the result.
+*/
+static u32 btCrc32c(u32 iCrc, const u8 *a, int nByte){
+#if defined(BT_HWCKSUM_X86)
+  if( __builtin_cpu_supports("sse4.2") ) return btCrc32cHw(iCrc, a, nByte);
+#elif defined(BT_HWCKSUM_ARM)
+  return btCrc32cHw(iCrc, a, nByte);
+#endif
+  return btCrc32cSw(iCrc, a, nByte);
+}
+
+/*
+** Test interface. Set *piCrc to the CRC32C of the nByte bytes of data in
+** buffer a[], extending the CRC32C value passed in *piCrc. If bHw is 
+** false, the portable implementation is used. Otherwise, the hardware
+** implementation is used, or SQLITE4_NOTFOUND returned if there is no
+** hardware implementation available on this platform.
+*/
+int sqlite4BtCrc32cTest(int bHw, const u8 *a, int nByte, u32 *piCrc){
+  if( bHw==0 ){
+    *piCrc = btCrc32cSw(*piCrc, a, nByte);
+    return SQLITE4_OK;
+  }
+#if defined(BT_HWCKSUM_X86)
+  if( __builtin_cpu_supports("sse4.2") ){
+    *piCrc = btCrc32cHw(*piCrc, a, nByte);
+    return SQLITE4_OK;
+  }
+#elif defined(BT_HWCKSUM_ARM)
+  *piCrc = btCrc32cHw(*piCrc, a, nByte);
+  return SQLITE4_OK;
+#endif
+  return SQLITE4_NOTFOUND;
+}
+
+/*
+** Calculate the checksum for a log frame using algorithm iAlg (one of the 
+** BT_CKSUM_xxx values). The checksum covers the frame header fields that
+** precede BtFrameHdr.aCksum and the pgsz bytes of page data in aData[], 
+** and extends the checksum of the previous frame (or the salt values from
+** the log header), aIn[]. The result is written to aOut[].
+**
+** For BT_CKSUM_CRC32C, the first word of the checksum is a CRC32C seeded
+** with aIn[0], and the second a CRC32C of the first seeded with aIn[1].
+*/
+static void btLogFrameChecksum(
+  u32 iAlg,                       /* Checksum algorithm */
+  BtFrameHdr *pFrame,             /* Frame header */
+  u8 *aData,                      /* Page data */
+  int pgsz,                       /* Size of aData[] in bytes */
+  const u32 *aIn,                 /* Checksum of previous frame */
+  u32 *aOut                       /* OUT: Checksum for this frame */
+){
+  if( iAlg==BT_CKSUM_CRC32C ){
+    u32 c0, c1;
+    c0 = btCrc32c(aIn[0], (u8*)pFrame, offsetof(BtFrameHdr, aCksum));
+    c0 = btCrc32c(c0, aData, pgsz);
+    c1 = btCrc32c(aIn[1], (u8*)&c0, sizeof(c0));
+    aOut[0] = c0;
+    aOut[1] = c1;
+  }else{
+    assert( iAlg==BT_CKSUM_FLETCHER );
+    btLogChecksum32(1, (u8*)pFrame, offsetof(BtFrameHdr, aCksum), aIn, aOut);
+    btLogChecksum(1, aData, pgsz, aOut, aOut);
+  }
+}
+
 #define BT_ALLOC_DEBUG   0
 #define BT_PAGE_DEBUG    0
 #define BT_VAL_DEBUG     0
@@ -533,6 +745,7 @@ static int btLogUpdateSharedHdr(BtLog *pLog){
   BtShm *pShm = btLogShm(pLog);
 
   /* Calculate a checksum for the private snapshot object. */
+  p->iVersion = BT_SHM_VERSION;
   btLogChecksum32(1, (u8*)p, offsetof(BtShmHdr, aCksum), 0, p->aCksum);
 
   /* Update the shared object. */
@@ -541,6 +754,11 @@ static int btLogUpdateSharedHdr(BtLog *pLog){
   pVfs->xShmBarrier(pLog->pFd);
   memcpy(&pShm->hdr2, p, sizeof(BtShmHdr));
 
+  /* The pager cache of this connection is consistent with the new header,
+  ** as it was just written by this connection.  */
+  memcpy(pLog->aCacheCksum, p->aCksum, sizeof(p->aCksum));
+  sqlite4BtLockCacheCommit(pLog->pLock, p->aCksum);
+
   return SQLITE4_OK;
 }
 
@@ -575,6 +793,23 @@ static int btLogReadData(BtLog *pLog, i64 iOff, u8 *aData, int nData){
   return pVfs->xRead(pLog->pFd, iOff, aData, nData);
 }
 
+/*
+** Return the log file format version used by logs with frame checksum 
+** algorithm iCksumAlg.
+*/
+static u32 btLogVersion(u32 iCksumAlg){
+  return (iCksumAlg==BT_CKSUM_FLETCHER ? BT_WAL_VERSION : BT_WAL_VERSION_CKSUM);
+}
+
+/*
+** Read the log file header at offset iOff into *pHdr. Return SQLITE4_OK
+** if successful, or SQLITE4_NOTFOUND if there is no valid header at iOff.
+**
+** If the header is valid but has a version or checksum algorithm this 
+** library does not understand, the log cannot be recovered. Return 
+** SQLITE4_CANTOPEN in this case, rather than ignoring the log and any
+** transactions it contains.
+*/
 static int btLogReadHeader(BtLog *pLog, int iOff, BtWalHdr *pHdr){
   int rc = btLogReadData(pLog, (i64)iOff, (u8*)pHdr, sizeof(BtWalHdr));
   if( rc==SQLITE4_OK ){
@@ -585,6 +820,10 @@ static int btLogReadHeader(BtLog *pLog, int iOff, BtWalHdr *pHdr){
      || aCksum[1]!=pHdr->aCksum[1] 
     ){
       rc = SQLITE4_NOTFOUND;
+    }else if( pHdr->iCksumAlg>BT_CKSUM_CRC32C 
+           || pHdr->iVersion!=btLogVersion(pHdr->iCksumAlg)
+    ){
+      rc = btErrorBkpt(SQLITE4_CANTOPEN);
     }else{
       btDebugLogHeader(pLog->pLock, "read", pHdr, iOff!=0);
     }
@@ -592,10 +831,230 @@ static int btLogReadHeader(BtLog *pLog, int iOff, BtWalHdr *pHdr){
   return rc;
 }
 
+/*
+** During recovery, frames are read from the log file in batches. The first
+** batch contains BT_RECOVER_MINFRAME frames, and each subsequent batch 
+** twice as many as the last, up to a limit of BT_RECOVER_BATCH bytes of
+** page data. Worker threads are only started to verify batches of at 
+** least BT_RECOVER_MINTHREAD frames. Each thread claims BT_RECOVER_CHUNK 
+** frames of the batch at a time.
+*/
+#define BT_RECOVER_MINFRAME  16
+#define BT_RECOVER_BATCH     (4*1024*1024)
+#define BT_RECOVER_MINTHREAD 256
+#define BT_RECOVER_CHUNK     16
+
+/*
+** A batch of frames read from the log file by btLogTraverse().
+**
+** Frames are read from the log file by the thread running recovery, as 
+** the VFS does not support concurrent reads on a single file handle. Their
+** checksums are then verified, by up to BtLock.nRecoverThread threads, 
+** before the frames are passed to the xFrame callback in log order.
+**
+** Each frame is stored in aBuf[] as it is in the log file - a BtFrameHdr
+** followed by pgsz bytes of page data. This allows a run of consecutive
+** frames to be read from the file using a single xRead() call.
+*/
+typedef struct BtRecoverBatch BtRecoverBatch;
+struct BtRecoverBatch {
+  u32 iCksumAlg;                  /* Checksum algorithm (BT_CKSUM_xxx) */
+  int pgsz;                       /* Page size */
+  int nFrame;                     /* Number of frames in batch */
+  u32 aCksum[2];                  /* Checksum of frame preceding frame 0 */
+  u8 *aBuf;                       /* Frame headers and data */
+  u32 *aFrame;                    /* Frame numbers */
+  u8 *aOk;                        /* True for frames with valid checksums */
+#if BT_THREADS
+  int nWorker;                    /* Worker threads to start */
+  int nThread;                    /* Number of worker threads running */
+  pthread_t *aThread;             /* Worker threads */
+  pthread_mutex_t mutex;          /* Mutex protecting the following */
+  pthread_cond_t workCond;        /* Workers wait on this for a batch */
+  pthread_cond_t doneCond;        /* Signalled when nBusy drops to zero */
+  int iNext;                      /* Next frame to be claimed by a thread */
+  int nPost;                      /* Frames available to threads */
+  int nBusy;                      /* Threads currently verifying frames */
+  int bShutdown;                  /* Set to ask worker threads to exit */
+#endif
+};
+
+/*
+** Return a pointer to the header of the i'th frame of batch p. The page
+** data follows it in memory.
+*/
+static BtFrameHdr *btRecoverFrame(BtRecoverBatch *p, int i){
+  return (BtFrameHdr*)&p->aBuf[(i64)i * (p->pgsz + sizeof(BtFrameHdr))];
+}
+
+/*
+** Verify the checksum of the i'th frame of batch p. Set p->aOk[i] to true
+** if it is correct, or false otherwise.
+**
+** The checksum of each frame extends that of the previous frame. Since 
+** recovery stops at the first frame that fails verification, the 
+** checksum stored in the previous frame header may be used in place of
+** the value calculated for it. This allows frames to be verified in any
+** order.
+*/
+static void btRecoverVerifyFrame(BtRecoverBatch *p, int i){
+  BtFrameHdr *pFrame = btRecoverFrame(p, i);
+  const u32 *aIn = (i==0 ? p->aCksum : btRecoverFrame(p, i-1)->aCksum);
+  u32 aCksum[2];
+
+  btLogFrameChecksum(p->iCksumAlg, 
+      pFrame, (u8*)&pFrame[1], p->pgsz, aIn, aCksum
+  );
+  p->aOk[i] = (aCksum[0]==pFrame->aCksum[0] && aCksum[1]==pFrame->aCksum[1]);
+}
+
+#if BT_THREADS
+/*
+** Claim and verify frames of the current batch until there are none left.
+** The caller must hold p->mutex.
+*/
+static void btRecoverWork(BtRecoverBatch *p){
+  while( p->iNext<p->nPost ){
+    int iFirst = p->iNext;
+    int iEnd = MIN(iFirst + BT_RECOVER_CHUNK, p->nPost);
+    int i;
+
+    p->iNext = iEnd;
+    p->nBusy++;
+    pthread_mutex_unlock(&p->mutex);
+    for(i=iFirst; i<iEnd; i++){
+      btRecoverVerifyFrame(p, i);
+    }
+    pthread_mutex_lock(&p->mutex);
+    p->nBusy--;
+  }
+  if( p->nBusy==0 ) pthread_cond_signal(&p->doneCond);
+}
+
+static void *btRecoverMain(void *pArg){
+  BtRecoverBatch *p = (BtRecoverBatch*)pArg;
+
+  pthread_mutex_lock(&p->mutex);
+  while( p->bShutdown==0 ){
+    btRecoverWork(p);
+    if( p->bShutdown==0 ) pthread_cond_wait(&p->workCond, &p->mutex);
+  }
+  pthread_mutex_unlock(&p->mutex);
+
+  return 0;
+}
+
+/*
+** Return the number of worker threads to start for recovery if up to 
+** nThread threads, including the thread running recovery, may be used. 
+** No more threads are used than there are processors online.
+*/
+static int btRecoverWorkers(int nThread){
+  long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if( nCpu>0 && nThread>nCpu ) nThread = (int)nCpu;
+  return nThread-1;
+}
+
+/*
+** Attempt to start p->nWorker worker threads. If they cannot be started,
+** frames are verified by the thread running recovery.
+*/
+static void btRecoverStart(sqlite4_env *pEnv, BtRecoverBatch *p){
+  int nWorker = p->nWorker;
+
+  p->nWorker = 0;
+  p->aThread = (pthread_t*)sqlite4_malloc(pEnv, sizeof(pthread_t) * nWorker);
+  if( p->aThread==0 ) return;
+
+  if( pthread_mutex_init(&p->mutex, 0)==0 ){
+    if( pthread_cond_init(&p->workCond, 0)==0 ){
+      if( pthread_cond_init(&p->doneCond, 0)==0 ){
+        while( p->nThread<nWorker ){
+          pthread_t *pThread = &p->aThread[p->nThread];
+          if( pthread_create(pThread, 0, btRecoverMain, (void*)p) ) break;
+          p->nThread++;
+        }
+        if( p->nThread>0 ) return;
+        pthread_cond_destroy(&p->doneCond);
+      }
+      pthread_cond_destroy(&p->workCond);
+    }
+    pthread_mutex_destroy(&p->mutex);
+  }
+  sqlite4_free(pEnv, p->aThread);
+  p->aThread = 0;
+}
+
+/*
+** Stop the worker threads started by btRecoverStart(), if any.
+*/
+static void btRecoverStop(sqlite4_env *pEnv, BtRecoverBatch *p){
+  if( p->nThread>0 ){
+    int i;
+    pthread_mutex_lock(&p->mutex);
+    p->bShutdown = 1;
+    pthread_cond_broadcast(&p->workCond);
+    pthread_mutex_unlock(&p->mutex);
+    for(i=0; i<p->nThread; i++){
+      void *pDummy;
+      pthread_join(p->aThread[i], &pDummy);
+    }
+    pthread_cond_destroy(&p->doneCond);
+    pthread_cond_destroy(&p->workCond);
+    pthread_mutex_destroy(&p->mutex);
+  }
+  sqlite4_free(pEnv, p->aThread);
+}
+#else
+# define btRecoverStop(pEnv, p)
+#endif /* BT_THREADS */
+
+/*
+** Verify the checksums of all frames in batch p.
+*/
+static void btRecoverVerify(sqlite4_env *pEnv, BtRecoverBatch *p){
+  int i;
+#if BT_THREADS
+  if( p->nWorker>0 && p->nFrame>=BT_RECOVER_MINTHREAD ){
+    btRecoverStart(pEnv, p);
+  }
+  if( p->nThread>0 ){
+    pthread_mutex_lock(&p->mutex);
+    p->iNext = 0;
+    p->nPost = p->nFrame;
+    pthread_cond_broadcast(&p->workCond);
+    btRecoverWork(p);
+    while( p->nBusy>0 ){
+      pthread_cond_wait(&p->doneCond, &p->mutex);
+    }
+    p->nPost = 0;
+    pthread_mutex_unlock(&p->mutex);
+    return;
+  }
+#endif
+  for(i=0; i<p->nFrame; i++){
+    btRecoverVerifyFrame(p, i);
+  }
+}
+
 /*
 ** This function is used as part of recovery. It reads the contents of
 ** the log file from disk and invokes the xFrame callback for each valid
 ** frame in the file.
+**
+** Frames are processed in batches. Each batch is read from disk by 
+** following the chain of "next frame" pointers in the frame headers, 
+** before it is known whether or not those headers are valid. Usually 
+** each frame is followed by the next in the file, so a run of frames is
+** read using a single xRead() call, assuming that this is so. Any frames
+** read beyond the first that is not are then discarded. Once the batch 
+** has been read, the checksums of its frames are verified (in parallel,
+** see btRecoverVerify()). Finally, the xFrame callback is invoked for
+** each frame up until the first that fails verification.
+**
+** If an error occurs while reading a frame that is not the first of its
+** batch, the batch is truncated. The error is only returned if all
+** frames that precede it in the log are found to be valid.
 */
 static int btLogTraverse(
   BtLog *pLog,                    /* Log module handle */
@@ -603,43 +1062,95 @@ static int btLogTraverse(
   int(*xFrame)(BtLog*, void*, u32, BtFrameHdr*), /* Frame callback */
   void *pCtx                      /* Passed as second argument to xFrame */
 ){
-  sqlite4_env *pEnv = pLog->pLock->pEnv;
+  BtLock *pLock = pLog->pLock;
+  sqlite4_env *pEnv = pLock->pEnv;
   const int pgsz = pHdr->nPgsz;
+  const int nFrameByte = pgsz + sizeof(BtFrameHdr);
+  const int nMax = MAX(BT_RECOVER_MINFRAME, BT_RECOVER_BATCH / pgsz);
   u32 iFrame = pHdr->iFirstFrame;
-  u32 aCksum[2];
-  BtFrameHdr fhdr;                /* Frame header */
-  u8 *aBuf;                       /* Buffer for frame data */
+  BtRecoverBatch b;               /* Current batch of frames */
+  int nAlloc = 0;                 /* Number of frames b.aBuf has space for */
+  int nDone = 0;                  /* Frames passed to xFrame so far */
+  int nTotal = 0;                 /* Frames the log file has space for */
+  int bEof = 0;                   /* True once an invalid frame is seen */
   int rc = SQLITE4_OK;
 
-  aCksum[0] = pHdr->iSalt1;
-  aCksum[1] = pHdr->iSalt2;
+  memset(&b, 0, sizeof(b));
+  b.iCksumAlg = pHdr->iCksumAlg;
+  b.pgsz = pgsz;
+  b.aCksum[0] = pHdr->iSalt1;
+  b.aCksum[1] = pHdr->iSalt2;
+#if BT_THREADS
+  b.nWorker = btRecoverWorkers(pLock->nRecoverThread);
+#endif
 
-  aBuf = sqlite4_malloc(pEnv, pgsz);
-  if( aBuf==0 ){
-    rc = SQLITE4_NOMEM;
+  if( pLock->xRecover ){
+    i64 nByte = 0;
+    rc = pLock->pVfs->xSize(pLog->pFd, &nByte);
+    nByte -= btLogFrameOffset(pLog, pgsz, 1);
+    if( nByte>0 ) nTotal = (int)(nByte / nFrameByte);
   }
 
-  while( rc==SQLITE4_OK ){
-    i64 iOff;
-    iOff = btLogFrameOffset(pLog, pgsz, iFrame);
+  while( rc==SQLITE4_OK && bEof==0 ){
+    int rcRead = SQLITE4_OK;      /* Error reading frame b.nFrame */
+    int i;
 
-    rc = btLogReadData(pLog, iOff, (u8*)&fhdr, sizeof(BtFrameHdr));
-    if( rc==SQLITE4_OK ){
-      rc = btLogReadData(pLog, iOff+sizeof(BtFrameHdr), aBuf, pgsz);
+    /* If the previous batch was full, double the size of the buffer */
+    if( b.nFrame==nAlloc && nAlloc<nMax ){
+      nAlloc = (nAlloc ? MIN(nAlloc*2, nMax) : BT_RECOVER_MINFRAME);
+      sqlite4_free(pEnv, b.aBuf);
+      b.aBuf = (u8*)sqlite4_malloc(pEnv, 
+          (i64)nAlloc * (nFrameByte + sizeof(u32) + sizeof(u8))
+      );
+      if( b.aBuf==0 ){
+        rc = btErrorBkpt(SQLITE4_NOMEM);
+        break;
+      }
+      b.aFrame = (u32*)&b.aBuf[(i64)nAlloc * nFrameByte];
+      b.aOk = (u8*)&b.aFrame[nAlloc];
     }
-    if( rc==SQLITE4_OK ){
-      btLogChecksum32(1, (u8*)&fhdr, offsetof(BtFrameHdr,aCksum),aCksum,aCksum);
-      btLogChecksum(1, aBuf, pgsz, aCksum, aCksum);
-      if( aCksum[0]!=fhdr.aCksum[0] || aCksum[1]!=fhdr.aCksum[1] ) break;
+
+    /* Read the next batch of frames from disk */
+    b.nFrame = 0;
+    while( b.nFrame<nAlloc ){
+      i64 iOff = btLogFrameOffset(pLog, pgsz, iFrame);
+      u8 *aRead = (u8*)btRecoverFrame(&b, b.nFrame);
+      int nRead = nAlloc - b.nFrame;
+
+      rcRead = btLogReadData(pLog, iOff, aRead, nRead * nFrameByte);
+      if( rcRead!=SQLITE4_OK ) break;
+      for(i=0; i<nRead; i++){
+        b.aFrame[b.nFrame++] = iFrame;
+        iFrame = btRecoverFrame(&b, b.nFrame-1)->iNext;
+        if( iFrame!=b.aFrame[b.nFrame-1]+1 ) break;
+      }
     }
-    if( rc==SQLITE4_OK ){
-      rc = xFrame(pLog, pCtx, iFrame, &fhdr);
+
+    /* Verify the checksums, then pass the valid frames to xFrame */
+    btRecoverVerify(pEnv, &b);
+    for(i=0; rc==SQLITE4_OK && i<b.nFrame; i++){
+      if( b.aOk[i]==0 ){
+        bEof = 1;
+        break;
+      }
+      rc = xFrame(pLog, pCtx, b.aFrame[i], btRecoverFrame(&b, i));
     }
+    nDone += i;
 
-    iFrame = fhdr.iNext;
+    if( rc==SQLITE4_OK && bEof==0 ){
+      rc = rcRead;
+      if( b.nFrame>0 ){
+        BtFrameHdr *pLast = btRecoverFrame(&b, b.nFrame-1);
+        memcpy(b.aCksum, pLast->aCksum, sizeof(b.aCksum));
+      }
+    }
+    if( rc==SQLITE4_OK && pLock->xRecover ){
+      pLock->xRecover(pLock->pRecoverCtx, nDone, MAX(nDone, nTotal));
+    }
   }
 
-  sqlite4_free(pEnv, aBuf);
+  btRecoverStop(pEnv, &b);
+  sqlite4_free(pEnv, b.aBuf);
   return rc;
 }
 
@@ -1017,6 +1528,7 @@ nCall++;
       pShm->ckpt.iFirstRecover = pHdr->iFirstFrame;
       rc = btLogRollbackRecovery(pLog, &ctx);
       pLog->snapshot.iNextFrame = ctx.iNextFrame;
+      pLog->snapshot.iCksumAlg = pHdr->iCksumAlg;
       pLog->snapshot.dbhdr.pgsz = pHdr->nPgsz;
       assert( pShm->ckpt.iFirstRead>0 );
     }
@@ -1199,8 +1711,18 @@ static int btLogHashSearch(
 ** part of a checkpoint operation. In this case, if there exists a version
 ** of page pgno within the log at some point past frame iSafe, return
 ** SQLITE4_NOTFOUND.
+**
+** If ppCache is not NULL and the frame is found in the shared page cache,
+** *ppCache is set to point to the cache entry and aData[] is not modified.
+** Otherwise, if ppCache is not NULL, *ppCache is set to NULL.
 */
-int btLogRead(BtLog *pLog, u32 pgno, u8 *aData, u32 iSafe){
+int btLogRead(
+  BtLog *pLog, 
+  u32 pgno, 
+  u8 *aData, 
+  BtCachePage **ppCache, 
+  u32 iSafe
+){
   const int pgsz = pLog->snapshot.dbhdr.pgsz;
   int rc = SQLITE4_NOTFOUND;
   u32 iFrame = 0;
@@ -1209,6 +1731,8 @@ int btLogRead(BtLog *pLog, u32 pgno, u8 *aData, u32 iSafe){
   u32 *aLog = pLog->snapshot.aLog;
   int iSafeIdx = sqlite4BtLogFrameToIdx(aLog, iSafe);
 
+  if( ppCache ) *ppCache = 0;
+
   /* Loop through regions (c), (b) and (a) of the log file. In that order. */
   for(i=2; i>=0 && rc==SQLITE4_NOTFOUND; i--){
     u32 iLo = pLog->snapshot.aLog[i*2+0];
@@ -1240,12 +1764,25 @@ int btLogRead(BtLog *pLog, u32 pgno, u8 *aData, u32 iSafe){
 
   btDebugLogSearch(pLog->pLock, pgno, iSafe, (rc==SQLITE4_OK ? iFrame : 0));
 
+  /* Unless this is a checkpoint, try the shared page cache before 
+  ** reading the frame from disk.  */
   if( rc==SQLITE4_OK ){
-    bt_env *pVfs = pLog->pLock->pVfs;
-    i64 iOff;
+    BtLock *pLock = pLog->pLock;
+    u32 iGen = 0;
+    i64 iOff = 0;
     assert( rc==SQLITE4_OK );
-    iOff = btLogFrameOffset(pLog, pgsz, iFrame);
-    rc = pVfs->xRead(pLog->pFd, iOff + sizeof(BtFrameHdr), aData, pgsz);
+    if( ppCache ){
+      rc = sqlite4BtLockCacheFetch(pLock, pgno, iFrame, pgsz, ppCache, &iGen);
+    }else{
+      rc = SQLITE4_NOTFOUND;
+    }
+    if( rc==SQLITE4_NOTFOUND ){
+      iOff = btLogFrameOffset(pLog, pgsz, iFrame);
+      rc = pLock->pVfs->xRead(pLog->pFd, iOff+sizeof(BtFrameHdr), aData, pgsz);
+      if( rc==SQLITE4_OK && ppCache ){
+        sqlite4BtLockCacheInsert(pLock, pgno, iFrame, iGen, aData, pgsz);
+      }
+    }
 
 #if 0
     fprintf(stderr, "read page %d from offset %d\n", (int)pgno, (int)iOff);
@@ -1258,8 +1795,12 @@ int btLogRead(BtLog *pLog, u32 pgno, u8 *aData, u32 iSafe){
 
 /*
 ** Attempt to read data for page pgno from the log file. If successful,
-** the data is written into buffer aData[] (which must be at least as
-** large as a database page). In this case SQLITE4_OK is returned.
+** SQLITE4_OK is returned and either the data is written into buffer 
+** aData[] (which must be at least as large as a database page) and 
+** *ppCache set to NULL, or, if the page was found in the shared page 
+** cache, *ppCache is set to point to the cache entry containing it and
+** aData[] is not modified. In the latter case the caller must eventually
+** release the entry using sqlite4BtLockCacheRelease().
 **
 ** If the log does not contain any version of page pgno, SQLITE4_NOTFOUND
 ** is returned and the contents of buffer aData[] are not modified.
@@ -1267,12 +1808,13 @@ int btLogRead(BtLog *pLog, u32 pgno, u8 *aData, u32 iSafe){
 ** If any other error occurs, an SQLite4 error code is returned. The final
 ** state of buffer aData[] is undefined in this case.
 */
-int sqlite4BtLogRead(BtLog *pLog, u32 pgno, u8 *aData){
+int sqlite4BtLogRead(BtLog *pLog, u32 pgno, u8 *aData, BtCachePage **ppCache){
   if( pLog->snapshot.aLog[4]==0 ){
     assert( pLog->snapshot.aLog[0]==0 && pLog->snapshot.aLog[2]==0 );
+    *ppCache = 0;
     return SQLITE4_NOTFOUND;
   }
-  return btLogRead(pLog, pgno, aData, 0);
+  return btLogRead(pLog, pgno, aData, ppCache, 0);
 }
 
 static int btLogZeroHash(BtLog *pLog, int iHash){
@@ -1302,6 +1844,9 @@ static int btLogWriteFrame(BtLog *pLog, int nPad, u32 pgno, u8 *aData, u32 nPg){
   iFrame = pLog->snapshot.iNextFrame;
   iOff = btLogFrameOffset(pLog, pgsz, iFrame);
 
+  /* If the frame being overwritten is in the shared page cache, remove it */
+  sqlite4BtLockCacheDiscard(pLog->pLock, 0, iFrame);
+
   /* The current frame will be written to location pLog->snapshot.iNextFrame.
   ** This code determines where the following frame will be stored. There
   ** are three possibilities:
@@ -1341,8 +1886,9 @@ static int btLogWriteFrame(BtLog *pLog, int nPad, u32 pgno, u8 *aData, u32 nPg){
       frame.iNext = iNextFrame;
       frame.nPg = nPg;
       a = pLog->snapshot.aFrameCksum;
-      btLogChecksum32(1,(u8*)&frame,offsetof(BtFrameHdr,aCksum),a,frame.aCksum);
-      btLogChecksum(1, aData, pgsz, frame.aCksum, frame.aCksum);
+      btLogFrameChecksum(
+          pLog->snapshot.iCksumAlg, &frame, aData, pgsz, a, frame.aCksum
+      );
 
       btDebugLogPage(pLog->pLock, pgno, iFrame, aData, pgsz, nPg);
 
@@ -1432,16 +1978,19 @@ int sqlite4BtLogWrite(BtLog *pLog, u32 pgno, u8 *aData, u32 nPg){
     memset(&hdr, 0, sizeof(BtWalHdr));
 
     hdr.iMagic = BT_WAL_MAGIC;
-    hdr.iVersion = BT_WAL_VERSION;
     hdr.nSector = pLog->snapshot.nSector;
     hdr.nPgsz = pgsz;
     hdr.iSalt1 = 22;
     hdr.iSalt2 = 23;
     hdr.iFirstFrame = 1;
+    hdr.iCksumAlg = pLog->pLock->iCksumAlg;
+    hdr.iVersion = btLogVersion(hdr.iCksumAlg);
 
     rc = btLogWriteHeader(pLog, 0, &hdr);
     if( rc!=SQLITE4_OK ) return rc;
 
+    pLog->snapshot.iCksumAlg = hdr.iCksumAlg;
+
     pLog->snapshot.aFrameCksum[0] = hdr.iSalt1;
     pLog->snapshot.aFrameCksum[1] = hdr.iSalt2;
     pLog->snapshot.iNextFrame = 1;
@@ -1490,7 +2039,13 @@ static int btLogSnapshot(BtLog *pLog, BtShmHdr *pHdr){
       if( btLogChecksumOk(pHdr) ) break;
     }
 
-    if( nAttempt==0 ) rc = SQLITE4_PROTOCOL;
+    if( nAttempt==0 ){
+      rc = SQLITE4_PROTOCOL;
+    }else if( pHdr->iVersion!=BT_SHM_VERSION ){
+      /* Shared-memory was initialized by an incompatible version of
+      ** the library. */
+      rc = btErrorBkpt(SQLITE4_CANTOPEN);
+    }
   }
 
   return rc;
@@ -1513,12 +2068,24 @@ static void btLogSnapshotTrim(u32 *aLog, u32 iFirst){
   }
 }
 
-int sqlite4BtLogSnapshotOpen(BtLog *pLog){
+/*
+** Open a read-only snapshot of the database. Before returning, set 
+** *pbChange to true if the snapshot is not the same as the one the 
+** pager cache was populated using (i.e. if the database has been written
+** by some other connection since this one last read from it), or to 
+** false otherwise.
+**
+** Also set *pbCkpt to true if the log has been checkpointed since the
+** previous snapshot was opened, or to false otherwise.
+*/
+int sqlite4BtLogSnapshotOpen(BtLog *pLog, int *pbChange, int *pbCkpt){
   u32 *aLog = pLog->snapshot.aLog;
   int rc = SQLITE4_NOTFOUND;
   BtShmHdr shmhdr;
   u32 iFirstRead = 0;
 
+  *pbChange = 0;
+  *pbCkpt = 0;
   while( rc==SQLITE4_NOTFOUND ){
     BtShm *pShm;
 
@@ -1567,6 +2134,18 @@ int sqlite4BtLogSnapshotOpen(BtLog *pLog){
     btLogSnapshotTrim(aLog, iFirstRead);
   }
 
+  if( rc==SQLITE4_OK ){
+    u32 *aCksum = pLog->snapshot.aCksum;
+    *pbChange = (aCksum[0]!=pLog->aCacheCksum[0] 
+              || aCksum[1]!=pLog->aCacheCksum[1]);
+    memcpy(pLog->aCacheCksum, aCksum, sizeof(pLog->aCacheCksum));
+    *pbCkpt = (iFirstRead!=pLog->iCacheFirstRead);
+    pLog->iCacheFirstRead = iFirstRead;
+    sqlite4BtLockCacheSnapshot(
+        pLog->pLock, aCksum, iFirstRead, btLogShm(pLog)->ckpt.iWalHdr
+    );
+  }
+
   if( rc==SQLITE4_OK ){
     btDebugTopology(
         pLog->pLock, "snapshotB", pLog->snapshot.iHashSide, pLog->snapshot.aLog
@@ -1741,8 +2320,10 @@ int sqlite4BtLogFrameToIdx(u32 *aLog, u32 iFrame){
 static int btLogGatherPgno(
   BtLog *pLog,                    /* Log module handle */
   int nFrameBuffer,
+  int nFrameMax,                  /* Max frames to gather (0 for no limit) */
   u32 **paPgno,                   /* OUT: s4_malloc'd array of sorted pgno */
   int *pnPgno,                    /* OUT: Number of entries in *paPgno */
+  int *pnFrame,                   /* OUT: Number of frames gathered */
   u32 *piLastFrame                /* OUT: Last frame checkpointed */
 ){
   BtShm *pShm = btLogShm(pLog);
@@ -1765,6 +2346,7 @@ static int btLogGatherPgno(
 
   *paPgno = 0;
   *pnPgno = 0;
+  *pnFrame = 0;
   *piLastFrame = 0;
 
   rc = sqlite4BtLockReaderQuery(pLock, aLog, pShm->aReadlock, &iSafe, &bLocked);
@@ -1780,6 +2362,13 @@ static int btLogGatherPgno(
   if( iSafeIdx<0 || iBufIdx<iSafeIdx ) iSafeIdx = iBufIdx;
   if( iSafeIdx<0 || (iFirstIdx>=0 && iSafeIdx<iFirstIdx) ) return rc;
 
+  /* If the caller has requested an incremental checkpoint, do not gather
+  ** more than nFrameMax frames, starting from the oldest.  */
+  if( nFrameMax>0 ){
+    int iMaxIdx = (iFirstIdx>=0 ? iFirstIdx : 0) + nFrameMax - 1;
+    if( iMaxIdx<iSafeIdx ) iSafeIdx = iMaxIdx;
+  }
+
   /* Determine an upper limit on the number of distinct page numbers. This
   ** limit is used to allocate space for the returned array.  */
   nMax = iSafeIdx - iFirstIdx +1;
@@ -1829,6 +2418,7 @@ static int btLogGatherPgno(
   /* Sort the contents of the array in ascending order. This step also 
   ** eliminates any  duplicate page numbers. */
   if( rc==SQLITE4_OK ){
+    *pnFrame = nPgno;
     btLogMergeSort(aPgno, &nPgno, aSpace);
     *pnPgno = nPgno;
     *paPgno = aPgno;
@@ -1858,37 +2448,88 @@ int sqlite4BtLogSize(BtLog *pLog){
   ;
 }
 
+/*
+** This is called by a checkpointer to run the merge described by schedule
+** page aBuf. The merge reads its input using the checkpointer snapshot. 
+** That snapshot is first trimmed so that no frames before iFirstRead are
+** read from the log, as a concurrent writer may be overwriting them. The
+** pages in the database file are up to date.
+*/
 static int btLogMerge(BtLog *pLog, u8 *aBuf){
-  bt_db *db = (bt_db*)sqlite4BtPagerExtra((BtPager*)pLog->pLock);
-  return sqlite4BtMerge(db, &pLog->snapshot.dbhdr, aBuf);
+  BtPager *pPager = (BtPager*)pLog->pLock;
+  bt_db *db = (bt_db*)sqlite4BtPagerExtra(pPager);
+  int rc;
+
+  btLogSnapshotTrim(pLog->snapshot.aLog, btLogShm(pLog)->ckpt.iFirstRead);
+  rc = sqlite4BtPagerInvalidate(pPager);
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4BtMerge(db, &pLog->snapshot.dbhdr, aBuf);
+  }
+  return rc;
 }
 
-int sqlite4BtLogCheckpoint(BtLog *pLog, int nFrameBuffer){
+/*
+** Write the nPg pages of data in buffer aBuf to the database file, 
+** starting at page iPg.
+*/
+static int btLogWritePages(BtLog *pLog, u32 iPg, u8 *aBuf, int nPg){
+  bt_env *pVfs = pLog->pLock->pVfs;
+  int pgsz = pLog->snapshot.dbhdr.pgsz;
+  i64 iOff = (i64)pgsz * (iPg-1);
+  return pVfs->xWrite(pLog->pLock->pFd, iOff, aBuf, pgsz*nPg);
+}
+
+/*
+** Checkpoint the log file. Frames are copied into the database file 
+** starting from the oldest, until either:
+**
+**   * all frames except the most recent nFrameBuffer have been copied, or
+**   * nFrameMax frames have been copied (if nFrameMax is greater than 0), or
+**   * the next frame may still be required by a reader.
+**
+** Pages are written to the database file in sorted order, with runs of 
+** up to BtLock.nCkptBatch consecutive pages written using a single call
+** to xWrite(). If pnCkpt is not NULL, *pnCkpt is set to the number of 
+** frames checkpointed before returning.
+*/
+int sqlite4BtLogCheckpoint(
+  BtLog *pLog,                    /* Log module handle */
+  int nFrameBuffer,               /* Minimum frames to leave in log */
+  int nFrameMax,                  /* Max frames to checkpoint (0 for all) */
+  int *pnCkpt                     /* OUT: Number of frames checkpointed */
+){
   BtLock *pLock = pLog->pLock;
   int rc;
 
+  if( pnCkpt ) *pnCkpt = 0;
+
   /* Take the CHECKPOINTER lock. */
   rc = sqlite4BtLockCkpt(pLock);
   if( rc==SQLITE4_OK ){
     int pgsz;
     bt_env *pVfs = pLock->pVfs;
-    bt_file *pFd = pLock->pFd;
     BtShm *pShm;                  /* Pointer to shared-memory region */
     u32 iLast;                    /* Last frame to checkpoint */
     BtFrameHdr fhdr;              /* Frame header of frame iLast */
     u32 *aPgno = 0;               /* Array of page numbers to checkpoint */
     int nPgno;                    /* Number of entries in aPgno[] */
+    int nFrame;                   /* Number of frames being checkpointed */
     int i;                        /* Used to loop through aPgno[] */
-    u8 *aBuf;                     /* Buffer to load page data into */
+    u8 *aBuf = 0;                 /* Buffer to load page data into */
+    u8 *aSched = 0;               /* Buffer to load schedule page into */
+    int nBatch;                   /* Max pages in aBuf[] */
+    int nBuf = 0;                 /* Pages currently in aBuf[] */
+    u32 iBufPgno = 0;             /* Page number of first page in aBuf[] */
     u32 iFirstRead;               /* First frame not checkpointed */
 
     rc = btLogSnapshot(pLog, &pLog->snapshot);
     sqlite4BtPagerSetDbhdr((BtPager*)pLock, &pLog->snapshot.dbhdr);
     pgsz = pLog->snapshot.dbhdr.pgsz;
+    nBatch = (pLock->nCkptBatch>0 ? pLock->nCkptBatch : 1);
 
     if( rc==SQLITE4_OK ){
       /* Allocate space to load log data into */
-      aBuf = sqlite4_malloc(pLock->pEnv, pgsz);
+      aBuf = sqlite4_malloc(pLock->pEnv, (sqlite4_size_t)pgsz*nBatch);
       if( aBuf==0 ) rc = btErrorBkpt(SQLITE4_NOMEM);
     }
     
@@ -1896,7 +2537,9 @@ int sqlite4BtLogCheckpoint(BtLog *pLog, int nFrameBuffer){
     ** file being checkpointed. Remove any duplicates and sort them in 
     ** ascending order.  */
     if( rc==SQLITE4_OK ){
-      rc = btLogGatherPgno(pLog, nFrameBuffer, &aPgno, &nPgno, &iLast);
+      rc = btLogGatherPgno(
+          pLog, nFrameBuffer, nFrameMax, &aPgno, &nPgno, &nFrame, &iLast
+      );
     }
 
     if( rc==SQLITE4_OK && nPgno>0 ){
@@ -1913,22 +2556,61 @@ int sqlite4BtLogCheckpoint(BtLog *pLog, int nFrameBuffer){
       /* Copy data from the log file to the database file. */
       for(i=0; rc==SQLITE4_OK && i<nPgno; i++){
         u32 pgno = aPgno[i];
-        rc = btLogRead(pLog, pgno, aBuf, iLast);
+        u8 *aData;
+
+        /* If the buffer is full, or if pgno does not immediately follow
+        ** the pages already in it, write the buffered pages out. */
+        if( nBuf>0 && (nBuf==nBatch || pgno!=iBufPgno+nBuf) ){
+          rc = btLogWritePages(pLog, iBufPgno, aBuf, nBuf);
+          nBuf = 0;
+          if( rc!=SQLITE4_OK ) break;
+        }
+
+        /* The schedule page is set aside until all other pages have been
+        ** copied. The merge it describes writes directly to blocks that 
+        ** may have been reused since they were last written to the log, 
+        ** so the merge output must not be overwritten by older frames.  */
+        if( pgno==pLog->snapshot.dbhdr.iSRoot ){
+          aSched = sqlite4_malloc(pLock->pEnv, pgsz);
+          if( aSched==0 ){
+            rc = btErrorBkpt(SQLITE4_NOMEM);
+          }else{
+            rc = btLogRead(pLog, pgno, aSched, 0, iLast);
+            if( rc==SQLITE4_NOTFOUND ){
+              sqlite4_free(pLock->pEnv, aSched);
+              aSched = 0;
+              rc = SQLITE4_OK;
+            }
+          }
+          continue;
+        }
+
+        aData = &aBuf[nBuf*pgsz];
+        rc = btLogRead(pLog, pgno, aData, 0, iLast);
         if( rc==SQLITE4_OK ){
-          i64 iOff = (i64)pgsz * (pgno-1);
           if( pgno==1 ){
-            rc = btLogUpdateDbhdr(pLog, aBuf);
-          }else if( pgno==pLog->snapshot.dbhdr.iSRoot ){
-            rc = btLogMerge(pLog, aBuf);
+            rc = btLogUpdateDbhdr(pLog, aData);
           }
           if( rc==SQLITE4_OK ){
-            btDebugCkptPage(pLog->pLock, pgno, aBuf, pgsz);
-            rc = pVfs->xWrite(pFd, iOff, aBuf, pgsz);
+            btDebugCkptPage(pLog->pLock, pgno, aData, pgsz);
+            if( nBuf==0 ) iBufPgno = pgno;
+            nBuf++;
           }
         }else if( rc==SQLITE4_NOTFOUND ){
           rc = SQLITE4_OK;
         }
       }
+      if( rc==SQLITE4_OK && nBuf>0 ){
+        rc = btLogWritePages(pLog, iBufPgno, aBuf, nBuf);
+      }
+      if( rc==SQLITE4_OK && aSched ){
+        u32 iSRoot = pLog->snapshot.dbhdr.iSRoot;
+        rc = btLogMerge(pLog, aSched);
+        if( rc==SQLITE4_OK ){
+          btDebugCkptPage(pLog->pLock, iSRoot, aSched, pgsz);
+          rc = btLogWritePages(pLog, iSRoot, aSched, 1);
+        }
+      }
 
       /* Sync the database file to disk. */
       if( rc==SQLITE4_OK ){
@@ -1941,6 +2623,7 @@ int sqlite4BtLogCheckpoint(BtLog *pLog, int nFrameBuffer){
       ** file).  */
       if( rc==SQLITE4_OK ){
         assert( iFirstRead>0 );
+        sqlite4BtLockCacheCheckpoint(pLock);
         pShm = btLogShm(pLog);
         pShm->ckpt.iFirstRead = iFirstRead;
         pVfs->xShmBarrier(pLog->pFd);
@@ -1956,11 +2639,12 @@ int sqlite4BtLogCheckpoint(BtLog *pLog, int nFrameBuffer){
 
         memset(&hdr, 0, sizeof(BtWalHdr));
         hdr.iMagic = BT_WAL_MAGIC;
-        hdr.iVersion = BT_WAL_VERSION;
         hdr.iCnt = (((pShm->ckpt.iWalHdr & 0x03) + 1) % 3);
         hdr.nSector = pLog->snapshot.nSector;
         hdr.nPgsz = pgsz;
         hdr.iFirstFrame = iFirstRead;
+        hdr.iCksumAlg = pLog->snapshot.iCksumAlg;
+        hdr.iVersion = btLogVersion(hdr.iCksumAlg);
 
         hdr.iSalt1 = fhdr.aCksum[0];
         hdr.iSalt2 = fhdr.aCksum[1];
@@ -1979,11 +2663,13 @@ int sqlite4BtLogCheckpoint(BtLog *pLog, int nFrameBuffer){
       if( rc==SQLITE4_OK ){
         pShm->ckpt.iFirstRecover = iFirstRead;
         pVfs->xShmBarrier(pLog->pFd);
+        if( pnCkpt ) *pnCkpt = nFrame;
       }
     }
 
     /* Free buffers and drop the checkpointer lock */
     sqlite4_free(pLock->pEnv, aBuf);
+    sqlite4_free(pLock->pEnv, aSched);
     sqlite4_free(pLock->pEnv, aPgno);
     sqlite4BtLockCkptUnlock(pLock);
     sqlite4BtPagerSetDbhdr((BtPager*)pLock, 0);
@@ -12,11 +12,16 @@
 **
 */
 
+#include "sqliteInt.h"
 #include "btInt.h"
 #include <string.h>
 #include <assert.h>
 #include <stddef.h>
 
+#if BT_THREADS
+# include <pthread.h>
+#endif
+
 #define BT_MAX_DEPTH 32           /* Maximum possible depth of tree */
 #define BT_MAX_DIRECT_OVERFLOW 8  /* Maximum direct overflow pages per cell */
 
@@ -39,12 +44,79 @@
 */
 #define MAX_SUBTREE_DEPTH 8
 
+/*
+** Default value for the BT_CONTROL_MERGE_BACKLOG setting.
+*/
+#define BT_DEFAULT_MERGE_BACKLOG 16
+
 /* #define BT_STDERR_DEBUG 1 */
 
 typedef struct BtCursor BtCursor;
+typedef struct BtMerger BtMerger;
+typedef struct FiBuffer FiBuffer;
 typedef struct FiCursor FiCursor;
 typedef struct FiSubCursor FiSubCursor;
 
+/*
+** Fast-insert write buffer.
+**
+** Key/value pairs written in fast-insert mode are accumulated in this
+** buffer. Each entry is appended to aData[] as two 32-bit big-endian 
+** integers - the sizes of the key and value (0xFFFFFFFF for a delete 
+** marker) - followed by the key and value themselves.
+**
+** The entries are indexed by a skip-list, the nodes of which are appended
+** to aNode[]. Neither array is modified other than by appending to it 
+** until the buffer is emptied, so a node is identified by its offset in 
+** aNode[] even if the array is reallocated. A node consists of the 
+** following 32-bit values (see the fiNodeXXX() macros below):
+**
+**   * The offset in aData[] of the newest entry for the node's key. If a
+**     key is written more than once, this is updated to point to the new
+**     entry.
+**   * The offset of the previous node at level 0.
+**   * The height of the node, N.
+**   * The offset of the next node at each of the N levels.
+**
+** The node at offset 0 is the list head. It has FIBUF_MAX_HEIGHT levels
+** and no entry, and its "previous node" field holds the last node in the
+** list. Since no other node refers to the head, a node offset of 0 is 
+** otherwise used to mean "no node".
+**
+** Fast-insert cursors read the buffer as the newest of their inputs. Once
+** the buffer is large enough, or when the transaction is committed, it is
+** written into the database as a new level-0 sub-tree (see fiBufferFlush()).
+*/
+struct FiBuffer {
+  u8 *aData;                      /* Buffered entries */
+  int nData;                      /* Bytes of aData[] in use */
+  int nDataAlloc;                 /* Allocated size of aData[] in bytes */
+  u32 *aNode;                     /* Skip-list nodes */
+  int nNode;                      /* Entries of aNode[] in use */
+  int nNodeAlloc;                 /* Allocated size of aNode[] */
+  int nHeight;                    /* Height of tallest node in skip-list */
+  u32 iRand;                      /* PRNG state used to pick node heights */
+};
+
+/*
+** The maximum height of a fast-insert buffer skip-list node, and the 
+** number of 32-bit values in a node before its array of next pointers.
+*/
+#define FIBUF_MAX_HEIGHT 16
+#define FIBUF_NODE_HDR   3
+
+#define fiNodeEntry(p, iNode)     ((p)->aNode[(iNode)])
+#define fiNodePrev(p, iNode)      ((p)->aNode[(iNode)+1])
+#define fiNodeHeight(p, iNode)    ((p)->aNode[(iNode)+2])
+#define fiNodeNext(p, iNode, i)   ((p)->aNode[(iNode)+FIBUF_NODE_HDR+(i)])
+
+/*
+** Return the first and last nodes of fast-insert buffer p, or 0 if the
+** buffer is empty.
+*/
+#define fiBufferFirst(p) ((p)->nNode ? fiNodeNext(p, 0, 0) : 0)
+#define fiBufferLast(p)  ((p)->nNode ? fiNodePrev(p, 0) : 0)
+
 struct bt_db {
   sqlite4_env *pEnv;              /* SQLite environment */
   sqlite4_mm *pMM;                /* Memory allocator for pEnv */
@@ -54,6 +126,14 @@ struct bt_db {
   int nScheduleAlloc;
   int bFastInsertOp;              /* Set by CONTROL_FAST_INSERT_OP */
 
+  int bMergeThread;               /* Set by CONTROL_MERGE_THREAD */
+  int nMaxBacklog;                /* Set by CONTROL_MERGE_BACKLOG */
+  BtMerger *pMerger;              /* Merge thread, if it is running */
+  int nSubtree;                   /* Level-0 sub-trees at last count */
+  int bNewSubtree;                /* True if write txn started a sub-tree */
+  int bMergePending;              /* True if write txn left merge pending */
+  FiBuffer fibuf;                 /* Fast-insert writes not yet flushed */
+
   BtCursor *pFreeCsr;
 };
 
@@ -106,6 +186,7 @@ struct BtCursor {
   u32 iRoot;                      /* Root page of b-tree this cursor queries */
   int nPg;                        /* Number of valid entries in apPage[] */
   BtOvfl ovfl;                    /* Overflow cache (see above) */
+  sqlite4_buffer range;           /* Part of value read by btCsrData() */
 
   int bRequireReseek;             /* True if a btCsrReseek() is required */
   int bSkipNext;                  /* True if next CsrNext() is a no-op */
@@ -130,8 +211,24 @@ struct FiCursor {
   int iBt;                        /* Current sub-tree (or -1 for EOF) */
   int nBt;                        /* Number of entries in aBt[] array */
   FiSubCursor *aSub;              /* Array of sub-tree cursors */
+  int nTree;                      /* Number of leaves in aTree[] */
+  int *aTree;                     /* Tournament tree used to merge aSub[] */
+  sqlite4_buffer key;             /* Used by fiCsrStep() to skip duplicates */
+
+  int iBuf;                       /* Current fast-insert buffer node or 0 */
+  u32 iBufEntry;                  /* Entry of node iBuf when cursor moved */
+  int bBufSaved;                  /* True if entry has been copied to bufsave */
+  sqlite4_buffer bufsave;         /* Copy of entry iBuf (see fiBufferSave()) */
+  int bReseek;                    /* True if buffer flushed since last seek */
 };
 
+/*
+** The fast-insert buffer is merged with the sub-trees read by each 
+** FiCursor. It is the newest input, so it is identified by index 
+** FiCursor.nBt - one greater than the index of the last sub-cursor.
+*/
+#define fiCsrIsBuffer(pCsr, iSub) ((iSub)==(pCsr)->nBt)
+
 /*
 ** TODO: Rearrange things so these are not required!
 */
@@ -142,6 +239,7 @@ static int btReadSchedule(bt_db *, u8 *, BtSchedule *);
 static int btCsrEnd(BtCursor *pCsr, int bLast);
 static int btCsrStep(BtCursor *pCsr, int bNext);
 static int btCsrKey(BtCursor *pCsr, const void **ppK, int *pnK);
+static int fiCsrSeek(FiCursor *pCsr, const void *pK, int nK, int eSeek);
 void sqlite4BtDebugFastTree(bt_db *db, int iCall);
 
 
@@ -225,6 +323,248 @@ void sqlite4BtPutU32(u8 *a, u32 i){
 struct FakePage { u8 *aData; };
 #define btPageData(pPg) (((struct FakePage*)(pPg))->aData)
 
+/*************************************************************************
+** Beginning of code for the background merge thread. See the description
+** of BT_CONTROL_MERGE_THREAD in bt.h.
+**
+** The thread has its own connection to the database, pWorker, which it
+** uses to checkpoint the log. If the schedule page is in BT_SCHEDULE_BUSY 
+** state when it is checkpointed, the merge it describes is run (see 
+** sqlite4BtMerge()). The results are integrated into the fast-insert tree 
+** by the next writer to start a new sub-tree.
+**
+** Each time a client requires a checkpoint, it increments nRequest and
+** signals workCond. When the thread finishes a checkpoint, it sets nDone
+** to the value nRequest had when the checkpoint started and broadcasts
+** doneCond. Fields nRequest, nDone, bMerge and bShutdown are protected
+** by the mutex.
+*/
+#if BT_THREADS
+struct BtMerger {
+  bt_db *pWorker;                 /* Connection used by merge thread */
+  int nAutoCkpt;                  /* Checkpoint when log is this large */
+  int bMerge;                     /* True if a merge is outstanding */
+  int bShutdown;                  /* Set to ask the thread to exit */
+  u32 nRequest;                   /* Checkpoints requested by client */
+  u32 nDone;                      /* Checkpoints completed by thread */
+  pthread_t thread;               /* Merge thread */
+  pthread_mutex_t mutex;          /* Mutex protecting the fields above */
+  pthread_cond_t workCond;        /* Thread waits on this for work */
+  pthread_cond_t doneCond;        /* Client waits on this for nDone */
+};
+
+/*
+** Checkpoint the database using the merge thread connection db. Unless 
+** bMerge is true, do nothing if the log is smaller than nAutoCkpt frames.
+**
+** Errors are ignored. The checkpoint is retried the next time the thread
+** is woken, or by the last connection to close the database.
+*/
+static void btMergerCheckpoint(bt_db *db, int bMerge, int nAutoCkpt){
+  int nLog = 0;
+  int rc;
+
+  rc = sqlite4BtBegin(db, 1);
+  if( rc==SQLITE4_OK ){
+    sqlite4BtPagerLogsize(db->pPager, &nLog);
+    sqlite4BtCommit(db, 0);
+  }
+
+  if( nLog>0 && (bMerge || (nAutoCkpt>0 && nLog>=nAutoCkpt)) ){
+    bt_checkpoint ckpt;
+    ckpt.nFrameBuffer = (bMerge ? 0 : nAutoCkpt/2);
+    ckpt.nFrameMax = 0;
+    ckpt.nCkpt = 0;
+    sqlite4BtPagerCheckpoint(db->pPager, &ckpt);
+  }
+}
+
+static void *btMergerMain(void *pArg){
+  BtMerger *p = (BtMerger*)pArg;
+
+  pthread_mutex_lock(&p->mutex);
+  while( 1 ){
+    u32 nReq;
+    int bMerge;
+    int nAutoCkpt;
+
+    while( p->nDone==p->nRequest && p->bShutdown==0 ){
+      pthread_cond_wait(&p->workCond, &p->mutex);
+    }
+    if( p->nDone==p->nRequest ) break;
+
+    nReq = p->nRequest;
+    bMerge = p->bMerge;
+    nAutoCkpt = p->nAutoCkpt;
+    p->bMerge = 0;
+    pthread_mutex_unlock(&p->mutex);
+
+    btMergerCheckpoint(p->pWorker, bMerge, nAutoCkpt);
+
+    pthread_mutex_lock(&p->mutex);
+    p->nDone = nReq;
+    pthread_cond_broadcast(&p->doneCond);
+  }
+  pthread_mutex_unlock(&p->mutex);
+
+  return 0;
+}
+
+/*
+** Ask the merge thread of connection db to checkpoint the database. If 
+** bMerge is true, the checkpoint is run even if the log is small. If 
+** bWait is true, do not return until it has finished.
+*/
+static void btMergerRequest(bt_db *db, int bMerge, int bWait){
+  BtMerger *p = db->pMerger;
+  u32 nReq;
+
+  pthread_mutex_lock(&p->mutex);
+  nReq = ++p->nRequest;
+  p->bMerge |= bMerge;
+  pthread_cond_signal(&p->workCond);
+  if( bWait ){
+    while( (int)(p->nDone - nReq)<0 ){
+      pthread_cond_wait(&p->doneCond, &p->mutex);
+    }
+  }
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/*
+** Stop the merge thread belonging to connection db, if any. Checkpoints
+** already requested are run before the thread exits.
+*/
+static void btMergerStop(bt_db *db){
+  BtMerger *p = db->pMerger;
+  if( p ){
+    void *pDummy;
+
+    pthread_mutex_lock(&p->mutex);
+    p->bShutdown = 1;
+    pthread_cond_signal(&p->workCond);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->thread, &pDummy);
+
+    pthread_cond_destroy(&p->doneCond);
+    pthread_cond_destroy(&p->workCond);
+    pthread_mutex_destroy(&p->mutex);
+    sqlite4BtClose(p->pWorker);
+
+    /* Restore the auto-checkpoint setting of the client connection */
+    sqlite4BtPagerSetAutockpt(db->pPager, &p->nAutoCkpt);
+    sqlite4_free(db->pEnv, p);
+    db->pMerger = 0;
+  }
+}
+
+/*
+** Start a merge thread for connection db, which must be open.
+*/
+static int btMergerStart(bt_db *db){
+  const char *zFile = sqlite4BtPagerFilename(db->pPager,BT_PAGERFILE_DATABASE);
+  BtMerger *p;
+  bt_db *pWorker = 0;
+  int rc;
+
+  assert( db->pMerger==0 && zFile );
+  p = (BtMerger*)sqlite4_malloc(db->pEnv, sizeof(BtMerger));
+  if( p==0 ) return btErrorBkpt(SQLITE4_NOMEM);
+  memset(p, 0, sizeof(BtMerger));
+
+  /* Open the connection used by the thread. It uses the same VFS and 
+  ** settings as connection db, except that it never checkpoints the
+  ** database automatically.  */
+  rc = sqlite4BtNew(db->pEnv, 0, &pWorker);
+  if( rc==SQLITE4_OK ){
+    static const int aOp[] = {
+      BT_CONTROL_SAFETY, BT_CONTROL_MULTIPROC, BT_CONTROL_CKPTBATCH
+    };
+    int i;
+    int iVal = 0;
+    bt_env *pVfs = 0;
+
+    sqlite4BtControl(db, BT_CONTROL_GETVFS, (void*)&pVfs);
+    sqlite4BtControl(pWorker, BT_CONTROL_SETVFS, (void*)pVfs);
+    sqlite4BtControl(pWorker, BT_CONTROL_AUTOCKPT, (void*)&iVal);
+    for(i=0; i<array_size(aOp); i++){
+      iVal = -1;
+      sqlite4BtControl(db, aOp[i], (void*)&iVal);
+      sqlite4BtControl(pWorker, aOp[i], (void*)&iVal);
+    }
+    rc = sqlite4BtOpen(pWorker, zFile);
+  }
+
+  if( rc==SQLITE4_OK ){
+    p->pWorker = pWorker;
+    if( pthread_mutex_init(&p->mutex, 0) ){
+      rc = btErrorBkpt(SQLITE4_ERROR);
+    }else if( pthread_cond_init(&p->workCond, 0) ){
+      pthread_mutex_destroy(&p->mutex);
+      rc = btErrorBkpt(SQLITE4_ERROR);
+    }else if( pthread_cond_init(&p->doneCond, 0) ){
+      pthread_cond_destroy(&p->workCond);
+      pthread_mutex_destroy(&p->mutex);
+      rc = btErrorBkpt(SQLITE4_ERROR);
+    }else if( pthread_create(&p->thread, 0, btMergerMain, (void*)p) ){
+      pthread_cond_destroy(&p->doneCond);
+      pthread_cond_destroy(&p->workCond);
+      pthread_mutex_destroy(&p->mutex);
+      rc = btErrorBkpt(SQLITE4_ERROR);
+    }
+  }
+
+  if( rc==SQLITE4_OK ){
+    /* From now on, the client leaves checkpoints to the thread. */
+    int iVal = 0;
+    p->nAutoCkpt = -1;
+    sqlite4BtPagerSetAutockpt(db->pPager, &p->nAutoCkpt);
+    sqlite4BtPagerSetAutockpt(db->pPager, &iVal);
+    db->pMerger = p;
+  }else{
+    sqlite4BtClose(pWorker);
+    sqlite4_free(db->pEnv, p);
+  }
+  return rc;
+}
+
+/*
+** This is called after connection db commits or rolls back a write
+** transaction. If the merge thread is running and there is work for it
+** to do, wake it up. If the transaction started a new sub-tree and 
+** there are now more than BT_CONTROL_MERGE_BACKLOG sub-trees, wait for
+** the merge thread to catch up.
+*/
+static void btMergerEndWrite(bt_db *db, int bCommit){
+  BtMerger *p = db->pMerger;
+  if( p && bCommit ){
+    int nLog = 0;
+    int bWait = 0;
+    sqlite4BtPagerLogsize(db->pPager, &nLog);
+    bWait = (db->bNewSubtree && db->bMergePending
+        && db->nMaxBacklog>0 && db->nSubtree>db->nMaxBacklog
+    );
+    if( bWait || db->bMergePending || (p->nAutoCkpt>0 && nLog>=p->nAutoCkpt) ){
+      btMergerRequest(db, db->bMergePending, bWait);
+    }
+  }
+  db->bNewSubtree = 0;
+  db->bMergePending = 0;
+}
+
+#else
+# define btMergerStart(db) SQLITE4_OK
+# define btMergerStop(db)
+# define btMergerEndWrite(db, bCommit) ((db)->bNewSubtree = (db)->bMergePending = 0)
+#endif /* BT_THREADS */
+
+/*
+** End of background merge thread code.
+*************************************************************************/
+
+static int fiBufferFlush(bt_db *db);
+static void fiBufferDiscard(bt_db *db);
+
 /*
 ** Allocate a new database handle.
 */
@@ -246,6 +586,7 @@ int sqlite4BtNew(sqlite4_env *pEnv, int nExtra, bt_db **ppDb){
 
     db->nMinMerge = MIN_MERGE;
     db->nScheduleAlloc = SCHEDULE_ALLOC;
+    db->nMaxBacklog = BT_DEFAULT_MERGE_BACKLOG;
   }
 
   *ppDb = db;
@@ -260,6 +601,9 @@ int sqlite4BtClose(bt_db *db){
   if( db ){
     BtCursor *pCsr;
     BtCursor *pNext;
+    btMergerStop(db);
+    sqlite4_free(db->pEnv, db->fibuf.aData);
+    sqlite4_free(db->pEnv, db->fibuf.aNode);
     for(pCsr=db->pFreeCsr; pCsr; pCsr=pNext){
       pNext = pCsr->pNextFree;
       sqlite4_free(db->pEnv, pCsr);
@@ -281,30 +625,57 @@ int sqlite4BtOpen(bt_db *db, const char *zFilename){
   int rc;
   sqlite4_env_config(db->pEnv, SQLITE4_ENVCONFIG_GETMM, &db->pMM);
   rc = sqlite4BtPagerOpen(db->pPager, zFilename);
+  if( rc==SQLITE4_OK && db->bMergeThread ){
+    rc = btMergerStart(db);
+  }
   return rc;
 }
 
+/*
+** The fast-insert buffer only ever contains entries written at the current
+** transaction level. So it is flushed before a nested write transaction is
+** opened or the outermost write transaction committed, and discarded if
+** the current level is rolled back.
+*/
 int sqlite4BtBegin(bt_db *db, int iLevel){
-  int rc;
-  rc = sqlite4BtPagerBegin(db->pPager, iLevel);
+  int rc = SQLITE4_OK;
+  int iCurrent = sqlite4BtPagerTransactionLevel(db->pPager);
+  if( iCurrent>=2 && iLevel>iCurrent ){
+    rc = fiBufferFlush(db);
+  }
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4BtPagerBegin(db->pPager, iLevel);
+  }
   return rc;
 }
 
 int sqlite4BtCommit(bt_db *db, int iLevel){
-  int rc;
+  int rc = SQLITE4_OK;
+  int bWrite = (iLevel<2 && sqlite4BtPagerTransactionLevel(db->pPager)>=2);
+  if( bWrite ){
+    rc = fiBufferFlush(db);
+    if( rc!=SQLITE4_OK ) return rc;
+  }
   rc = sqlite4BtPagerCommit(db->pPager, iLevel);
+  if( bWrite ) btMergerEndWrite(db, rc==SQLITE4_OK);
   return rc;
 }
 
 int sqlite4BtRevert(bt_db *db, int iLevel){
   int rc;
+  int iCurrent = sqlite4BtPagerTransactionLevel(db->pPager);
+  if( iCurrent>=2 && iLevel<=iCurrent ) fiBufferDiscard(db);
   rc = sqlite4BtPagerRevert(db->pPager, iLevel);
   return rc;
 }
 
 int sqlite4BtRollback(bt_db *db, int iLevel){
   int rc;
+  int iCurrent = sqlite4BtPagerTransactionLevel(db->pPager);
+  int bWrite = (iLevel<2 && iCurrent>=2);
+  if( iCurrent>=2 && iLevel<=iCurrent ) fiBufferDiscard(db);
   rc = sqlite4BtPagerRollback(db->pPager, iLevel);
+  if( bWrite ) btMergerEndWrite(db, 0);
   return rc;
 }
 
@@ -319,6 +690,7 @@ static void btCsrSetup(bt_db *db, u32 iRoot, BtCursor *pCsr){
   pCsr->base.pDb = db;
   pCsr->iRoot = iRoot;
   pCsr->ovfl.buf.pMM = db->pMM;
+  pCsr->range.pMM = db->pMM;
 }
 
 int sqlite4BtCsrOpen(bt_db *db, int nExtra, bt_cursor **ppCsr){
@@ -388,6 +760,7 @@ static void btCsrReset(BtCursor *pCsr, int bFreeBuffer){
   btCsrReleaseAll(pCsr);
   if( bFreeBuffer ){
     sqlite4_buffer_clear(&pCsr->ovfl.buf);
+    sqlite4_buffer_clear(&pCsr->range);
   }
   pCsr->bSkipNext = 0;
   pCsr->bSkipPrev = 0;
@@ -403,9 +776,17 @@ static void fiCsrReset(FiCursor *pCsr){
     btCsrReset(&pCsr->aSub[i].mcsr, 1);
   }
   sqlite4_free(db->pEnv, pCsr->aSub);
+  sqlite4_free(db->pEnv, pCsr->aTree);
+  sqlite4_buffer_clear(&pCsr->key);
+  sqlite4_buffer_clear(&pCsr->bufsave);
   pCsr->aSub = 0;
   pCsr->nBt = 0;
   pCsr->iBt = -1;
+  pCsr->aTree = 0;
+  pCsr->nTree = 0;
+  pCsr->iBuf = 0;
+  pCsr->bBufSaved = 0;
+  pCsr->bReseek = 0;
 }
 
 int sqlite4BtCsrClose(bt_cursor *pCsr){
@@ -710,7 +1091,7 @@ static void btPageToAscii(
             sqlite4BtBufAppendf(pBuf, "  [age=%d level=%d root=%d]", 
                 (int)iAge, (int)iLevel, (int)iRoot
             );
-            sqlite4BtBufAppendf(pBuf, "  (blk=%d)", 1 + (iRoot / nPgPerBlk));
+            sqlite4BtBufAppendf(pBuf, "  (blk=%d)", 1 + ((iRoot-1) / nPgPerBlk));
           }
         }
       }
@@ -773,6 +1154,33 @@ static int btFreelistToAscii(bt_db *db, u32 iFirst, sqlite4_buffer *pBuf){
   return rc;
 }
 
+/*
+** Append a description of the fast-insert meta-tree summary record to
+** buffer pBuf. One line is appended for each age.
+*/
+static int btSummaryToAscii(bt_db *db, sqlite4_buffer *pBuf){
+  BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
+  int rc = SQLITE4_OK;
+  if( pHdr->iMRoot ){
+    BtCursor csr;
+    const u8 *aSum;
+    int nSum;
+    int iAge;
+
+    rc = fiLoadSummary(db, &csr, &aSum, &nSum);
+    for(iAge=0; rc==SQLITE4_OK && iAge<nSum/6; iAge++){
+      u16 iMin, nLevel, iMerge;
+      btReadSummary(aSum, iAge, &iMin, &nLevel, &iMerge);
+      sqlite4BtBufAppendf(pBuf, "iAge=%d iMinLevel=%d ", iAge, (int)iMin);
+      sqlite4BtBufAppendf(pBuf, "nLevel=%d iMergeLevel=%d\n", 
+          (int)nLevel, (int)iMerge
+      );
+    }
+    btCsrReset(&csr, 1);
+  }
+  return rc;
+}
+
 #ifndef NDEBUG
 #include <stdio.h>
 
@@ -849,6 +1257,9 @@ static void fiDumpCsr(FiCursor *pCsr){
     btDumpCsr(&buf, &pSub->csr);
     sqlite4BtBufAppendf(&buf, "\n");
   }
+  sqlite4BtBufAppendf(&buf, "%d buf   : %d%s\n", 
+      pCsr->nBt, pCsr->iBuf, (pCsr->bBufSaved ? " (saved)" : "")
+  );
 
   sqlite4_buffer_append(&buf, "", 1);
   fprintf(stderr, "%s", (char*)buf.p);
@@ -941,6 +1352,7 @@ static void assert_ficursor_ok(FiCursor *p, int crc){
 
   if( crc!=SQLITE4_OK && crc!=SQLITE4_NOTFOUND && crc!=SQLITE4_INEXACT ) return;
   if( (p->base.flags & (CSR_NEXT_OK|CSR_PREV_OK))==0 ) return;
+  assert( p->iBuf==0 || p->bBufSaved || p->iBuf<p->base.pDb->fibuf.nNode );
 
   for(iBt=0; iBt<p->nBt; iBt++){
     FiSubCursor *pSub = &p->aSub[iBt];
@@ -1378,11 +1790,11 @@ static int fiCsrAllocateSubs(bt_db *db, FiCursor *pCsr, int nBt){
 }
 
 /*
-** Return the page number of the first page on block iBlk.
+** Return the number of the block that contains page pgno.
 */
-static u32 btFirstOfBlock(BtDbHdr *pHdr, u32 iBlk){
-  assert( iBlk>0 );
-  return (iBlk - 1) * (pHdr->blksz / pHdr->pgsz) + 1;
+static u32 btBlockOfPage(BtDbHdr *pHdr, u32 pgno){
+  assert( pgno>0 );
+  return ((pgno - 1) / (pHdr->blksz / pHdr->pgsz)) + 1;
 }
 
 /*
@@ -1416,11 +1828,183 @@ static int btCsrIsDelete(BtCursor *pCsr){
   return bRet;
 }
 
+/*
+** Return a pointer to the key of the fast-insert buffer entry that starts
+** at aEntry[0]. Set *pnKey to the size of the key in bytes before 
+** returning.
+*/
+static const u8 *fiBufferKey(const u8 *aEntry, int *pnKey){
+  *pnKey = (int)btGetU32(aEntry);
+  return &aEntry[8];
+}
+
+/*
+** Return a pointer to the value of the fast-insert buffer entry that starts
+** at aEntry[0]. Set *pnVal to the size of the value in bytes, or to -1 if
+** the entry is a delete marker.
+*/
+static const u8 *fiBufferVal(const u8 *aEntry, int *pnVal){
+  u32 nVal = btGetU32(&aEntry[4]);
+  *pnVal = (nVal==0xFFFFFFFF ? -1 : (int)nVal);
+  return &aEntry[8 + btGetU32(aEntry)];
+}
+
+/*
+** Return a pointer to the entry that node iNode of fast-insert buffer p
+** currently refers to.
+*/
+static const u8 *fiBufferNodeEntry(FiBuffer *p, u32 iNode){
+  return &p->aData[fiNodeEntry(p, iNode)];
+}
+
+/*
+** Search the fast-insert buffer for key pK/nK. Return the first node with
+** a key greater than or equal to pK/nK, or 0 if there is no such node. Set
+** *pbExact to true if the key is present in the buffer, or to false 
+** otherwise.
+**
+** Array aPrev[] must have room for FIBUF_MAX_HEIGHT elements. Before 
+** returning, each aPrev[i] for i<MAX(p->nHeight, 1) is set to the last 
+** node at level i with a key smaller than pK/nK, or to 0 if there is no
+** such node.
+*/
+static u32 fiBufferSearch(
+  FiBuffer *p, 
+  const void *pK, int nK, 
+  u32 *aPrev, 
+  int *pbExact
+){
+  u32 iPrev = 0;
+  u32 iNext = 0;
+  int i;
+
+  aPrev[0] = 0;
+  for(i=p->nHeight-1; i>=0; i--){
+    iNext = fiNodeNext(p, iPrev, i);
+    while( iNext ){
+      const u8 *pNext; int nNext;
+      pNext = fiBufferKey(fiBufferNodeEntry(p, iNext), &nNext);
+      if( btKeyCompare(pNext, nNext, pK, nK)>=0 ) break;
+      iPrev = iNext;
+      iNext = fiNodeNext(p, iNext, i);
+    }
+    aPrev[i] = iPrev;
+  }
+
+  *pbExact = 0;
+  if( iNext ){
+    const u8 *pNext; int nNext;
+    pNext = fiBufferKey(fiBufferNodeEntry(p, iNext), &nNext);
+    *pbExact = (btKeyCompare(pNext, nNext, pK, nK)==0);
+  }
+  return iNext;
+}
+
+/*
+** Return a pointer to the fast-insert buffer entry that the buffer input
+** of cursor pCsr currently points to.
+*/
+static const u8 *fiCsrBufferEntry(FiCursor *pCsr){
+  FiBuffer *p = &pCsr->base.pDb->fibuf;
+  assert( pCsr->iBuf>0 );
+  if( pCsr->bBufSaved ) return (const u8*)pCsr->bufsave.p;
+  assert( pCsr->iBuf<p->nNode && (int)pCsr->iBufEntry<p->nData );
+  return &p->aData[pCsr->iBufEntry];
+}
+
+/*
+** Point the buffer input of cursor pCsr at node iNode, or at EOF if iNode
+** is 0. The entry the node refers to is recorded as well, so that the 
+** cursor continues to read it if the key is written again before the
+** cursor is next moved.
+*/
+static void fiCsrBufferSet(FiCursor *pCsr, u32 iNode){
+  FiBuffer *p = &pCsr->base.pDb->fibuf;
+  pCsr->iBuf = (int)iNode;
+  pCsr->iBufEntry = (iNode ? fiNodeEntry(p, iNode) : 0);
+  pCsr->bBufSaved = 0;
+}
+
+/*
+** Position the buffer input of cursor pCsr for a BT_SEEK_LE or BT_SEEK_GE
+** seek on key pK/nK. Return true if the buffer contains key pK/nK.
+*/
+static int fiCsrBufferSeek(FiCursor *pCsr, const void *pK, int nK, int eSeek){
+  FiBuffer *p = &pCsr->base.pDb->fibuf;
+  u32 aPrev[FIBUF_MAX_HEIGHT];
+  int bExact;
+  u32 iNode;
+
+  assert( eSeek==BT_SEEK_LE || eSeek==BT_SEEK_GE );
+  iNode = fiBufferSearch(p, pK, nK, aPrev, &bExact);
+  if( eSeek==BT_SEEK_LE && bExact==0 ) iNode = aPrev[0];
+  fiCsrBufferSet(pCsr, iNode);
+  return bExact;
+}
+
+/*
+** Advance the buffer input of cursor pCsr (in the direction indicated by
+** bNext). If the current entry was saved by fiBufferSave(), the buffer has
+** been flushed since. In that case the new position is found by searching
+** the buffer for the saved key.
+*/
+static void fiCsrBufferStep(FiCursor *pCsr, int bNext){
+  FiBuffer *p = &pCsr->base.pDb->fibuf;
+  u32 iNode;
+
+  assert( pCsr->iBuf>0 );
+  if( pCsr->bBufSaved ){
+    const u8 *pK; int nK;
+    u32 aPrev[FIBUF_MAX_HEIGHT];
+    int bExact;
+    pK = fiBufferKey((const u8*)pCsr->bufsave.p, &nK);
+    iNode = fiBufferSearch(p, pK, nK, aPrev, &bExact);
+    if( bNext==0 ){
+      iNode = aPrev[0];
+    }else if( bExact ){
+      iNode = fiNodeNext(p, iNode, 0);
+    }
+  }else if( bNext ){
+    iNode = fiNodeNext(p, pCsr->iBuf, 0);
+  }else{
+    iNode = fiNodePrev(p, pCsr->iBuf);
+  }
+  fiCsrBufferSet(pCsr, iNode);
+}
+
+/*
+** Return true if input iSub of fast-insert cursor pCsr is at EOF. Input 
+** iSub may be a sub-cursor or the buffer. Any index greater than that of 
+** the buffer is treated as EOF.
+*/
+static int fiCsrInputEof(FiCursor *pCsr, int iSub){
+  if( fiCsrIsBuffer(pCsr, iSub) ) return (pCsr->iBuf==0);
+  return (iSub<0 || iSub>pCsr->nBt || pCsr->aSub[iSub].csr.nPg==0);
+}
+
+/*
+** Set *ppK and *pnK to the key that input iSub of fast-insert cursor pCsr
+** currently points to.
+*/
+static int fiCsrInputKey(FiCursor *pCsr, int iSub, const void **ppK, int *pnK){
+  if( fiCsrIsBuffer(pCsr, iSub) ){
+    *ppK = (const void*)fiBufferKey(fiCsrBufferEntry(pCsr), pnK);
+    return SQLITE4_OK;
+  }
+  return btCsrKey(&pCsr->aSub[iSub].csr, ppK, pnK);
+}
+
 static int fiCsrIsDelete(FiCursor *pCsr){
   int res = 0;
   if( (pCsr->base.flags & CSR_VISIT_DEL)==0 ){
-    BtCursor *p = &pCsr->aSub[pCsr->iBt].csr;
-    res = btCsrIsDelete(p);
+    if( fiCsrIsBuffer(pCsr, pCsr->iBt) ){
+      int nVal;
+      fiBufferVal(fiCsrBufferEntry(pCsr), &nVal);
+      res = (nVal<0);
+    }else{
+      BtCursor *p = &pCsr->aSub[pCsr->iBt].csr;
+      res = btCsrIsDelete(p);
+    }
   }
   return res;
 }
@@ -1428,6 +2012,7 @@ static int fiCsrIsDelete(FiCursor *pCsr){
 static int btOverflowArrayRead(
   bt_db *db,
   u8 *pOvfl,
+  int iOff,
   u8 *aOut,
   int nOut
 ){
@@ -1438,37 +2023,54 @@ static int btOverflowArrayRead(
   int nDepth;                     /* Depth of overflow tree */
   int iOut;                       /* Bytes of data copied so far */
   int iPg;
+  int iFirst;                     /* Index of first page to read from */
+  int iSkip;                      /* Bytes to skip on first page read from */
 
   nDirect = (int)(pOvfl[0] & 0x0F);
   nDepth = (int)(pOvfl[0]>>4);
 
+  /* Pages that lie entirely before offset iOff are not read. */
   iOut = 0;
+  iFirst = iOff / pgsz;
+  iSkip = iOff % pgsz;
 
   /* Read from the direct overflow pages. And from the overflow tree, if
   ** it has a depth of zero.  */
-  for(iPg=0; rc==SQLITE4_OK && iPg<(nDirect+(nDepth==0)) && iOut<nOut; iPg++){
+  for(iPg=iFirst; 
+      rc==SQLITE4_OK && iPg<(nDirect+(nDepth==0)) && iOut<nOut; iPg++
+  ){
     u32 pgno = btGetU32(&pOvfl[1+iPg*4]);
     BtPage *pPg = 0;
     rc = sqlite4BtPageGet(db->pPager, pgno, &pPg);
     if( rc==SQLITE4_OK ){
-      int nCopy = MIN(nOut-iOut, pgsz);
+      int nCopy = MIN(nOut-iOut, pgsz-iSkip);
       u8 *a = btPageData(pPg);
-      memcpy(&aOut[iOut], a, nCopy);
+      memcpy(&aOut[iOut], &a[iSkip], nCopy);
       sqlite4BtPageRelease(pPg);
       iOut += nCopy;
+      iSkip = 0;
     }
   }
 
   /* Read from the overflow tree, if it was not read by the block above. */
-  if( nDepth>0 ){
+  if( nDepth>0 && iOut<nOut ){
     struct Heir {
       BtPage *pPg;
       int iCell;
     } apHier[8];
     int i;
     u32 pgno;
+    u32 iLeaf;
     memset(apHier, 0, sizeof(apHier));
 
+    /* Set each apHier[].iCell to the cell on the path to the first leaf
+    ** page to read from. */
+    iLeaf = (iFirst>nDirect ? iFirst-nDirect : 0);
+    for(i=nDepth-1; i>=0; i--){
+      apHier[i].iCell = iLeaf % nPgPtr;
+      iLeaf = iLeaf / nPgPtr;
+    }
+
     /* Initialize the apHier[] array. */
     pgno = btGetU32(&pOvfl[1+nDirect*4]);
     for(i=0; i<nDepth && rc==SQLITE4_OK; i++){
@@ -1476,28 +2078,29 @@ static int btOverflowArrayRead(
       rc = sqlite4BtPageGet(db->pPager, pgno, &apHier[i].pPg);
       if( rc==SQLITE4_OK ){
         a = btPageData(apHier[i].pPg);
-        pgno = btGetU32(a);
+        pgno = btGetU32(&a[apHier[i].iCell * 4]);
       }
     }
 
     /* Loop runs once for each leaf page we read from. */
-    while( iOut<nOut ){
+    while( rc==SQLITE4_OK && iOut<nOut ){
       u8 *a;                      /* Data associated with some page */
       BtPage *pLeaf;              /* Leaf page */
       int nCopy;                  /* Bytes of data to read from leaf page */
 
       int iLvl;
 
-      nCopy =  MIN(nOut-iOut, pgsz);
+      nCopy =  MIN(nOut-iOut, pgsz-iSkip);
       assert( nCopy>0 );
 
       /* Read data from the current leaf page */
       rc = sqlite4BtPageGet(db->pPager, pgno, &pLeaf);
       if( rc!=SQLITE4_OK ) break;
       a = btPageData(pLeaf);
-      memcpy(&aOut[iOut], a, nCopy);
+      memcpy(&aOut[iOut], &a[iSkip], nCopy);
       sqlite4BtPageRelease(pLeaf);
       iOut += nCopy;
+      iSkip = 0;
 
       /* If all required data has been read, break out of the loop */
       if( iOut>=nOut ) break;
@@ -1520,7 +2123,7 @@ static int btOverflowArrayRead(
       }
     }
 
-    for(i=0; i<nDepth && rc==SQLITE4_OK; i++){
+    for(i=0; i<nDepth; i++){
       sqlite4BtPageRelease(apHier[i].pPg);
     }
   }
@@ -1528,7 +2131,70 @@ static int btOverflowArrayRead(
   return rc;
 }
 
+/*
+** Parse the cell that cursor pCsr currently points to. Set the output
+** variables to the local parts of the key and value and to the number of
+** bytes of each stored on overflow pages. Return a pointer to the overflow
+** array of the cell (which is only valid if *pnKOvfl or *pnVOvfl is 
+** non-zero).
+*/
+static u8 *btCsrParseCell(
+  BtCursor *pCsr,                 /* Cursor handle */
+  u8 **ppKLocal, int *pnKLocal,   /* OUT: Local part of key */
+  u8 **ppVLocal, int *pnVLocal,   /* OUT: Local part of value */
+  int *pnKOvfl,                   /* OUT: Bytes of key on overflow pages */
+  int *pnVOvfl                    /* OUT: Bytes of value on overflow pages */
+){
+  const int pgsz = sqlite4BtPagerPagesize(pCsr->base.pDb->pPager);
+  u8 *aData;                      /* Page data */
+  u8 *pCell;                      /* Pointer to cell within aData[] */
+  u8 *pKLocal = 0;                /* Pointer to local part of key */
+  u8 *pVLocal = 0;                /* Pointer to local part of value, if any */
+  int nKLocal = 0;                /* Bytes of key on page */
+  int nVLocal = 0;                /* Bytes of value on page */
+  int nKOvfl = 0;                 /* Bytes of key on overflow pages */
+  int nVOvfl = 0;                 /* Bytes of value on overflow pages */
+
+  aData = (u8*)btPageData(pCsr->apPage[pCsr->nPg-1]);
+  pCell = btCellFind(aData, pgsz, pCsr->aiCell[pCsr->nPg-1]);
+  pCell += sqlite4BtVarintGet32(pCell, &nKLocal);
+  if( nKLocal==0 ){
+    /* Type (c) leaf cell. */
+    pCell += sqlite4BtVarintGet32(pCell, &nKLocal);
+    pKLocal = pCell;
+    pCell += nKLocal;
+    pCell += sqlite4BtVarintGet32(pCell, &nKOvfl);
+    pCell += sqlite4BtVarintGet32(pCell, &nVOvfl);
+    if( nVOvfl>0 ) nVOvfl -= 1;
+
+  }else{
+    pKLocal = pCell;
+    pCell += nKLocal;
+    pCell += sqlite4BtVarintGet32(pCell, &nVLocal);
+    if( nVLocal==0 ){
+      /* Type (b) */
+      pCell += sqlite4BtVarintGet32(pCell, &nVLocal);
+      pVLocal = pCell;
+      pCell += nVLocal;
+      pCell += sqlite4BtVarintGet32(pCell, &nVOvfl);
+    }else{
+      /* Type (a) */
+      pVLocal = pCell;
+      nVLocal -= 2;
+    }
+  }
+
+  /* A delete-key */
+  if( nVLocal<0 ) nVLocal = 0;
 
+  *ppKLocal = pKLocal;
+  *pnKLocal = nKLocal;
+  *ppVLocal = pVLocal;
+  *pnVLocal = nVLocal;
+  *pnKOvfl = nKOvfl;
+  *pnVOvfl = nVOvfl;
+  return pCell;
+}
 
 /*
 ** Buffer the key and value belonging to the current cursor position
@@ -1537,49 +2203,19 @@ static int btOverflowArrayRead(
 static int btCsrBuffer(BtCursor *pCsr, int bVal){
   int rc = SQLITE4_OK;            /* Return code */
   if( pCsr->ovfl.nKey<=0 ){
-    const int pgsz = sqlite4BtPagerPagesize(pCsr->base.pDb->pPager);
-    u8 *aData;                      /* Page data */
-    u8 *pCell;                      /* Pointer to cell within aData[] */
+    u8 *pOvfl;                      /* Overflow array of cell */
     int nReq;                       /* Total required space */
     u8 *aOut;                       /* Output buffer */
-    u8 *pKLocal = 0;                /* Pointer to local part of key */
-    u8 *pVLocal = 0;                /* Pointer to local part of value, if any */
-    int nKLocal = 0;                /* Bytes of key on page */
-    int nVLocal = 0;                /* Bytes of value on page */
-    int nKOvfl = 0;                 /* Bytes of key on overflow pages */
-    int nVOvfl = 0;                 /* Bytes of value on overflow pages */
-
-    aData = (u8*)btPageData(pCsr->apPage[pCsr->nPg-1]);
-    pCell = btCellFind(aData, pgsz, pCsr->aiCell[pCsr->nPg-1]);
-    pCell += sqlite4BtVarintGet32(pCell, &nKLocal);
-    if( nKLocal==0 ){
-      /* Type (c) leaf cell. */
-      pCell += sqlite4BtVarintGet32(pCell, &nKLocal);
-      pKLocal = pCell;
-      pCell += nKLocal;
-      pCell += sqlite4BtVarintGet32(pCell, &nKOvfl);
-      pCell += sqlite4BtVarintGet32(pCell, &nVOvfl);
-      if( nVOvfl>0 ) nVOvfl -= 1;
-
-    }else{
-      pKLocal = pCell;
-      pCell += nKLocal;
-      pCell += sqlite4BtVarintGet32(pCell, &nVLocal);
-      if( nVLocal==0 ){
-        /* Type (b) */
-        pCell += sqlite4BtVarintGet32(pCell, &nVLocal);
-        pVLocal = pCell;
-        pCell += nVLocal;
-        pCell += sqlite4BtVarintGet32(pCell, &nVOvfl);
-      }else{
-        /* Type (a) */
-        pVLocal = pCell;
-        nVLocal -= 2;
-      }
-    }
-
-    /* A delete-key */
-    if( nVLocal<0 ) nVLocal = 0;
+    u8 *pKLocal;                    /* Pointer to local part of key */
+    u8 *pVLocal;                    /* Pointer to local part of value, if any */
+    int nKLocal;                    /* Bytes of key on page */
+    int nVLocal;                    /* Bytes of value on page */
+    int nKOvfl;                     /* Bytes of key on overflow pages */
+    int nVOvfl;                     /* Bytes of value on overflow pages */
+
+    pOvfl = btCsrParseCell(pCsr,
+        &pKLocal, &nKLocal, &pVLocal, &nVLocal, &nKOvfl, &nVOvfl
+    );
 
     pCsr->ovfl.nKey = nKLocal + nKOvfl;
     pCsr->ovfl.nVal = nVLocal + nVOvfl;
@@ -1597,7 +2233,7 @@ static int btCsrBuffer(BtCursor *pCsr, int bVal){
     /* Load in overflow data */
     if( nKOvfl || nVOvfl ){
       rc = btOverflowArrayRead(
-          pCsr->base.pDb, pCell, &aOut[nKLocal + nVLocal], nKOvfl + nVOvfl
+          pCsr->base.pDb, pOvfl, 0, &aOut[nKLocal + nVLocal], nKOvfl + nVOvfl
           );
     }
   }
@@ -1605,6 +2241,64 @@ static int btCsrBuffer(BtCursor *pCsr, int bVal){
   return rc;
 }
 
+/*
+** Read nByte bytes of the value belonging to the current cursor position,
+** starting at offset iOffset. The current cursor position must be a type
+** (b) or (c) cell.
+**
+** If the requested range lies entirely within the part of the value
+** stored on the leaf page, *ppV is set to point to it and *pnV to the
+** number of bytes of value that follow it on the leaf. Otherwise, the
+** requested range is copied into buffer pCsr->range. Only those overflow
+** pages that contain part of the range are read.
+*/
+static int btCsrDataRange(
+  BtCursor *pCsr,                 /* Cursor handle */
+  int iOffset,                    /* Offset of requested data */
+  int nByte,                      /* Bytes requested */
+  const void **ppV,               /* OUT: Pointer to data buffer */
+  int *pnV                        /* OUT: Size of data buffer in bytes */
+){
+  int rc = SQLITE4_OK;
+  u8 *pOvfl;                      /* Overflow array of cell */
+  u8 *pKLocal;                    /* Pointer to local part of key */
+  u8 *pVLocal;                    /* Pointer to local part of value, if any */
+  int nKLocal;                    /* Bytes of key on page */
+  int nVLocal;                    /* Bytes of value on page */
+  int nKOvfl;                     /* Bytes of key on overflow pages */
+  int nVOvfl;                     /* Bytes of value on overflow pages */
+  int iEnd;                       /* Offset of byte following range */
+
+  pOvfl = btCsrParseCell(pCsr,
+      &pKLocal, &nKLocal, &pVLocal, &nVLocal, &nKOvfl, &nVOvfl
+  );
+  iEnd = MIN(iOffset + nByte, nVLocal + nVOvfl);
+
+  if( iEnd<=iOffset ){
+    /* The range starts at or past the end of the value */
+    *ppV = 0;
+    *pnV = 0;
+  }else if( iEnd<=nVLocal ){
+    *ppV = &pVLocal[iOffset];
+    *pnV = nVLocal - iOffset;
+  }else{
+    int nLocal = MAX(0, nVLocal - iOffset);
+    rc = sqlite4_buffer_resize(&pCsr->range, iEnd - iOffset);
+    if( rc==SQLITE4_OK ){
+      u8 *aOut = (u8*)pCsr->range.p;
+      if( nLocal>0 ) memcpy(aOut, &pVLocal[iOffset], nLocal);
+      rc = btOverflowArrayRead(pCsr->base.pDb, pOvfl,
+          nKOvfl + (iOffset + nLocal - nVLocal),
+          &aOut[nLocal], iEnd - iOffset - nLocal
+      );
+      *ppV = aOut;
+      *pnV = iEnd - iOffset;
+    }
+  }
+
+  return rc;
+}
+
 
 static int btCsrKey(BtCursor *pCsr, const void **ppK, int *pnK){
   int rc = SQLITE4_OK;
@@ -1641,40 +2335,101 @@ static int btCsrKey(BtCursor *pCsr, const void **ppK, int *pnK){
 }
 
 
-static int fiCsrSetCurrent(FiCursor *pCsr){
-  const void *pMin = 0;
-  int nMin = 0;
-  int iMin = -1;
-  int i;
-  int rc = SQLITE4_OK;
-  int mul;
-
-  assert( pCsr->base.flags & (CSR_NEXT_OK | CSR_PREV_OK) );
-  mul = ((pCsr->base.flags & CSR_NEXT_OK) ? 1 : -1);
+/*
+** Compare the keys that inputs iLeft and iRight (where iLeft<iRight) of 
+** fast-insert cursor pCsr point to. Return the index of the input that 
+** should be visited first, or -1 if both are at EOF. If both point to the
+** same key, the newer of the two is returned - the buffer if it is one of
+** the two, or otherwise the smaller index.
+**
+** If an error occurs, *pRc is set to an error code and -1 returned.
+*/
+static int fiCsrCompare(FiCursor *pCsr, int iLeft, int iRight, int *pRc){
+  const void *pL; int nL;
+  const void *pR; int nR;
+  int res;
 
-  for(i=0; i<pCsr->nBt && rc==SQLITE4_OK; i++){
-    BtCursor *pSub = &pCsr->aSub[i].csr;
-    if( pSub->nPg>0 ){
-      int nKey;
-      const void *pKey;
-
-      rc = btCsrKey(pSub, &pKey, &nKey);
-      if( rc==SQLITE4_OK 
-          && (iMin<0 || (mul * btKeyCompare(pKey, nKey, pMin, nMin))<0) 
-        ){
-        pMin = pKey;
-        nMin = nKey;
-        iMin = i;
-      }
-    }
+  if( *pRc!=SQLITE4_OK ) return -1;
+  if( fiCsrInputEof(pCsr, iRight) ){
+    return (fiCsrInputEof(pCsr, iLeft) ? -1 : iLeft);
   }
+  if( fiCsrInputEof(pCsr, iLeft) ) return iRight;
 
-  if( iMin<0 && rc==SQLITE4_OK ) rc = SQLITE4_NOTFOUND;
-  pCsr->iBt = iMin;
-  return rc;
+  *pRc = fiCsrInputKey(pCsr, iLeft, &pL, &nL);
+  if( *pRc==SQLITE4_OK ) *pRc = fiCsrInputKey(pCsr, iRight, &pR, &nR);
+  if( *pRc!=SQLITE4_OK ) return -1;
+
+  res = btKeyCompare(pL, nL, pR, nR);
+  if( (pCsr->base.flags & CSR_NEXT_OK)==0 ) res = res * -1;
+  if( res==0 && fiCsrIsBuffer(pCsr, iRight) ) return iRight;
+  return (res<=0 ? iLeft : iRight);
 }
 
-static int fiSubCsrCheckPrefix(FiSubCursor *pSub){
+/*
+** Recalculate the value of node iNode of the tournament tree in 
+** pCsr->aTree[], assuming that its children are already up to date.
+** Nodes are numbered as in a binary heap - node 1 is the root and the 
+** children of node N are 2N and 2N+1. Node (pCsr->nTree+i) is the leaf
+** that represents input i (sub-cursor i, or the buffer if i==pCsr->nBt).
+*/
+static void fiCsrTreeNode(FiCursor *pCsr, int iNode, int *pRc){
+  int i1;
+  int i2;
+  if( iNode*2>=pCsr->nTree ){
+    i1 = iNode*2 - pCsr->nTree;
+    i2 = i1 + 1;
+  }else{
+    i1 = pCsr->aTree[iNode*2];
+    i2 = pCsr->aTree[iNode*2+1];
+  }
+  pCsr->aTree[iNode] = fiCsrCompare(pCsr, i1, i2, pRc);
+}
+
+/*
+** Input iSub of pCsr has just been moved. Update the tournament tree
+** and pCsr->iBt to match.
+*/
+static int fiCsrTreeFixup(FiCursor *pCsr, int iSub){
+  int rc = SQLITE4_OK;
+  int i;
+  for(i=(pCsr->nTree+iSub)/2; i>0; i=i/2){
+    fiCsrTreeNode(pCsr, i, &rc);
+  }
+  pCsr->iBt = pCsr->aTree[1];
+  if( pCsr->iBt<0 && rc==SQLITE4_OK ) rc = SQLITE4_NOTFOUND;
+  return rc;
+}
+
+/*
+** Rebuild the tournament tree from scratch and set pCsr->iBt to the
+** input that points to the smallest key (or largest, for an xPrev
+** cursor). SQLITE4_NOTFOUND is returned if all inputs are at EOF.
+*/
+static int fiCsrSetCurrent(FiCursor *pCsr){
+  bt_db *db = pCsr->base.pDb;
+  int rc = SQLITE4_OK;
+  int nTree;
+  int i;
+
+  assert( pCsr->base.flags & (CSR_NEXT_OK | CSR_PREV_OK) );
+
+  for(nTree=2; nTree<(pCsr->nBt+1); nTree=nTree*2);
+  if( nTree>pCsr->nTree ){
+    int *aNew = (int*)sqlite4_realloc(db->pEnv, pCsr->aTree, sizeof(int)*nTree);
+    if( aNew==0 ) return btErrorBkpt(SQLITE4_NOMEM);
+    pCsr->aTree = aNew;
+  }
+  pCsr->nTree = nTree;
+
+  for(i=nTree-1; i>0; i--){
+    fiCsrTreeNode(pCsr, i, &rc);
+  }
+  pCsr->iBt = pCsr->aTree[1];
+  if( pCsr->iBt<0 && rc==SQLITE4_OK ) rc = SQLITE4_NOTFOUND;
+  return rc;
+}
+
+static int fiSubCsrCheckPrefix(FiSubCursor *pSub){
   const int nPrefix = sizeof(pSub->aPrefix);
   const void *pK = 0;
   int nK;
@@ -1758,7 +2513,6 @@ static int fiCsrStep(FiCursor *pCsr){
   int rc = SQLITE4_OK;
   int bNext = (0!=(pCsr->base.flags & CSR_NEXT_OK));
   const void *pKey; int nKey;     /* Current key that cursor points to */
-  int i;
 
 #ifndef NDEBUG
   sqlite4_buffer buf;
@@ -1772,36 +2526,37 @@ static int fiCsrStep(FiCursor *pCsr){
   assert( pCsr->iBt>=0 );
 
   do{
-    /* Load the current key in to pKey/nKey. Then advance all sub-cursors 
-    ** that share a key with the current sub-cursor. */
+    /* Save a copy of the current key. Then advance the current input
+    ** and any others that point to the same key. Since the tournament tree
+    ** breaks ties in favour of newer inputs, these are visited in order
+    ** once the current input has been advanced.  */
     rc = sqlite4BtCsrKey(&pCsr->base, &pKey, &nKey);
-    for(i=0; rc==SQLITE4_OK && i<pCsr->nBt; i++){
-      FiSubCursor *pSub = &pCsr->aSub[i];
-      if( i!=pCsr->iBt && pSub->csr.nPg>0 ){
-        const void *p; int n;       /* Key that this sub-cursor points to */
-        rc = btCsrKey(&pSub->csr, &p, &n);
-        if( rc==SQLITE4_OK && btKeyCompare(p, n, pKey, nKey)==0 ){
-          rc = fiSubCsrStep(pCsr, pSub, bNext);
-          if( rc==SQLITE4_NOTFOUND ){
-            assert( pSub->csr.nPg==0 );
-            rc = SQLITE4_OK;
-          }
-        }
-      }
-    }
-
-    /* Advance the current sub-cursor */
     if( rc==SQLITE4_OK ){
-      rc = fiSubCsrStep(pCsr, &pCsr->aSub[pCsr->iBt], bNext);
-      if( rc==SQLITE4_NOTFOUND ){
-        assert( pCsr->aSub[pCsr->iBt].csr.nPg==0 );
-        rc = SQLITE4_OK;
-      }
+      rc = sqlite4_buffer_set(&pCsr->key, pKey, nKey);
     }
+    while( rc==SQLITE4_OK ){
+      const void *p; int n;       /* Key that the current input has */
+      int iSub = pCsr->iBt;
 
-    /* Figure out a new current bt cursor */
-    if( rc==SQLITE4_OK ){
-      rc = fiCsrSetCurrent(pCsr);
+      if( fiCsrIsBuffer(pCsr, iSub) ){
+        fiCsrBufferStep(pCsr, bNext);
+      }else{
+        FiSubCursor *pSub = &pCsr->aSub[iSub];
+        rc = fiSubCsrStep(pCsr, pSub, bNext);
+        if( rc==SQLITE4_NOTFOUND ){
+          assert( pSub->csr.nPg==0 );
+          rc = SQLITE4_OK;
+        }
+      }
+      if( rc==SQLITE4_OK ){
+        rc = fiCsrTreeFixup(pCsr, iSub);
+      }
+      if( rc==SQLITE4_OK ){
+        rc = fiCsrInputKey(pCsr, pCsr->iBt, &p, &n);
+        if( rc==SQLITE4_OK && btKeyCompare(p, n, pCsr->key.p, pCsr->key.n) ){
+          break;
+        }
+      }
     }
   }while( rc==SQLITE4_OK && fiCsrIsDelete(pCsr) );
 
@@ -1817,6 +2572,51 @@ static int fiCsrStep(FiCursor *pCsr){
   return rc;
 }
 
+/*
+** Cursor pCsr has been flagged by fiBufferSave() for a reseek. Seek it 
+** to the key it currently points to, so that it also reads the sub-tree
+** that the fast-insert buffer was written to. 
+**
+** If the key is found, SQLITE4_OK is returned and the caller should 
+** advance the cursor as usual. If the cursor is left pointing to the 
+** next entry in the direction of travel, SQLITE4_INEXACT is returned. 
+** Or, if there is no such entry, SQLITE4_NOTFOUND.
+*/
+static int fiCsrRestore(FiCursor *pCsr){
+  int eSeek = ((pCsr->base.flags & CSR_NEXT_OK) ? BT_SEEK_GE : BT_SEEK_LE);
+  const void *pKey; int nKey;
+  sqlite4_buffer buf;
+  int rc;
+
+  sqlite4_buffer_init(&buf, 0);
+  rc = sqlite4BtCsrKey(&pCsr->base, &pKey, &nKey);
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4_buffer_set(&buf, pKey, nKey);
+  }
+  if( rc==SQLITE4_OK ){
+    rc = fiCsrSeek(pCsr, buf.p, buf.n, eSeek);
+  }
+  sqlite4_buffer_clear(&buf);
+  return rc;
+}
+
+/*
+** Advance a fast-insert cursor in response to an xNext() or xPrev() call.
+** This is the same as fiCsrStep(), except that it first reseeks the 
+** cursor if required.
+*/
+static int fiCsrAdvance(FiCursor *pCsr){
+  int rc = SQLITE4_OK;
+  if( pCsr->bReseek ){
+    rc = fiCsrRestore(pCsr);
+    if( rc==SQLITE4_INEXACT ) return SQLITE4_OK;
+  }
+  if( rc==SQLITE4_OK ){
+    rc = fiCsrStep(pCsr);
+  }
+  return rc;
+}
+
 typedef struct FiLevelIter FiLevelIter;
 struct FiLevelIter {
   /* Used internally */
@@ -1886,14 +2686,39 @@ static void fiFormatPrefix(u8 *aPrefix, u32 iAge, u32 iLvl){
 ** Seek a fast-insert cursor.
 */
 static int fiCsrSeek(FiCursor *pCsr, const void *pK, int nK, int eSeek){
-  int rc = SQLITE4_NOTFOUND;      /* Return code */
+  int rc = SQLITE4_OK;            /* Return code */
   bt_db *db = pCsr->base.pDb;     /* Database handle */
   BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
+  int bMatch = 0;                 /* Found an exact match */
 
   assert( eSeek==BT_SEEK_LE || eSeek==BT_SEEK_EQ || eSeek==BT_SEEK_GE );
   assert( (pCsr->base.flags & CSR_VISIT_DEL)==0 || eSeek==BT_SEEK_GE );
   fiCsrReset(pCsr);
 
+  if( eSeek==BT_SEEK_EQ ){
+    /* The buffer holds the newest version of each key it contains. So if
+    ** the requested key is found there, the sub-trees are not searched. */
+    FiBuffer *pBuf = &db->fibuf;
+    u32 aPrev[FIBUF_MAX_HEIGHT];
+    u32 iNode = fiBufferSearch(pBuf, pK, nK, aPrev, &bMatch);
+    pCsr->base.flags &= ~(CSR_NEXT_OK | CSR_PREV_OK);
+    if( bMatch ){
+      int nVal;
+      fiBufferVal(fiBufferNodeEntry(pBuf, iNode), &nVal);
+      if( nVal<0 ) return SQLITE4_NOTFOUND;
+      fiCsrBufferSet(pCsr, iNode);
+      pCsr->iBt = pCsr->nBt;
+      return SQLITE4_OK;
+    }
+    rc = SQLITE4_NOTFOUND;
+  }else{
+    pCsr->base.flags &= ~(CSR_NEXT_OK | CSR_PREV_OK);
+    pCsr->base.flags |= (eSeek==BT_SEEK_GE ? CSR_NEXT_OK : CSR_PREV_OK);
+    if( (pCsr->base.flags & CSR_VISIT_DEL)==0 ){
+      bMatch = fiCsrBufferSeek(pCsr, pK, nK, eSeek);
+    }
+  }
+
   if( pHdr->iMRoot ){
     u8 *pKey;
     FiLevelIter iter;
@@ -1903,13 +2728,12 @@ static int fiCsrSeek(FiCursor *pCsr, const void *pK, int nK, int eSeek){
     if( rc!=SQLITE4_OK ) return rc;
     pKey = sqlite4_malloc(db->pEnv, nK+8);
     if( pKey==0 ) return SQLITE4_NOMEM;
+    memcpy(&pKey[8], pK, nK);
 
     if( eSeek==BT_SEEK_EQ ){
       FiSubCursor *pSub;
       BtCursor *pM;
 
-      pCsr->base.flags &= ~(CSR_NEXT_OK | CSR_PREV_OK);
-
       /* A BT_SEEK_EQ is a special case. There is no need to set up a cursor
       ** that can be advanced (in either direction) in this case. All that
       ** is required is to search each level in order for the requested key 
@@ -1963,11 +2787,6 @@ static int fiCsrSeek(FiCursor *pCsr, const void *pK, int nK, int eSeek){
         }
       }
     }else{
-      int bMatch = 0;           /* Found an exact match */
-      int bHit = 0;             /* Found at least one entry */
-
-      pCsr->base.flags |= (eSeek==BT_SEEK_GE ? CSR_NEXT_OK : CSR_PREV_OK);
-
       /* Allocate required sub-cursors. */
       if( rc==SQLITE4_OK ){
         rc = fiCsrAllocateSubs(db, pCsr, iter.nSub);
@@ -2019,12 +2838,13 @@ static int fiCsrSeek(FiCursor *pCsr, const void *pK, int nK, int eSeek){
             }
           }
 
+          /* If the seek key was replaced by the smallest key in the level,
+          ** a hit on it is not an exact match for the caller's key.  */
           rc = btCsrSeek(&pSub->csr, 0, pSeek, nSeek, eSeek, BT_CSRSEEK_SEEK);
           if( rc==SQLITE4_NOTFOUND ){
             rc = fiSubCsrStep(pCsr, pSub, (eSeek==BT_SEEK_GE ? 1 : 0));
-          }else{
-            if( rc==SQLITE4_OK ) bMatch = 1;
-            if( rc==SQLITE4_INEXACT ) bHit = 1;
+          }else if( rc==SQLITE4_OK && pSeek==pK ){
+            bMatch = 1;
           }
 
           if( rc==SQLITE4_INEXACT || rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
@@ -2033,41 +2853,46 @@ static int fiCsrSeek(FiCursor *pCsr, const void *pK, int nK, int eSeek){
         }
       }
       assert( rc!=SQLITE4_OK || iter.iSub==iter.nSub );
-
-      if( rc==SQLITE4_OK ){
-        rc = fiCsrSetCurrent(pCsr);
-        if( rc==SQLITE4_OK ){
-          if( fiCsrIsDelete(pCsr) ){
-            rc = fiCsrStep(pCsr);
-            if( rc==SQLITE4_OK ) rc = SQLITE4_INEXACT;
-          }else if( bMatch==0 ){
-            rc = (bHit ? SQLITE4_INEXACT : SQLITE4_NOTFOUND);
-          }
-        }
-      }
     }
 
     sqlite4_free(db->pEnv, pKey);
     fiLevelIterCleanup(&iter);
   }
 
+  if( rc==SQLITE4_OK && eSeek!=BT_SEEK_EQ ){
+    rc = fiCsrSetCurrent(pCsr);
+    if( rc==SQLITE4_OK ){
+      if( fiCsrIsDelete(pCsr) ){
+        rc = fiCsrStep(pCsr);
+        if( rc==SQLITE4_OK ) rc = SQLITE4_INEXACT;
+      }else if( bMatch==0 ){
+        rc = SQLITE4_INEXACT;
+      }
+    }
+  }
+
   return rc;
 }
 
 static int fiCsrEnd(FiCursor *pCsr, int bLast){
   bt_db *db = pCsr->base.pDb;
   BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
+  FiBuffer *pBuf = &db->fibuf;    /* Fast-insert buffer */
   FiLevelIter iter;         /* Used to iterate through all f-tree levels */
-  int rc;                   /* Return code */
+  int rc = SQLITE4_OK;      /* Return code */
 
   assert( (pCsr->base.flags & CSR_VISIT_DEL)==0 );
+  fiCsrReset(pCsr);
+  memset(&iter, 0, sizeof(FiLevelIter));
 
-  rc = fiLevelIterInit(db, &iter);
-  if( rc==SQLITE4_OK ){
-    rc = fiCsrAllocateSubs(db, pCsr, iter.nSub);
+  if( pHdr->iMRoot ){
+    rc = fiLevelIterInit(db, &iter);
+    if( rc==SQLITE4_OK ){
+      rc = fiCsrAllocateSubs(db, pCsr, iter.nSub);
+    }
   }
 
-  while( rc==SQLITE4_OK && 0==fiLevelIterNext(&iter) ){
+  while( rc==SQLITE4_OK && pHdr->iMRoot && 0==fiLevelIterNext(&iter) ){
     FiSubCursor *pSub = &pCsr->aSub[iter.iSub];
     const int n = (int)sizeof(pSub->aPrefix);
 
@@ -2116,10 +2941,11 @@ static int fiCsrEnd(FiCursor *pCsr, int bLast){
   fiLevelIterCleanup(&iter);
 
   if( rc==SQLITE4_OK ){
+    fiCsrBufferSet(pCsr, bLast ? fiBufferLast(pBuf) : fiBufferFirst(pBuf));
     pCsr->base.flags &= ~(CSR_NEXT_OK | CSR_PREV_OK);
     pCsr->base.flags |= (bLast ? CSR_PREV_OK : CSR_NEXT_OK);
     rc = fiCsrSetCurrent(pCsr);
-    if( rc==SQLITE4_OK && btCsrIsDelete(&pCsr->aSub[pCsr->iBt].csr) ){
+    if( rc==SQLITE4_OK && fiCsrIsDelete(pCsr) ){
       rc = fiCsrStep(pCsr);
     }
   }
@@ -2184,7 +3010,7 @@ int sqlite4BtCsrNext(bt_cursor *pBase){
   if( IsBtCsr(pBase) ){
     rc = btCsrStep((BtCursor*)pBase, 1);
   }else{
-    rc = fiCsrStep((FiCursor*)pBase);
+    rc = fiCsrAdvance((FiCursor*)pBase);
   }
   return rc;
 }
@@ -2197,7 +3023,7 @@ int sqlite4BtCsrPrev(bt_cursor *pBase){
   if( IsBtCsr(pBase) ){
     rc = btCsrStep((BtCursor*)pBase, 0);
   }else{
-    rc = fiCsrStep((FiCursor*)pBase);
+    rc = fiCsrAdvance((FiCursor*)pBase);
   }
   return rc;
 }
@@ -2336,16 +3162,22 @@ static int btCsrData(
 
       if( nV==0 ){
         /* Type (b) or (c) cell */
-        rc = btCsrBuffer(pCsr, 1);
-        if( rc==SQLITE4_OK ){
-          u8 *aBuf = (u8*)pCsr->ovfl.buf.p;
-          *ppV = &aBuf[pCsr->ovfl.nKey];
-          *pnV = pCsr->ovfl.nVal;
+        if( nByte<0 || pCsr->ovfl.nKey>0 ){
+          rc = btCsrBuffer(pCsr, 1);
+          if( rc==SQLITE4_OK ){
+            u8 *aBuf = (u8*)pCsr->ovfl.buf.p;
+            int iOff = MIN(iOffset, pCsr->ovfl.nVal);
+            *ppV = &aBuf[pCsr->ovfl.nKey + iOff];
+            *pnV = pCsr->ovfl.nVal - iOff;
+          }
+        }else{
+          rc = btCsrDataRange(pCsr, iOffset, nByte, ppV, pnV);
         }
       }else{
         /* Type (a) cell */
-        *ppV = pCell;
-        *pnV = (nV-2);
+        int iOff = MIN(iOffset, MAX(0, nV-2));
+        *ppV = &pCell[iOff];
+        *pnV = (nV-2) - iOff;
       }
 
 #ifndef NDEBUG
@@ -2372,7 +3204,7 @@ int sqlite4BtCsrKey(bt_cursor *pBase, const void **ppK, int *pnK){
   }else{
     FiCursor *pCsr = (FiCursor*)pBase;
     assert( pCsr->iBt>=0 );
-    rc = btCsrKey(&pCsr->aSub[pCsr->iBt].csr, ppK, pnK);
+    rc = fiCsrInputKey(pCsr, pCsr->iBt, ppK, pnK);
   }
 
   return rc;
@@ -2392,7 +3224,16 @@ int sqlite4BtCsrData(
   }else{
     FiCursor *pCsr = (FiCursor*)pBase;
     assert( pCsr->iBt>=0 );
-    rc = btCsrData(&pCsr->aSub[pCsr->iBt].csr, iOffset, nByte, ppV, pnV);
+    if( fiCsrIsBuffer(pCsr, pCsr->iBt) ){
+      int nVal;
+      const u8 *pVal = fiBufferVal(fiCsrBufferEntry(pCsr), &nVal);
+      int iOff = MIN(iOffset, MAX(nVal, 0));
+      assert( nVal>=0 );
+      *ppV = (const void*)&pVal[iOff];
+      *pnV = nVal - iOff;
+    }else{
+      rc = btCsrData(&pCsr->aSub[pCsr->iBt].csr, iOffset, nByte, ppV, pnV);
+    }
   }
 
   return rc;
@@ -2457,7 +3298,7 @@ static void fiCsrCell(FiCursor *pCsr, const void **ppCell, int *pnCell){
   u8 *aData;                      /* Current page data */
   int iCell;
 
-  assert( pCsr->iBt>=0 );
+  assert( pCsr->iBt>=0 && fiCsrIsBuffer(pCsr, pCsr->iBt)==0 );
   pSub = &pCsr->aSub[pCsr->iBt];
   aData = btPageData(pSub->csr.apPage[pSub->csr.nPg-1]);
   iCell = pSub->csr.aiCell[pSub->csr.nPg-1];
@@ -2665,48 +3506,6 @@ static int btOverflowArraySz(int pgsz, int nContent){
   return 1 + (BT_MAX_DIRECT_OVERFLOW+1) * 4;
 }
 
-/*
-** Allocate a non-overflow page.
-**
-** This function is a simple wrapper around sqlite4BtPageAllocate(),
-** except that if the database is currenly in fast-insert mode the
-** BtDbHdr.nSubPg counter is incremented.
-*/
-static int btAllocateNonOverflow(bt_db *db, BtPage **ppPg){
-  int rc;
-  if( db->bFastInsertOp ){
-    BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
-    u32 iPg;
-
-    sqlite4BtPagerDbhdrDirty(db->pPager);
-    iPg = pHdr->nSubPg + btFirstOfBlock(pHdr, pHdr->iSubBlock);
-    pHdr->nSubPg++;
-    rc = sqlite4BtPageGet(db->pPager, iPg, ppPg);
-    if( rc==SQLITE4_OK ){
-      rc = sqlite4BtPageWrite(*ppPg);
-      if( rc!=SQLITE4_OK ){
-        sqlite4BtPageRelease(*ppPg);
-      }
-    }
-  }else{
-    rc = sqlite4BtPageAllocate(db->pPager, ppPg);
-  }
-  return rc;
-}
-
-/*
-** Trim a non-overflow page.
-*/
-static int btTrimNonOverflow(bt_db *db, BtPage *pPg){
-  int rc;                         /* Return code */
-  if( db->bFastInsertOp==0 ){
-    rc = sqlite4BtPageTrim(pPg);
-  }else{
-    rc = sqlite4BtPageRelease(pPg);
-  }
-  return rc;
-}
-
 /*
 ** Allocate and zero an overflow page.
 */
@@ -3436,14 +4235,14 @@ int btBalance(
   /* Clobber the old pages with the new buffers */
   for(iPg=0; iPg<ctx.nOut; iPg++){
     if( iPg>=ctx.nIn ){
-      rc = btAllocateNonOverflow(pDb, &ctx.apPg[iPg]);
+      rc = sqlite4BtPageAllocate(pDb->pPager, &ctx.apPg[iPg]);
       if( rc!=SQLITE4_OK ) goto rebalance_out;
     }
     btSetBuffer(pDb, ctx.apPg[iPg], ctx.apOut[iPg]);
     ctx.apOut[iPg] = 0;
   }
   for(iPg=ctx.nOut; iPg<ctx.nIn; iPg++){
-    rc = btTrimNonOverflow(pDb, ctx.apPg[iPg]);
+    rc = sqlite4BtPageTrim(ctx.apPg[iPg]);
     ctx.apPg[iPg] = 0;
     if( rc!=SQLITE4_OK ) goto rebalance_out;
   }
@@ -3513,7 +4312,7 @@ static int btExtendTree(BtCursor *pCsr){
 
   rc = sqlite4BtPageWrite(pRoot);
   if( rc==SQLITE4_OK ){
-    rc = btAllocateNonOverflow(pDb, &pNew);
+    rc = sqlite4BtPageAllocate(pDb->pPager, &pNew);
   }
   if( rc==SQLITE4_OK ){
     u8 *aRoot = btPageData(pRoot);
@@ -3560,7 +4359,7 @@ static int btTryAppend(BtCursor *pCsr, int nKV, KeyValue *apKV){
     if( nCell==pCsr->aiCell[pCsr->nPg-1] ){
       KeyValue kv;
       BtPage *pNew = 0;
-      rc = btAllocateNonOverflow(pDb, &pNew);
+      rc = sqlite4BtPageAllocate(pDb->pPager, &pNew);
       if( rc==SQLITE4_OK ){
         aData = btPageData(pNew);
         btPutU16(&aData[pgsz-2], 0);
@@ -3709,20 +4508,7 @@ static int btInsertAndBalance(
     /* The new entry will not fit on the leaf page. Entries will have
     ** to be shuffled between existing leaves and new leaves may need
     ** to be added to make space for it. */
-    bt_db *db = pCsr->base.pDb;
-    if( bLeaf && db->bFastInsertOp ){
-      /* This operation will need to allocate further pages. The worst
-      ** case scenario is (nDepth+1) pages. If fewer than that remain
-      ** available in the block, return BT_BLOCKFULL. */
-      BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
-      int nPgPerBlk = (pHdr->blksz / pHdr->pgsz);
-      if( (nPgPerBlk - pHdr->nSubPg) < pCsr->nPg+1 ){
-        sqlite4BtPagerDbhdrDirty(db->pPager);
-        rc = BT_BLOCKFULL;
-        pHdr->iSubBlock = 0;
-      }
-    }
-    if( rc==SQLITE4_OK && pCsr->nPg==1 ){
+    if( pCsr->nPg==1 ){
       rc = btExtendTree(pCsr);
     }
     if( rc==SQLITE4_OK ){
@@ -3803,8 +4589,8 @@ static int btBalanceIfUnderfull(BtCursor *pCsr){
       }
       if( rc==SQLITE4_OK ){
         u8 *a = btPageData(pChild);
-        memcpy(aData, a, pgsz);
-        rc = btTrimNonOverflow(pCsr->base.pDb, pChild);
+        memcpy(btPageData(pPg), a, pgsz);
+        rc = sqlite4BtPageTrim(pChild);
       }
     }
   }else if( nCell==0 || (nFree>(2*pgsz/3) && bLeaf==0) ){
@@ -3837,47 +4623,35 @@ static int btSaveAllCursor(bt_db *pDb, BtCursor *pCsr){
   return rc;
 }
 
-static int btFastInsertRoot(bt_db *db, BtDbHdr *pHdr, u32 *piRoot);
-static int btScheduleMerge(bt_db *db);
-
 static int btReplaceEntry(
   bt_db *db,                      /* Database handle */
   u32 iRoot,                      /* Root page of b-tree to update */
   const void *pK, int nK,         /* Key to insert */
   const void *pV, int nV          /* Value to insert. (nV<0) -> delete */
 ){
-  BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
   int rc = SQLITE4_OK;            /* Return code */
   BtCursor csr;                  /* Cursor object to seek to insert point */
-  u32 iRootPg = iRoot;
 
-  if( iRoot==0 ){
-    rc = btFastInsertRoot(db, pHdr, &iRootPg);
-  }
-  btCsrSetup(db, iRootPg, &csr);
+  btCsrSetup(db, iRoot, &csr);
 
   /* Seek stack cursor csr to the b-tree page that key pK/nK is/would be
   ** stored on.  */
-  if( rc==SQLITE4_OK ){
-    rc = btCsrSeek(&csr, 0, pK, nK, BT_SEEK_GE, BT_CSRSEEK_UPDATE);
-  }
+  rc = btCsrSeek(&csr, 0, pK, nK, BT_SEEK_GE, BT_CSRSEEK_UPDATE);
 
   if( rc==SQLITE4_OK ){
     /* The cursor currently points to an entry with key pK/nK. This call
     ** should therefore replace that entry. So delete it and then re-seek
     ** the cursor.  */
     rc = sqlite4BtDelete(&csr.base);
-    if( rc==SQLITE4_OK && (nV>=0 || iRoot==0) ){
+    if( rc==SQLITE4_OK && nV>=0 ){
       rc = btCsrSeek(&csr, 0, pK, nK, BT_SEEK_GE, BT_CSRSEEK_UPDATE);
       if( rc==SQLITE4_OK ) rc = btErrorBkpt(SQLITE4_CORRUPT);
     }
   }
 
-
   if( rc==SQLITE4_NOTFOUND || rc==SQLITE4_INEXACT ){
-    if( nV<0 && iRoot!=0 ){
-      /* This is a delete on the regular b-tree (not the fast-insert tree).
-      ** Nothing more to do.  */
+    if( nV<0 ){
+      /* This is a delete. Nothing more to do.  */
       rc = SQLITE4_OK;
     }else{
       KeyValue kv;
@@ -3888,26 +4662,7 @@ static int btReplaceEntry(
 
       rc = btOverflowAssign(db, &kv);
       if( rc==SQLITE4_OK ){
-        do{
-          /* Insert the new KV pair into the current leaf. */
-          rc = btInsertAndBalance(&csr, 1, &kv);
-
-          /* Unless this is a block-full error, break out of the loop */
-          if( rc!=BT_BLOCKFULL ) break;
-          assert( iRoot==0 );
-
-          /* Try to schedule a merge operation */
-          rc = btScheduleMerge(db);
-
-          if( rc==SQLITE4_OK ){
-            rc = btFastInsertRoot(db, pHdr, &iRootPg);
-          }
-          if( rc==SQLITE4_OK ){
-            btCsrReset(&csr, 1);
-            btCsrSetup(db, iRootPg, &csr);
-            rc = btCsrSeek(&csr, 0, pK, nK, BT_SEEK_GE, BT_CSRSEEK_UPDATE);
-          }
-        }while( rc==SQLITE4_NOTFOUND || rc==SQLITE4_INEXACT );
+        rc = btInsertAndBalance(&csr, 1, &kv);
       }
 
       if( kv.eType==KV_CELL ){
@@ -4048,6 +4803,8 @@ static int btAllocateNewLevel(
     btFree(db, aNew);
 
     *piNext = (iMin + nLevel);
+    db->nSubtree = nLevel+1;
+    db->bNewSubtree = 1;
   }
 
   btCsrReset(&csr, 1);
@@ -4158,6 +4915,7 @@ static int btFindMerge(
         /* Find the output level */
         btReadSummary(aNew, iBestAge+1, &iMin, &nLevel, &iMerge);
         *piOutLevel = iMin + nLevel;
+        btFree(db, aNew);
       }
     }
   }
@@ -4176,9 +4934,138 @@ static int btFindMerge(
 ** If successful, SQLITE4_OK is returned. If an error occurs, an SQLite
 ** error code.
 */ 
+/*
+** Append block iBlk to the list of blocks to trim in buffer pTrim, unless
+** it is already the last entry in the list.
+*/
+static int btTrimAppend(sqlite4_buffer *pTrim, u32 iBlk){
+  int nTrim = (int)(pTrim->n / sizeof(u32));
+  if( nTrim>0 && ((u32*)pTrim->p)[nTrim-1]==iBlk ) return SQLITE4_OK;
+  return sqlite4_buffer_append(pTrim, (void*)&iBlk, sizeof(u32));
+}
+
+/*
+** This is a helper function for btIntegrateMerge(). Buffer pTrim contains
+** a list of blocks from which sub-trees that were inputs to merge p have
+** been removed. This function zeroes any entry in the list for a block
+** that still contains the root page of a sub-tree belonging to one of
+** the input levels.
+*/
+static int btTrimRemoveLive(bt_db *db, BtSchedule *p, sqlite4_buffer *pTrim){
+  BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
+  u32 *aTrim = (u32*)pTrim->p;
+  int nTrim = (int)(pTrim->n / sizeof(u32));
+  BtCursor mcsr;
+  u32 iLvl;
+  int rc = SQLITE4_OK;
+
+  btCsrSetup(db, pHdr->iMRoot, &mcsr);
+  for(iLvl=p->iMinLevel; rc==SQLITE4_OK && iLvl<=p->iMaxLevel; iLvl++){
+    u8 aPrefix[8];
+    fiFormatPrefix(aPrefix, p->iAge, iLvl);
+    rc = btCsrSeek(&mcsr, 0, aPrefix, sizeof(aPrefix), BT_SEEK_GE, 0);
+    if( rc==SQLITE4_INEXACT ) rc = SQLITE4_OK;
+    while( rc==SQLITE4_OK ){
+      const void *pMKey; int nMKey;
+      const void *pData; int nData;
+      rc = btCsrKey(&mcsr, &pMKey, &nMKey);
+      if( rc!=SQLITE4_OK ) break;
+      if( nMKey<sizeof(aPrefix) || memcmp(aPrefix, pMKey, sizeof(aPrefix)) ){
+        break;
+      }
+      rc = btCsrData(&mcsr, 0, 4, &pData, &nData);
+      if( rc==SQLITE4_OK ){
+        u32 iBlk = btBlockOfPage(pHdr, btGetU32((const u8*)pData));
+        int i;
+        for(i=0; i<nTrim; i++){
+          if( aTrim[i]==iBlk ) aTrim[i] = 0;
+        }
+        rc = btCsrStep(&mcsr, 1);
+      }
+    }
+    if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+  }
+
+  btCsrReset(&mcsr, 1);
+  return rc;
+}
+
+/*
+** Add meta-tree entries for the sub-trees with the root pages in array
+** aRoot[] to level iLvl of age iAge. The array is terminated by the first
+** zero entry, or after nRoot entries. The key of each new entry is the 8-byte age/level prefix
+** followed by the smallest key in the sub-tree.
+*/
+static int fiAddSubtrees(
+  bt_db *db,                      /* Database handle */
+  u32 iAge,                       /* Age of new sub-trees */
+  u32 iLvl,                       /* Level of new sub-trees */
+  u32 *aRoot,                     /* Root pages of new sub-trees */
+  int nRoot                       /* Size of aRoot[] array */
+){
+  BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
+  int rc = SQLITE4_OK;
+  BtCursor csr;                   /* Cursor used to read each sub-tree */
+  sqlite4_buffer buf;             /* Buffer used to assemble meta-tree key */
+  int i;
+
+  memset(&csr, 0, sizeof(csr));
+  sqlite4_buffer_init(&buf, 0);
+  for(i=0; rc==SQLITE4_OK && i<nRoot && aRoot[i]; i++){
+    const void *pKey = 0;
+    int nKey = 0;
+
+    btCsrReset(&csr, 1);
+    btCsrSetup(db, aRoot[i], &csr);
+    rc = btCsrEnd(&csr, 0);
+    if( rc==SQLITE4_OK ){
+      rc = btCsrKey(&csr, &pKey, &nKey);
+    }
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4_buffer_resize(&buf, nKey+8);
+    }
+    if( rc==SQLITE4_OK ){
+      u8 aData[4];
+      u8 *a = (u8*)buf.p;
+      fiFormatPrefix(a, iAge, iLvl);
+      memcpy(&a[8], pKey, nKey);
+      btPutU32(aData, aRoot[i]);
+      rc = btReplaceEntry(db, pHdr->iMRoot, a, nKey+8, aData, sizeof(aData));
+    }
+  }
+
+  btCsrReset(&csr, 1);
+  sqlite4_buffer_clear(&buf);
+  return rc;
+}
+
+/*
+** Sub-tree iRoot is an input to a merge that stopped before key pKey/nKey.
+** Set *pbConsumed to true if the sub-tree contains no keys equal to or 
+** larger than pKey, or to false otherwise. If the sub-tree was consumed
+** by the merge, it must be removed from its level, not restored to it 
+** with key pKey.
+*/
+static int btSubtreeConsumed(
+  bt_db *db, 
+  u32 iRoot, 
+  const void *pKey, int nKey,
+  int *pbConsumed
+){
+  BtCursor csr;
+  int rc;
+
+  memset(&csr, 0, sizeof(csr));
+  btCsrSetup(db, iRoot, &csr);
+  rc = btCsrSeek(&csr, 0, pKey, nKey, BT_SEEK_GE, 0);
+  btCsrReset(&csr, 1);
+  *pbConsumed = (rc==SQLITE4_NOTFOUND);
+  if( rc==SQLITE4_INEXACT || rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+  return rc;
+}
+
 static int btIntegrateMerge(bt_db *db, BtSchedule *p){
   BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
-  const int nPgPerBlk = (pHdr->blksz / pHdr->pgsz);
   int rc = SQLITE4_OK;
   BtCursor csr;                   /* Cursor for reading various sub-trees */
   BtCursor mcsr;                  /* Cursor for reading the meta-tree */
@@ -4186,15 +5073,11 @@ static int btIntegrateMerge(bt_db *db, BtSchedule *p){
   int nKey = 0;                   /* Size of pKey in bytes */
   const u8 *aSum; int nSum;       /* Summary value */
   sqlite4_buffer buf;             /* Buffer object used for various purposes */
+  sqlite4_buffer trim;            /* Blocks that may be trimmed */
   u32 iLvl;
   int iBlk;
+  int i;
 
-  /* Save the value of the fast-insert flag. It will be restored before
-  ** this function returns. Leaving it set here interferes with page 
-  ** allocation if the meta-tree needs to be extended.  */
-  const int bFastInsertOp = db->bFastInsertOp;
-  db->bFastInsertOp = 0;
-  
 #if 0
   static int nCall = 0; nCall++;
   fprintf(stderr, "BEFORE %d\n", nCall);
@@ -4206,6 +5089,7 @@ static int btIntegrateMerge(bt_db *db, BtSchedule *p){
   memset(&mcsr, 0, sizeof(mcsr));
   btCsrSetup(db, pHdr->iMRoot, &mcsr);
   sqlite4_buffer_init(&buf, 0);
+  sqlite4_buffer_init(&trim, 0);
   
   if( p->iNextPg ){
     btCsrSetup(db, p->iNextPg, &csr);
@@ -4250,7 +5134,8 @@ static int btIntegrateMerge(bt_db *db, BtSchedule *p){
   /* The following loop iterates through each of the input levels. Each
   ** level is either removed from the database completely (if the merge
   ** completed) or else modified so that it contains no keys smaller
-  ** than (pKey/nKey).  */ 
+  ** than (pKey/nKey). The blocks containing the sub-trees removed are
+  ** added to the trim buffer.  */ 
   for(iLvl=p->iMinLevel; iLvl<=p->iMaxLevel; iLvl++){
     u8 aPrefix[8];
     u32 iRoot = 0;
@@ -4286,7 +5171,7 @@ static int btIntegrateMerge(bt_db *db, BtSchedule *p){
           }
         }
         if( iRoot ){
-          rc = sqlite4BtBlockTrim(db->pPager, 1 + (iRoot / nPgPerBlk));
+          rc = btTrimAppend(&trim, btBlockOfPage(pHdr, iRoot));
         }
       }
 
@@ -4305,6 +5190,18 @@ static int btIntegrateMerge(bt_db *db, BtSchedule *p){
     }
     if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
 
+    /* If the merge did not complete, the last sub-tree deleted from the
+    ** level is restored with key pKey. Unless it was consumed by the merge
+    ** along with its predecessors, in which case it may be trimmed.  */
+    if( rc==SQLITE4_OK && iRoot && pKey ){
+      int bConsumed = 0;
+      rc = btSubtreeConsumed(db, iRoot, pKey, nKey, &bConsumed);
+      if( rc==SQLITE4_OK && bConsumed ){
+        rc = btTrimAppend(&trim, btBlockOfPage(pHdr, iRoot));
+        iRoot = 0;
+      }
+    }
+
     if( rc==SQLITE4_OK && iRoot ){
       if( pKey ){
         int n = sizeof(aPrefix) + nKey;
@@ -4318,35 +5215,31 @@ static int btIntegrateMerge(bt_db *db, BtSchedule *p){
           rc = btReplaceEntry(db, pHdr->iMRoot, a, n, aData, sizeof(aData));
         }
       }else{
-        rc = sqlite4BtBlockTrim(db->pPager, 1 + (iRoot / nPgPerBlk));
+        rc = btTrimAppend(&trim, btBlockOfPage(pHdr, iRoot));
       }
     }
   }
 
+  /* Level-0 sub-trees share blocks (see fiBufferFlush()). So a block
+  ** that contains a sub-tree removed above may also contain another
+  ** sub-tree that remains part of an input level following a partial
+  ** merge. Remove any such blocks from the trim buffer, then trim the
+  ** rest.  */
+  if( rc==SQLITE4_OK && p->iAge==0 && pKey ){
+    rc = btTrimRemoveLive(db, p, &trim);
+  }
+  for(i=0; rc==SQLITE4_OK && i<(int)(trim.n/sizeof(u32)); i++){
+    u32 iTrim = ((u32*)trim.p)[i];
+    if( iTrim ) rc = sqlite4BtBlockTrim(db->pPager, iTrim);
+  }
+
   /* Add new entries for the new output level blocks. */
-  for(iBlk=0; 
-      rc==SQLITE4_OK && iBlk<array_size(p->aRoot) && p->aRoot[iBlk]; 
-      iBlk++
-  ){
-    btCsrReset(&csr, 1);
-    btCsrSetup(db, p->aRoot[iBlk], &csr);
-    rc = btCsrEnd(&csr, 0);
-    if( rc==SQLITE4_OK ){
-      rc = btCsrKey(&csr, &pKey, &nKey);
-    }
-    if( rc==SQLITE4_OK ){
-      rc = sqlite4_buffer_resize(&buf, nKey+8);
-    }
-    if( rc==SQLITE4_OK ){
-      u8 aData[4];
-      u8 *a = (u8*)buf.p;
-      btPutU32(a, p->iAge+1);
-      btPutU32(&a[4], ~p->iOutLevel);
-      memcpy(&a[8], pKey, nKey);
-      btPutU32(aData, p->aRoot[iBlk]);
-      rc = btReplaceEntry(db, pHdr->iMRoot, a, nKey+8, aData, sizeof(aData));
-    }
+  if( rc==SQLITE4_OK ){
+    rc = fiAddSubtrees(
+        db, p->iAge+1, p->iOutLevel, p->aRoot, array_size(p->aRoot)
+    );
   }
+  for(iBlk=0; iBlk<array_size(p->aRoot) && p->aRoot[iBlk]; iBlk++);
 
   /* Trim any unused blocks */
   while( rc==SQLITE4_OK && iBlk<array_size(p->aBlock) && p->aBlock[iBlk] ){
@@ -4393,6 +5286,7 @@ static int btIntegrateMerge(bt_db *db, BtSchedule *p){
   btCsrReset(&csr, 1);
   btCsrReset(&mcsr, 1);
   sqlite4_buffer_clear(&buf);
+  sqlite4_buffer_clear(&trim);
 
 #if 0
   if( rc==SQLITE4_OK ){
@@ -4401,7 +5295,6 @@ static int btIntegrateMerge(bt_db *db, BtSchedule *p){
   }
 #endif
   assert_summary_ok(db, SQLITE4_OK);
-  db->bFastInsertOp = bFastInsertOp;
   return rc;
 }
 
@@ -4446,6 +5339,7 @@ static int btScheduleMerge(bt_db *db){
     
     switch( btGetU32(aData) ){
       case BT_SCHEDULE_BUSY:
+        db->bMergePending = 1;
         rc = SQLITE4_NOTFOUND;
         break;
 
@@ -4483,75 +5377,21 @@ static int btScheduleMerge(bt_db *db){
     rc = btAllocateBlock(db, db->nScheduleAlloc, s.aBlock);
 
     btWriteSchedulePage(pPg, &s, &rc);
-  }
-
-  sqlite4BtPageRelease(pPg);
-  if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
-  return rc;
-}
-
-static int btFastInsertRoot(
-  bt_db *db, 
-  BtDbHdr *pHdr, 
-  u32 *piRoot
-){
-  int rc = SQLITE4_OK;
-
-  assert( db->bFastInsertOp );
-  db->bFastInsertOp = 0;
+    if( rc==SQLITE4_OK ) db->bMergePending = 1;
 
-  /* If the meta-tree has not been created, create it now. */
-  if( pHdr->iMRoot==0 ){
-    sqlite4BtPagerDbhdrDirty(db->pPager);
-    rc = btAllocateNewRoot(db, BT_PGFLAGS_METATREE, &pHdr->iMRoot);
-  }
-
-  /* If no writable sub-tree current exists, create one */ 
-  if( rc==SQLITE4_OK && pHdr->iSubBlock==0 ){
-    u32 iLevel;                   /* Level number for new sub-tree */
-    u32 iSubBlock;                /* New block */
-
-    rc = btAllocateNewLevel(db, pHdr, &iLevel);
-    if( rc==SQLITE4_OK ){
-      rc = btAllocateBlock(db, 1, &iSubBlock);
-    }
-
-    if( rc==SQLITE4_OK ){
-      u8 aKey[8];
-      u8 aVal[4];
+    /* If the inputs are level-0 sub-trees, stop appending to the current
+    ** level-0 block. This ensures that no block contains both input
+    ** sub-trees and sub-trees written after the merge was scheduled, so
+    ** that btIntegrateMerge() may trim the blocks the inputs occupy.  */
+    if( rc==SQLITE4_OK && iAge==0 && pHdr->iSubBlock ){
       sqlite4BtPagerDbhdrDirty(db->pPager);
-      pHdr->iSubBlock = iSubBlock;
-      pHdr->nSubPg = 1;           /* Root page is automatically allocated */
-
-      /* The key for the new entry consists of the concatentation of two 
-      ** 32-bit big-endian integers - the <age> and <level-no>. The age
-      ** of the new segment is 0. The level number is one greater than the
-      ** level number of the previous segment.  */
-      btPutU32(&aKey[0], 0);
-      btPutU32(&aKey[4], ~iLevel);
-      btPutU32(&aVal[0], btFirstOfBlock(pHdr, iSubBlock));
-      rc = btReplaceEntry(db, pHdr->iMRoot, aKey, 8, aVal, 4);
-    }
-
-    if( rc==SQLITE4_OK ){
-      u32 iRoot = btFirstOfBlock(pHdr, pHdr->iSubBlock);
-      BtPage *pPg = 0;
-
-      rc = sqlite4BtPageGet(db->pPager, iRoot, &pPg);
-      if( rc==SQLITE4_OK ) rc = sqlite4BtPageWrite(pPg);
-      if( rc==SQLITE4_OK ){
-        u8 *aData = btPageData(pPg);
-        memset(&aData[pHdr->pgsz-6], 0, 6);
-        aData[0] = 0;
-      }
-      sqlite4BtPageRelease(pPg);
+      pHdr->iSubBlock = 0;
+      pHdr->nSubPg = 0;
     }
   }
 
-  if( rc==SQLITE4_OK ){
-    *piRoot = btFirstOfBlock(pHdr, pHdr->iSubBlock);
-  }
-  db->bFastInsertOp = 1;
+  sqlite4BtPageRelease(pPg);
+  if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
   return rc;
 }
 
@@ -4649,6 +5489,7 @@ struct FiWriter {
   int nPgPerBlk;                  /* Pages per block in this database */
   u32 iBlk;                       /* Block to write to */
   int nOvflPerPage;               /* Overflow pointers per page */
+  int bPager;                     /* Write pages via the log, not directly */
 
   int nAlloc;                     /* Pages allocated from current block */
   int nWrite;                     /* Pages written to current block */
@@ -4679,7 +5520,15 @@ static int fiWriterFlush(
   p->nWrite++;
   assert( p->nWrite<=p->nAlloc );
   assert( p->nWrite<=p->nPgPerBlk );
-  rc = sqlite4BtPagerRawWrite(p->db->pPager, pgno, pPg->aBuf);
+  if( p->bPager ){
+    BtPage *pPage = 0;
+    rc = sqlite4BtPageGet(p->db->pPager, pgno, &pPage);
+    if( rc==SQLITE4_OK ) rc = sqlite4BtPageWrite(pPage);
+    if( rc==SQLITE4_OK ) memcpy(btPageData(pPage), pPg->aBuf, p->pgsz);
+    sqlite4BtPageRelease(pPage);
+  }else{
+    rc = sqlite4BtPagerRawWrite(p->db->pPager, pgno, pPg->aBuf);
+  }
   *pPgno = pgno;
   return rc;
 }
@@ -4707,7 +5556,21 @@ static int fiWriterFlushAll(FiWriter *p){
   return rc;
 }
 
+/*
+** Free the page buffers still held by FiWriter object p. This includes the
+** overflow trunk page buffer, which is not freed when it is written. The
+** FiWriter must have been zeroed or initialized by fiWriterInit().
+*/
 static void fiWriterCleanup(FiWriter *p){
+  if( p->db ){
+    int i;
+    for(i=0; i<array_size(p->aHier); i++){
+      btFreeBuffer(p->db, p->aHier[i].aBuf);
+      p->aHier[i].aBuf = 0;
+    }
+    btFreeBuffer(p->db, p->aTrunk);
+    p->aTrunk = 0;
+  }
 }
 
 /*
@@ -4864,14 +5727,11 @@ static int fiWriterFreeOverflow(FiWriter *p, FiCursor *pCsr){
   rc = btCsrKey(&pCsr->aSub[pCsr->iBt].csr, &pKey, &nKey);
   for(i=pCsr->iBt+1; i<pCsr->nBt && rc==SQLITE4_OK; i++){
     BtCursor *pSub = &pCsr->aSub[i].csr;
-    if( pSub->nPg ){
+    if( pSub->nPg && btCsrOverflow(pSub) ){
       const void *pSKey;            /* Current key for pSub */
       int nSKey;                    /* Size of pSKey in bytes */
       rc = btCsrKey(pSub, &pSKey, &nSKey);
-      if( rc==SQLITE4_OK 
-       && 0==btKeyCompare(pKey, nKey, pSKey, nSKey) 
-       && btCsrOverflow(pSub)
-      ){
+      if( rc==SQLITE4_OK && 0==btKeyCompare(pKey, nKey, pSKey, nSKey) ){
         u32 pgno = sqlite4BtPagePgno(pSub->apPage[pSub->nPg-1]);
         int iCell = pSub->aiCell[pSub->nPg-1];
 
@@ -4994,6 +5854,7 @@ int sqlite4BtMerge(bt_db *db, BtDbHdr *pHdr, u8 *aSched){
     FiCursor fcsr;                /* FiCursor used to read input */
     FiWriter writer;              /* FiWriter used to write output */
 
+    memset(&writer, 0, sizeof(FiWriter));
     rc = fiSetupMergeCsr(db, pHdr, &s, &fcsr);
     assert( rc!=SQLITE4_NOTFOUND );
     assert_ficursor_ok(&fcsr, rc);
@@ -5059,11 +5920,286 @@ int sqlite4BtMerge(bt_db *db, BtDbHdr *pHdr, u8 *aSched){
   return rc;
 }
 
+/*
+** This is called before the fast-insert buffer is written to the database
+** and emptied. Copy the entry that the buffer input of each fast-insert 
+** cursor points to into FiCursor.bufsave. Until it is next moved, the 
+** cursor reads the saved copy. It then finds its new position within the
+** buffer by searching for the saved key (see fiCsrBufferStep()).
+**
+** The sub-trees that each cursor reads are fixed when it is positioned, 
+** so each cursor that may be stepped is also flagged for a full reseek 
+** before it is next moved (see fiCsrRestore()).
+*/
+static int fiBufferSave(bt_db *db){
+  int rc = SQLITE4_OK;            /* Return code */
+  bt_cursor *pIter;               /* Used to iterate through cursors */
+
+  for(pIter=db->pAllCsr; rc==SQLITE4_OK && pIter; pIter=pIter->pNextCsr){
+    if( IsBtCsr(pIter)==0 ){
+      FiCursor *p = (FiCursor*)pIter;
+      if( p->iBuf>0 && p->bBufSaved==0 ){
+        const u8 *aEntry = fiCsrBufferEntry(p);
+        int nKey, nVal;
+        fiBufferKey(aEntry, &nKey);
+        fiBufferVal(aEntry, &nVal);
+        rc = sqlite4_buffer_set(&p->bufsave, aEntry, 8 + nKey + MAX(nVal, 0));
+        if( rc==SQLITE4_OK ) p->bBufSaved = 1;
+      }
+      if( p->iBt>=0 && (p->base.flags & CSR_VISIT_DEL)==0
+       && (p->base.flags & (CSR_NEXT_OK|CSR_PREV_OK))
+      ){
+        p->bReseek = 1;
+      }
+    }
+  }
+
+  return rc;
+}
+
+/*
+** Discard the contents of the fast-insert buffer. Any fast-insert cursor
+** with a buffer input that points to an entry that has not been saved 
+** by fiBufferSave() loses that input.
+*/
+static void fiBufferDiscard(bt_db *db){
+  bt_cursor *pIter;               /* Used to iterate through cursors */
+
+  for(pIter=db->pAllCsr; pIter; pIter=pIter->pNextCsr){
+    if( IsBtCsr(pIter)==0 ){
+      FiCursor *p = (FiCursor*)pIter;
+      if( p->iBuf>0 && p->bBufSaved==0 ){
+        if( fiCsrIsBuffer(p, p->iBt) ) p->iBt = -1;
+        p->iBuf = 0;
+      }
+    }
+  }
+  db->fibuf.nData = 0;
+  db->fibuf.nNode = 0;
+  db->fibuf.nHeight = 0;
+}
+
+/*
+** Write the contents of the fast-insert buffer to the database as a new
+** level-0 sub-tree, then empty the buffer.
+**
+** The sub-tree is written sequentially using an FiWriter, starting at the
+** first unused page of block BtDbHdr.iSubBlock. If that block fills up
+** before all entries have been written, the remaining entries are written
+** to a new sub-tree in a newly allocated block, and so on. Pages are
+** written through the log, not directly to the database file, so that 
+** the new sub-tree is part of the current transaction.
+*/
+static int fiBufferFlush(bt_db *db){
+  FiBuffer *p = &db->fibuf;
+  BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
+  const int nPgPerBlk = (pHdr->blksz / pHdr->pgsz);
+  int rc = SQLITE4_OK;
+  BtSchedule s;                   /* Blocks written and sub-tree roots */
+  FiWriter writer;                /* Object used to write the sub-tree */
+  u32 iLvl = 0;                   /* Level number of new sub-tree */
+  int iBlk = 0;                   /* Index of current block in s.aBlock[] */
+  u8 *aCell = 0;                  /* Buffer used to format cells */
+  int nCell = 0;                  /* Size of cell in aCell[] */
+  u32 iNode = fiBufferFirst(p);   /* Next buffer entry to write */
+
+  if( iNode==0 ) return SQLITE4_OK;
+  memset(&s, 0, sizeof(BtSchedule));
+  memset(&writer, 0, sizeof(FiWriter));
+
+  rc = btSaveAllCursor(db, 0);
+  if( rc==SQLITE4_OK ) rc = fiBufferSave(db);
+  if( rc==SQLITE4_OK ) rc = btNewBuffer(db, &aCell);
+
+  /* If the meta-tree has not been created, create it now. */
+  if( rc==SQLITE4_OK && pHdr->iMRoot==0 ){
+    sqlite4BtPagerDbhdrDirty(db->pPager);
+    rc = btAllocateNewRoot(db, BT_PGFLAGS_METATREE, &pHdr->iMRoot);
+  }
+  if( rc==SQLITE4_OK ){
+    rc = btAllocateNewLevel(db, pHdr, &iLvl);
+  }
+
+  /* Continue writing to the current level-0 block, if there is one and
+  ** it is not full. Otherwise, allocate a new block.  */
+  if( rc==SQLITE4_OK ){
+    if( pHdr->iSubBlock==0 || pHdr->nSubPg>=nPgPerBlk ){
+      rc = btAllocateBlock(db, 1, &s.aBlock[0]);
+      if( rc==SQLITE4_OK ){
+        sqlite4BtPagerDbhdrDirty(db->pPager);
+        pHdr->iSubBlock = s.aBlock[0];
+        pHdr->nSubPg = 0;
+      }
+    }else{
+      s.aBlock[0] = pHdr->iSubBlock;
+    }
+  }
+  fiWriterInit(db, &s, &writer, &rc);
+  writer.bPager = 1;
+  writer.nAlloc = writer.nWrite = pHdr->nSubPg;
+
+  while( rc==SQLITE4_OK && iNode ){
+    if( nCell==0 ){
+      const u8 *aEntry = fiBufferNodeEntry(p, iNode);
+      KeyValue kv;
+      kv.pgno = 0;
+      kv.eType = KV_VALUE;
+      kv.pK = fiBufferKey(aEntry, &kv.nK);
+      kv.pV = fiBufferVal(aEntry, &kv.nV);
+      if( kv.nV<0 ) kv.pV = 0;
+      rc = btOverflowAssign(db, &kv);
+      if( rc==SQLITE4_OK ){
+        nCell = btKVCellWrite(&kv, aCell);
+      }
+      if( kv.eType==KV_CELL ){
+        sqlite4_free(db->pEnv, (void*)kv.pV);
+      }
+      if( rc!=SQLITE4_OK ) break;
+    }
+
+    rc = fiWriterAdd(&writer, aCell, nCell);
+    if( rc==BT_BLOCKFULL ){
+      /* Finish the sub-tree in the current block and start a new one 
+      ** in a new block. The current cell is retried.  */
+      rc = fiWriterFlushAll(&writer);
+      iBlk++;
+      assert( iBlk<array_size(s.aBlock) );
+      if( rc==SQLITE4_OK ){
+        rc = btAllocateBlock(db, 1, &s.aBlock[iBlk]);
+      }
+      fiWriterInit(db, &s, &writer, &rc);
+      writer.bPager = 1;
+    }else if( rc==SQLITE4_OK ){
+      nCell = 0;
+      iNode = fiNodeNext(p, iNode, 0);
+    }
+  }
+
+  if( rc==SQLITE4_OK ){
+    rc = fiWriterFlushAll(&writer);
+  }
+  if( rc==SQLITE4_OK ){
+    sqlite4BtPagerDbhdrDirty(db->pPager);
+    pHdr->iSubBlock = s.aBlock[iBlk];
+    pHdr->nSubPg = writer.nWrite;
+    rc = fiAddSubtrees(db, 0, iLvl, s.aRoot, array_size(s.aRoot));
+  }
+  fiWriterCleanup(&writer);
+  btFreeBuffer(db, aCell);
+
+  /* Empty the buffer and try to schedule a merge operation. */
+  fiBufferDiscard(db);
+  if( rc==SQLITE4_OK ){
+    rc = btScheduleMerge(db);
+  }
+  return rc;
+}
+
+/*
+** Return a randomly selected height for a new node in the skip-list of
+** fast-insert buffer p. A node of height N+1 is one quarter as likely as
+** a node of height N.
+*/
+static int fiBufferRandomHeight(FiBuffer *p){
+  u32 r = p->iRand;
+  int nHeight = 1;
+  if( r==0 ) r = 0x2545F491;
+  r ^= (r<<13);
+  r ^= (r>>17);
+  r ^= (r<<5);
+  p->iRand = r;
+  while( nHeight<FIBUF_MAX_HEIGHT && (r & 0x03)==0 ){
+    nHeight++;
+    r = r>>2;
+  }
+  return nHeight;
+}
+
+/*
+** Add a key/value pair (or delete marker, if nV<0) to the fast-insert
+** buffer. If the buffer is then large enough, flush it to disk.
+**
+** The new entry is appended to aData[]. If the key is already present in
+** the buffer, its skip-list node is updated to refer to the new entry. 
+** Otherwise, a new node is appended to aNode[] and linked into the list.
+** Existing entries and nodes are not moved, so cursors reading the buffer 
+** are not disturbed.
+*/
+static int fiBufferAppend(
+  bt_db *db, 
+  const void *pK, int nK, 
+  const void *pV, int nV
+){
+  FiBuffer *p = &db->fibuf;
+  BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
+  int nByte = 8 + nK + MAX(nV, 0);
+  int rc = SQLITE4_OK;
+  u32 aPrev[FIBUF_MAX_HEIGHT];    /* Predecessors of new node at each level */
+  u32 iNode;                      /* Node for key pK/nK */
+  int bExact;                     /* True if key is already in buffer */
+
+  iNode = fiBufferSearch(p, pK, nK, aPrev, &bExact);
+  if( p->nData+nByte>p->nDataAlloc ){
+    int nNew = MAX(p->nDataAlloc*2, p->nData+nByte);
+    u8 *aNew = (u8*)sqlite4_realloc(db->pEnv, p->aData, nNew);
+    if( aNew==0 ) return btErrorBkpt(SQLITE4_NOMEM);
+    p->aData = aNew;
+    p->nDataAlloc = nNew;
+  }
+
+  if( bExact==0 ){
+    int nHeight = fiBufferRandomHeight(p);
+    int nReq = FIBUF_NODE_HDR + nHeight;
+    int i;
+
+    if( p->nNode==0 ) nReq += FIBUF_NODE_HDR + FIBUF_MAX_HEIGHT;
+    if( p->nNode+nReq>p->nNodeAlloc ){
+      int nNew = MAX(p->nNodeAlloc*2, MAX(p->nNode+nReq, 256));
+      u32 *aNew = (u32*)sqlite4_realloc(db->pEnv, p->aNode, nNew*sizeof(u32));
+      if( aNew==0 ) return btErrorBkpt(SQLITE4_NOMEM);
+      p->aNode = aNew;
+      p->nNodeAlloc = nNew;
+    }
+    if( p->nNode==0 ){
+      p->nNode = FIBUF_NODE_HDR + FIBUF_MAX_HEIGHT;
+      memset(p->aNode, 0, p->nNode*sizeof(u32));
+      fiNodeHeight(p, 0) = FIBUF_MAX_HEIGHT;
+    }
+
+    iNode = (u32)p->nNode;
+    p->nNode += FIBUF_NODE_HDR + nHeight;
+    fiNodeHeight(p, iNode) = (u32)nHeight;
+    for(i=p->nHeight; i<nHeight; i++) aPrev[i] = 0;
+    if( nHeight>p->nHeight ) p->nHeight = nHeight;
+    for(i=0; i<nHeight; i++){
+      fiNodeNext(p, iNode, i) = fiNodeNext(p, aPrev[i], i);
+      fiNodeNext(p, aPrev[i], i) = iNode;
+    }
+    fiNodePrev(p, iNode) = aPrev[0];
+    fiNodePrev(p, fiNodeNext(p, iNode, 0)) = iNode;
+  }
+  fiNodeEntry(p, iNode) = (u32)p->nData;
+  btPutU32(&p->aData[p->nData], (u32)nK);
+  btPutU32(&p->aData[p->nData+4], (nV<0 ? 0xFFFFFFFF : (u32)nV));
+  memcpy(&p->aData[p->nData+8], pK, nK);
+  if( nV>0 ) memcpy(&p->aData[p->nData+8+nK], pV, nV);
+  p->nData += nByte;
+
+  /* Flush the buffer once it contains roughly enough data to fill three
+  ** quarters of a block. This leaves room for the b+tree cell overhead
+  ** and internal nodes, so that the sub-tree usually fits in a single 
+  ** block.  */
+  if( p->nData>=(pHdr->blksz/4)*3 ){
+    rc = fiBufferFlush(db);
+  }
+  return rc;
+}
+
 /*
 ** Insert a new key/value pair or replace an existing one.
 **
-** This function may modify either the b-tree or fast-insert-tree, depending
-** on whether or not the db->bFastInsertOp flag is set.
+** If the db->bFastInsertOp flag is set, the new entry is added to the 
+** fast-insert buffer. Otherwise, the main b-tree is modified directly.
 */
 int sqlite4BtReplace(bt_db *db, const void *pK, int nK, const void *pV, int nV){
   int rc = SQLITE4_OK;
@@ -5071,27 +6207,22 @@ int sqlite4BtReplace(bt_db *db, const void *pK, int nK, const void *pV, int nV){
   /* Debugging output. */
   sqlite4BtDebugKV((BtLock*)db->pPager, "replace", (u8*)pK, nK, (u8*)pV, nV);
 
+  if( db->bFastInsertOp ){
+    db->bFastInsertOp = 0;
+    return fiBufferAppend(db, pK, nK, pV, nV);
+  }
+
   /* Save the position of any open cursors */
   rc = btSaveAllCursor(db, 0);
   assert( rc!=SQLITE4_NOTFOUND && rc!=SQLITE4_INEXACT );
   btCheckPageRefs(db);
 
-  /* Call btReplaceEntry() to update either the main b-tree or the top-level
-  ** sub-tree. Pass iRoot=0 to update the sub-tree, or the root page number
-  ** of the b-tree to update the b-tree.  */
   if( rc==SQLITE4_OK ){
-    u32 iRoot = 0;
-    if( !db->bFastInsertOp ){
-      BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
-      iRoot = pHdr->iRoot;
-    }
-    if( rc==SQLITE4_OK ){
-      rc = btReplaceEntry(db, iRoot, pK, nK, pV, nV);
-    }
+    BtDbHdr *pHdr = sqlite4BtPagerDbhdr(db->pPager);
+    rc = btReplaceEntry(db, pHdr->iRoot, pK, nK, pV, nV);
   }
 
   btCheckPageRefs(db);
-  db->bFastInsertOp = 0;
   return rc;
 }
 
@@ -5162,19 +6293,20 @@ int sqlite4BtDelete(bt_cursor *pBase){
     btCsrReleaseAll(pCsr);
   }else{
     FiCursor *pCsr = (FiCursor*)pBase;
-    BtCursor *pSub = &pCsr->aSub[pCsr->iBt].csr;
-
-    void *pKey;
+    const void *pKey;
     int nKey;
 
-    rc = btCsrBuffer(pSub, 0);
-    pKey = pSub->ovfl.buf.p;
-    nKey = pSub->ovfl.nKey;
+    /* Copy the key before writing the delete marker, as the key may be 
+    ** stored in the fast-insert buffer itself.  */
+    rc = sqlite4BtCsrKey(pBase, &pKey, &nKey);
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4_buffer_set(&pCsr->key, pKey, nKey);
+    }
 
     if( rc==SQLITE4_OK ){
       int bFastInsertOp = db->bFastInsertOp;
       db->bFastInsertOp = 1;
-      rc = sqlite4BtReplace(db, pKey, nKey, 0, -1);
+      rc = sqlite4BtReplace(db, pCsr->key.p, pCsr->key.n, 0, -1);
       db->bFastInsertOp = bFastInsertOp;
     }
 
@@ -5276,6 +6408,16 @@ static int btControlInfo(bt_db *db, bt_info *pInfo){
       break;
     }
 
+    case BT_INFO_SUMMARY: {
+      int iCtx;                   /* ControlTransaction() context */
+      rc = btControlTransaction(db, &iCtx);
+      if( rc==SQLITE4_OK ){
+        rc = btSummaryToAscii(db, &pInfo->output);
+        btControlTransactionDone(db, iCtx);
+      }
+      break;
+    }
+
     default: {
       rc = SQLITE4_ERROR;
       break;
@@ -5313,10 +6455,64 @@ int sqlite4BtControl(bt_db *db, int op, void *pArg){
 
     case BT_CONTROL_AUTOCKPT: {
       int *pInt = (int*)pArg;
+#if BT_THREADS
+      if( db->pMerger ){
+        /* The merge thread checkpoints on behalf of this connection */
+        BtMerger *p = db->pMerger;
+        pthread_mutex_lock(&p->mutex);
+        if( *pInt>=0 ) p->nAutoCkpt = *pInt;
+        *pInt = p->nAutoCkpt;
+        pthread_mutex_unlock(&p->mutex);
+        break;
+      }
+#endif
       sqlite4BtPagerSetAutockpt(db->pPager, pInt);
       break;
     }
 
+    case BT_CONTROL_CKPTSLICE: {
+      int *pInt = (int*)pArg;
+      sqlite4BtPagerSetCkptSlice(db->pPager, pInt);
+      break;
+    }
+
+    case BT_CONTROL_CKPTBATCH: {
+      int *pInt = (int*)pArg;
+      sqlite4BtPagerSetCkptBatch(db->pPager, pInt);
+      break;
+    }
+
+    case BT_CONTROL_CKSUM: {
+      int *pInt = (int*)pArg;
+      sqlite4BtPagerSetCksum(db->pPager, pInt);
+      break;
+    }
+
+    case BT_CONTROL_RECOVER_THREADS: {
+      int *pInt = (int*)pArg;
+      sqlite4BtPagerSetRecoverThreads(db->pPager, pInt);
+      break;
+    }
+
+    case BT_CONTROL_RECOVERCB: {
+      bt_recovercb *p = (bt_recovercb*)pArg;
+      sqlite4BtPagerRecoverCb(db->pPager, p);
+      break;
+    }
+
+    case BT_CONTROL_SHAREDCACHE: {
+      int *pInt = (int*)pArg;
+      sqlite4BtLockCacheConfig((BtLock*)db->pPager, pInt);
+      break;
+    }
+
+    case BT_CONTROL_SHAREDCACHE_STATS: {
+      bt_cachestats *p = (bt_cachestats*)pArg;
+      p->nHit = ((BtLock*)db->pPager)->nCacheHit;
+      p->nMiss = ((BtLock*)db->pPager)->nCacheMiss;
+      break;
+    }
+
     case BT_CONTROL_LOGSIZE: {
       int *pInt = (int*)pArg;
       sqlite4BtPagerLogsize(db->pPager, pInt);
@@ -5346,6 +6542,29 @@ int sqlite4BtControl(bt_db *db, int op, void *pArg){
       break;
     }
 
+    case BT_CONTROL_MERGE_THREAD: {
+      int *pInt = (int*)pArg;
+      if( BT_THREADS && (*pInt==0 || *pInt==1) ){
+        if( sqlite4BtPagerFilename(db->pPager, BT_PAGERFILE_DATABASE) ){
+          if( *pInt && db->pMerger==0 ){
+            rc = btMergerStart(db);
+          }else if( *pInt==0 ){
+            btMergerStop(db);
+          }
+        }
+        if( rc==SQLITE4_OK ) db->bMergeThread = *pInt;
+      }
+      *pInt = db->bMergeThread;
+      break;
+    }
+
+    case BT_CONTROL_MERGE_BACKLOG: {
+      int *pInt = (int*)pArg;
+      if( *pInt>=0 ) db->nMaxBacklog = *pInt;
+      *pInt = db->nMaxBacklog;
+      break;
+    }
+
     case BT_CONTROL_BLKSZ: {
       int *pInt = (int*)pArg;
       ((BtLock*)db->pPager)->nBlksz = *pInt;
@@ -5438,7 +6657,7 @@ static void assert_pages_used(
           int i;
           btCsrData(&csr, 0, 4, (const void**)&aVal, &nVal);
           iSubRoot = btGetU32(aVal);
-          iBlk = (iSubRoot / nPgPerBlk) + 1;
+          iBlk = ((iSubRoot-1) / nPgPerBlk) + 1;
           assert_pages_used(db, iSubRoot, &aKey[8], nKey-8, &rc);
           markBlockAsUsed(db, iBlk, aUsed);
         }
@@ -25,6 +25,17 @@
 
 #define BT_DEFAULT_MULTIPROC 1
 
+/* By default checkpoints write up to 32 consecutive pages at a time */
+#define BT_DEFAULT_CKPTBATCH 32
+
+/* Larger BT_CONTROL_CKPTBATCH values are clamped to this many pages */
+#define BT_MAX_CKPTBATCH 1024
+
+#define BT_DEFAULT_CKSUM BT_CKSUM_FLETCHER
+
+/* By default log recovery verifies checksums in the calling thread only */
+#define BT_DEFAULT_RECOVER_THREADS 1
+
 typedef struct BtPageHash BtPageHash;
 
 typedef struct BtSavepoint BtSavepoint;
@@ -66,6 +77,11 @@ struct BtSavepage {
 /*
 ** See macro btPageData() in bt_main.c for why the aData variable must be
 ** first in this structure.
+**
+** If pCache is not NULL, then the page data is mapped directly from an 
+** entry in the shared page cache, and aData points to the entry's buffer.
+** It may not be modified until sqlite4BtPageWrite() has been called to
+** copy it into a private buffer (see btPagePrivate()).
 */
 struct BtPage {
   u8 *aData;                      /* Pointer to current data. MUST BE FIRST */
@@ -78,6 +94,7 @@ struct BtPage {
   BtPage *pNextLru;               /* Next page in LRU list */
   BtPage *pPrevLru;               /* Previous page in LRU list */
   BtSavepage *pSavepage;          /* List of saved page images */
+  BtCachePage *pCache;            /* Shared cache entry aData belongs to */
 };
 
 /*
@@ -110,6 +127,7 @@ struct BtPager {
   int bDirtyHdr;                  /* True if pHdr has been modified */
   void *pLogsizeCtx;              /* A copy of this is passed to xLogsize() */
   void (*xLogsize)(void*, int);   /* Log-size Callback function */
+  u8 *aSpare;                     /* Spare page buffer, or NULL */
 };
 
 
@@ -269,6 +287,9 @@ int sqlite4BtPagerNew(sqlite4_env *pEnv, int nExtra, BtPager **pp){
   p->btl.pVfs = sqlite4BtEnvDefault();
   p->btl.iSafetyLevel = BT_DEFAULT_SAFETY;
   p->btl.nAutoCkpt = BT_DEFAULT_AUTOCKPT;
+  p->btl.nCkptBatch = BT_DEFAULT_CKPTBATCH;
+  p->btl.iCksumAlg = BT_DEFAULT_CKSUM;
+  p->btl.nRecoverThread = BT_DEFAULT_RECOVER_THREADS;
   p->btl.bRequestMultiProc = BT_DEFAULT_MULTIPROC;
   p->btl.nBlksz = BT_DEFAULT_BLKSZ;
   p->btl.nPgsz = BT_DEFAULT_PGSZ;
@@ -279,11 +300,42 @@ int sqlite4BtPagerNew(sqlite4_env *pEnv, int nExtra, BtPager **pp){
 
 static void btFreePage(BtPager *p, BtPage *pPg){
   if( pPg ){
-    sqlite4_free(p->btl.pEnv, pPg->aData);
+    if( pPg->pCache ){
+      sqlite4BtLockCacheRelease(&p->btl, pPg->pCache);
+    }else{
+      sqlite4_free(p->btl.pEnv, pPg->aData);
+    }
     sqlite4_free(p->btl.pEnv, pPg);
   }
 }
 
+/*
+** Ensure that page pPg has a private buffer that may be modified. If the 
+** page is currently mapped from the shared page cache, release the cache
+** entry, copying its contents into the new buffer first if bCopy is true.
+** A page that has not yet been loaded is also given a buffer.
+**
+** Return SQLITE4_OK if successful, or SQLITE4_NOMEM if an OOM occurs.
+*/
+static int btPagePrivate(BtPager *p, BtPage *pPg, int bCopy){
+  if( pPg->pCache || pPg->aData==0 ){
+    u8 *aData = p->aSpare;
+    if( aData ){
+      p->aSpare = 0;
+    }else{
+      aData = (u8*)sqlite4_malloc(p->btl.pEnv, p->pHdr->pgsz);
+      if( aData==0 ) return btErrorBkpt(SQLITE4_NOMEM);
+    }
+    if( pPg->pCache ){
+      if( bCopy ) memcpy(aData, pPg->aData, p->pHdr->pgsz);
+      sqlite4BtLockCacheRelease(&p->btl, pPg->pCache);
+      pPg->pCache = 0;
+    }
+    pPg->aData = aData;
+  }
+  return SQLITE4_OK;
+}
+
 static void btPurgeCache(BtPager *p){
   int i;
   assert( p->iTransactionLevel==0 );
@@ -306,7 +358,7 @@ static void btPurgeCache(BtPager *p){
 static int btCheckpoint(BtLock *pLock){
   BtPager *p = (BtPager*)pLock;
   if( p->pLog==0 ) return SQLITE4_BUSY;
-  return sqlite4BtLogCheckpoint(p->pLog, 0);
+  return sqlite4BtLogCheckpoint(p->pLog, 0, 0, 0);
 }
 
 static int btCleanup(BtLock *pLock){
@@ -448,6 +500,7 @@ static int btCloseSavepoints(
 
         /* If bRollback is set, restore the page data */
         if( bRollback ){
+          assert( pPg->pCache==0 );
           memcpy(pPg->aData, pSavepg->aData, p->pHdr->pgsz);
         }else{
           int iNextSaved = (
@@ -499,6 +552,7 @@ int sqlite4BtPagerClose(BtPager *p){
   btCloseSavepoints(p, 0, 0);
   btPurgeCache(p);
   sqlite4BtLogClose(p->pLog, 0);
+  sqlite4_free(p->btl.pEnv, p->aSpare);
   sqlite4_free(p->btl.pEnv, p->zFile);
   sqlite4_free(p->btl.pEnv, p->aSavepoint);
   sqlite4_free(p->btl.pEnv, p);
@@ -557,23 +611,74 @@ int sqlite4BtPagerOpen(BtPager *p, const char *zFilename){
   return rc;
 }
 
+static int btLoadPageData(BtPager *p, BtPage *pPg);
+
+/*
+** Discard the contents of the page cache, as it was populated using a 
+** snapshot other than the current one. Any pages that are still 
+** referenced are reloaded from the current snapshot.
+*/
+static int btInvalidateCache(BtPager *p){
+  int rc = SQLITE4_OK;
+  BtPage *pPg;
+  BtPage *pNext;
+  int i;
+
+  assert( p->pDirty==0 );
+
+  /* All unreferenced pages are on the LRU list. Free them. */
+  for(pPg=p->pLru; pPg; pPg=pNext){
+    pNext = pPg->pNextLru;
+    btHashRemove(p, pPg);
+    btFreePage(p, pPg);
+  }
+  p->pLru = 0;
+  p->pLruTail = 0;
+
+  /* Reload the data for any pages that remain. */
+  for(i=0; rc==SQLITE4_OK && i<p->hash.nHash; i++){
+    for(pPg=p->hash.aHash[i]; rc==SQLITE4_OK && pPg; pPg=pPg->pNextHash){
+      if( pPg->pgno<=p->pHdr->nPg ){
+        rc = btLoadPageData(p, pPg);
+      }else{
+        rc = btPagePrivate(p, pPg, 0);
+        if( rc==SQLITE4_OK ) memset(pPg->aData, 0, p->pHdr->pgsz);
+      }
+    }
+  }
+
+  return rc;
+}
+
 /*
 ** Open a read-transaction.
 */
 static int btOpenReadTransaction(BtPager *p){
   int rc;
+  int bChange = 0;                /* True if db modified by another conn. */
+  int bCkpt = 0;                  /* True if log checkpointed since */
 
   assert( p->iTransactionLevel==0 );
   assert( p->btl.pFd );
   assert( p->pHdr==0 );
 
-  rc = sqlite4BtLogSnapshotOpen(p->pLog);
+  rc = sqlite4BtLogSnapshotOpen(p->pLog, &bChange, &bCkpt);
 
   if( rc==SQLITE4_OK ){
     /* If the read transaction was successfully opened, the transaction 
     ** level is now 1.  */
     p->iTransactionLevel = 1;
     p->pHdr = sqlite4BtLogDbhdr(p->pLog);
+
+    /* If some other connection has written to the database since the 
+    ** cache was populated, it may contain out-of-date pages. The same is
+    ** true if the log has been checkpointed and the database has a
+    ** schedule page, as the checkpointer may have run a merge. Merges
+    ** update the schedule page and write their output directly to the 
+    ** database file, bypassing the log.  */
+    if( bChange || (bCkpt && p->pHdr->iSRoot) ){
+      rc = btInvalidateCache(p);
+    }
   }
   return rc;
 }
@@ -600,7 +705,9 @@ static int btCloseReadTransaction(BtPager *p){
   //btPurgeCache(p);
 
   if( rc==SQLITE4_OK && p->bDoAutoCkpt ){
-    sqlite4BtLogCheckpoint(p->pLog, (p->btl.nAutoCkpt / 2));
+    sqlite4BtLogCheckpoint(
+        p->pLog, (p->btl.nAutoCkpt / 2), p->btl.nCkptSlice, 0
+    );
   }
   p->bDoAutoCkpt = 0;
 
@@ -655,17 +762,47 @@ static int btCommitTransaction(BtPager *p){
 
 static int btLoadPageData(BtPager *p, BtPage *pPg){
   int rc;                         /* Return code */
+  BtCachePage *pCache = 0;        /* Shared cache entry to map, if any */
+
+  /* Make sure there is a private buffer to read data into. If the page
+  ** is currently mapped from the shared cache, the mapping is released. */
+  rc = btPagePrivate(p, pPg, 0);
 
   /* Try to load data from the logging module. If SQLITE4_OK is returned,
   ** data was loaded successfully. If SQLITE4_NOTFOUND, the required page
   ** is not present in the log and should be loaded from the database
   ** file. Any other error code is returned to the caller.  */
-  rc = sqlite4BtLogRead(p->pLog, pPg->pgno, pPg->aData);
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4BtLogRead(p->pLog, pPg->pgno, pPg->aData, &pCache);
+  }
 
-  /* If necessary, load data from the database file. */
+  /* If necessary, load data from the shared page cache or the database 
+  ** file.  */
   if( rc==SQLITE4_NOTFOUND ){
-    i64 iOff = (i64)p->pHdr->pgsz * (i64)(pPg->pgno-1);
-    rc = p->btl.pVfs->xRead(p->btl.pFd, iOff, pPg->aData, p->pHdr->pgsz);
+    const int pgsz = p->pHdr->pgsz;
+    const u32 pgno = pPg->pgno;
+    u32 iGen = 0;
+    rc = sqlite4BtLockCacheFetch(&p->btl, pgno, 0, pgsz, &pCache, &iGen);
+    if( rc==SQLITE4_NOTFOUND ){
+      i64 iOff = (i64)pgsz * (i64)(pgno-1);
+      rc = p->btl.pVfs->xRead(p->btl.pFd, iOff, pPg->aData, pgsz);
+      if( rc==SQLITE4_OK ){
+        sqlite4BtLockCacheInsert(&p->btl, pgno, 0, iGen, pPg->aData, pgsz);
+      }
+    }
+  }
+
+  /* If the page was found in the shared cache, map the entry instead of
+  ** copying it. The private buffer is kept for the next page loaded.  */
+  if( pCache ){
+    assert( rc==SQLITE4_OK );
+    if( p->aSpare==0 ){
+      p->aSpare = pPg->aData;
+    }else{
+      sqlite4_free(p->btl.pEnv, pPg->aData);
+    }
+    pPg->pCache = pCache;
+    pPg->aData = sqlite4BtLockCacheData(pCache);
   }
 
   return rc;
@@ -700,18 +837,14 @@ static int btAllocatePage(BtPager *p, BtPage **ppPg){
     pRet->pNextDirty = 0;
     pRet->pNextLru = 0;
   }else{
-    u8 *aData = (u8*)sqlite4_malloc(p->btl.pEnv, p->pHdr->pgsz);
+    /* The page buffer is allocated when the page is loaded (see
+    ** btPagePrivate()), as it may be mapped from the shared cache.  */
     pRet = (BtPage*)sqlite4_malloc(p->btl.pEnv, sizeof(BtPage));
-
-    if( pRet && aData ){
+    if( pRet ){
       memset(pRet, 0, sizeof(BtPage));
-      pRet->aData = aData;
       pRet->pPager = p;
     }else{
-      sqlite4_free(p->btl.pEnv, pRet);
-      sqlite4_free(p->btl.pEnv, aData);
       rc = btErrorBkpt(SQLITE4_NOMEM);
-      pRet = 0;
     }
   }
 
@@ -810,6 +943,7 @@ int sqlite4BtPagerCommit(BtPager *p, int iLevel){
 int sqlite4BtPagerRawWrite(BtPager *p, u32 pgno, u8 *aBuf){
   int pgsz = p->pHdr->pgsz;
   i64 iOff = (i64)pgsz * (i64)(pgno-1);
+  sqlite4BtLockCacheDiscard(&p->btl, pgno, 0);
   return p->btl.pVfs->xWrite(p->btl.pFd, iOff, aBuf, pgsz);
 }
 
@@ -887,6 +1021,17 @@ void sqlite4BtPagerSetDbhdr(BtPager *p, BtDbHdr *pHdr){
   p->pHdr = pHdr;
 }
 
+/*
+** This is called by a checkpointer, after sqlite4BtPagerSetDbhdr(), 
+** before it reads pages to run a merge. The page cache may have been
+** populated using an older snapshot than the one being checkpointed, so
+** discard its contents.
+*/
+int sqlite4BtPagerInvalidate(BtPager *p){
+  assert( p->iTransactionLevel==0 && p->pHdr );
+  return btInvalidateCache(p);
+}
+
 /*
 ** Request a reference to page pgno of the database.
 */
@@ -910,7 +1055,8 @@ int sqlite4BtPageGet(BtPager *p, u32 pgno, BtPage **ppPg){
         rc = btLoadPageData(p, pRet);
       }else{
         assert( p->iTransactionLevel>=2 );
-        memset(pRet->aData, 0, p->pHdr->pgsz);
+        rc = btPagePrivate(p, pRet, 0);
+        if( rc==SQLITE4_OK ) memset(pRet->aData, 0, p->pHdr->pgsz);
       }
 
       if( rc==SQLITE4_OK ){
@@ -938,9 +1084,14 @@ int sqlite4BtPageGet(BtPager *p, u32 pgno, BtPage **ppPg){
 }
 
 int sqlite4BtPageWrite(BtPage *pPg){
-  int rc = SQLITE4_OK;
+  int rc;
   BtPager *p = pPg->pPager;
 
+  /* If the page is mapped from the shared cache, copy it into a private
+  ** buffer before it is modified.  */
+  rc = btPagePrivate(p, pPg, 1);
+  if( rc!=SQLITE4_OK ) return rc;
+
   /* If there are savepoints open, add this page to the innermost savepoint */
   if( p->nSavepoint>0 ){
     rc = btAddToSavepoint(p, pPg);
@@ -1260,6 +1411,38 @@ void sqlite4BtPagerSetAutockpt(BtPager *pPager, int *piVal){
   *piVal = pPager->btl.nAutoCkpt;
 }
 
+void sqlite4BtPagerSetCkptSlice(BtPager *pPager, int *piVal){
+  int iVal = *piVal;
+  if( iVal>=0 ){
+    pPager->btl.nCkptSlice = iVal;
+  }
+  *piVal = pPager->btl.nCkptSlice;
+}
+
+void sqlite4BtPagerSetCkptBatch(BtPager *pPager, int *piVal){
+  int iVal = *piVal;
+  if( iVal>0 ){
+    pPager->btl.nCkptBatch = MIN(iVal, BT_MAX_CKPTBATCH);
+  }
+  *piVal = pPager->btl.nCkptBatch;
+}
+
+void sqlite4BtPagerSetCksum(BtPager *pPager, int *piVal){
+  int iVal = *piVal;
+  if( iVal==BT_CKSUM_FLETCHER || iVal==BT_CKSUM_CRC32C ){
+    pPager->btl.iCksumAlg = iVal;
+  }
+  *piVal = pPager->btl.iCksumAlg;
+}
+
+void sqlite4BtPagerSetRecoverThreads(BtPager *pPager, int *piVal){
+  int iVal = *piVal;
+  if( iVal>0 ){
+    pPager->btl.nRecoverThread = iVal;
+  }
+  *piVal = pPager->btl.nRecoverThread;
+}
+
 void sqlite4BtPagerLogsize(BtPager *pPager, int *pnFrame){
   *pnFrame = sqlite4BtLogSize(pPager->pLog);
 }
@@ -1276,9 +1459,16 @@ void sqlite4BtPagerLogsizeCb(BtPager *pPager, bt_logsizecb *p){
   pPager->pLogsizeCtx = p->pCtx;
 }
 
+void sqlite4BtPagerRecoverCb(BtPager *pPager, bt_recovercb *p){
+  pPager->btl.xRecover = p->xRecover;
+  pPager->btl.pRecoverCtx = p->pCtx;
+}
+
 int sqlite4BtPagerCheckpoint(BtPager *pPager, bt_checkpoint *pCkpt){
   int rc;
-  rc = sqlite4BtLogCheckpoint(pPager->pLog, pCkpt->nFrameBuffer);
+  rc = sqlite4BtLogCheckpoint(pPager->pLog, 
+      pCkpt->nFrameBuffer, pCkpt->nFrameMax, &pCkpt->nCkpt
+  );
   return rc;
 }
 
@@ -68,6 +68,29 @@ static char *btPosixShmFile(BtPosixFile *p){
   return zShm;
 }
 
+/*
+** Open an anonymous temporary file in the directory named by the TMPDIR
+** environment variable (or /tmp). The file is unlinked as soon as it
+** has been created, so that it is removed when the file descriptor is
+** closed, even if the process crashes. Return the file descriptor, or
+** -1 if an error occurs.
+*/
+static int btPosixOsOpenTemp(sqlite4_env *pSqlEnv){
+  const char *zDir;
+  char *zPath;
+  int fd = -1;
+
+  zDir = getenv("TMPDIR");
+  if( zDir==0 || zDir[0]=='\0' ) zDir = "/tmp";
+  zPath = sqlite4_mprintf(pSqlEnv, "%s/sqlite4_tmp_XXXXXX", zDir);
+  if( zPath ){
+    fd = mkstemp(zPath);
+    if( fd>=0 ) unlink(zPath);
+    sqlite4_free(pSqlEnv, zPath);
+  }
+  return fd;
+}
+
 static int btPosixOsOpen(
   sqlite4_env *pSqlEnv,
   bt_env *pEnv,
@@ -88,7 +111,11 @@ static int btPosixOsOpen(
     p->zName = zFile;
     p->pEnv = pEnv;
     p->pSqlEnv = pSqlEnv;
-    p->fd = open(zFile, oflags, 0644);
+    if( flags & BT_OPEN_TEMP ){
+      p->fd = btPosixOsOpenTemp(pSqlEnv);
+    }else{
+      p->fd = open(zFile, oflags, 0644);
+    }
     if( p->fd<0 ){
       sqlite4_free(pSqlEnv, p);
       p = 0;
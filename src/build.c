@@ -3272,7 +3272,7 @@ SrcList *sqlite4SrcListAppend(
   SrcListItem *pItem;
   assert( pDatabase==0 || pTable!=0 );  /* Cannot have C without B */
   if( pList==0 ){
-    pList = sqlite4DbMallocZero(db, sizeof(SrcList) );
+    pList = sqlite4DbMallocNode(db, sizeof(SrcList) );
     if( pList==0 ) return 0;
     pList->nAlloc = 1;
   }
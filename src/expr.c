@@ -360,7 +360,7 @@ int sqlite4SelectExprHeight(Select *p){
 **
 ** Construct a new expression node and return a pointer to it.  Memory
 ** for this node and for the pToken argument is a single allocation
-** obtained from sqlite4DbMalloc().  The calling function
+** obtained from sqlite4DbMallocNode().  The calling function
 ** is responsible for making sure the node eventually gets freed.
 **
 ** If dequote is true, then the token (if it exists) is dequoted.
@@ -391,7 +391,7 @@ Expr *sqlite4ExprAlloc(
       assert( iValue>=0 );
     }
   }
-  pNew = sqlite4DbMallocZero(db, sizeof(Expr)+nExtra);
+  pNew = sqlite4DbMallocNode(db, sizeof(Expr)+nExtra);
   if( pNew ){
     pNew->op = (u8)op;
     pNew->iAgg = -1;
@@ -986,7 +986,7 @@ ExprList *sqlite4ExprListAppend(
 ){
   sqlite4 *db = pParse->db;
   if( pList==0 ){
-    pList = sqlite4DbMallocZero(db, sizeof(ExprList) );
+    pList = sqlite4DbMallocNode(db, sizeof(ExprList) );
     if( pList==0 ){
       goto no_mem;
     }
@@ -995,7 +995,11 @@ ExprList *sqlite4ExprListAppend(
   if( pList->nAlloc<=pList->nExpr ){
     ExprListItem *a;
     int n = pList->nAlloc*2 + 4;
-    a = sqlite4DbRealloc(db, pList->a, n*sizeof(pList->a[0]));
+    if( pList->a==0 ){
+      a = sqlite4DbMallocNode(db, n*sizeof(pList->a[0]));
+    }else{
+      a = sqlite4DbRealloc(db, pList->a, n*sizeof(pList->a[0]));
+    }
     if( a==0 ){
       goto no_mem;
     }
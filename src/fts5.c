@@ -2831,12 +2831,13 @@ int sqlite4_mi_column_value(
         }
 
         if( rc==SQLITE4_OK ){
-          int i;
           RowDecoder *pCodec;   /* The decoder object */
 
           rc = sqlite4VdbeDecoderCreate(db,0, pCsr->pCsr, pInfo->nCol, &pCodec);
-          for(i=0; rc==SQLITE4_OK && i<pInfo->nCol; i++){
-            rc = sqlite4VdbeDecoderGetColumn(pCodec, i, 0, &pCsr->aMem[i]);
+          if( rc==SQLITE4_OK ){
+            rc = sqlite4VdbeDecoderGetColumns(
+                pCodec, 0, pInfo->nCol-1, pCsr->aMem
+            );
           }
           sqlite4VdbeDecoderDestroy(pCodec);
         }
@@ -17,6 +17,39 @@
 */
 #include "sqliteInt.h"
 
+/*
+** The maximum number of entries, and the size of the buffer used to hold
+** their keys and values, that may be read ahead by a single call to the
+** xNextBatch method of a storage engine.
+*/
+#define KVBATCH_NENTRY 64
+#define KVBATCH_NBUF   16384
+
+/*
+** Read-ahead does not begin until a cursor has been advanced this many
+** times in a row. This avoids copying entries that are never used by short
+** scans, for example those that end after the first row because of a LIMIT.
+*/
+#define KVBATCH_MINSEQ 4
+
+/*
+** The read-ahead buffer of a cursor. See sqlite4KVCursorBatch().
+**
+** If iEntry<nEntry, the cursor is positioned on the copy in aEntry[iEntry]
+** and the storage engine cursor on the entry that follows the last copy
+** (or at EOF, if rcLive is SQLITE4_NOTFOUND). Otherwise, the cursor is
+** positioned wherever the storage engine cursor is.
+*/
+struct sqlite4_kvbatch {
+  int nSeq;                       /* xNext calls since seek (max NENTRY) */
+  int nEntry;                     /* Number of copies in aEntry[] */
+  int iEntry;                     /* Current copy, or nEntry */
+  int rcLive;                     /* Value returned by xNextBatch */
+  unsigned nWrite;                /* KVStore.nWrite when aEntry[] filled */
+  KVEntry *aEntry;                /* Array of KVBATCH_NENTRY copies */
+  KVByteArray *aBuf;              /* Buffer of KVBATCH_NBUF bytes */
+};
+
 /*
 ** Names of error codes used for tracing.
 */
@@ -136,6 +169,172 @@ static void binToHex(char *zOut, int mxOut, const KVByteArray *a, KVSize n){
   zOut[i*2] = 0;
 }
 
+/*
+** The sqlite4_kvstore.nWrite and sqlite4_kvcursor.pBatch fields were added
+** in version 2 of the storage engine method table. Objects that belong to
+** an engine with an older method table do not have them, so they must not
+** be accessed. The following two routines are used to check this.
+**
+** Return the read-ahead buffer of cursor p, or NULL if it has none.
+*/
+static KVBatch *kvCursorBatch(KVCursor *p){
+  return (p->pStoreVfunc->iVersion>=2 ? p->pBatch : 0);
+}
+
+/*
+** Record that the content of storage object p may have changed.
+*/
+static void kvStoreWrite(KVStore *p){
+  if( p->pStoreVfunc->iVersion>=2 ) p->nWrite++;
+}
+
+/*
+** Discard the copies in the read-ahead buffer of cursor p, if any. If 
+** bSeek is true, the read-ahead sequence is also restarted.
+*/
+static void kvBatchClear(KVCursor *p, int bSeek){
+  KVBatch *pBatch = kvCursorBatch(p);
+  if( pBatch ){
+    pBatch->nEntry = pBatch->iEntry = 0;
+    if( bSeek ) pBatch->nSeq = 0;
+  }
+}
+
+/*
+** Return true if cursor p is positioned on a copy in its read-ahead buffer.
+*/
+static int kvBatchOnCopy(KVCursor *p){
+  KVBatch *pBatch = kvCursorBatch(p);
+  return (pBatch && pBatch->iEntry<pBatch->nEntry);
+}
+
+/*
+** Cursor p is positioned on a copy in its read-ahead buffer. Seek the 
+** storage engine cursor to the key of the copy, using direction dir, and
+** discard the copies.
+*/
+static int kvBatchSeekCopy(KVCursor *p, int dir){
+  KVBatch *pBatch = p->pBatch;
+  KVEntry *pEntry = &pBatch->aEntry[pBatch->iEntry];
+  kvBatchClear(p, 0);
+  return p->pStoreVfunc->xSeek(p, pEntry->pKey, pEntry->nKey, dir);
+}
+
+/*
+** Advance cursor p, which has a read-ahead buffer.
+*/
+static int kvBatchNext(KVCursor *p){
+  KVBatch *pBatch = p->pBatch;
+  int rc;
+
+  if( pBatch->nSeq<KVBATCH_NENTRY ) pBatch->nSeq++;
+  if( pBatch->iEntry<pBatch->nEntry ){
+    if( pBatch->nWrite!=p->pStore->nWrite ){
+      /* The database has been written since the copies were made. Move
+      ** the storage engine cursor to the entry that now follows the current
+      ** copy instead of using the copies that follow it.  */
+      rc = kvBatchSeekCopy(p, +1);
+      if( rc==SQLITE4_OK ){
+        rc = p->pStoreVfunc->xNext(p);
+      }else if( rc==SQLITE4_INEXACT ){
+        rc = SQLITE4_OK;
+      }
+    }else{
+      pBatch->iEntry++;
+      if( pBatch->iEntry<pBatch->nEntry ){
+        rc = SQLITE4_OK;
+      }else{
+        rc = pBatch->rcLive;
+        kvBatchClear(p, 0);
+      }
+    }
+    return rc;
+  }
+
+  if( pBatch->nSeq>=KVBATCH_MINSEQ && pBatch->aEntry==0 ){
+    KVEntry *aEntry = (KVEntry*)sqlite4_malloc(p->pStore->pEnv,
+        KVBATCH_NENTRY*sizeof(KVEntry) + KVBATCH_NBUF
+    );
+    if( aEntry ){
+      pBatch->aEntry = aEntry;
+      pBatch->aBuf = (KVByteArray*)&aEntry[KVBATCH_NENTRY];
+    }
+  }
+  if( pBatch->nSeq<KVBATCH_MINSEQ || pBatch->aEntry==0 ){
+    return p->pStoreVfunc->xNext(p);
+  }
+
+  rc = p->pStoreVfunc->xNextBatch(p, pBatch->nSeq,
+      pBatch->aEntry, pBatch->aBuf, KVBATCH_NBUF, &pBatch->nEntry
+  );
+  kvTrace(p->pStore, "xNextBatch(%d) -> %s,%d", 
+          p->curId, kvErrName(rc), pBatch->nEntry);
+  if( rc==SQLITE4_OK || rc==SQLITE4_NOTFOUND ){
+    if( pBatch->nEntry>0 ){
+      pBatch->rcLive = rc;
+      pBatch->nWrite = p->pStore->nWrite;
+      rc = SQLITE4_OK;
+    }
+  }else{
+    pBatch->nEntry = 0;
+  }
+  return rc;
+}
+
+/*
+** Enable read-ahead on cursor p. Once a scan has advanced the cursor 
+** several times in a row, the entries that follow are copied in batches
+** using the xNextBatch method of the storage engine. Most subsequent
+** calls to sqlite4KVCursorNext(), Key() and Data() are then served from
+** the copies without calling into the storage engine at all.
+**
+** If the database is written while the cursor is positioned on a copy,
+** the remaining copies are discarded and the next call to
+** sqlite4KVCursorNext() seeks the storage engine cursor past the current
+** key. This is a no-op if the storage engine does not implement 
+** xNextBatch or if a malloc fails.
+*/
+void sqlite4KVCursorBatch(KVCursor *p){
+  const KVStoreMethods *pMethods = p->pStoreVfunc;
+  if( pMethods->iVersion>=2 && pMethods->xNextBatch && p->pBatch==0 ){
+    KVBatch *pBatch;
+    pBatch = (KVBatch*)sqlite4_malloc(p->pStore->pEnv, sizeof(KVBatch));
+    if( pBatch ){
+      memset(pBatch, 0, sizeof(KVBatch));
+      p->pBatch = pBatch;
+    }
+  }
+}
+
+/*
+** This routine is used by the xNextBatch methods of the built-in storage
+** engines. Copy the key and value of an entry into buffer aBuf[] at offset
+** *piBuf, set *pEntry to point to the copies and advance *piBuf past them.
+**
+** Return 1 if successful, or 0 if the entry does not fit in the remaining
+** space or is larger than nBuf/8 bytes (see xNextBatch in kv.h). 
+*/
+int sqlite4KVBatchCopy(
+  KVEntry *pEntry,                /* Populate this object */
+  KVByteArray *aBuf,              /* Buffer to copy key and value into */
+  KVSize nBuf,                    /* Size of aBuf[] in bytes */
+  KVSize *piBuf,                  /* IN/OUT: Offset of free space in aBuf[] */
+  const KVByteArray *pKey, KVSize nKey,
+  const KVByteArray *pData, KVSize nData
+){
+  KVSize iBuf = *piBuf;
+  if( nKey+nData>nBuf/8 || iBuf+nKey+nData>nBuf ) return 0;
+  memcpy(&aBuf[iBuf], pKey, nKey);
+  pEntry->pKey = &aBuf[iBuf];
+  pEntry->nKey = nKey;
+  iBuf += nKey;
+  if( nData>0 ) memcpy(&aBuf[iBuf], pData, nData);
+  pEntry->pData = &aBuf[iBuf];
+  pEntry->nData = nData;
+  *piBuf = iBuf + nData;
+  return 1;
+}
+
 /*
 ** The following wrapper functions invoke the underlying methods of
 ** the storage object and add optional tracing.
@@ -152,6 +351,7 @@ int sqlite4KVStoreReplace(
     kvTrace(p, "xReplace(%d,%s,%d,%s,%d)",
            p->kvId, zKey, (int)nKey, zData, (int)nData);
   }
+  kvStoreWrite(p);
   return p->pStoreVfunc->xReplace(p,pKey,nKey,pData,nData);
 }
 int sqlite4KVStoreOpenCursor(KVStore *p, KVCursor **ppKVCursor){
@@ -164,6 +364,7 @@ int sqlite4KVStoreOpenCursor(KVStore *p, KVCursor **ppKVCursor){
     sqlite4_randomness(pCur->pEnv, sizeof(pCur->curId), &pCur->curId);
     pCur->fTrace = p->fTrace;
     pCur->pStore = p;
+    if( pCur->pStoreVfunc->iVersion>=2 ) pCur->pBatch = 0;
   }
   kvTrace(p, "xOpenCursor(%d,%d) -> %s",
           p->kvId, pCur?pCur->curId:-1, kvErrName(rc));
@@ -176,6 +377,7 @@ int sqlite4KVCursorSeek(
 ){
   int rc;
   assert( dir==0 || dir==(+1) || dir==(-1) || dir==(-2) );  
+  kvBatchClear(p, 1);
   rc = p->pStoreVfunc->xSeek(p,pKey,nKey,dir);
   if( p->fTrace ){
     char zKey[52];
@@ -187,31 +389,59 @@ int sqlite4KVCursorSeek(
 }
 int sqlite4KVCursorNext(KVCursor *p){
   int rc;
-  rc = p->pStoreVfunc->xNext(p);
+  if( kvCursorBatch(p) ){
+    rc = kvBatchNext(p);
+  }else{
+    rc = p->pStoreVfunc->xNext(p);
+  }
   kvTrace(p->pStore, "xNext(%d) -> %s", p->curId, kvErrName(rc));
   return rc;
 }
 int sqlite4KVCursorPrev(KVCursor *p){
   int rc;
-  rc = p->pStoreVfunc->xPrev(p);
+  if( kvBatchOnCopy(p) ){
+    rc = kvBatchSeekCopy(p, -1);
+    if( rc==SQLITE4_OK ){
+      rc = p->pStoreVfunc->xPrev(p);
+    }else if( rc==SQLITE4_INEXACT ){
+      rc = SQLITE4_OK;
+    }
+  }else{
+    kvBatchClear(p, 1);
+    rc = p->pStoreVfunc->xPrev(p);
+  }
   kvTrace(p->pStore, "xPrev(%d) -> %s", p->curId, kvErrName(rc));
   return rc;
 }
 int sqlite4KVCursorDelete(KVCursor *p){
-  int rc;
-  rc = p->pStoreVfunc->xDelete(p);
+  int rc = SQLITE4_OK;
+  if( kvBatchOnCopy(p) ){
+    rc = kvBatchSeekCopy(p, 0);
+  }
+  if( rc==SQLITE4_OK ){
+    rc = p->pStoreVfunc->xDelete(p);
+    kvStoreWrite(p->pStore);
+  }
   kvTrace(p->pStore, "xDelete(%d) -> %s", p->curId, kvErrName(rc));
   return rc;
 }
 int sqlite4KVCursorReset(KVCursor *p){
   int rc;
+  kvBatchClear(p, 1);
   rc = p->pStoreVfunc->xReset(p);
   kvTrace(p->pStore, "xReset(%d) -> %s", p->curId, kvErrName(rc));
   return rc;
 }
 int sqlite4KVCursorKey(KVCursor *p, const KVByteArray **ppKey, KVSize *pnKey){
   int rc;
-  rc = p->pStoreVfunc->xKey(p, ppKey, pnKey);
+  if( kvBatchOnCopy(p) ){
+    KVEntry *pEntry = &p->pBatch->aEntry[p->pBatch->iEntry];
+    *ppKey = pEntry->pKey;
+    *pnKey = pEntry->nKey;
+    rc = SQLITE4_OK;
+  }else{
+    rc = p->pStoreVfunc->xKey(p, ppKey, pnKey);
+  }
   if( p->fTrace ){
     if( rc==SQLITE4_OK ){
       char zKey[52];
@@ -231,7 +461,15 @@ int sqlite4KVCursorData(
   KVSize *pnData
 ){
   int rc;
-  rc = p->pStoreVfunc->xData(p, ofst, n, ppData, pnData);
+  if( kvBatchOnCopy(p) ){
+    KVEntry *pEntry = &p->pBatch->aEntry[p->pBatch->iEntry];
+    if( ofst>pEntry->nData ) ofst = pEntry->nData;
+    *ppData = &pEntry->pData[ofst];
+    *pnData = pEntry->nData - ofst;
+    rc = SQLITE4_OK;
+  }else{
+    rc = p->pStoreVfunc->xData(p, ofst, n, ppData, pnData);
+  }
   if( p->fTrace ){
     if( rc==SQLITE4_OK ){
       char zData[52];
@@ -249,8 +487,13 @@ int sqlite4KVCursorClose(KVCursor *p){
   int rc = SQLITE4_OK;
   if( p ){
     KVStore *pStore = p->pStore;
+    KVBatch *pBatch = kvCursorBatch(p);
     int curId = p->curId;
     rc = p->pStoreVfunc->xCloseCursor(p);
+    if( pBatch ){
+      sqlite4_free(pStore->pEnv, pBatch->aEntry);
+      sqlite4_free(pStore->pEnv, pBatch);
+    }
     kvTrace(pStore, "xCloseCursor(%d) -> %s", curId, kvErrName(rc));
   }
   return rc;
@@ -297,6 +540,7 @@ int sqlite4KVStoreRollback(KVStore *p, int iLevel){
   assert( iLevel>=0 );
   assert( iLevel<=p->iTransLevel );
   rc = p->pStoreVfunc->xRollback(p, iLevel);
+  kvStoreWrite(p);
   kvTrace(p, "xRollback(%d,%d) -> %s", p->kvId, iLevel, kvErrName(rc));
   assert( p->iTransLevel==iLevel || rc!=SQLITE4_OK );
   return rc;
@@ -307,6 +551,7 @@ int sqlite4KVStoreRevert(KVStore *p, int iLevel){
   assert( iLevel<=p->iTransLevel );
   if( p->pStoreVfunc->xRevert ){
     rc = p->pStoreVfunc->xRevert(p, iLevel);
+    kvStoreWrite(p);
     kvTrace(p, "xRevert(%d,%d) -> %s", p->kvId, iLevel, kvErrName(rc));
   }else{
     rc = sqlite4KVStoreRollback(p, iLevel-1);
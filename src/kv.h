@@ -111,7 +111,27 @@
 ** every call must be stable until the cursor moves, or is reset or closed.
 ** The cursor owns the values returned by xKey and xData and will take
 ** responsiblity for freeing memory used to hold those values when appropriate.
-** 
+**
+** If the n argument passed to xData is negative, the entire value starting
+** at offset ofst is returned. Otherwise, at least n bytes starting at
+** offset ofst are returned, or all bytes following ofst if there are fewer
+** than n. The implementation may return more than n bytes. A storage
+** engine that stores large values on overflow pages need only read those
+** that contain the requested bytes. The buffer returned by such a call is
+** only guaranteed to remain stable until the next call to xData with a
+** non-negative n on the same cursor, or until the cursor moves.
+**
+** The optional xNextBatch(pCur, nMax, aEntry, aBuf, nBuf, pnEntry) method
+** moves the cursor forward in the same way as a series of up to nMax+1
+** xNext calls. The key and value of each entry visited, except for the
+** last, are copied into aBuf[] and described by an element of aEntry[].
+** *pnEntry is set to the number of entries so copied. xNextBatch stops
+** early at the first entry that does not fit in the unused part of aBuf[]
+** or whose key and value together are larger than nBuf/8 bytes. It returns
+** SQLITE4_OK if the cursor is left pointing at the entry that follows
+** the copies, or SQLITE4_NOTFOUND if it is left at EOF. The copies remain
+** valid until the next call to xNextBatch on the same cursor.
+**
 ** The xDelete method deletes the entry that the cursor is currently
 ** pointing at.  However, subsequent xNext or xPrev calls behave as if the
 ** entries is not actually deleted until the cursor moves.  In other words
@@ -155,6 +175,8 @@
 typedef struct sqlite4_kvstore KVStore;
 typedef struct sqlite4_kv_methods KVStoreMethods;
 typedef struct sqlite4_kvcursor KVCursor;
+typedef struct sqlite4_kventry KVEntry;
+typedef struct sqlite4_kvbatch KVBatch;
 typedef unsigned char KVByteArray;
 typedef sqlite4_kvsize KVSize;
 
@@ -192,6 +214,13 @@ int sqlite4KVCursorData(
   KVSize *pnData
 );
 int sqlite4KVCursorClose(KVCursor *p);
+void sqlite4KVCursorBatch(KVCursor *p);
+int sqlite4KVBatchCopy(
+  KVEntry *pEntry,
+  KVByteArray *aBuf, KVSize nBuf, KVSize *piBuf,
+  const KVByteArray *pKey, KVSize nKey,
+  const KVByteArray *pData, KVSize nData
+);
 int sqlite4KVStoreBegin(KVStore *p, int iLevel);
 int sqlite4KVStoreCommitPhaseOne(KVStore *p, int iLevel);
 int sqlite4KVStoreCommitPhaseTwo(KVStore *p, int iLevel);
@@ -228,6 +228,51 @@ static int btData(
   return sqlite4BtCsrData(pCsr->pCsr, ofst, n, (const void**)paData, (int*)pN);
 }
 
+/*
+** Advance the cursor, copying the entries visited into aBuf[]. See the
+** description of xNextBatch in kv.h.
+*/
+static int btNextBatch(
+  KVCursor *pKVCursor,         /* The cursor to advance */
+  int nMax,                    /* Maximum number of entries to copy */
+  KVEntry *aEntry,             /* Array of nMax entries to populate */
+  KVByteArray *aBuf,           /* Buffer to copy keys and values into */
+  KVSize nBuf,                 /* Size of aBuf[] in bytes */
+  int *pnEntry                 /* OUT: Number of entries copied */
+){
+  KVBtCsr *pCsr = (KVBtCsr *)pKVCursor;
+  KVSize iBuf = 0;
+  int nEntry = 0;
+  int rc;
+
+  rc = sqlite4BtCsrNext(pCsr->pCsr);
+  while( rc==SQLITE4_OK && nEntry<nMax ){
+    const void *pKey;
+    const void *pData;
+    int nKey;
+    int nData;
+
+    /* Request one byte more than may be copied. This way the overflow 
+    ** pages of a large value are not all read only to find that it is
+    ** too large. */
+    rc = sqlite4BtCsrKey(pCsr->pCsr, &pKey, &nKey);
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4BtCsrData(pCsr->pCsr, 0, nBuf/8+1, &pData, &nData);
+    }
+    if( rc!=SQLITE4_OK ) break;
+    if( 0==sqlite4KVBatchCopy(&aEntry[nEntry], aBuf, nBuf, &iBuf,
+          (const KVByteArray*)pKey, nKey, (const KVByteArray*)pData, nData
+    )){
+      break;
+    }
+    nEntry++;
+    rc = sqlite4BtCsrNext(pCsr->pCsr);
+  }
+
+  *pnEntry = nEntry;
+  return rc;
+}
+
 /*
 ** Destructor for the entire in-memory storage tree.
 */
@@ -265,6 +310,13 @@ struct BtPragmaCtx {
 */
 #define BTPRAGMA_PAGESZ     1
 #define BTPRAGMA_CHECKPOINT 2
+#define BTPRAGMA_CKPTSLICE  3
+#define BTPRAGMA_CKPTBATCH  4
+#define BTPRAGMA_SHAREDCACHE 5
+#define BTPRAGMA_CACHEHIT   6
+#define BTPRAGMA_CACHEMISS  7
+#define BTPRAGMA_MERGETHREAD 8
+#define BTPRAGMA_LOGCKSUM   9
 
 static void btPragmaDestroy(void *pArg){
   BtPragmaCtx *p = (BtPragmaCtx*)pArg;
@@ -294,6 +346,7 @@ static void btPragma(
     case BTPRAGMA_CHECKPOINT: {
       bt_checkpoint ckpt;
       ckpt.nFrameBuffer = 0;
+      ckpt.nFrameMax = 0;
       ckpt.nCkpt = 0;
       rc = sqlite4BtControl(db, BT_CONTROL_CHECKPOINT, (void*)&ckpt);
       if( rc!=SQLITE4_OK ){
@@ -304,6 +357,41 @@ static void btPragma(
       break;
     }
 
+    case BTPRAGMA_CKPTSLICE:
+    case BTPRAGMA_CKPTBATCH:
+    case BTPRAGMA_SHAREDCACHE:
+    case BTPRAGMA_MERGETHREAD:
+    case BTPRAGMA_LOGCKSUM: {
+      int iVal = -1;
+      int op = BT_CONTROL_SHAREDCACHE;
+      if( p->ePragma==BTPRAGMA_CKPTSLICE ) op = BT_CONTROL_CKPTSLICE;
+      if( p->ePragma==BTPRAGMA_CKPTBATCH ) op = BT_CONTROL_CKPTBATCH;
+      if( p->ePragma==BTPRAGMA_MERGETHREAD ) op = BT_CONTROL_MERGE_THREAD;
+      if( p->ePragma==BTPRAGMA_LOGCKSUM ) op = BT_CONTROL_CKSUM;
+      if( nVal>0 ){
+        iVal = sqlite4_value_int(apVal[0]);
+      }
+      rc = sqlite4BtControl(db, op, (void*)&iVal);
+      if( rc!=SQLITE4_OK ){
+        sqlite4_result_error_code(pCtx, rc);
+      }else{
+        sqlite4_result_int(pCtx, iVal);
+      }
+      break;
+    }
+
+    case BTPRAGMA_CACHEHIT:
+    case BTPRAGMA_CACHEMISS: {
+      bt_cachestats stats;
+      sqlite4BtControl(db, BT_CONTROL_SHAREDCACHE_STATS, (void*)&stats);
+      if( p->ePragma==BTPRAGMA_CACHEHIT ){
+        sqlite4_result_int(pCtx, stats.nHit);
+      }else{
+        sqlite4_result_int(pCtx, stats.nMiss);
+      }
+      break;
+    }
+
     default:
       assert( 0 );
   }
@@ -323,6 +411,13 @@ static int btGetMethod(
   } aPragma[] = {
     { "page_size", BTPRAGMA_PAGESZ },
     { "checkpoint", BTPRAGMA_CHECKPOINT },
+    { "ckpt_slice", BTPRAGMA_CKPTSLICE },
+    { "ckpt_batch", BTPRAGMA_CKPTBATCH },
+    { "shared_cache", BTPRAGMA_SHAREDCACHE },
+    { "shared_cache_hit", BTPRAGMA_CACHEHIT },
+    { "shared_cache_miss", BTPRAGMA_CACHEMISS },
+    { "merge_thread", BTPRAGMA_MERGETHREAD },
+    { "log_cksum", BTPRAGMA_LOGCKSUM },
   };
   int i;
   for(i=0; i<ArraySize(aPragma); i++){
@@ -347,7 +442,7 @@ int sqlite4OpenBtree(
   unsigned flags                  /* Bit flags */
 ){
   static const sqlite4_kv_methods bt_methods = {
-    1,                            /* iVersion */
+    2,                            /* iVersion */
     sizeof(sqlite4_kv_methods),   /* szSelf */
     btReplace,                    /* xReplace */
     btOpenCursor,                 /* xOpenCursor */
@@ -368,7 +463,8 @@ int sqlite4OpenBtree(
     btControl,                    /* xControl */
     btGetMeta,                    /* xGetMeta */
     btPutMeta,                    /* xPutMeta */
-    btGetMethod                   /* xGetMethod */
+    btGetMethod,                  /* xGetMethod */
+    btNextBatch                   /* xNextBatch */
   };
 
   KVBt *pNew = 0;
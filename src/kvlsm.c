@@ -328,21 +328,65 @@ static int kvlsmData(
   void *pData;
   int nData;
 
-  rc = lsm_csr_value(pCsr->pCsr, (const void **)&pData, &nData);
+  if( n<0 ){
+    rc = lsm_csr_value(pCsr->pCsr, (const void **)&pData, &nData);
+  }else{
+    /* Only the pages of a large value that contain the requested range 
+    ** are read. */
+    rc = lsm_csr_value_range(
+        pCsr->pCsr, ofst, n, (const void **)&pData, &nData
+    );
+  }
   if( rc==SQLITE4_OK ){
-    if( n<0 ){
-      *paData = pData;
-      *pNData = nData;
-    }else{
-      int nOut = n;
-      if( (ofst+n)>nData ) nOut = nData - ofst;
-      if( nOut<0 ) nOut = 0;
+    *paData = pData;
+    *pNData = nData;
+  }
+
+  return rc;
+}
+
+/*
+** Advance the cursor, copying the entries visited into aBuf[]. See the
+** description of xNextBatch in kv.h.
+*/
+static int kvlsmNextBatch(
+  KVCursor *pKVCursor,         /* The cursor to advance */
+  int nMax,                    /* Maximum number of entries to copy */
+  KVEntry *aEntry,             /* Array of nMax entries to populate */
+  KVByteArray *aBuf,           /* Buffer to copy keys and values into */
+  KVSize nBuf,                 /* Size of aBuf[] in bytes */
+  int *pnEntry                 /* OUT: Number of entries copied */
+){
+  KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
+  KVSize iBuf = 0;
+  int nEntry = 0;
+  int rc;
 
-      *paData = &((u8 *)pData)[n];
-      *pNData = nOut;
+  rc = kvlsmNextEntry(pKVCursor);
+  while( rc==SQLITE4_OK && nEntry<nMax ){
+    const void *pKey;
+    const void *pData;
+    int nKey;
+    int nData;
+
+    /* Request one byte more than may be copied. This way a value that
+    ** spans many pages is not read in full only to find that it is too
+    ** large. */
+    rc = lsm_csr_key(pCsr->pCsr, &pKey, &nKey);
+    if( rc==SQLITE4_OK ){
+      rc = lsm_csr_value_range(pCsr->pCsr, 0, nBuf/8+1, &pData, &nData);
+    }
+    if( rc!=SQLITE4_OK ) break;
+    if( 0==sqlite4KVBatchCopy(&aEntry[nEntry], aBuf, nBuf, &iBuf,
+          (const KVByteArray*)pKey, nKey, (const KVByteArray*)pData, nData
+    )){
+      break;
     }
+    nEntry++;
+    rc = kvlsmNextEntry(pKVCursor);
   }
 
+  *pnEntry = nEntry;
   return rc;
 }
 
@@ -518,7 +562,7 @@ int sqlite4KVStoreOpenLsm(
 
   /* Virtual methods for an LSM data store */
   static const KVStoreMethods kvlsmMethods = {
-    1,                            /* iVersion */
+    2,                            /* iVersion */
     sizeof(KVStoreMethods),       /* szSelf */
     kvlsmReplace,                 /* xReplace */
     kvlsmOpenCursor,              /* xOpenCursor */
@@ -539,7 +583,8 @@ int sqlite4KVStoreOpenLsm(
     kvlsmControl,                 /* xControl */
     kvlsmGetMeta,                 /* xGetMeta */
     kvlsmPutMeta,                 /* xPutMeta */
-    kvlsmGetMethod                /* xGetMethod */
+    kvlsmGetMethod,               /* xGetMethod */
+    kvlsmNextBatch                /* xNextBatch */
   };
 
   KVLsm *pNew;
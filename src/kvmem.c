@@ -749,6 +749,48 @@ static int kvmemPrevEntry(KVCursor *pKVCursor){
   return pNode ? SQLITE4_OK : SQLITE4_NOTFOUND;
 }
 
+/*
+** Advance the cursor, copying the entries visited into aBuf[]. See the
+** description of xNextBatch in kv.h.
+*/
+static int kvmemNextBatch(
+  KVCursor *pKVCursor,         /* The cursor to advance */
+  int nMax,                    /* Maximum number of entries to copy */
+  KVEntry *aEntry,             /* Array of nMax entries to populate */
+  KVByteArray *aBuf,           /* Buffer to copy keys and values into */
+  KVSize nBuf,                 /* Size of aBuf[] in bytes */
+  int *pnEntry                 /* OUT: Number of entries copied */
+){
+  KVMemCursor *pCur;
+  KVMemNode *pNode;
+  KVSize iBuf = 0;
+  int nEntry = 0;
+
+  pCur = (KVMemCursor*)pKVCursor;
+  assert( pCur->iMagicKVMemCur==SQLITE4_KVMEMCUR_MAGIC );
+  pNode = pCur->pNode;
+  kvmemReset(pKVCursor);
+  while( 1 ){
+    do{
+      pNode = kvmemNext(pNode);
+    }while( pNode && pNode->pData==0 );
+    if( pNode==0 || nEntry>=nMax ) break;
+    if( 0==sqlite4KVBatchCopy(&aEntry[nEntry], aBuf, nBuf, &iBuf,
+          pNode->aKey, pNode->nKey, pNode->pData->a, pNode->pData->n
+    )){
+      break;
+    }
+    nEntry++;
+  }
+  if( pNode ){
+    pCur->pNode = kvmemNodeRef(pNode);
+    pCur->pData = kvmemDataRef(pNode->pData);
+  }
+
+  *pnEntry = nEntry;
+  return pNode ? SQLITE4_OK : SQLITE4_NOTFOUND;
+}
+
 /*
 ** Seek a cursor.
 */
@@ -946,7 +988,7 @@ static int kvmemPutMeta(KVStore *pKVStore, unsigned int iVal){
 
 /* Virtual methods for the in-memory storage engine */
 static const KVStoreMethods kvmemMethods = {
-  1,                        /* iVersion */
+  2,                        /* iVersion */
   sizeof(KVStoreMethods),   /* szSelf */
   kvmemReplace,             /* xReplace */
   kvmemOpenCursor,          /* xOpenCursor */
@@ -966,9 +1008,456 @@ static const KVStoreMethods kvmemMethods = {
   kvmemClose,               /* xClose */
   kvmemControl,             /* xControl */
   kvmemGetMeta,             /* xGetMeta */
-  kvmemPutMeta              /* xPutMeta */
+  kvmemPutMeta,             /* xPutMeta */
+  0,                        /* xGetMethod */
+  kvmemNextBatch            /* xNextBatch */
+};
+
+/****************************************************************************
+** The remainder of this file implements a second in-memory storage engine.
+** It is used instead of the one above for stores opened with both the
+** SQLITE4_KVOPEN_TEMPORARY and SQLITE4_KVOPEN_NO_TRANSACTIONS flags - the
+** ephemeral tables and automatic indexes used by a single statement.
+**
+** Such a store is never rolled back, so nothing need be freed before the
+** store itself is closed. All memory is taken from large chunks using
+** a bump allocator, and all chunks are freed at once by xClose. Entries
+** are kept in a skip-list. An entry is deleted by setting its value to 
+** NULL, and a replaced value is simply abandoned in its chunk.
+*/
+typedef struct KVArena KVArena;
+typedef struct KVArenaChunk KVArenaChunk;
+typedef struct KVArenaCsr KVArenaCsr;
+typedef struct KVArenaNode KVArenaNode;
+
+/*
+** The maximum height of a skip-list node. And the smallest and largest
+** sizes of the chunks memory is allocated from. Each chunk is twice the
+** size of its predecessor, up to the maximum.
+*/
+#define KVARENA_MAX_HEIGHT 16
+#define KVARENA_MIN_CHUNK  4096
+#define KVARENA_MAX_CHUNK  (256*1024)
+
+/*
+** A chunk of memory. The nByte bytes of space follow this header.
+*/
+struct KVArenaChunk {
+  KVArenaChunk *pNext;           /* Next in list of all chunks */
+  int nByte;                     /* Size of the chunk in bytes */
+};
+
+/*
+** A single entry in the skip-list. The key is stored immediately after
+** the apNext[] array.
+*/
+struct KVArenaNode {
+  const KVByteArray *aData;      /* Value. NULL if the entry is deleted */
+  KVSize nData;                  /* Size of aData[] in bytes */
+  KVSize nKey;                   /* Size of the key in bytes */
+  int nHeight;                   /* Number of elements in apNext[] */
+  KVArenaNode *pPrev;            /* Previous node at level 0 */
+  KVArenaNode *apNext[1];        /* Next node at each level */
+};
+#define kvarenaNodeKey(pNode) \
+  ((KVByteArray*)&(pNode)->apNext[(pNode)->nHeight])
+
+/*
+** A skip-list based in-memory store. A subclass of KVStore.
+*/
+struct KVArena {
+  KVStore base;                  /* Base class, must be first */
+  KVArenaChunk *pChunk;          /* Chunk currently allocated from */
+  int iChunk;                    /* Offset of free space in pChunk */
+  int szChunk;                   /* Size of the next chunk to allocate */
+  u32 iRand;                     /* PRNG state used to pick node heights */
+  int nHeight;                   /* Height of tallest node in the list */
+  KVArenaNode *apHead[KVARENA_MAX_HEIGHT];   /* First node at each level */
+  unsigned int iMeta;            /* Schema cookie value */
+};
+
+/*
+** A cursor used for scanning a KVArena store.
+*/
+struct KVArenaCsr {
+  KVCursor base;                 /* Base class. Must be first */
+  KVArena *pOwner;               /* The store that owns this cursor */
+  KVArenaNode *pNode;            /* Current entry, or NULL for EOF */
+  const KVByteArray *aData;      /* Value of pNode when cursor moved there */
+  KVSize nData;                  /* Size of aData[] in bytes */
+};
+
+/*
+** Allocate nByte bytes of 8-byte aligned memory from the chunks of store p.
+** Return NULL if a malloc fails.
+*/
+static void *kvarenaAlloc(KVArena *p, int nByte){
+  void *pRet;
+  nByte = ROUND8(nByte);
+  if( p->pChunk==0 || p->iChunk+nByte>p->pChunk->nByte ){
+    KVArenaChunk *pNew;
+    int sz = p->szChunk;
+    if( nByte>sz/4 && p->pChunk ){
+      /* A large allocation is given a chunk of its own. It is linked in
+      ** behind the current chunk, so the free space remaining in the
+      ** current chunk is not wasted.  */
+      pNew = sqlite4_malloc(p->base.pEnv, sizeof(KVArenaChunk)+nByte);
+      if( pNew==0 ) return 0;
+      pNew->nByte = nByte;
+      pNew->pNext = p->pChunk->pNext;
+      p->pChunk->pNext = pNew;
+      return (void*)&pNew[1];
+    }
+    if( sz<nByte ) sz = nByte;
+    pNew = sqlite4_malloc(p->base.pEnv, sizeof(KVArenaChunk)+sz);
+    if( pNew==0 ) return 0;
+    pNew->nByte = sz;
+    pNew->pNext = p->pChunk;
+    p->pChunk = pNew;
+    p->iChunk = 0;
+    if( p->szChunk<KVARENA_MAX_CHUNK ) p->szChunk = p->szChunk*2;
+  }
+  pRet = (void*)&((u8*)&p->pChunk[1])[p->iChunk];
+  p->iChunk += nByte;
+  return pRet;
+}
+
+/*
+** Return a randomly selected height for a new skip-list node. A node of
+** height N+1 is one quarter as likely as a node of height N.
+*/
+static int kvarenaRandomHeight(KVArena *p){
+  u32 r = p->iRand;
+  int nHeight = 1;
+  r ^= (r<<13);
+  r ^= (r>>17);
+  r ^= (r<<5);
+  p->iRand = r;
+  while( nHeight<KVARENA_MAX_HEIGHT && (r & 0x03)==0 ){
+    nHeight++;
+    r = r>>2;
+  }
+  return nHeight;
+}
+
+/*
+** Search the skip-list of store p for key aKey[]. Return the first node
+** with a key equal to or larger than aKey[], or NULL if there is no such
+** node. If apPrev is not NULL, set each apPrev[i] for i<p->nHeight to the
+** last node at level i with a key smaller than aKey[] (or NULL).
+*/
+static KVArenaNode *kvarenaSearch(
+  KVArena *p,
+  const KVByteArray *aKey, KVSize nKey,
+  KVArenaNode **apPrev
+){
+  KVArenaNode *pPrev = 0;
+  int i;
+  for(i=p->nHeight-1; i>=0; i--){
+    KVArenaNode *pNext = (pPrev ? pPrev->apNext[i] : p->apHead[i]);
+    while( pNext && kvmemKeyCompare(
+          kvarenaNodeKey(pNext), pNext->nKey, aKey, nKey)<0
+    ){
+      pPrev = pNext;
+      pNext = pNext->apNext[i];
+    }
+    if( apPrev ) apPrev[i] = pPrev;
+  }
+  return (pPrev ? pPrev->apNext[0] : p->apHead[0]);
+}
+
+/*
+** Point cursor pCsr at node pNode, or at the first non-deleted node that
+** follows (if dir>0) or precedes (if dir<0) it. Return SQLITE4_OK if 
+** successful, or SQLITE4_NOTFOUND if the cursor is left at EOF.
+*/
+static int kvarenaCsrSet(KVArenaCsr *pCsr, KVArenaNode *pNode, int dir){
+  while( pNode && pNode->aData==0 ){
+    pNode = (dir>0 ? pNode->apNext[0] : pNode->pPrev);
+  }
+  pCsr->pNode = pNode;
+  if( pNode ){
+    pCsr->aData = pNode->aData;
+    pCsr->nData = pNode->nData;
+    return SQLITE4_OK;
+  }
+  return SQLITE4_NOTFOUND;
+}
+
+/*
+** Transactions are no-ops, except for the transaction level itself.
+*/
+static int kvarenaBegin(KVStore *pKVStore, int iLevel){
+  pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int kvarenaCommitPhaseOne(KVStore *pKVStore, int iLevel){
+  return SQLITE4_OK;
+}
+static int kvarenaCommitPhaseTwo(KVStore *pKVStore, int iLevel){
+  pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int kvarenaRollback(KVStore *pKVStore, int iLevel){
+  pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+
+/*
+** Implementation of the xReplace(X, aKey, nKey, aData, nData) method.
+*/
+static int kvarenaReplace(
+  KVStore *pKVStore,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+){
+  KVArena *p = (KVArena*)pKVStore;
+  KVArenaNode *apPrev[KVARENA_MAX_HEIGHT];
+  KVArenaNode *pNode;
+  KVArenaNode *pNew;
+  KVByteArray *aCopy;
+  int nHeight;
+  int i;
+
+  assert( p->base.iTransLevel>=2 );
+  aCopy = (KVByteArray*)kvarenaAlloc(p, nData);
+  if( aCopy==0 ) return SQLITE4_NOMEM;
+  if( nData>0 ) memcpy(aCopy, aData, nData);
+
+  pNode = kvarenaSearch(p, aKey, nKey, apPrev);
+  if( pNode 
+   && 0==kvmemKeyCompare(kvarenaNodeKey(pNode), pNode->nKey, aKey, nKey)
+  ){
+    pNode->aData = aCopy;
+    pNode->nData = nData;
+    return SQLITE4_OK;
+  }
+
+  nHeight = kvarenaRandomHeight(p);
+  pNew = (KVArenaNode*)kvarenaAlloc(p, 
+      sizeof(KVArenaNode) + (nHeight-1)*sizeof(KVArenaNode*) + nKey
+  );
+  if( pNew==0 ) return SQLITE4_NOMEM;
+  pNew->aData = aCopy;
+  pNew->nData = nData;
+  pNew->nKey = nKey;
+  pNew->nHeight = nHeight;
+  memcpy(kvarenaNodeKey(pNew), aKey, nKey);
+
+  for(i=p->nHeight; i<nHeight; i++) apPrev[i] = 0;
+  if( nHeight>p->nHeight ) p->nHeight = nHeight;
+  for(i=0; i<nHeight; i++){
+    KVArenaNode **ppNext;
+    ppNext = (apPrev[i] ? &apPrev[i]->apNext[i] : &p->apHead[i]);
+    pNew->apNext[i] = *ppNext;
+    *ppNext = pNew;
+  }
+  pNew->pPrev = apPrev[0];
+  if( pNew->apNext[0] ) pNew->apNext[0]->pPrev = pNew;
+  return SQLITE4_OK;
+}
+
+/*
+** Create a new cursor object.
+*/
+static int kvarenaOpenCursor(KVStore *pKVStore, KVCursor **ppKVCursor){
+  KVArenaCsr *pCsr;
+  pCsr = (KVArenaCsr*)sqlite4_malloc(pKVStore->pEnv, sizeof(KVArenaCsr));
+  if( pCsr==0 ){
+    *ppKVCursor = 0;
+    return SQLITE4_NOMEM;
+  }
+  memset(pCsr, 0, sizeof(KVArenaCsr));
+  pCsr->base.pStore = pKVStore;
+  pCsr->base.pStoreVfunc = pKVStore->pStoreVfunc;
+  pCsr->pOwner = (KVArena*)pKVStore;
+  *ppKVCursor = (KVCursor*)pCsr;
+  return SQLITE4_OK;
+}
+
+/*
+** Reset a cursor.
+*/
+static int kvarenaReset(KVCursor *pKVCursor){
+  KVArenaCsr *pCsr = (KVArenaCsr*)pKVCursor;
+  pCsr->pNode = 0;
+  return SQLITE4_OK;
+}
+
+/*
+** Destroy a cursor object.
+*/
+static int kvarenaCloseCursor(KVCursor *pKVCursor){
+  sqlite4_free(pKVCursor->pStore->pEnv, pKVCursor);
+  return SQLITE4_OK;
+}
+
+/*
+** Move a cursor to the next or previous non-deleted node.
+*/
+static int kvarenaNextEntry(KVCursor *pKVCursor){
+  KVArenaCsr *pCsr = (KVArenaCsr*)pKVCursor;
+  if( pCsr->pNode==0 ) return SQLITE4_NOTFOUND;
+  return kvarenaCsrSet(pCsr, pCsr->pNode->apNext[0], +1);
+}
+static int kvarenaPrevEntry(KVCursor *pKVCursor){
+  KVArenaCsr *pCsr = (KVArenaCsr*)pKVCursor;
+  if( pCsr->pNode==0 ) return SQLITE4_NOTFOUND;
+  return kvarenaCsrSet(pCsr, pCsr->pNode->pPrev, -1);
+}
+
+/*
+** Seek a cursor.
+*/
+static int kvarenaSeek(
+  KVCursor *pKVCursor, 
+  const KVByteArray *aKey,
+  KVSize nKey,
+  int dir
+){
+  KVArenaCsr *pCsr = (KVArenaCsr*)pKVCursor;
+  KVArena *p = pCsr->pOwner;
+  KVArenaNode *apPrev[KVARENA_MAX_HEIGHT];
+  KVArenaNode *pNode;
+  int bExact;
+  int rc;
+
+  pNode = kvarenaSearch(p, aKey, nKey, apPrev);
+  bExact = (pNode && pNode->aData
+      && 0==kvmemKeyCompare(kvarenaNodeKey(pNode), pNode->nKey, aKey, nKey)
+  );
+  if( bExact ){
+    rc = kvarenaCsrSet(pCsr, pNode, 0);
+  }else if( dir==0 ){
+    pCsr->pNode = 0;
+    rc = SQLITE4_NOTFOUND;
+  }else{
+    if( dir<0 ) pNode = (p->nHeight>0 ? apPrev[0] : 0);
+    rc = kvarenaCsrSet(pCsr, pNode, dir);
+    if( rc==SQLITE4_OK ) rc = SQLITE4_INEXACT;
+  }
+  return rc;
+}
+
+/*
+** Delete the entry that the cursor is pointing to. The cursor continues
+** to point to the deleted entry, so subsequent xNext, xPrev, xKey and 
+** xData calls work as if it had not been deleted.
+*/
+static int kvarenaDelete(KVCursor *pKVCursor){
+  KVArenaCsr *pCsr = (KVArenaCsr*)pKVCursor;
+  assert( pKVCursor->pStore->iTransLevel>=2 );
+  if( pCsr->pNode ) pCsr->pNode->aData = 0;
+  return SQLITE4_OK;
+}
+
+/*
+** Return the key of the node the cursor is pointing to.
+*/
+static int kvarenaKey(
+  KVCursor *pKVCursor,         /* The cursor whose key is desired */
+  const KVByteArray **paKey,   /* Make this point to the key */
+  KVSize *pN                   /* Make this point to the size of the key */
+){
+  KVArenaCsr *pCsr = (KVArenaCsr*)pKVCursor;
+  if( pCsr->pNode==0 ){
+    *paKey = 0;
+    *pN = 0;
+    return SQLITE4_DONE;
+  }
+  *paKey = kvarenaNodeKey(pCsr->pNode);
+  *pN = pCsr->pNode->nKey;
+  return SQLITE4_OK;
+}
+
+/*
+** Return the data of the node the cursor is pointing to.
+*/
+static int kvarenaData(
+  KVCursor *pKVCursor,         /* The cursor from which to take the data */
+  KVSize ofst,                 /* Offset into the data to begin reading */
+  KVSize n,                    /* Number of bytes requested */
+  const KVByteArray **paData,  /* Pointer to the data written here */
+  KVSize *pNData               /* Number of bytes delivered */
+){
+  KVArenaCsr *pCsr = (KVArenaCsr*)pKVCursor;
+  if( pCsr->pNode==0 ){
+    *paData = 0;
+    *pNData = 0;
+    return SQLITE4_DONE;
+  }
+  if( ofst>pCsr->nData ) ofst = pCsr->nData;
+  *paData = pCsr->aData + ofst;
+  *pNData = pCsr->nData - ofst;
+  if( n>=0 && n<*pNData ) *pNData = n;
+  return SQLITE4_OK;
+}
+
+/*
+** Free all memory used by the store.
+*/
+static int kvarenaClose(KVStore *pKVStore){
+  KVArena *p = (KVArena*)pKVStore;
+  KVArenaChunk *pChunk;
+  KVArenaChunk *pNext;
+  for(pChunk=p->pChunk; pChunk; pChunk=pNext){
+    pNext = pChunk->pNext;
+    sqlite4_free(p->base.pEnv, pChunk);
+  }
+  sqlite4_free(p->base.pEnv, p);
+  return SQLITE4_OK;
+}
+
+static int kvarenaGetMeta(KVStore *pKVStore, unsigned int *piVal){
+  *piVal = ((KVArena*)pKVStore)->iMeta;
+  return SQLITE4_OK;
+}
+
+static int kvarenaPutMeta(KVStore *pKVStore, unsigned int iVal){
+  ((KVArena*)pKVStore)->iMeta = iVal;
+  return SQLITE4_OK;
+}
+
+/* Virtual methods for the arena-based in-memory storage engine */
+static const KVStoreMethods kvarenaMethods = {
+  1,                        /* iVersion */
+  sizeof(KVStoreMethods),   /* szSelf */
+  kvarenaReplace,           /* xReplace */
+  kvarenaOpenCursor,        /* xOpenCursor */
+  kvarenaSeek,              /* xSeek */
+  kvarenaNextEntry,         /* xNext */
+  kvarenaPrevEntry,         /* xPrev */
+  kvarenaDelete,            /* xDelete */
+  kvarenaKey,               /* xKey */
+  kvarenaData,              /* xData */
+  kvarenaReset,             /* xReset */
+  kvarenaCloseCursor,       /* xCloseCursor */
+  kvarenaBegin,             /* xBegin */
+  kvarenaCommitPhaseOne,    /* xCommitPhaseOne */
+  kvarenaCommitPhaseTwo,    /* xCommitPhaseTwo */
+  kvarenaRollback,          /* xRollback */
+  0,                        /* xRevert */
+  kvarenaClose,             /* xClose */
+  kvmemControl,             /* xControl */
+  kvarenaGetMeta,           /* xGetMeta */
+  kvarenaPutMeta            /* xPutMeta */
 };
 
+/*
+** Create a new arena-based in-memory storage engine.
+*/
+static int kvarenaOpen(sqlite4_env *pEnv, KVStore **ppKVStore){
+  KVArena *pNew = (KVArena*)sqlite4_malloc(pEnv, sizeof(KVArena));
+  if( pNew==0 ) return SQLITE4_NOMEM;
+  memset(pNew, 0, sizeof(KVArena));
+  pNew->base.pStoreVfunc = &kvarenaMethods;
+  pNew->base.pEnv = pEnv;
+  pNew->szChunk = KVARENA_MIN_CHUNK;
+  pNew->iRand = 0x2545F491;
+  *ppKVStore = (KVStore*)pNew;
+  return SQLITE4_OK;
+}
+
 /*
 ** Create a new in-memory storage engine and return a pointer to it.
 */
@@ -978,7 +1467,14 @@ int sqlite4KVStoreOpenMem(
   const char *zName,              /* Name of in-memory storage unit */
   unsigned openFlags              /* Flags */
 ){
-  KVMem *pNew = sqlite4_malloc(pEnv, sizeof(*pNew) );
+  const unsigned mArena = 
+    (SQLITE4_KVOPEN_TEMPORARY | SQLITE4_KVOPEN_NO_TRANSACTIONS);
+  KVMem *pNew;
+
+  if( (openFlags & mArena)==mArena ){
+    return kvarenaOpen(pEnv, ppKVStore);
+  }
+  pNew = sqlite4_malloc(pEnv, sizeof(*pNew) );
   if( pNew==0 ) return SQLITE4_NOMEM;
   memset(pNew, 0, sizeof(*pNew));
   pNew->base.pStoreVfunc = &kvmemMethods;
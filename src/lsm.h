@@ -206,6 +206,14 @@ int lsm_config(lsm_db *, int, ...);
 **                 database file. Following recovery the database file
 **                 contains all successfully committed transactions.
 **
+**   In full mode, the log file is synced after the write lock has been 
+**   released at the end of each transaction. If several connections
+**   within a single process commit transactions at around the same time,
+**   a single sync is used to make all of them durable (see also
+**   LSM_CONFIG_COMMIT_DELAY). If the sync fails, lsm_commit() returns an
+**   error code. But the transaction is not rolled back, and may be visible 
+**   to other connections.
+**
 ** LSM_CONFIG_AUTOWORK:
 **   A read/write integer parameter.
 **
@@ -265,7 +273,8 @@ int lsm_config(lsm_db *, int, ...);
 **   Set the compression methods used to compress and decompress database
 **   content. The argument to this option should be a pointer to a structure
 **   of type lsm_compress. The lsm_config() method takes a copy of the 
-**   structures contents.
+**   structures contents. The iId field of the structure must be no greater
+**   than 0x00FFFFFF.
 **
 **   This option may only be used before lsm_open() is called. Invoking it
 **   after lsm_open() has been called results in an LSM_MISUSE error.
@@ -281,6 +290,84 @@ int lsm_config(lsm_db *, int, ...);
 ** LSM_CONFIG_READONLY:
 **   A read/write boolean parameter. This parameter may only be set before
 **   lsm_open() is called.
+**
+** LSM_CONFIG_WORKER_THREAD:
+**   A read/write boolean parameter. This parameter may only be set before
+**   lsm_open() is called. If true, lsm_open() opens a second, private 
+**   connection to the database and starts a background thread that uses
+**   it to flush in-memory trees to disk, merge segments and checkpoint the
+**   database (according to the LSM_CONFIG_AUTOMERGE and 
+**   LSM_CONFIG_AUTOCHECKPOINT values configured on this connection). The
+**   connection itself then only writes to the in-memory tree and log 
+**   file, as if LSM_CONFIG_AUTOWORK were set to zero. 
+**
+**   If the background thread falls so far behind that the in-memory tree
+**   cannot be flushed when it next fills up, a writer waits for the
+**   background thread before beginning its next write transaction.
+**
+**   The background thread is stopped when the connection is closed. Any
+**   compression methods configured on the connection are shared with the
+**   background thread, and so must be thread-safe. Worker threads are only
+**   available if the library is compiled with LSM_MUTEX_PTHREADS defined.
+**   Otherwise, lsm_open() fails with LSM_MISUSE if this option is set.
+**
+**   After lsm_open() has been called, querying this parameter returns true
+**   if a background thread is running.
+**
+** LSM_CONFIG_PAGE_CACHE:
+**   A read/write integer parameter. This value determines the maximum 
+**   amount of memory, in KB, used by the cache of uncompressed pages that 
+**   is shared by all connections to a single compressed database from 
+**   within the same process. It has no effect on databases that are not
+**   compressed. Pages read by any connection are added to the cache, so
+**   that subsequent reads of the same page do not need to read and 
+**   uncompress the page data. Set to 0 to disable the cache.
+**
+**   If this parameter is set before lsm_open() is called, the value is used
+**   only if the connection is the first within the process to open the 
+**   database. Setting it after lsm_open() has been called reconfigures the
+**   cache used by all connections to the database. The default value is 
+**   4096 (4MB).
+**
+** LSM_CONFIG_MERGE_POLICY:
+**   A read/write integer parameter. This value determines how the segments
+**   to merge together are selected when work is performed on the database.
+**   It must be set to one of the following:
+**
+**   LSM_MERGE_TIERED:
+**     Merge runs of at least LSM_CONFIG_AUTOMERGE segments of similar 
+**     size. This is the default.
+**
+**   LSM_MERGE_LEVELED:
+**     Each segment is merged into the next oldest as soon as the combined
+**     size of it and all newer segments reaches 1/N of the size of the 
+**     older segment, where N is the LSM_CONFIG_AUTOMERGE value. This keeps
+**     fewer segments in the database (improving read performance and space
+**     amplification) at the cost of rewriting data more often.
+**
+**   LSM_MERGE_WINDOW:
+**     As for LSM_MERGE_TIERED, except that once a segment grows larger 
+**     than LSM_CONFIG_MERGE_WINDOW KB it is not merged again unless the
+**     database would otherwise become full. This minimizes write 
+**     amplification for workloads that write mostly new keys, such as 
+**     time-ordered data.
+**
+**   The policy applies to work performed by this connection only. Calls
+**   to lsm_work() with an nMerge argument of 1 always merge all segments
+**   together, regardless of the policy in use.
+**
+** LSM_CONFIG_MERGE_WINDOW:
+**   A read/write integer parameter. The size in KB at which a segment
+**   is no longer considered for merging when the LSM_MERGE_WINDOW merge
+**   policy is in use. The default value is 65536 (64MB).
+**
+** LSM_CONFIG_COMMIT_DELAY:
+**   A read/write integer parameter. This value is only used if 
+**   LSM_CONFIG_SAFETY is set to 2 (full). It is the number of microseconds
+**   that a connection waits before syncing the log file to disk when it
+**   commits a transaction, in order to allow transactions committed by 
+**   other connections in the same process during that time to be made 
+**   durable by the same sync. The default value is 0.
 */
 #define LSM_CONFIG_AUTOFLUSH                1
 #define LSM_CONFIG_PAGE_SIZE                2
@@ -297,11 +384,20 @@ int lsm_config(lsm_db *, int, ...);
 #define LSM_CONFIG_GET_COMPRESSION         14
 #define LSM_CONFIG_SET_COMPRESSION_FACTORY 15
 #define LSM_CONFIG_READONLY                16
+#define LSM_CONFIG_WORKER_THREAD           17
+#define LSM_CONFIG_PAGE_CACHE              18
+#define LSM_CONFIG_MERGE_POLICY            19
+#define LSM_CONFIG_MERGE_WINDOW            20
+#define LSM_CONFIG_COMMIT_DELAY            21
 
 #define LSM_SAFETY_OFF    0
 #define LSM_SAFETY_NORMAL 1
 #define LSM_SAFETY_FULL   2
 
+#define LSM_MERGE_TIERED  0
+#define LSM_MERGE_LEVELED 1
+#define LSM_MERGE_WINDOW  2
+
 /*
 ** CAPI: Compression and/or Encryption Hooks
 */
@@ -460,6 +556,32 @@ int lsm_set_user_version(lsm_db *, unsigned int);
 **   This value should be followed by a single argument of type 
 **   (unsigned int *). If successful, the location pointed to is populated 
 **   with the database compression id before returning.
+**
+** LSM_INFO_PAGE_CACHE_HIT:
+** LSM_INFO_PAGE_CACHE_MISS:
+**   The third parameter should be of type (int *). The location pointed 
+**   to is set to the number of times a compressed page read by any 
+**   connection to the database within this process was (HIT) or was not
+**   (MISS) found in the shared cache of uncompressed pages (see 
+**   LSM_CONFIG_PAGE_CACHE).
+**
+** LSM_INFO_WRITE_AMP:
+**   The third parameter should be of type (int *). The location pointed 
+**   to is set to the write amplification of the database multiplied by 
+**   100 - the total number of pages written to the database file by 
+**   flushes and merges divided by the number written by flushes of 
+**   in-memory trees alone. Only work performed by connections within this
+**   process since the database was first opened is considered. If no 
+**   in-memory trees have been flushed, the value is 100.
+**
+** LSM_INFO_SPACE_AMP:
+**   The third parameter should be of type (int *). The location pointed 
+**   to is set to the space amplification of the database multiplied by 
+**   100 - the total number of pages in all segments of the database divided
+**   by the number in the oldest level. This approximates the ratio of the
+**   space used by the database to the space that would be used if all 
+**   segments were merged together. If the database is empty, the value 
+**   is 100.
 */
 #define LSM_INFO_NWRITE           1
 #define LSM_INFO_NREAD            2
@@ -474,6 +596,10 @@ int lsm_set_user_version(lsm_db *, unsigned int);
 #define LSM_INFO_TREE_SIZE       11
 #define LSM_INFO_FREELIST_SIZE   12
 #define LSM_INFO_COMPRESSION_ID  13
+#define LSM_INFO_PAGE_CACHE_HIT  14
+#define LSM_INFO_PAGE_CACHE_MISS 15
+#define LSM_INFO_WRITE_AMP       16
+#define LSM_INFO_SPACE_AMP       17
 
 
 /* 
@@ -553,6 +679,34 @@ int lsm_flush(lsm_db *pDb);
 */
 int lsm_checkpoint(lsm_db *pDb, int *pnKB);
 
+/*
+** CAPI: Bulk Loading Data
+**
+** Write a stream of key-value pairs directly to a new segment at the top
+** of the database, bypassing the log file and in-memory tree. The stream
+** is read by calling xNext repeatedly. Each call should set its output
+** parameters to the key and value of the next pair and return LSM_OK. At
+** the end of the stream, it should set the key pointer to NULL. If xNext
+** returns any value other than LSM_OK, the load is abandoned and that
+** value returned to the caller. The buffers returned by xNext need only
+** remain valid until the next call.
+**
+** Keys must be returned in strictly increasing order. LSM_MISUSE is 
+** returned (and the load abandoned) if they are not.
+**
+** Before the new segment is written, the contents of the in-memory tree
+** are flushed to disk as if by lsm_flush(). Once it has been written, the
+** new database snapshot is checkpointed. The loaded data is not visible
+** to other connections until it has been written in its entirety. As with
+** lsm_flush(), it is an error (LSM_MISUSE) to call this function while
+** the connection has an open transaction or cursor.
+*/
+int lsm_bulk_load(
+  lsm_db *pDb, 
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx
+);
+
 /*
 ** CAPI: Opening and Closing Database Cursors
 **
@@ -646,10 +800,21 @@ int lsm_csr_prev(lsm_cursor *pCsr);
 ** CAPI: Extracting Data From Database Cursors
 **
 ** Retrieve data from a database cursor.
+**
+** The lsm_csr_value_range() function retrieves nByte bytes of the value
+** starting at byte offset iOff. If the value is smaller than (iOff+nByte)
+** bytes, *pnVal is set to the number of bytes that follow offset iOff. 
+** More than nByte bytes may be returned if they are available at no extra
+** cost. Only the pages of a large value that contain the requested bytes 
+** are copied. The buffer returned is valid until the next call to 
+** lsm_csr_value_range() or until the cursor is moved.
 */
 int lsm_csr_valid(lsm_cursor *pCsr);
 int lsm_csr_key(lsm_cursor *pCsr, const void **ppKey, int *pnKey);
 int lsm_csr_value(lsm_cursor *pCsr, const void **ppVal, int *pnVal);
+int lsm_csr_value_range(
+  lsm_cursor *pCsr, int iOff, int nByte, const void **ppVal, int *pnVal
+);
 
 /*
 ** If no error occurs, this function compares the database key passed via
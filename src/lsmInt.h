@@ -53,6 +53,10 @@
 #define LSM_DFLT_MMAP               (LSM_IS_64_BIT ? 1 : 32768)
 #define LSM_DFLT_MULTIPLE_PROCESSES 1
 #define LSM_DFLT_USE_LOG            1
+#define LSM_DFLT_PAGE_CACHE         (i64)(4 * 1024 * 1024)
+#define LSM_DFLT_MERGE_POLICY       LSM_MERGE_TIERED
+#define LSM_DFLT_MERGE_WINDOW       (i64)(64 * 1024 * 1024)
+#define LSM_DFLT_COMMIT_DELAY       0
 
 /* Initial values for log file checksums. These are only used if the 
 ** database file does not contain a valid checkpoint.  */
@@ -67,6 +71,32 @@
 
 #define LSM_AUTOWORK_QUANT 32
 
+/* Maximum number of KB written by the background worker thread (see
+** LSM_CONFIG_WORKER_THREAD) before it checks whether it has been asked
+** to stop, and the number of milliseconds it sleeps for when there is
+** no work to do and it has not been signalled. */
+#define LSM_BGWORK_KB     256
+#define LSM_BGWORK_POLL   100
+
+/* Number of bits per key in the Bloom filter written to the end of each
+** new segment (see "BLOOM FILTERS" in lsm_sorted.c).  */
+#define LSM_BLOOM_BITS_PER_KEY  10
+
+/* File-format version stored in the checkpoint of each new database. 
+** Segments are written using prefix-compressed leaf pages only if the 
+** database format is 2 or greater. On such pages every LSM_PREFIX_RESTART'th 
+** key is stored in full (see "PREFIX COMPRESSION" in lsm_sorted.c).  */
+#define LSM_FORMAT_VERSION      2
+#define LSM_PREFIX_RESTART      16
+
+/* The largest compression scheme id that may be configured. The remaining
+** bits of the checkpoint field that stores the id are used for the 
+** file-format version (see lsm_ckpt.c).  */
+#define LSM_MAX_COMPRESSION_ID  0x00FFFFFF
+
+typedef struct BgWorker BgWorker;
+typedef struct Bloom Bloom;
+typedef struct BloomBuild BloomBuild;
 typedef struct Database Database;
 typedef struct DbLog DbLog;
 typedef struct FileSystem FileSystem;
@@ -76,13 +106,16 @@ typedef struct Level Level;
 typedef struct LogMark LogMark;
 typedef struct LogRegion LogRegion;
 typedef struct LogWriter LogWriter;
+typedef struct LsmCond LsmCond;
 typedef struct LsmString LsmString;
+typedef struct LsmThread LsmThread;
 typedef struct Mempool Mempool;
 typedef struct Merge Merge;
 typedef struct MergeInput MergeInput;
 typedef struct MetaPage MetaPage;
 typedef struct MultiCursor MultiCursor;
 typedef struct Page Page;
+typedef struct PageCache PageCache;
 typedef struct Redirect Redirect;
 typedef struct Segment Segment;
 typedef struct SegmentMerger SegmentMerger;
@@ -339,6 +372,11 @@ struct lsm_db {
   i64 nAutockpt;                  /* Configured by LSM_CONFIG_AUTOCHECKPOINT */
   int bMultiProc;                 /* Configured by L_C_MULTIPLE_PROCESSES */
   int bReadonly;                  /* Configured by LSM_CONFIG_READONLY */
+  int bWorkerThread;              /* Configured by LSM_CONFIG_WORKER_THREAD */
+  i64 nPageCache;                 /* Configured by LSM_CONFIG_PAGE_CACHE */
+  int eMergePolicy;               /* Configured by LSM_CONFIG_MERGE_POLICY */
+  i64 nMergeWindow;               /* Configured by LSM_CONFIG_MERGE_WINDOW */
+  int nCommitDelay;               /* Configured by LSM_CONFIG_COMMIT_DELAY */
   lsm_compress compress;          /* Compression callbacks */
   lsm_compress_factory factory;   /* Compression callback factory */
 
@@ -359,14 +397,18 @@ struct lsm_db {
   TransMark *aTrans;              /* Array of marks for transaction rollback */
   IntArray rollback;              /* List of tree-nodes to roll back */
   int bDiscardOld;                /* True if lsmTreeDiscardOld() was called */
+  int nTreeAppendSkip;            /* See treeSeekAppend() */
 
   MultiCursor *pCsrCache;         /* List of all closed cursors */
+  Bloom *pBloom;                  /* Cache of segment Bloom filters */
+  i64 iBloomSnap;                 /* Client snapshot id pBloom checked against */
 
   /* Worker context */
   Snapshot *pWorker;              /* Worker snapshot (or NULL) */
   Freelist *pFreelist;            /* See sortedNewToplevel() */
   int bUseFreelist;               /* True to use pFreelist */
   int bIncrMerge;                 /* True if currently doing a merge */
+  BloomBuild *pBloomBuild;        /* Filters for incomplete merges */
 
   int bInFactory;                 /* True if within factory.xFactory() */
 
@@ -378,6 +420,8 @@ struct lsm_db {
   void (*xWork)(lsm_db *, void *);
   void *pWorkCtx;
 
+  BgWorker *pBgWorker;            /* Background worker thread (or NULL) */
+
   u64 mLock;                      /* Mask of current locks. See lsmShmLock(). */
   lsm_db *pNext;                  /* Next connection to same database */
 
@@ -560,6 +604,7 @@ struct FreelistEntry {
 struct Snapshot {
   Database *pDatabase;            /* Database this snapshot belongs to */
   u32 iCmpId;                     /* Id of compression scheme */
+  int iFormat;                    /* File-format version */
   Level *pLevel;                  /* Pointer to level 0 of snapshot (or NULL) */
   i64 iId;                        /* Snapshot id */
   i64 iLogOff;                    /* Log file offset */
@@ -675,6 +720,21 @@ int lsmMutexHeld(lsm_env *, lsm_mutex *);
 int lsmMutexNotHeld(lsm_env *, lsm_mutex *);
 #endif
 
+/* 
+** Functions from file "lsm_unix.c".
+*/
+int lsmThreadStart(lsm_env*, void (*)(LsmThread*, void*), void*, LsmThread**);
+void lsmThreadSignal(LsmThread *);
+int lsmThreadWait(LsmThread *, int);
+void lsmThreadProgress(LsmThread *);
+int lsmThreadWaitProgress(LsmThread *, int *, int);
+void lsmThreadStop(LsmThread *);
+
+int lsmCondNew(lsm_env*, LsmCond**);
+void lsmCondDel(LsmCond *);
+void lsmCondBroadcast(LsmCond *);
+void lsmCondWait(LsmCond *, int *, int);
+
 /**************************************************************************
 ** Start of functions from "lsm_file.c".
 */
@@ -773,6 +833,14 @@ int lsmFsSegmentContainsPg(FileSystem *pFS, Segment *, Pgno, int *);
 
 void lsmFsPurgeCache(FileSystem *);
 
+int lsmFsCacheNew(lsm_env *, i64, PageCache **);
+void lsmFsCacheFree(lsm_env *, PageCache *);
+void lsmFsCacheConfigure(lsm_env *, PageCache *, i64);
+i64 lsmFsCacheSize(lsm_env *, PageCache *);
+void lsmFsCacheInvalidate(FileSystem *, int);
+void lsmFsCacheSnapshot(lsm_env *, PageCache *, i64, int);
+void lsmFsCacheStats(lsm_env *, PageCache *, int *, int *);
+
 /*
 ** End of functions from "lsm_file.c".
 **************************************************************************/
@@ -813,9 +881,11 @@ int lsmMCursorValid(MultiCursor *);
 int lsmMCursorNext(MultiCursor *);
 int lsmMCursorKey(MultiCursor *, void **, int *);
 int lsmMCursorValue(MultiCursor *, void **, int *);
+int lsmMCursorValueRange(MultiCursor *, int, int, void **, int *);
 int lsmMCursorType(MultiCursor *, int *);
 lsm_db *lsmMCursorDb(MultiCursor *);
 void lsmMCursorFreeCache(lsm_db *);
+void lsmSortedFreeBloom(lsm_db *);
 
 int lsmSaveCursors(lsm_db *pDb);
 int lsmRestoreCursors(lsm_db *pDb);
@@ -845,6 +915,7 @@ int lsmVarintSize(u8 c);
 */
 void lsmLogMessage(lsm_db *, int, const char *, ...);
 int lsmInfoFreelist(lsm_db *pDb, char **pzOut);
+void lsmBgWorkerSignal(lsm_db *);
 
 /*
 ** Functions from file "lsm_log.c".
@@ -856,6 +927,7 @@ void lsmLogEnd(lsm_db *pDb, int bCommit);
 void lsmLogTell(lsm_db *, LogMark *);
 void lsmLogSeek(lsm_db *, LogMark *);
 void lsmLogClose(lsm_db *);
+int lsmCksumAvx2(const u8 *, int, u32 *, u32 *);
 
 int lsmLogRecover(lsm_db *);
 int lsmInfoLogStructure(lsm_db *pDb, char **pzVal);
@@ -939,6 +1011,11 @@ int lsmFreelistAppend(lsm_env *pEnv, Freelist *p, int iBlk, i64 iId);
 int lsmDbMultiProc(lsm_db *);
 void lsmDbDeferredClose(lsm_db *, lsm_file *, LsmFile *);
 LsmFile *lsmDbRecycleFd(lsm_db *);
+PageCache *lsmDbPageCache(lsm_db *);
+void lsmDbRecordWrite(lsm_db *, int, int);
+void lsmDbWriteStats(lsm_db *, i64 *, i64 *);
+i64 lsmDbLogCommitted(lsm_db *);
+int lsmDbSyncLog(lsm_db *, i64);
 
 int lsmWalkFreelist(lsm_db *, int, int (*)(void *, int, i64), void *);
 
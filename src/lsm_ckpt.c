@@ -32,7 +32,7 @@
 **     2. The checkpoint id LSW.
 **     3. The number of integer values in the entire checkpoint, including 
 **        the two checksum values.
-**     4. The compression scheme id.
+**     4. The compression scheme id and file-format version (see below).
 **     5. The total number of blocks in the database.
 **     6. The block size.
 **     7. The number of levels.
@@ -99,6 +99,18 @@
 **     1. Checksum value 1.
 **     2. Checksum value 2.
 **
+** The least significant 24 bits of the compression scheme id field contain
+** the id of the compression scheme used by the database. The most 
+** significant 8 bits contain the file-format version (see 
+** LSM_FORMAT_VERSION) if it is 2 or greater, or zero for version 1 
+** databases, which were written by versions of the library that predate
+** prefix-compressed segment pages. Since those versions of the library
+** compare the entire field against the id of their compression scheme, 
+** they refuse to read databases of version 2 or greater, returning 
+** LSM_MISMATCH. For the same reason, this version of the library refuses
+** to read databases with a file-format version greater than
+** LSM_FORMAT_VERSION.
+**
 ** In the above, a segment record consists of the following four 64-bit 
 ** fields (converted to 2 * u32 by storing the MSW followed by LSW):
 **
@@ -196,6 +208,10 @@ static const int one = 1;
 #define CKPT_HDR_PGSZ     7
 #define CKPT_HDR_NWRITE   8
 
+/* The parts of the CKPT_HDR_CMPID field. */
+#define CKPT_CMPID_MASK    LSM_MAX_COMPRESSION_ID
+#define CKPT_FORMAT_SHIFT  24
+
 #define CKPT_HDR_LO_MSW     9
 #define CKPT_HDR_LO_LSW    10
 #define CKPT_HDR_LO_CKSUM1 11
@@ -240,6 +256,17 @@ static void ckptChecksum(u32 *aCkpt, u32 nCkpt, u32 *piCksum1, u32 *piCksum2){
   *piCksum2 = cksum2;
 }
 
+/*
+** Return the value to store in the CKPT_HDR_CMPID field of a checkpoint 
+** for a database that uses compression scheme iCmpId and file-format 
+** version iFormat.
+*/
+static u32 ckptCmpidValue(u32 iCmpId, int iFormat){
+  assert( iCmpId==(iCmpId & CKPT_CMPID_MASK) );
+  if( iFormat<2 ) return iCmpId;
+  return ((u32)iFormat << CKPT_FORMAT_SHIFT) | iCmpId;
+}
+
 /*
 ** Set integer iIdx of the checkpoint accumulating in buffer *p to iVal.
 */
@@ -463,7 +490,9 @@ static int ckptExportSnapshot(
   ckptSetValue(&ckpt, CKPT_HDR_ID_MSW, (u32)(iId>>32), &rc);
   ckptSetValue(&ckpt, CKPT_HDR_ID_LSW, (u32)(iId&0xFFFFFFFF), &rc);
   ckptSetValue(&ckpt, CKPT_HDR_NCKPT, iOut+2, &rc);
-  ckptSetValue(&ckpt, CKPT_HDR_CMPID, pDb->compress.iId, &rc);
+  ckptSetValue(&ckpt, CKPT_HDR_CMPID, 
+      ckptCmpidValue(pDb->compress.iId, pSnap->iFormat), &rc
+  );
   ckptSetValue(&ckpt, CKPT_HDR_NBLOCK, pSnap->nBlock, &rc);
   ckptSetValue(&ckpt, CKPT_HDR_BLKSZ, lsmFsBlockSize(pFS), &rc);
   ckptSetValue(&ckpt, CKPT_HDR_NLEVEL, nLevel, &rc);
@@ -776,7 +805,7 @@ static void ckptLoadEmpty(lsm_db *pDb){
     0,                       /* CKPT_HDR_ID_MSW */
     10,                      /* CKPT_HDR_ID_LSW */
     0,                       /* CKPT_HDR_NCKPT */
-    LSM_COMPRESSION_EMPTY,   /* CKPT_HDR_CMPID */
+    0,                       /* CKPT_HDR_CMPID */
     0,                       /* CKPT_HDR_NBLOCK */
     0,                       /* CKPT_HDR_BLKSZ */
     0,                       /* CKPT_HDR_NLEVEL */
@@ -792,6 +821,9 @@ static void ckptLoadEmpty(lsm_db *pDb){
   ShmHeader *pShm = pDb->pShmhdr;
 
   aCkpt[CKPT_HDR_NCKPT] = nCkpt;
+  aCkpt[CKPT_HDR_CMPID] = ckptCmpidValue(
+      LSM_COMPRESSION_EMPTY, LSM_FORMAT_VERSION
+  );
   aCkpt[CKPT_HDR_BLKSZ] = pDb->nDfltBlksz;
   aCkpt[CKPT_HDR_PGSZ] = pDb->nDfltPgsz;
   ckptChecksum(aCkpt, array_size(aCkpt), &aCkpt[nCkpt-2], &aCkpt[nCkpt-1]);
@@ -898,7 +930,7 @@ int lsmInfoCompressionId(lsm_db *db, u32 *piCmpId){
   assert( db->pClient==0 && db->pWorker==0 );
   rc = lsmCheckpointLoad(db, 0);
   if( rc==LSM_OK ){
-    *piCmpId = db->aSnapshot[CKPT_HDR_CMPID];
+    *piCmpId = db->aSnapshot[CKPT_HDR_CMPID] & CKPT_CMPID_MASK;
   }
 
   return rc;
@@ -965,6 +997,15 @@ int lsmCheckpointDeserialize(
 ){
   int rc = LSM_OK;
   Snapshot *pNew;
+  int iFormat;
+
+  /* Check that the file-format version is one this library can read
+  ** before attempting to interpret the rest of the checkpoint.  */
+  iFormat = (int)(aCkpt[CKPT_HDR_CMPID] >> CKPT_FORMAT_SHIFT);
+  if( iFormat>LSM_FORMAT_VERSION ){
+    *ppSnap = 0;
+    return LSM_MISMATCH;
+  }
 
   pNew = (Snapshot *)lsmMallocZeroRc(pDb->pEnv, sizeof(Snapshot), &rc);
   if( rc==LSM_OK ){
@@ -974,12 +1015,13 @@ int lsmCheckpointDeserialize(
     int nLevel = (int)aCkpt[CKPT_HDR_NLEVEL];
     int iIn = CKPT_HDR_SIZE + CKPT_APPENDLIST_SIZE + CKPT_LOGPTR_SIZE;
 
+    pNew->iFormat = (iFormat ? iFormat : 1);
     pNew->iId = lsmCheckpointId(aCkpt, 0);
     pNew->nBlock = aCkpt[CKPT_HDR_NBLOCK];
     pNew->nWrite = aCkpt[CKPT_HDR_NWRITE];
     rc = ckptLoadLevels(pDb, aCkpt, &iIn, nLevel, &pNew->pLevel);
     pNew->iLogOff = lsmCheckpointLogOffset(aCkpt);
-    pNew->iCmpId = aCkpt[CKPT_HDR_CMPID];
+    pNew->iCmpId = aCkpt[CKPT_HDR_CMPID] & CKPT_CMPID_MASK;
 
     /* Make a copy of the append-list */
     for(i=0; i<LSM_APPLIST_SZ; i++){
@@ -1091,6 +1133,10 @@ int lsmCheckpointSaveWorker(lsm_db *pDb, int bFlush){
   memcpy(pShm->aSnap1, p, n);
   lsmFree(pDb->pEnv, p);
 
+  /* Let the shared page cache know that this snapshot was created by a
+  ** connection within this process.  */
+  lsmFsCacheSnapshot(pDb->pEnv, lsmDbPageCache(pDb), pSnap->iId, 1);
+
   assert( lsmFsIntegrityCheck(pDb) );
   return LSM_OK;
 }
@@ -207,6 +207,12 @@
 **   The first and last entries in a doubly-linked list of pages. This
 **   list contains all pages with malloc'd data that are present in the
 **   hash table and have a ref-count of zero.
+**
+** pCache:
+**   In compressed database mode, the cache of uncompressed page images
+**   shared by all connections to the database within this process. Pages
+**   that are not found in the apHash/nHash hash table are searched for 
+**   here before they are read from disk and uncompressed.
 */
 struct FileSystem {
   lsm_db *pDb;                    /* Database handle that owns this object */
@@ -245,6 +251,7 @@ struct FileSystem {
   int nHash;                      /* Number of hash slots in hash table */
   Page **apHash;                  /* nHash Hash slots */
   Page *pWaiting;                 /* b-tree pages waiting to be written */
+  PageCache *pCache;              /* Shared cache of uncompressed pages */
 
   /* Statistics */
   int nOut;                       /* Number of outstanding pages */
@@ -638,6 +645,7 @@ int lsmFsOpen(
     pFS->nMetasize = 4 * 1024;
     pFS->pDb = pDb;
     pFS->pEnv = pDb->pEnv;
+    pFS->pCache = lsmDbPageCache(pDb);
 
     /* Make a copy of the database and log file names. */
     memcpy(pFS->zDb, zDb, nDb+1);
@@ -1112,6 +1120,418 @@ static int fsPageBuffer(
   return rc;
 }
 
+/*
+** The shared page cache.
+**
+** In compressed database mode, reading a page requires reading the 
+** compressed page record from the database file and then uncompressing
+** it. Since the apHash/nHash cache belonging to each connection is purged
+** each time a new snapshot is loaded, an object of the following type is
+** used to cache uncompressed page images across snapshots and among all
+** connections to the same database within a process. The object is owned 
+** by the Database object (see lsm_shared.c) and protected by its own 
+** mutex.
+**
+** Entries are keyed by page number, which in compressed database mode is
+** the offset of the compressed page record within the database file. 
+** Each entry is also linked into a second hash table keyed by the number
+** of the block on which the page record begins, so that the entries for 
+** a single block may be found without scanning the entire cache. The
+** cache may also contain entries for free space records (see the comment
+** at the top of this file), which carry no page image. Since
+** a page record is never modified once it has been written, an entry 
+** remains valid until the block it is stored on is reused. Blocks reused
+** by connections within this process are removed from the cache by
+** lsmFsCacheInvalidate(), called from lsmBlockAllocate(). To guard 
+** against blocks being reused by other processes, the cache records the
+** id of the most recent snapshot created within this process (iSnap). If
+** a connection loads a newer snapshot, it must have been created by some
+** other process and the entire cache is purged (see lsmFsCacheSnapshot()).
+**
+** Eviction uses a segmented LRU scheme. Newly inserted entries are added 
+** to the "probationary" list. An entry is moved to the "protected" list
+** the next time it is found in the cache. Entries are evicted from the 
+** head of the probationary list first, so that a large scan (which reads
+** each page once only) does not evict pages that are used repeatedly, 
+** such as b-tree interior pages. If the protected list grows larger than
+** PAGECACHE_PROTECTED percent of the configured size, entries are moved
+** from its head to the tail of the probationary list.
+*/
+#define PAGECACHE_PROTECTED 80
+
+typedef struct CacheEntry CacheEntry;
+typedef struct CacheList CacheList;
+
+struct CacheEntry {
+  Pgno iPg;                       /* Page number (offset of page record) */
+  int iBlk;                       /* Block on which page record begins */
+  int nCompress;                  /* Compressed size, or bytes of free space */
+  int nData;                      /* Size of page image (0 for free space) */
+  int bProtected;                 /* True if on the protected list */
+  u8 *aData;                      /* Uncompressed page image */
+  CacheEntry *pHashNext;          /* Next entry in same hash slot */
+  CacheEntry *pBlkNext;           /* Next entry in same apBlk[] slot */
+  CacheEntry *pBlkPrev;           /* Previous entry in same apBlk[] slot */
+  CacheEntry *pNext;              /* Next entry in LRU list */
+  CacheEntry *pPrev;              /* Previous entry in LRU list */
+};
+
+struct CacheList {
+  CacheEntry *pFirst;             /* Least recently used entry */
+  CacheEntry *pLast;              /* Most recently used entry */
+  i64 nByte;                      /* Total size of entries on this list */
+};
+
+struct PageCache {
+  lsm_mutex *pMutex;              /* Mutex protecting this object */
+  i64 nMax;                       /* Configured size of cache in bytes */
+  i64 iSnap;                      /* Most recent snapshot created locally */
+  CacheList probation;            /* Entries found in cache 0 times */
+  CacheList protect;              /* Entries found in cache 1 or more times */
+  int nEntry;                     /* Number of entries in hash table */
+  int nHash;                      /* Number of slots in apHash[], apBlk[] */
+  CacheEntry **apHash;            /* Hash table keyed by page number */
+  CacheEntry **apBlk;             /* Hash table keyed by block number */
+  int nHit;                       /* Number of successful lookups */
+  int nMiss;                      /* Number of unsuccessful lookups */
+};
+
+/*
+** Return the number of bytes of memory used by cache entry p.
+*/
+static i64 fsCacheEntrySize(CacheEntry *p){
+  return (i64)sizeof(CacheEntry) + p->nData;
+}
+
+static int fsCacheHash(int nHash, Pgno iPg){
+  return (int)((u64)iPg % (u64)nHash);
+}
+
+/*
+** Add entry p to the start of the list in slot iBlk of hash table apBlk[].
+*/
+static void fsCacheBlkLink(CacheEntry **apBlk, int nHash, CacheEntry *p){
+  CacheEntry **pp = &apBlk[fsCacheHash(nHash, p->iBlk)];
+  p->pBlkPrev = 0;
+  p->pBlkNext = *pp;
+  if( *pp ) (*pp)->pBlkPrev = p;
+  *pp = p;
+}
+
+/*
+** Remove entry p from the list it is on in the PageCache.apBlk[] table.
+*/
+static void fsCacheBlkUnlink(PageCache *pCache, CacheEntry *p){
+  if( p->pBlkNext ) p->pBlkNext->pBlkPrev = p->pBlkPrev;
+  if( p->pBlkPrev ){
+    p->pBlkPrev->pBlkNext = p->pBlkNext;
+  }else{
+    pCache->apBlk[fsCacheHash(pCache->nHash, p->iBlk)] = p->pBlkNext;
+  }
+}
+
+/*
+** Remove entry p from the LRU list it is currently on.
+*/
+static void fsCacheUnlink(PageCache *pCache, CacheEntry *p){
+  CacheList *pList = (p->bProtected ? &pCache->protect : &pCache->probation);
+  if( p->pNext ){
+    p->pNext->pPrev = p->pPrev;
+  }else{
+    pList->pLast = p->pPrev;
+  }
+  if( p->pPrev ){
+    p->pPrev->pNext = p->pNext;
+  }else{
+    pList->pFirst = p->pNext;
+  }
+  p->pNext = p->pPrev = 0;
+  pList->nByte -= fsCacheEntrySize(p);
+}
+
+/*
+** Add entry p to the most recently used end of the probationary list (if
+** bProtected is false) or the protected list (if it is true).
+*/
+static void fsCacheLink(PageCache *pCache, CacheEntry *p, int bProtected){
+  CacheList *pList = (bProtected ? &pCache->protect : &pCache->probation);
+  assert( p->pNext==0 && p->pPrev==0 );
+  p->bProtected = bProtected;
+  p->pPrev = pList->pLast;
+  if( p->pPrev ){
+    p->pPrev->pNext = p;
+  }else{
+    pList->pFirst = p;
+  }
+  pList->pLast = p;
+  pList->nByte += fsCacheEntrySize(p);
+}
+
+/*
+** Remove entry p from the cache altogether and free it.
+*/
+static void fsCacheRemove(lsm_env *pEnv, PageCache *pCache, CacheEntry *p){
+  CacheEntry **pp;
+  fsCacheUnlink(pCache, p);
+  pp = &pCache->apHash[fsCacheHash(pCache->nHash, p->iPg)];
+  while( *pp!=p ) pp = &(*pp)->pHashNext;
+  *pp = p->pHashNext;
+  fsCacheBlkUnlink(pCache, p);
+  pCache->nEntry--;
+  lsmFree(pEnv, p);
+}
+
+/*
+** Evict entries from the cache until there is room for a new entry nReq
+** bytes in size. Entries are evicted from the probationary list first.
+*/
+static void fsCacheEvict(lsm_env *pEnv, PageCache *pCache, i64 nReq){
+  while( pCache->nEntry>0 
+      && pCache->probation.nByte+pCache->protect.nByte+nReq > pCache->nMax
+  ){
+    CacheEntry *p = pCache->probation.pFirst;
+    if( p==0 ) p = pCache->protect.pFirst;
+    fsCacheRemove(pEnv, pCache, p);
+  }
+}
+
+/*
+** Remove all entries from the cache.
+*/
+static void fsCachePurge(lsm_env *pEnv, PageCache *pCache){
+  while( pCache->probation.pFirst ){
+    fsCacheRemove(pEnv, pCache, pCache->probation.pFirst);
+  }
+  while( pCache->protect.pFirst ){
+    fsCacheRemove(pEnv, pCache, pCache->protect.pFirst);
+  }
+  assert( pCache->nEntry==0 );
+}
+
+/*
+** Allocate a new, empty, page cache configured to use at most nMax bytes
+** of memory.
+*/
+int lsmFsCacheNew(lsm_env *pEnv, i64 nMax, PageCache **ppCache){
+  int rc = LSM_OK;
+  PageCache *pCache;
+
+  pCache = (PageCache *)lsmMallocZeroRc(pEnv, sizeof(PageCache), &rc);
+  if( rc==LSM_OK ){
+    pCache->nMax = nMax;
+    pCache->nHash = 256;
+    pCache->apHash = (CacheEntry **)lsmMallocZeroRc(
+        pEnv, sizeof(CacheEntry *) * pCache->nHash, &rc
+    );
+    pCache->apBlk = (CacheEntry **)lsmMallocZeroRc(
+        pEnv, sizeof(CacheEntry *) * pCache->nHash, &rc
+    );
+  }
+  if( rc==LSM_OK ){
+    rc = lsmMutexNew(pEnv, &pCache->pMutex);
+  }
+  if( rc!=LSM_OK ){
+    lsmFsCacheFree(pEnv, pCache);
+    pCache = 0;
+  }
+  *ppCache = pCache;
+  return rc;
+}
+
+/*
+** Free a page cache allocated by lsmFsCacheNew().
+*/
+void lsmFsCacheFree(lsm_env *pEnv, PageCache *pCache){
+  if( pCache ){
+    if( pCache->apHash && pCache->apBlk ) fsCachePurge(pEnv, pCache);
+    lsmMutexDel(pEnv, pCache->pMutex);
+    lsmFree(pEnv, pCache->apHash);
+    lsmFree(pEnv, pCache->apBlk);
+    lsmFree(pEnv, pCache);
+  }
+}
+
+/*
+** Set the maximum size of the cache to nMax bytes. If the cache is 
+** currently larger than this, evict entries until it is not.
+*/
+void lsmFsCacheConfigure(lsm_env *pEnv, PageCache *pCache, i64 nMax){
+  lsmMutexEnter(pEnv, pCache->pMutex);
+  pCache->nMax = nMax;
+  fsCacheEvict(pEnv, pCache, 0);
+  lsmMutexLeave(pEnv, pCache->pMutex);
+}
+
+/*
+** Return the configured maximum size of the cache in bytes.
+*/
+i64 lsmFsCacheSize(lsm_env *pEnv, PageCache *pCache){
+  i64 nMax;
+  lsmMutexEnter(pEnv, pCache->pMutex);
+  nMax = pCache->nMax;
+  lsmMutexLeave(pEnv, pCache->pMutex);
+  return nMax;
+}
+
+/*
+** Set *pnHit and *pnMiss to the number of successful and unsuccessful
+** cache lookups, respectively.
+*/
+void lsmFsCacheStats(lsm_env *pEnv, PageCache *pCache, int *pnHit, int *pnMiss){
+  lsmMutexEnter(pEnv, pCache->pMutex);
+  *pnHit = pCache->nHit;
+  *pnMiss = pCache->nMiss;
+  lsmMutexLeave(pEnv, pCache->pMutex);
+}
+
+/*
+** This function is called each time a connection loads a worker or client
+** snapshot (bNew==0), and each time a connection creates a new snapshot
+** (bNew!=0). In the latter case, iId is the id of the new snapshot.
+**
+** If a connection loads a snapshot newer than the newest created within
+** this process, it was created by another process that may have reused
+** blocks from which pages are cached. In this case the cache is purged.
+*/
+void lsmFsCacheSnapshot(lsm_env *pEnv, PageCache *pCache, i64 iId, int bNew){
+  lsmMutexEnter(pEnv, pCache->pMutex);
+  if( iId>pCache->iSnap ){
+    if( bNew==0 ) fsCachePurge(pEnv, pCache);
+    pCache->iSnap = iId;
+  }
+  lsmMutexLeave(pEnv, pCache->pMutex);
+}
+
+/*
+** Block iBlk has just been allocated for reuse. Remove any cached pages
+** that begin on the block from the shared page cache.
+*/
+void lsmFsCacheInvalidate(FileSystem *pFS, int iBlk){
+  PageCache *pCache = pFS->pCache;
+  CacheEntry *p;
+  CacheEntry *pNext;
+
+  lsmMutexEnter(pFS->pEnv, pCache->pMutex);
+  for(p=pCache->apBlk[fsCacheHash(pCache->nHash, iBlk)]; p; p=pNext){
+    pNext = p->pBlkNext;
+    if( p->iBlk==iBlk ) fsCacheRemove(pFS->pEnv, pCache, p);
+  }
+  lsmMutexLeave(pFS->pEnv, pCache->pMutex);
+}
+
+/*
+** Search the shared page cache for a copy of page pPg->iPg. If one is
+** found, copy it into the pPg->aData[] buffer, set pPg->nCompress and 
+** return true. Or, if the cache indicates that there is a free space
+** record at offset pPg->iPg, set *pnSpace to the total number of free
+** bytes and return true. Otherwise, if there is no entry, return false.
+*/
+static int fsCacheFetch(FileSystem *pFS, Page *pPg, int *pnSpace){
+  PageCache *pCache = pFS->pCache;
+  CacheEntry *p;
+
+  assert( pFS->pCompress );
+  lsmMutexEnter(pFS->pEnv, pCache->pMutex);
+  p = pCache->apHash[fsCacheHash(pCache->nHash, pPg->iPg)];
+  while( p && p->iPg!=pPg->iPg ) p = p->pHashNext;
+  if( p && (p->nData==0 || p->nData==pFS->nPagesize) ){
+    if( p->nData==0 ){
+      *pnSpace = p->nCompress;
+    }else{
+      memcpy(pPg->aData, p->aData, p->nData);
+      pPg->nCompress = p->nCompress;
+    }
+    pCache->nHit++;
+
+    /* Move the entry to the end of the protected list. Then, if the
+    ** protected list has grown too large, demote entries from the start
+    ** of it to the probationary list.  */
+    fsCacheUnlink(pCache, p);
+    fsCacheLink(pCache, p, 1);
+    while( pCache->protect.nByte > pCache->nMax/100*PAGECACHE_PROTECTED ){
+      CacheEntry *pDemote = pCache->protect.pFirst;
+      fsCacheUnlink(pCache, pDemote);
+      fsCacheLink(pCache, pDemote, 0);
+    }
+  }else{
+    pCache->nMiss++;
+    p = 0;
+  }
+  lsmMutexLeave(pFS->pEnv, pCache->pMutex);
+  return (p!=0);
+}
+
+/*
+** Add a copy of page pPg, which has just been read from disk and 
+** uncompressed, to the shared page cache. Or, if nSpace is greater than
+** zero, record the fact that there is a free space record nSpace bytes
+** in size at offset pPg->iPg. Since the cache is only an optimization, a
+** failure to allocate memory is ignored.
+*/
+static void fsCacheInsert(FileSystem *pFS, Page *pPg, int nSpace){
+  PageCache *pCache = pFS->pCache;
+  lsm_env *pEnv = pFS->pEnv;
+  int nData = (nSpace ? 0 : pFS->nPagesize);
+  int iHash;
+  CacheEntry *p;
+
+  assert( pFS->pCompress && (pPg->nCompress>0 || nSpace>0) );
+  lsmMutexEnter(pEnv, pCache->pMutex);
+  if( ((i64)sizeof(CacheEntry) + nData)<=pCache->nMax ){
+
+    /* Grow the hash tables if they are more than full. */
+    if( pCache->nEntry>=pCache->nHash ){
+      int nNew = pCache->nHash*2;
+      CacheEntry **aNew = lsmMallocZero(pEnv, sizeof(CacheEntry *) * nNew);
+      CacheEntry **aNewBlk = lsmMallocZero(pEnv, sizeof(CacheEntry *) * nNew);
+      if( aNew && aNewBlk ){
+        int i;
+        for(i=0; i<pCache->nHash; i++){
+          CacheEntry *pNext;
+          for(p=pCache->apHash[i]; p; p=pNext){
+            int iNew = fsCacheHash(nNew, p->iPg);
+            pNext = p->pHashNext;
+            p->pHashNext = aNew[iNew];
+            aNew[iNew] = p;
+            fsCacheBlkLink(aNewBlk, nNew, p);
+          }
+        }
+        lsmFree(pEnv, pCache->apHash);
+        lsmFree(pEnv, pCache->apBlk);
+        pCache->apHash = aNew;
+        pCache->apBlk = aNewBlk;
+        pCache->nHash = nNew;
+      }else{
+        lsmFree(pEnv, aNew);
+        lsmFree(pEnv, aNewBlk);
+      }
+    }
+
+    /* Another connection may have added the page since fsCacheFetch() 
+    ** was called. In this case there is nothing to do.  */
+    iHash = fsCacheHash(pCache->nHash, pPg->iPg);
+    for(p=pCache->apHash[iHash]; p && p->iPg!=pPg->iPg; p=p->pHashNext);
+    if( p==0 ){
+      fsCacheEvict(pEnv, pCache, (i64)sizeof(CacheEntry) + nData);
+      p = (CacheEntry *)lsmMallocZero(pEnv, sizeof(CacheEntry) + nData);
+      if( p ){
+        p->iPg = pPg->iPg;
+        p->iBlk = fsPageToBlock(pFS, pPg->iPg);
+        p->nCompress = (nSpace ? nSpace : pPg->nCompress);
+        p->nData = nData;
+        p->aData = (u8 *)&p[1];
+        memcpy(p->aData, pPg->aData, nData);
+        p->pHashNext = pCache->apHash[iHash];
+        pCache->apHash[iHash] = p;
+        fsCacheBlkLink(pCache->apBlk, pCache->nHash, p);
+        pCache->nEntry++;
+        fsCacheLink(pCache, p, 0);
+      }
+    }
+  }
+  lsmMutexLeave(pEnv, pCache->pMutex);
+}
+
 /*
 ** Assuming *pRc is initially LSM_OK, attempt to ensure that the 
 ** memory-mapped region is at least iSz bytes in size. If it is not already,
@@ -1591,13 +2011,17 @@ static int fsPageGet(
         assert( p->pLruNext==0 && p->pLruPrev==0 );
         if( noContent==0 ){
           if( pFS->pCompress ){
-            rc = fsReadPagedata(pFS, pSeg, p, &nSpace);
+            if( fsCacheFetch(pFS, p, &nSpace)==0 ){
+              rc = fsReadPagedata(pFS, pSeg, p, &nSpace);
+              if( rc==LSM_OK ) fsCacheInsert(pFS, p, nSpace);
+              pFS->nRead++;
+            }
           }else{
             int nByte = pFS->nPagesize;
             i64 iOff = (i64)(iReal-1) * pFS->nPagesize;
             rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, p->aData, nByte);
+            pFS->nRead++;
           }
-          pFS->nRead++;
         }
 
         /* If the xRead() call was successful (or not attempted), link the
@@ -190,6 +190,17 @@
 # include "lsmInt.h"
 #endif
 
+/*
+** Where the compiler and CPU support them, vector instructions (AVX2) are
+** used to compute log checksums. Define LSM_NO_HWCKSUM to always use the
+** portable C version.
+*/
+#if !defined(LSM_NO_HWCKSUM) && defined(__GNUC__) \
+ && (defined(__i386__) || defined(__x86_64__))
+# include <immintrin.h>
+# define LSM_HWCKSUM_X86 1
+#endif
+
 /* Log record types */
 #define LSM_LOG_EOF          0x00
 #define LSM_LOG_PAD1         0x01
@@ -208,6 +219,12 @@
 /* Do not wrap a log file smaller than this in bytes. */
 #define LSM_MIN_LOGWRAP      (128*1024)
 
+/* Bytes read from the log file at a time during recovery. */
+#define LSM_LOG_READSIZE     (64*1024)
+
+/* Report recovery progress each time this many bytes have been replayed. */
+#define LSM_RECOVER_PROGRESS (4*1024*1024)
+
 /*
 ** szSector:
 **   Commit records must be aligned to end on szSector boundaries. If
@@ -239,6 +256,92 @@ static u32 getU32le(u8 *aIn){
 }
 
 
+#ifdef LSM_HWCKSUM_X86
+/*
+** The log checksum is linear in its input. If F(i) is the i'th Fibonacci
+** number (mod 2^32), with F(-1)==1, then after consuming the 2N 32-bit
+** words x[0] to x[2N-1]:
+**
+**   s0 = F(2N-1)*s0 + F(2N)*s1   + SUM( F(2N-1-i) * x[i] )
+**   s1 = F(2N)*s0   + F(2N+1)*s1 + SUM( F(2N-i) * x[i] )
+**
+** This function uses the above to checksum blocks of LOG_CKSUM_NWORD
+** words at a time using vector multiply and add instructions, instead of
+** a serial chain of additions. The results are identical to those of the
+** loop in logCksumUnaligned(). The number of bytes consumed from the
+** start of buffer a[] is returned.
+**
+** Since this is only used on x86 hosts, the words are little-endian.
+*/
+#define LOG_CKSUM_NWORD 64
+__attribute__((target("avx2")))
+static int logCksumAvx2(const u8 *a, int n, u32 *pCksum0, u32 *pCksum1){
+  const int nBlk = LOG_CKSUM_NWORD*4;
+  u32 aFib[LOG_CKSUM_NWORD+2];
+  u32 aW0[LOG_CKSUM_NWORD];       /* Weights for cksum0 */
+  u32 aW1[LOG_CKSUM_NWORD];       /* Weights for cksum1 */
+  u32 cksum0 = *pCksum0;
+  u32 cksum1 = *pCksum1;
+  int iOff;
+  int i;
+
+  aFib[0] = 0;
+  aFib[1] = 1;
+  for(i=2; i<LOG_CKSUM_NWORD+2; i++) aFib[i] = aFib[i-1] + aFib[i-2];
+  for(i=0; i<LOG_CKSUM_NWORD; i++){
+    aW0[i] = aFib[LOG_CKSUM_NWORD-1-i];
+    aW1[i] = aFib[LOG_CKSUM_NWORD-i];
+  }
+
+  for(iOff=0; iOff+nBlk<=n; iOff+=nBlk){
+    __m256i v0 = _mm256_setzero_si256();
+    __m256i v1 = _mm256_setzero_si256();
+    u32 a0[8];
+    u32 a1[8];
+    u32 t0, t1;
+
+    for(i=0; i<LOG_CKSUM_NWORD; i+=8){
+      __m256i x = _mm256_loadu_si256((const __m256i*)&a[iOff + i*4]);
+      __m256i w0 = _mm256_loadu_si256((const __m256i*)&aW0[i]);
+      __m256i w1 = _mm256_loadu_si256((const __m256i*)&aW1[i]);
+      v0 = _mm256_add_epi32(v0, _mm256_mullo_epi32(x, w0));
+      v1 = _mm256_add_epi32(v1, _mm256_mullo_epi32(x, w1));
+    }
+    _mm256_storeu_si256((__m256i*)a0, v0);
+    _mm256_storeu_si256((__m256i*)a1, v1);
+    t0 = a0[0] + a0[1] + a0[2] + a0[3] + a0[4] + a0[5] + a0[6] + a0[7];
+    t1 = a1[0] + a1[1] + a1[2] + a1[3] + a1[4] + a1[5] + a1[6] + a1[7];
+
+    t0 += aFib[LOG_CKSUM_NWORD-1]*cksum0 + aFib[LOG_CKSUM_NWORD]*cksum1;
+    t1 += aFib[LOG_CKSUM_NWORD]*cksum0 + aFib[LOG_CKSUM_NWORD+1]*cksum1;
+    cksum0 = t0;
+    cksum1 = t1;
+  }
+
+  *pCksum0 = cksum0;
+  *pCksum1 = cksum1;
+  return iOff;
+}
+#endif /* ifdef LSM_HWCKSUM_X86 */
+
+/*
+** If the CPU supports AVX2 instructions, extend the checksum in *pCksum0
+** and *pCksum1 with as many whole blocks of LOG_CKSUM_NWORD words from
+** the start of buffer a[] (n bytes in size) as possible and return the
+** number of bytes consumed. Otherwise, return zero.
+**
+** The bt module computes the same checksum for its log frames, so this
+** is also called by btLogChecksum() in bt_log.c.
+*/
+int lsmCksumAvx2(const u8 *a, int n, u32 *pCksum0, u32 *pCksum1){
+#ifdef LSM_HWCKSUM_X86
+  if( n>=LOG_CKSUM_NWORD*4 && __builtin_cpu_supports("avx2") ){
+    return logCksumAvx2(a, n, pCksum0, pCksum1);
+  }
+#endif
+  return 0;
+}
+
 /*
 ** This function is the same as logCksum(), except that pointer "a" need
 ** not be aligned to an 8-byte boundary or padded with zero bytes. This
@@ -254,10 +357,11 @@ static void logCksumUnaligned(
   u32 cksum0 = *pCksum0;
   u32 cksum1 = *pCksum1;
   int nIn = (n/8) * 8;
-  int i;
+  int i = 0;
 
   assert( n>0 );
-  for(i=0; i<nIn; i+=8){
+  i = lsmCksumAvx2(a, nIn, &cksum0, &cksum1);
+  for(; i<nIn; i+=8){
     cksum0 += getU32le(&a[i]) + cksum1;
     cksum1 += getU32le(&a[i+4]) + cksum0;
   }
@@ -638,13 +742,9 @@ static int logFlush(lsm_db *pDb, int eType){
   pLog->buf.z[pLog->buf.n++] = eType;
   memset(&pLog->buf.z[pLog->buf.n], 0, 8);
 
-  rc = logCksumAndFlush(pDb);
-
-  /* If this is a commit and synchronous=full, sync the log to disk. */
-  if( rc==LSM_OK && eType==LSM_LOG_COMMIT && pDb->eSafety==LSM_SAFETY_FULL ){
-    rc = lsmFsSyncLog(pDb->pFS);
-  }
-  return rc;
+  /* If this is a commit and synchronous=full, the caller syncs the log
+  ** to disk (see lsmDbSyncLog()).  */
+  return logCksumAndFlush(pDb);
 }
 
 /*
@@ -821,6 +921,8 @@ struct LogReader {
   int iCksumBuf;                  /* Offset in buf corresponding to cksum[01] */
   u32 cksum0;                     /* Checksum 0 at offset iCksumBuf */
   u32 cksum1;                     /* Checksum 1 at offset iCksumBuf */
+  int bNoCksum;                   /* True to skip checksum verification */
+  i64 nRead;                      /* Total bytes read from the log file */
 };
 
 static void logReaderBlob(
@@ -830,7 +932,6 @@ static void logReaderBlob(
   u8 **ppBlob,                    /* OUT: Pointer to blob read */
   int *pRc                        /* IN/OUT: Error code */
 ){
-  static const int LOG_READ_SIZE = 512;
   int rc = *pRc;                  /* Return code */
   int nReq = nBlob;               /* Bytes required */
 
@@ -844,7 +945,7 @@ static void logReaderBlob(
       if( nCksum>0 ){
         nCarry = nCksum % 8;
         nCksum = ((nCksum / 8) * 8);
-        if( nCksum>0 ){
+        if( nCksum>0 && p->bNoCksum==0 ){
           logCksumUnaligned(
               &p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1
           );
@@ -854,10 +955,11 @@ static void logReaderBlob(
       p->buf.n = nCarry;
       p->iBuf = nCarry;
 
-      rc = lsmFsReadLog(p->pFS, p->iOff, LOG_READ_SIZE, &p->buf);
+      rc = lsmFsReadLog(p->pFS, p->iOff, LSM_LOG_READSIZE, &p->buf);
       if( rc!=LSM_OK ) break;
       p->iCksumBuf = 0;
-      p->iOff += LOG_READ_SIZE;
+      p->iOff += LSM_LOG_READSIZE;
+      p->nRead += LSM_LOG_READSIZE;
     }
 
     nAvail = p->buf.n - p->iBuf;
@@ -912,15 +1014,21 @@ static void logReaderCksum(LogReader *p, LsmString *pBuf, int *pbEof, int *pRc){
 
     /* Update in-memory (expected) checksums */
     assert( nCksum>=0 );
-    logCksumUnaligned(&p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1);
+    if( p->bNoCksum==0 ){
+      logCksumUnaligned(
+          &p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1
+      );
+    }
     p->iCksumBuf = p->iBuf + 8;
     logReaderBlob(p, pBuf, 8, &pPtr, pRc);
 
     /* Read the checksums from the log file. Set *pbEof if they do not match. */
     if( pPtr ){
-      cksum0 = lsmGetU32(pPtr);
-      cksum1 = lsmGetU32(&pPtr[4]);
-      *pbEof = (cksum0!=p->cksum0 || cksum1!=p->cksum1);
+      if( p->bNoCksum==0 ){
+        cksum0 = lsmGetU32(pPtr);
+        cksum1 = lsmGetU32(&pPtr[4]);
+        *pbEof = (cksum0!=p->cksum0 || cksum1!=p->cksum1);
+      }
       p->iCksumBuf = p->iBuf;
     }
   }
@@ -940,6 +1048,8 @@ static void logReaderInit(
   p->buf.n = 0;
   p->iCksumBuf = 0;
   p->iBuf = 0;
+  p->bNoCksum = 0;
+  p->nRead = 0;
 }
 
 /*
@@ -954,6 +1064,11 @@ static int logRequireCksum(LogReader *p, int nByte){
 
 /*
 ** Recover the contents of the log file.
+**
+** The log is read twice. The first pass verifies checksums and counts 
+** the committed transactions. The second inserts the contents of those
+** transactions into the in-memory tree. As the data has already been 
+** verified, checksums are not calculated during the second pass.
 */
 int lsmLogRecover(lsm_db *pDb){
   LsmString buf1;                 /* Key buffer */
@@ -961,6 +1076,10 @@ int lsmLogRecover(lsm_db *pDb){
   LogReader reader;               /* Log reader object */
   int rc = LSM_OK;                /* Return code */
   int nCommit = 0;                /* Number of transactions to recover */
+  int nTotal = 0;                 /* Total transactions to recover */
+  i64 nReport = LSM_RECOVER_PROGRESS;  /* Report progress at this offset */
+  u32 cksum0 = 0;                 /* Checksum 0 after last commit in pass 0 */
+  u32 cksum1 = 0;                 /* Checksum 1 after last commit in pass 0 */
   int iPass;
   int nJump = 0;                  /* Number of LSM_LOG_JUMP records in pass 0 */
   DbLog *pLog;
@@ -1050,6 +1169,15 @@ int lsmLogRecover(lsm_db *pDb){
               nCommit++;
               assert( nCommit>0 || iPass==1 );
               if( nCommit==0 ) bEof = 1;
+              if( iPass==0 ){
+                cksum0 = reader.cksum0;
+                cksum1 = reader.cksum1;
+              }else if( reader.nRead>=nReport ){
+                lsmLogMessage(pDb, LSM_OK, "recovered %d/%d transactions",
+                    nTotal + nCommit, nTotal
+                );
+                nReport += LSM_RECOVER_PROGRESS;
+              }
             }
             break;
 
@@ -1097,6 +1225,8 @@ int lsmLogRecover(lsm_db *pDb){
           }
         }
         logReaderInit(pDb, pLog, 0, &reader);
+        reader.bNoCksum = (iPass==0);
+        nTotal = nCommit;
         nCommit = nCommit * -1;
       }
     }
@@ -1105,8 +1235,13 @@ int lsmLogRecover(lsm_db *pDb){
   /* Initialize DbLog object */
   if( rc==LSM_OK ){
     pLog->aRegion[2].iEnd = reader.iOff - reader.buf.n + reader.iBuf;
-    pLog->cksum0 = reader.cksum0;
-    pLog->cksum1 = reader.cksum1;
+    if( reader.bNoCksum ){
+      pLog->cksum0 = cksum0;
+      pLog->cksum1 = cksum1;
+    }else{
+      pLog->cksum0 = reader.cksum0;
+      pLog->cksum1 = reader.cksum1;
+    }
   }
 
   if( rc==LSM_OK ){
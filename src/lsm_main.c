@@ -97,6 +97,10 @@ int lsm_new(lsm_env *pEnv, lsm_db **ppDb){
   pDb->iRwclient = -1;
   pDb->bMultiProc = LSM_DFLT_MULTIPLE_PROCESSES;
   pDb->iMmap = LSM_DFLT_MMAP;
+  pDb->nPageCache = LSM_DFLT_PAGE_CACHE;
+  pDb->eMergePolicy = LSM_DFLT_MERGE_POLICY;
+  pDb->nMergeWindow = LSM_DFLT_MERGE_WINDOW;
+  pDb->nCommitDelay = LSM_DFLT_COMMIT_DELAY;
   pDb->xLog = xLog;
   pDb->compress.iId = LSM_COMPRESSION_NONE;
   return LSM_OK;
@@ -162,6 +166,119 @@ static void assertRwclientLockValue(lsm_db *db){
 #endif
 }
 
+/*
+** The following object is used to manage the background worker thread
+** started if LSM_CONFIG_WORKER_THREAD is set. The thread flushes, merges
+** and checkpoints the database using a private connection of its own.
+*/
+struct BgWorker {
+  lsm_db *pDb;                    /* Connection used by worker thread */
+  LsmThread *pThread;             /* Worker thread handle */
+  int rc;                         /* Error code that stopped thread */
+};
+
+/*
+** Main routine for the background worker thread. Each time it is woken,
+** the thread performs work until there is no more to do (or until it is
+** asked to stop). It then waits to be signalled by the client connection,
+** or for LSM_BGWORK_POLL ms, whichever happens first.
+**
+** After each call to lsm_work(), the thread reports progress so that any
+** client blocked in bgWorkerThrottle() may check whether or not it can
+** proceed.
+*/
+static void bgWorkerMain(LsmThread *pThread, void *pCtx){
+  BgWorker *p = (BgWorker *)pCtx;
+  int rc = LSM_OK;
+  int bStop = 0;
+
+  while( bStop==0 ){
+    int nWrite = 0;
+    rc = lsm_work(p->pDb, 0, LSM_BGWORK_KB, &nWrite);
+    if( rc==LSM_BUSY ) rc = LSM_OK;
+    if( rc!=LSM_OK ) break;
+    lsmThreadProgress(pThread);
+    bStop = lsmThreadWait(pThread, (nWrite>0 ? 0 : LSM_BGWORK_POLL));
+  }
+
+  if( rc!=LSM_OK ){
+    lsmLogMessage(p->pDb, rc, "background worker thread stopped");
+  }
+  p->rc = rc;
+}
+
+/*
+** Stop the background worker thread belonging to connection pDb, if any,
+** and close its private connection.
+*/
+static void bgWorkerStop(lsm_db *pDb){
+  BgWorker *p = pDb->pBgWorker;
+  if( p ){
+    lsmThreadStop(p->pThread);
+    lsm_close(p->pDb);
+    lsmFree(pDb->pEnv, p);
+    pDb->pBgWorker = 0;
+  }
+}
+
+/*
+** Open a private connection to database zFull (a full path) configured in
+** the same way as pDb, and start a background worker thread that uses it.
+*/
+static int bgWorkerStart(lsm_db *pDb, const char *zFull){
+  BgWorker *p;
+  int rc = LSM_OK;
+
+  p = (BgWorker *)lsmMallocZeroRc(pDb->pEnv, sizeof(BgWorker), &rc);
+  if( rc==LSM_OK ) rc = lsm_new(pDb->pEnv, &p->pDb);
+  if( rc==LSM_OK ){
+    lsm_db *pWorker = p->pDb;
+    pWorker->xCmp = pDb->xCmp;
+    pWorker->eSafety = pDb->eSafety;
+    pWorker->bAutowork = 0;
+    pWorker->nTreeLimit = pDb->nTreeLimit;
+    pWorker->nMerge = pDb->nMerge;
+    pWorker->nMaxFreelist = pDb->nMaxFreelist;
+    pWorker->iMmap = pDb->iMmap;
+    pWorker->nAutockpt = pDb->nAutockpt;
+    pWorker->bMultiProc = pDb->bMultiProc;
+    pWorker->nPageCache = pDb->nPageCache;
+    pWorker->eMergePolicy = pDb->eMergePolicy;
+    pWorker->nMergeWindow = pDb->nMergeWindow;
+    pWorker->xLog = pDb->xLog;
+    pWorker->pLogCtx = pDb->pLogCtx;
+
+    /* The compression methods and factory are shared with pDb. Clear the
+    ** destructors so that they are only invoked once, by pDb.  */
+    pWorker->compress = pDb->compress;
+    pWorker->compress.xFree = 0;
+    pWorker->factory = pDb->factory;
+    pWorker->factory.xFree = 0;
+
+    rc = lsm_open(pWorker, zFull);
+  }
+  if( rc==LSM_OK ){
+    rc = lsmThreadStart(pDb->pEnv, bgWorkerMain, (void *)p, &p->pThread);
+  }
+
+  if( rc==LSM_OK ){
+    pDb->pBgWorker = p;
+    pDb->bAutowork = 0;
+  }else if( p ){
+    lsm_close(p->pDb);
+    lsmFree(pDb->pEnv, p);
+  }
+  return rc;
+}
+
+/*
+** Signal the background worker thread belonging to connection pDb, if
+** any, that there may be work for it to do.
+*/
+void lsmBgWorkerSignal(lsm_db *pDb){
+  if( pDb->pBgWorker ) lsmThreadSignal(pDb->pBgWorker->pThread);
+}
+
 /*
 ** Open a new connection to database zFilename.
 */
@@ -198,6 +315,10 @@ int lsm_open(lsm_db *pDb, const char *zFilename){
         lsmFsSetPageSize(pDb->pFS, lsmCheckpointPgsz(pDb->aSnapshot));
         lsmFsSetBlockSize(pDb->pFS, lsmCheckpointBlksz(pDb->aSnapshot));
       }
+
+      if( rc==LSM_OK && pDb->bWorkerThread ){
+        rc = bgWorkerStart(pDb, zFull);
+      }
     }
 
     lsmFree(pDb->pEnv, zFull);
@@ -217,7 +338,9 @@ int lsm_close(lsm_db *pDb){
     if( pDb->pCsr || pDb->nTransOpen ){
       rc = LSM_MISUSE_BKPT;
     }else{
+      bgWorkerStop(pDb);
       lsmMCursorFreeCache(pDb);
+      lsmSortedFreeBloom(pDb);
       lsmFreeSnapshot(pDb->pEnv, pDb->pClient);
       pDb->pClient = 0;
 
@@ -262,7 +385,7 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
 
     case LSM_CONFIG_AUTOWORK: {
       int *piVal = va_arg(ap, int *);
-      if( *piVal>=0 ){
+      if( *piVal>=0 && pDb->pBgWorker==0 ){
         pDb->bAutowork = *piVal;
       }
       *piVal = pDb->bAutowork;
@@ -385,11 +508,70 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_CONFIG_WORKER_THREAD: {
+      int *piVal = va_arg(ap, int *);
+      if( pDb->pDatabase ){
+        /* If lsm_open() has been called, this is a read-only parameter. 
+        ** Set the output variable to true if a worker thread is running. */
+        *piVal = (pDb->pBgWorker!=0);
+      }else{
+        if( *piVal>=0 ) pDb->bWorkerThread = (*piVal!=0);
+        *piVal = pDb->bWorkerThread;
+      }
+      break;
+    }
+
+    case LSM_CONFIG_PAGE_CACHE: {
+      /* This parameter is read and written in KB. But all internal processing
+      ** (including the lsm_db.nPageCache variable) is done in bytes.  */
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ){
+        pDb->nPageCache = (i64)*piVal * 1024;
+        if( pDb->pDatabase ){
+          lsmFsCacheConfigure(pDb->pEnv, lsmDbPageCache(pDb), pDb->nPageCache);
+        }
+      }
+      if( pDb->pDatabase ){
+        *piVal = (int)(lsmFsCacheSize(pDb->pEnv, lsmDbPageCache(pDb)) / 1024);
+      }else{
+        *piVal = (int)(pDb->nPageCache / 1024);
+      }
+      break;
+    }
+
+    case LSM_CONFIG_MERGE_POLICY: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=LSM_MERGE_TIERED && *piVal<=LSM_MERGE_WINDOW ){
+        pDb->eMergePolicy = *piVal;
+      }
+      *piVal = pDb->eMergePolicy;
+      break;
+    }
+
+    case LSM_CONFIG_MERGE_WINDOW: {
+      /* This parameter is read and written in KB. But all internal processing
+      ** (including the lsm_db.nMergeWindow variable) is done in bytes.  */
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>0 ) pDb->nMergeWindow = (i64)*piVal * 1024;
+      *piVal = (int)(pDb->nMergeWindow / 1024);
+      break;
+    }
+
+    case LSM_CONFIG_COMMIT_DELAY: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ) pDb->nCommitDelay = *piVal;
+      *piVal = pDb->nCommitDelay;
+      break;
+    }
+
     case LSM_CONFIG_SET_COMPRESSION: {
       lsm_compress *p = va_arg(ap, lsm_compress *);
       if( pDb->iReader>=0 && pDb->bInFactory==0 ){
         /* May not change compression schemes with an open transaction */
         rc = LSM_MISUSE_BKPT;
+      }else if( p->xBound && p->iId>LSM_MAX_COMPRESSION_ID ){
+        /* Compression scheme ids are limited to 24 bits */
+        rc = LSM_MISUSE_BKPT;
       }else{
         if( pDb->compress.xFree ){
           /* Invoke any destructor belonging to the current compression. */
@@ -521,6 +703,32 @@ int lsmInfoFreelist(lsm_db *pDb, char **pzOut){
   return rc;
 }
 
+/*
+** Set *piVal to the space amplification of the database, multiplied by
+** 100. See the description of LSM_INFO_SPACE_AMP in lsm.h for details.
+*/
+static int infoSpaceAmp(lsm_db *pDb, int *piVal){
+  Snapshot *pWorker;              /* Worker snapshot */
+  int bUnlock = 0;
+  int rc;
+
+  rc = infoGetWorker(pDb, &pWorker, &bUnlock);
+  if( rc==LSM_OK ){
+    i64 nTotal = 0;               /* Pages in all segments */
+    i64 nLast = 0;                /* Pages in the oldest level */
+    Level *p;
+    for(p=lsmDbSnapshotLevel(pWorker); p; p=p->pNext){
+      int i;
+      nLast = p->lhs.nSize;
+      for(i=0; i<p->nRight; i++) nLast += p->aRhs[i].nSize;
+      nTotal += nLast;
+    }
+    *piVal = (nLast ? (int)((nTotal * 100) / nLast) : 100);
+  }
+  infoFreeWorker(pDb, bUnlock);
+  return rc;
+}
+
 static int infoTreeSize(lsm_db *db, int *pnOldKB, int *pnNewKB){
   ShmHeader *pShm = db->pShmhdr;
   TreeHeader *p = &pShm->hdr1;
@@ -576,6 +784,35 @@ int lsm_info(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_INFO_PAGE_CACHE_HIT:
+    case LSM_INFO_PAGE_CACHE_MISS: {
+      int *piVal = va_arg(ap, int *);
+      int nHit = 0;
+      int nMiss = 0;
+      if( pDb->pDatabase ){
+        lsmFsCacheStats(pDb->pEnv, lsmDbPageCache(pDb), &nHit, &nMiss);
+      }
+      *piVal = (eParam==LSM_INFO_PAGE_CACHE_HIT ? nHit : nMiss);
+      break;
+    }
+
+    case LSM_INFO_WRITE_AMP: {
+      int *piVal = va_arg(ap, int *);
+      i64 nFlush = 0;
+      i64 nMerge = 0;
+      if( pDb->pDatabase ){
+        lsmDbWriteStats(pDb, &nFlush, &nMerge);
+      }
+      *piVal = (nFlush ? (int)(((nFlush + nMerge) * 100) / nFlush) : 100);
+      break;
+    }
+
+    case LSM_INFO_SPACE_AMP: {
+      int *piVal = va_arg(ap, int *);
+      rc = infoSpaceAmp(pDb, piVal);
+      break;
+    }
+
     case LSM_INFO_DB_STRUCTURE: {
       char **pzVal = va_arg(ap, char **);
       rc = lsmStructList(pDb, pzVal);
@@ -838,6 +1075,18 @@ int lsm_csr_value(lsm_cursor *pCsr, const void **ppVal, int *pnVal){
   return lsmMCursorValue((MultiCursor *)pCsr, (void **)ppVal, pnVal);
 }
 
+int lsm_csr_value_range(
+  lsm_cursor *pCsr, 
+  int iOff, 
+  int nByte, 
+  const void **ppVal, 
+  int *pnVal
+){
+  return lsmMCursorValueRange(
+      (MultiCursor *)pCsr, iOff, nByte, (void **)ppVal, pnVal
+  );
+}
+
 void lsm_config_log(
   lsm_db *pDb, 
   void (*xLog)(void *, int, const char *), 
@@ -871,11 +1120,41 @@ void lsmLogMessage(lsm_db *pDb, int rc, const char *zFormat, ...){
   }
 }
 
+/*
+** This function is called before opening a write transaction on a 
+** connection that uses a background worker thread. If the live in-memory
+** tree is already large enough to be flushed, but cannot be because the
+** worker has not yet finished flushing the previous (old) tree to disk,
+** wait for the worker to catch up. This limits the amount of memory used
+** by in-memory trees if the writer is faster than the worker.
+*/
+static void bgWorkerThrottle(lsm_db *pDb){
+  LsmThread *pThread = pDb->pBgWorker->pThread;
+  int iProgress = 0;
+  int bExit;
+
+  /* Take a snapshot of the worker's progress counter before checking the 
+  ** tree sizes. This ensures that a flush completed after the check
+  ** but before lsmThreadWaitProgress() is called is not missed.  */
+  bExit = lsmThreadWaitProgress(pThread, &iProgress, 0);
+  while( bExit==0 ){
+    int nOld;
+    int nNew;
+    infoTreeSize(pDb, &nOld, &nNew);
+    if( nOld==0 || ((i64)nNew*1024)<=pDb->nTreeLimit ) break;
+    lsmThreadSignal(pThread);
+    bExit = lsmThreadWaitProgress(pThread, &iProgress, LSM_BGWORK_POLL);
+  }
+}
+
 int lsm_begin(lsm_db *pDb, int iLevel){
   int rc;
 
   assert_db_state( pDb );
   rc = (pDb->bReadonly ? LSM_READONLY : LSM_OK);
+  if( rc==LSM_OK && pDb->nTransOpen==0 && pDb->pBgWorker ){
+    bgWorkerThrottle(pDb);
+  }
 
   /* A value less than zero means open one more transaction. */
   if( iLevel<0 ) iLevel = pDb->nTransOpen + 1;
@@ -923,12 +1202,18 @@ int lsm_commit(lsm_db *pDb, int iLevel){
 
   if( iLevel<pDb->nTransOpen ){
     if( iLevel==0 ){
-      /* Commit the transaction to disk. */
+      i64 iCommit = 0;
+
+      /* Commit the transaction to disk. If the safety level is FULL, the
+      ** log file is synced only after the WRITER lock has been released,
+      ** so that a single sync may cover transactions committed by other
+      ** connections in this process in the meantime.  */
       if( rc==LSM_OK ) rc = lsmLogCommit(pDb);
-      if( rc==LSM_OK && pDb->eSafety==LSM_SAFETY_FULL ){
-        rc = lsmFsSyncLog(pDb->pFS);
+      if( rc==LSM_OK && pDb->eSafety==LSM_SAFETY_FULL && pDb->bUseLog ){
+        iCommit = lsmDbLogCommitted(pDb);
       }
       lsmFinishWriteTrans(pDb, (rc==LSM_OK));
+      if( iCommit ) rc = lsmDbSyncLog(pDb, iCommit);
     }
     pDb->nTransOpen = iLevel;
   }
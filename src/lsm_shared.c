@@ -57,6 +57,15 @@ struct Database {
   int nShmChunk;                  /* Number of entries in apShmChunk[] array */
   void **apShmChunk;              /* Array of "shared" memory regions */
   lsm_db *pConn;                  /* List of connections to this db. */
+  i64 nFlushWrite;                /* Pages written by flushes */
+  i64 nMergeWrite;                /* Pages written by merges */
+  i64 iCommit;                    /* Commits written to the log */
+  i64 iCommitSynced;              /* Commits known to have been synced */
+  int bSyncing;                   /* True while a log sync is underway */
+  LsmCond *pSyncCond;             /* Broadcast when bSyncing is cleared */
+
+  /* Protected by its own mutex */
+  PageCache *pPageCache;          /* Shared cache of uncompressed pages */
 };
 
 /*
@@ -146,6 +155,10 @@ static void freeDatabase(lsm_env *pEnv, Database *p){
   if( p ){
     /* Free the mutexes */
     lsmMutexDel(pEnv, p->pClientMutex);
+    lsmCondDel(p->pSyncCond);
+
+    /* Free the shared page cache */
+    lsmFsCacheFree(pEnv, p->pPageCache);
 
     if( p->pFile ){
       lsmEnvClose(pEnv, p->pFile);
@@ -464,6 +477,12 @@ int lsmDbDatabaseConnect(
         memcpy((void *)p->zName, zName, nName+1);
         rc = lsmMutexNew(pEnv, &p->pClientMutex);
       }
+      if( rc==LSM_OK ){
+        rc = lsmCondNew(pEnv, &p->pSyncCond);
+      }
+      if( rc==LSM_OK ){
+        rc = lsmFsCacheNew(pEnv, pDb->nPageCache, &p->pPageCache);
+      }
 
       /* If nothing has gone wrong so far, open the shared fd. And if that
       ** succeeds and this connection requested single-process mode, 
@@ -543,6 +562,116 @@ LsmFile *lsmDbRecycleFd(lsm_db *db){
   return pRet;
 }
 
+/*
+** Return a pointer to the cache of uncompressed pages shared by all
+** connections to the same database as db.
+*/
+PageCache *lsmDbPageCache(lsm_db *db){
+  return db->pDatabase->pPageCache;
+}
+
+/*
+** Add nPg to the number of pages written to the database by flushes (if
+** bFlush is true) or merges (otherwise) performed by connections within
+** this process. These values are used to report write amplification.
+*/
+void lsmDbRecordWrite(lsm_db *db, int bFlush, int nPg){
+  Database *p = db->pDatabase;
+  lsmMutexEnter(db->pEnv, p->pClientMutex);
+  if( bFlush ){
+    p->nFlushWrite += nPg;
+  }else{
+    p->nMergeWrite += nPg;
+  }
+  lsmMutexLeave(db->pEnv, p->pClientMutex);
+}
+
+/*
+** Retrieve the values accumulated by lsmDbRecordWrite().
+*/
+void lsmDbWriteStats(lsm_db *db, i64 *pnFlush, i64 *pnMerge){
+  Database *p = db->pDatabase;
+  lsmMutexEnter(db->pEnv, p->pClientMutex);
+  *pnFlush = p->nFlushWrite;
+  *pnMerge = p->nMergeWrite;
+  lsmMutexLeave(db->pEnv, p->pClientMutex);
+}
+
+/*
+** This function is called by a connection that has just written a commit
+** record to the log file, while it is still holding the WRITER lock. It
+** returns a value to pass to lsmDbSyncLog() once the WRITER lock has
+** been released.
+*/
+i64 lsmDbLogCommitted(lsm_db *db){
+  Database *p = db->pDatabase;
+  i64 iRet;
+  lsmMutexEnter(db->pEnv, p->pClientMutex);
+  iRet = ++p->iCommit;
+  lsmMutexLeave(db->pEnv, p->pClientMutex);
+  return iRet;
+}
+
+/*
+** Ensure that the log file has been synced to disk since the commit 
+** identified by iCommit (a value returned by lsmDbLogCommitted()) was 
+** written to it.
+**
+** If no other connection within this process is syncing the log, this
+** connection does so, making all commit records written so far durable.
+** Otherwise, this function waits for the sync underway to finish, then
+** checks again - the commit may have been written after the sync began.
+**
+** The connection that syncs the log wakes all waiting connections using
+** condition variable Database.pSyncCond when it is finished. If the 
+** library is built without pthreads there is no condition variable, and
+** waiting connections poll instead.
+*/
+int lsmDbSyncLog(lsm_db *db, i64 iCommit){
+  Database *p = db->pDatabase;
+  int rc = LSM_OK;
+
+  lsmMutexEnter(db->pEnv, p->pClientMutex);
+  while( rc==LSM_OK && p->iCommitSynced<iCommit ){
+    if( p->bSyncing==0 ){
+      i64 iTarget;
+      p->bSyncing = 1;
+      lsmMutexLeave(db->pEnv, p->pClientMutex);
+
+      /* Give other connections a chance to add their commit records to 
+      ** this batch before syncing.  */
+      if( db->nCommitDelay>0 ) lsmEnvSleep(db->pEnv, db->nCommitDelay);
+
+      lsmMutexEnter(db->pEnv, p->pClientMutex);
+      iTarget = p->iCommit;
+      lsmMutexLeave(db->pEnv, p->pClientMutex);
+      rc = lsmFsSyncLog(db->pFS);
+      lsmMutexEnter(db->pEnv, p->pClientMutex);
+
+      p->bSyncing = 0;
+      if( rc==LSM_OK && iTarget>p->iCommitSynced ) p->iCommitSynced = iTarget;
+      if( p->pSyncCond ) lsmCondBroadcast(p->pSyncCond);
+    }else if( p->pSyncCond ){
+      /* Read the broadcast count while holding the client mutex, so that
+      ** a broadcast made after the mutex is released is not missed. The
+      ** timeout is only a safeguard - the syncing connection always 
+      ** broadcasts once it has cleared bSyncing.  */
+      int iSeq = 0;
+      lsmCondWait(p->pSyncCond, &iSeq, 0);
+      lsmMutexLeave(db->pEnv, p->pClientMutex);
+      lsmCondWait(p->pSyncCond, &iSeq, 1000);
+      lsmMutexEnter(db->pEnv, p->pClientMutex);
+    }else{
+      lsmMutexLeave(db->pEnv, p->pClientMutex);
+      lsmEnvSleep(db->pEnv, 50);
+      lsmMutexEnter(db->pEnv, p->pClientMutex);
+    }
+  }
+  lsmMutexLeave(db->pEnv, p->pClientMutex);
+
+  return rc;
+}
+
 /*
 ** Release a reference to a Database object obtained from 
 ** lsmDbDatabaseConnect(). There should be exactly one call to this function 
@@ -849,6 +978,12 @@ int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
     }
   }
 
+  /* Any pages cached from the previous incarnation of the block are now
+  ** out of date. Remove them from the shared page cache. */
+  if( rc==LSM_OK && iRet>0 ){
+    lsmFsCacheInvalidate(pDb->pFS, iRet);
+  }
+
   assert( iBefore>0 || iRet>0 || rc!=LSM_OK );
   *piBlk = iRet;
   return rc;
@@ -978,6 +1113,11 @@ int lsmBeginWork(lsm_db *pDb){
   if( rc==LSM_OK ){
     rc = lsmCheckpointLoadWorker(pDb);
   }
+  if( rc==LSM_OK ){
+    lsmFsCacheSnapshot(
+        pDb->pEnv, pDb->pDatabase->pPageCache, pDb->pWorker->iId, 0
+    );
+  }
   return rc;
 }
 
@@ -1179,6 +1319,11 @@ int lsmBeginReadTrans(lsm_db *pDb){
           ** version of the snapshot.  */
           if( pDb->pClient==0 ){
             rc = lsmCheckpointDeserialize(pDb, 0, pDb->aSnapshot,&pDb->pClient);
+            if( rc==LSM_OK ){
+              lsmFsCacheSnapshot(pDb->pEnv, 
+                  pDb->pDatabase->pPageCache, pDb->pClient->iId, 0
+              );
+            }
           }
           assert( (rc==LSM_OK)==(pDb->pClient!=0) );
           assert( pDb->iReader>=0 );
@@ -1424,6 +1569,7 @@ int lsmFinishWriteTrans(lsm_db *pDb, int bCommit){
   pDb->bDiscardOld = 0;
   lsmShmLock(pDb, LSM_LOCK_WRITER, LSM_LOCK_UNLOCK, 0);
 
+  if( bFlush ) lsmBgWorkerSignal(pDb);
   if( bFlush && pDb->bAutowork==0 && pDb->xWork ){
     pDb->xWork(pDb, pDb->pWorkCtx);
   }
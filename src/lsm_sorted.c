@@ -65,6 +65,60 @@
 **
 **   Finally, the blob of data containing the key, and for LSM_INSERT
 **   records, the value as well.
+**
+** PREFIX COMPRESSION:
+**
+**   In databases with a file-format version of 2 or greater (see 
+**   LSM_FORMAT_VERSION), the leaf pages of each segment have the 
+**   SEGMENT_PREFIX_FLAG flag set and use a slightly different record 
+**   format. In place of the key size field, each record header contains:
+**
+**     * The number of leading bytes the key shares with the key of the
+**       previous record that starts on the same page (nPrefix), and
+**     * the number of remaining bytes in the key (nSuffix),
+**
+**   both encoded as varints. Only the final nSuffix bytes of the key are
+**   stored in the record body. Records 0, LSM_PREFIX_RESTART, 
+**   2*LSM_PREFIX_RESTART and so on of each page are "restart points" - 
+**   for these nPrefix is always 0 and the key is stored in full. A key may 
+**   therefore be reconstructed by reading forward from the nearest restart
+**   point at or before it, and a page may be searched by first doing a 
+**   binary search of the restart points. B-tree pages are never prefix
+**   compressed.
+**
+** BLOOM FILTERS:
+**
+**   When a segment is completed, a Bloom filter containing each user key
+**   stored in the segment as an LSM_INSERT or LSM_POINT_DELETE record is 
+**   appended to it. The filter is stored on one or more pages following
+**   the b-tree pages, so that the last page of the segment (Segment.iLastPg,
+**   which is stored in the checkpoint) is always the last page of the 
+**   filter. Each filter page has the SEGMENT_BLOOM_FLAG flag set and 
+**   zero records. The filter bits are stored in the page body area of 
+**   each page in order. The final 20 bytes of the body area of the last 
+**   page contain a header:
+**
+**     * The id of the worker snapshot that created the filter (8 bytes).
+**     * The size of the filter in bytes (4 bytes).
+**     * The number of hash functions used (4 bytes).
+**     * The number of keys added to the filter (4 bytes).
+**
+**   The filter is sized before the first key is written to the segment,
+**   using the number of entries in the in-memory tree for a flush, or the
+**   key counts stored in the headers of the input segment filters for a
+**   merge. For an input segment with no filter, the number of records on
+**   its first page multiplied by its size in pages is used instead. See
+**   sortedBloomMergeKeys(). Segments written by lsm_bulk_load() have no
+**   filter, as the number of keys is not known in advance.
+**
+**   The footer pointer field of the last page is set to the page number
+**   of the first filter page, or to zero if the entire filter fits on
+**   the last page.
+**
+**   No filter is written for a segment that contains range-delete markers,
+**   or for a segment produced by a merge that was started by some other 
+**   connection. A point lookup (LSM_SEEK_EQ) may skip any segment with a
+**   filter that excludes the key. See sortedBloomSkip() for details.
 */
 
 #ifndef _LSM_INT_H
@@ -98,6 +152,11 @@
 #define SEGMENT_BTREE_FLAG     0x0001
 #define PGFTR_SKIP_NEXT_FLAG   0x0002
 #define PGFTR_SKIP_THIS_FLAG   0x0004
+#define SEGMENT_BLOOM_FLAG     0x0008
+#define SEGMENT_PREFIX_FLAG    0x0010
+
+/* Size of the header stored at the end of the last Bloom filter page */
+#define SEGMENT_BLOOM_HDR      20
 
 typedef struct SegmentPtr SegmentPtr;
 typedef struct Blob Blob;
@@ -133,6 +192,9 @@ struct SegmentPtr {
   Pgno iPgPtr;                  /* Cascade pointer offset */
   void *pKey; int nKey;         /* Key associated with current record */
   void *pVal; int nVal;         /* Current record value (eType==WRITE only) */
+  int iValOff;                  /* Offset of value on pPg, if pVal==0 */
+  int bSkip;                    /* Bloom filter excludes key of EQ seek */
+  int iKeyCell;                 /* Cell pKey/nKey was loaded from, or -1 */
 
   /* Blobs used to allocate buffers for pKey and pVal as required */
   Blob blob1;
@@ -201,6 +263,7 @@ struct MultiCursor {
   int eType;                      /* Cache of current key type */
   Blob key;                       /* Cache of current key (or NULL) */
   Blob val;                       /* Cache of current value */
+  Blob range;                     /* Part of value (lsmMCursorValueRange) */
 
   /* All the component cursors: */
   TreeCursor *apTreeCsr[2];       /* Up to two tree cursors */
@@ -292,6 +355,8 @@ struct MergeWorker {
   Page *pPage;                    /* Current output page */
   int nWork;                      /* Number of calls to mergeWorkerNextPage() */
   Pgno *aGobble;                  /* Gobble point for each input segment */
+  BloomBuild *pBloom;             /* Bloom filter under construction */
+  Blob prevKey;                   /* Key of last record written to pPage */
 
   Pgno iIndirect;
   struct SavedPgno {
@@ -512,6 +577,95 @@ static Pgno pageGetRecordPtr(u8 *aData, int nData, int iCell){
   return iRet;
 }
 
+/*
+** Page pPg is a leaf page with the SEGMENT_PREFIX_FLAG flag set. This
+** function reconstructs the key of cell iCell. If pBase is not NULL, then
+** (pBase/nBase) is the key of cell (iCell-1). Otherwise, the key is built
+** up starting from the nearest restart point at or before cell iCell.
+**
+** If successful, *ppKey and *pnKey are set to point to the key and LSM_OK
+** is returned. The key is either stored on page pPg itself, or in buffer 
+** pBlob. Buffer pTmp is used as scratch space if the key of cell iCell 
+** spans more than one page.
+*/
+static int sortedPrefixKey(
+  Segment *pSeg,                  /* Segment pPg belongs to */
+  Page *pPg,                      /* Page to read from */
+  int iCell,                      /* Index of cell on page to read */
+  void *pBase, int nBase,         /* Key of cell (iCell-1), or NULL */
+  void **ppKey, int *pnKey,       /* OUT: Key of cell iCell */
+  Blob *pBlob,                    /* Buffer to build key in */
+  Blob *pTmp                      /* Scratch buffer */
+){
+  int rc = LSM_OK;                /* Return code */
+  u8 *aData;                      /* Page data */
+  int nData;                      /* Size of aData[] in bytes */
+  int iEnd;                       /* Offset of end of record area */
+  u8 *pKey = (u8 *)pBase;         /* Key of cell i */
+  int nKey = nBase;               /* Size of pKey in bytes */
+  int i;                          /* Current cell */
+
+  aData = fsPageData(pPg, &nData);
+  iEnd = SEGMENT_EOF(nData, pageGetNRec(aData, nData));
+  assert( pageGetFlags(aData, nData) & SEGMENT_PREFIX_FLAG );
+  assert( iCell<pageGetNRec(aData, nData) );
+
+  i = (pBase ? iCell : (iCell - (iCell % LSM_PREFIX_RESTART)));
+  if( pBase==0 ) nKey = 0;
+  for(; rc==LSM_OK; i++){
+    u8 *aCell = pageGetCell(aData, nData, i);
+    int eType;
+    int nPrefix;
+    int nSuffix;
+    int nDummy;
+
+    eType = *aCell++;
+    aCell += lsmVarintGet32(aCell, &nDummy);
+    aCell += lsmVarintGet32(aCell, &nPrefix);
+    aCell += lsmVarintGet32(aCell, &nSuffix);
+    if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nDummy);
+
+    if( nPrefix>nKey || (i<iCell && (aCell-aData)+nSuffix>iEnd) ){
+      rc = LSM_CORRUPT_BKPT;
+    }else if( nPrefix==0 ){
+      nKey = nSuffix;
+      if( i==iCell ){
+        rc = sortedReadData(pSeg, pPg, aCell-aData, nKey, (void **)&pKey, pBlob);
+      }else{
+        pKey = aCell;
+      }
+    }else{
+      int bInBlob = (pKey==(u8 *)pBlob->pData);
+      u8 *aSuffix = aCell;
+      if( i==iCell ){
+        rc = sortedReadData(
+            pSeg, pPg, aCell-aData, nSuffix, (void **)&aSuffix, pTmp
+        );
+      }
+      if( rc==LSM_OK ){
+        rc = sortedBlobGrow(lsmPageEnv(pPg), pBlob, nPrefix+nSuffix);
+      }
+      if( rc==LSM_OK ){
+        u8 *aOut = (u8 *)pBlob->pData;
+        if( bInBlob==0 ) memcpy(aOut, pKey, nPrefix);
+        memcpy(&aOut[nPrefix], aSuffix, nSuffix);
+        pKey = aOut;
+        nKey = pBlob->nData = nPrefix + nSuffix;
+      }
+    }
+    if( i==iCell ) break;
+  }
+
+  *ppKey = (void *)pKey;
+  *pnKey = nKey;
+  return rc;
+}
+
+/*
+** Return a pointer to the key of cell iCell of leaf page pPg. If the key
+** is not stored contiguously on the page, it is copied into blob pBlob. 
+** NULL is returned (and *pnKey set to 0) if an error occurs.
+*/
 static u8 *pageGetKey(
   Segment *pSeg,                  /* Segment pPg belongs to */
   Page *pPg,                      /* Page to read from */
@@ -531,6 +685,20 @@ static u8 *pageGetKey(
   assert( !(pageGetFlags(aData, nData) & SEGMENT_BTREE_FLAG) );
   assert( iCell<pageGetNRec(aData, nData) );
 
+  if( pageGetFlags(aData, nData) & SEGMENT_PREFIX_FLAG ){
+    Blob tmp = {0, 0, 0, 0};
+    void *p = 0;
+    int rc;
+    rc = sortedPrefixKey(pSeg, pPg, iCell, 0, 0, &p, pnKey, pBlob, &tmp);
+    sortedBlobFree(&tmp);
+    *piTopic = rtTopic(*pageGetCell(aData, nData, iCell));
+    if( rc!=LSM_OK ){
+      *pnKey = 0;
+      p = 0;
+    }
+    return (u8 *)p;
+  }
+
   pKey = pageGetCell(aData, nData, iCell);
   eType = *pKey++;
   pKey += lsmVarintGet32(pKey, &nDummy);
@@ -558,7 +726,9 @@ static int pageGetKeyCopy(
 
   aKey = pageGetKey(pSeg, pPg, iCell, piTopic, &nKey, pBlob);
   assert( (void *)aKey!=pBlob->pData || nKey==pBlob->nData );
-  if( (void *)aKey!=pBlob->pData ){
+  if( aKey==0 ){
+    rc = LSM_NOMEM_BKPT;
+  }else if( (void *)aKey!=pBlob->pData ){
     rc = sortedBlobSet(pEnv, pBlob, aKey, nKey);
   }
 
@@ -1001,6 +1171,7 @@ static void segmentPtrSetPage(SegmentPtr *pPtr, Page *pNext){
     pPtr->iPtr = pageGetPtr(aData, nData);
   }
   pPtr->pPg = pNext;
+  pPtr->iKeyCell = -1;
 }
 
 /*
@@ -1065,28 +1236,71 @@ static int segmentPtrLoadCell(
     pPtr->eType = aData[iOff];
     iOff++;
     iOff += GETVARINT64(&aData[iOff], pPtr->iPgPtr);
-    iOff += GETVARINT32(&aData[iOff], pPtr->nKey);
-    if( rtIsWrite(pPtr->eType) ){
-      iOff += GETVARINT32(&aData[iOff], pPtr->nVal);
-    }
-    assert( pPtr->nKey>=0 );
 
-    rc = segmentPtrReadData(
-        pPtr, iOff, pPtr->nKey, &pPtr->pKey, &pPtr->blob1
-    );
-    if( rc==LSM_OK && rtIsWrite(pPtr->eType) ){
+    if( pPtr->flags & SEGMENT_PREFIX_FLAG ){
+      int nPrefix;                /* Bytes shared with previous key */
+      int nSuffix;                /* Bytes of key stored in this record */
+      iOff += GETVARINT32(&aData[iOff], nPrefix);
+      iOff += GETVARINT32(&aData[iOff], nSuffix);
+      if( rtIsWrite(pPtr->eType) ){
+        iOff += GETVARINT32(&aData[iOff], pPtr->nVal);
+      }
+
+      if( nPrefix==0 ){
+        pPtr->nKey = nSuffix;
+        rc = segmentPtrReadData(
+            pPtr, iOff, nSuffix, &pPtr->pKey, &pPtr->blob1
+        );
+      }else{
+        /* If the previous cell is currently loaded (as it is when iterating
+        ** forwards through the page), build the key from its key. */
+        void *pBase = (pPtr->iKeyCell==iNew-1 ? pPtr->pKey : 0);
+        rc = sortedPrefixKey(pPtr->pSeg, pPtr->pPg, iNew, pBase, pPtr->nKey,
+            &pPtr->pKey, &pPtr->nKey, &pPtr->blob1, &pPtr->blob2
+        );
+      }
+      iOff += nSuffix;
+    }else{
+      iOff += GETVARINT32(&aData[iOff], pPtr->nKey);
+      if( rtIsWrite(pPtr->eType) ){
+        iOff += GETVARINT32(&aData[iOff], pPtr->nVal);
+      }
+      assert( pPtr->nKey>=0 );
+
       rc = segmentPtrReadData(
-          pPtr, iOff+pPtr->nKey, pPtr->nVal, &pPtr->pVal, &pPtr->blob2
+          pPtr, iOff, pPtr->nKey, &pPtr->pKey, &pPtr->blob1
       );
+      iOff += pPtr->nKey;
+    }
+    pPtr->iKeyCell = (rc==LSM_OK ? iNew : -1);
+
+    /* The value is not loaded until it is required. See 
+    ** segmentPtrLoadVal(). */
+    pPtr->pVal = 0;
+    if( rc==LSM_OK && rtIsWrite(pPtr->eType) ){
+      pPtr->iValOff = iOff;
     }else{
       pPtr->nVal = 0;
-      pPtr->pVal = 0;
     }
   }
 
   return rc;
 }
 
+/*
+** Make sure the pPtr->pVal and pPtr->nVal variables are set to the value
+** associated with the current cell of SegmentPtr pPtr, if any.
+*/
+static int segmentPtrLoadVal(SegmentPtr *pPtr){
+  int rc = LSM_OK;
+  if( pPtr->pVal==0 && pPtr->pPg && rtIsWrite(pPtr->eType) ){
+    rc = segmentPtrReadData(
+        pPtr, pPtr->iValOff, pPtr->nVal, &pPtr->pVal, &pPtr->blob2
+    );
+  }
+  return rc;
+}
+
 
 static Segment *sortedSplitkeySegment(Level *pLevel){
   Merge *pMerge = pLevel->pMerge;
@@ -1159,6 +1373,7 @@ static void segmentPtrReset(SegmentPtr *pPtr){
   pPtr->nVal = 0;
   pPtr->eType = 0;
   pPtr->iCell = 0;
+  pPtr->iKeyCell = -1;
   sortedBlobFree(&pPtr->blob1);
   sortedBlobFree(&pPtr->blob2);
 }
@@ -1433,9 +1648,11 @@ static int segmentPtrSearchOversized(
     Page *pNext;
 
     /* Load the last key on the current page. */
+    pPtr->iKeyCell = -1;
     pLastKey = pageGetKey(pPtr->pSeg,
         pPtr->pPg, pPtr->nCell-1, &iLastTopic, &nLastKey, &pPtr->blob1
     );
+    if( pLastKey==0 ) return LSM_NOMEM_BKPT;
 
     /* If the loaded key is >= than (pKey/nKey), break out of the loop.
     ** If (pKey/nKey) is present in this array, it must be on the current 
@@ -1618,6 +1835,75 @@ static int segmentPtrFwdPointer(
   return rc;
 }
 
+/*
+** This function is used by segmentPtrSeek() to search a leaf page with 
+** the SEGMENT_PREFIX_FLAG flag set for key (iTopic/pKey/nKey). It first 
+** does a binary search of the page's restart points, then reads forward
+** from the closest restart point.
+**
+** When it returns, pPtr is left pointing to the cell that matches the key,
+** if any. Otherwise, to either the largest key on the page smaller than the
+** key sought or the smallest key larger than it. *pRes is set to the result
+** of comparing the key pPtr points to with (iTopic/pKey/nKey). If pPtr
+** points to a key smaller than or equal to the one sought, *piPtrOut is 
+** set to its absolute cascade pointer value.
+*/
+static int segmentPtrSearchPrefix(
+  MultiCursor *pCsr,              /* Cursor context */
+  SegmentPtr *pPtr,               /* Pointer to seek */
+  int iTopic,                     /* Key topic to seek to */
+  void *pKey, int nKey,           /* Key to seek to */
+  int *pRes,                      /* OUT: Result of final comparison */
+  Pgno *piPtrOut                  /* IN/OUT: FC pointer */
+){
+  int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
+  int rc = LSM_OK;
+  int res = 0;
+  int iMin = 0;
+  int iMax = (pPtr->nCell-1) / LSM_PREFIX_RESTART;
+
+  /* Binary search the restart points. */
+  while( 1 ){
+    int iTry = (iMin+iMax)/2;
+
+    rc = segmentPtrLoadCell(pPtr, iTry*LSM_PREFIX_RESTART);
+    if( rc!=LSM_OK ) break;
+    res = sortedKeyCompare(xCmp, rtTopic(pPtr->eType), pPtr->pKey, pPtr->nKey,
+        iTopic, pKey, nKey
+    );
+    if( res<=0 ) *piPtrOut = pPtr->iPtr + pPtr->iPgPtr;
+
+    if( res==0 || iMin==iMax ){
+      break;
+    }else if( res>0 ){
+      iMax = LSM_MAX(iTry-1, iMin);
+    }else{
+      iMin = iTry+1;
+    }
+  }
+
+  /* Unless an exact match was found, the key sought lies between restart
+  ** point iMin and the next, or else between restart point (iMin-1) and
+  ** iMin. Scan forwards through the cells in that interval.  */
+  if( rc==LSM_OK && res!=0 && (res<0 || iMin>0) ){
+    int iCell = (res<0 ? iMin : iMin-1) * LSM_PREFIX_RESTART;
+    int iEnd = LSM_MIN(iCell+LSM_PREFIX_RESTART, pPtr->nCell);
+    if( res<0 ) iCell++;
+    for(; iCell<iEnd; iCell++){
+      rc = segmentPtrLoadCell(pPtr, iCell);
+      if( rc!=LSM_OK ) break;
+      res = sortedKeyCompare(xCmp, rtTopic(pPtr->eType), 
+          pPtr->pKey, pPtr->nKey, iTopic, pKey, nKey
+      );
+      if( res<=0 ) *piPtrOut = pPtr->iPtr + pPtr->iPgPtr;
+      if( res>=0 ) break;
+    }
+  }
+
+  *pRes = res;
+  return rc;
+}
+
 static int segmentPtrSeek(
   MultiCursor *pCsr,              /* Cursor context */
   SegmentPtr *pPtr,               /* Pointer to seek */
@@ -1628,7 +1914,7 @@ static int segmentPtrSeek(
   int *pbStop
 ){
   int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
-  int res;                        /* Result of comparison operation */
+  int res = 0;                    /* Result of comparison operation */
   int rc = LSM_OK;
   int iMin;
   int iMax;
@@ -1659,6 +1945,10 @@ static int segmentPtrSeek(
   );
   if( pPtr->nCell==0 ){
     segmentPtrReset(pPtr);
+  }else if( pPtr->flags & SEGMENT_PREFIX_FLAG ){
+    rc = segmentPtrSearchPrefix(
+        pCsr, pPtr, iTopic, pKey, nKey, &res, &iPtrOut
+    );
   }else{
     iMin = 0;
     iMax = pPtr->nCell-1;
@@ -1695,45 +1985,49 @@ static int segmentPtrSeek(
       if( res ){
         rc = segmentPtrLoadCell(pPtr, iMin);
       }
-      assert( rc!=LSM_OK || res>0 || iPtrOut==(pPtr->iPtr + pPtr->iPgPtr) );
+    }
+  }
 
-      if( rc==LSM_OK ){
-        switch( eSeek ){
-          case LSM_SEEK_EQ: {
-            int eType = pPtr->eType;
-            if( (res<0 && (eType & LSM_START_DELETE))
-             || (res>0 && (eType & LSM_END_DELETE))
-             || (res==0 && (eType & LSM_POINT_DELETE))
-            ){
-              *pbStop = 1;
-            }else if( res==0 && (eType & LSM_INSERT) ){
-              lsm_env *pEnv = pCsr->pDb->pEnv;
-              *pbStop = 1;
-              pCsr->eType = pPtr->eType;
-              rc = sortedBlobSet(pEnv, &pCsr->key, pPtr->pKey, pPtr->nKey);
-              if( rc==LSM_OK ){
-                rc = sortedBlobSet(pEnv, &pCsr->val, pPtr->pVal, pPtr->nVal);
-              }
-              pCsr->flags |= CURSOR_SEEK_EQ;
+  if( pPtr->pPg ){
+    if( rc==LSM_OK ){
+      assert( res>0 || iPtrOut==(pPtr->iPtr + pPtr->iPgPtr) );
+
+      switch( eSeek ){
+        case LSM_SEEK_EQ: {
+          int eType = pPtr->eType;
+          if( (res<0 && (eType & LSM_START_DELETE))
+           || (res>0 && (eType & LSM_END_DELETE))
+           || (res==0 && (eType & LSM_POINT_DELETE))
+          ){
+            *pbStop = 1;
+          }else if( res==0 && (eType & LSM_INSERT) ){
+            lsm_env *pEnv = pCsr->pDb->pEnv;
+            *pbStop = 1;
+            pCsr->eType = pPtr->eType;
+            rc = sortedBlobSet(pEnv, &pCsr->key, pPtr->pKey, pPtr->nKey);
+            if( rc==LSM_OK ) rc = segmentPtrLoadVal(pPtr);
+            if( rc==LSM_OK ){
+              rc = sortedBlobSet(pEnv, &pCsr->val, pPtr->pVal, pPtr->nVal);
             }
-            segmentPtrReset(pPtr);
-            break;
+            pCsr->flags |= CURSOR_SEEK_EQ;
           }
-          case LSM_SEEK_LE:
-            if( res>0 ) rc = segmentPtrAdvance(pCsr, pPtr, 1);
-            break;
-          case LSM_SEEK_GE: {
-            /* Figure out if we need to 'skip' the pointer forward or not */
-            if( (res<=0 && (pPtr->eType & LSM_START_DELETE)) 
-             || (res>0  && (pPtr->eType & LSM_END_DELETE)) 
-            ){
-              rc = segmentPtrFwdPointer(pCsr, pPtr, &iPtrOut);
-            }
-            if( res<0 && rc==LSM_OK ){
-              rc = segmentPtrAdvance(pCsr, pPtr, 0);
-            }
-            break;
+          segmentPtrReset(pPtr);
+          break;
+        }
+        case LSM_SEEK_LE:
+          if( res>0 ) rc = segmentPtrAdvance(pCsr, pPtr, 1);
+          break;
+        case LSM_SEEK_GE: {
+          /* Figure out if we need to 'skip' the pointer forward or not */
+          if( (res<=0 && (pPtr->eType & LSM_START_DELETE)) 
+           || (res>0  && (pPtr->eType & LSM_END_DELETE)) 
+          ){
+            rc = segmentPtrFwdPointer(pCsr, pPtr, &iPtrOut);
+          }
+          if( res<0 && rc==LSM_OK ){
+            rc = segmentPtrAdvance(pCsr, pPtr, 0);
           }
+          break;
         }
       }
     }
@@ -1837,6 +2131,341 @@ static int seekInBtree(
   return rc;
 }
 
+/*
+** An object of the following type is used by the worker connection to
+** build the filter for a new segment. The aBit[] array is allocated when
+** the first page of the segment is written and the bits for each key set
+** as it is written. It is appended to the segment once the segment is
+** complete (see sortedBloomWrite()).
+**
+** If a merge is interrupted (because an lsm_work() call has written the
+** requested number of pages), the BloomBuild object is stored in the
+** lsm_db.pBloomBuild list until the same connection resumes the merge. 
+** The iLastPg and nSize fields are used to check that no other connection
+** has written to the segment in the meantime.
+*/
+struct BloomBuild {
+  Pgno iFirst;                    /* First page of segment being written */
+  Pgno iLastPg;                   /* Segment.iLastPg when merge interrupted */
+  int nSize;                      /* Segment.nSize when merge interrupted */
+  int nKey;                       /* Number of keys added to aBit[] */
+  int nHash;                      /* Number of hash functions */
+  int nByte;                      /* Size of aBit[] in bytes */
+  u8 *aBit;                       /* Filter data */
+  BloomBuild *pNext;              /* Next object in lsm_db.pBloomBuild */
+};
+
+/*
+** A Bloom filter loaded from the database file. The lsm_db.pBloom list
+** caches one of these for each segment probed by an LSM_SEEK_EQ seek. If
+** the segment has no filter, nByte is zero.
+**
+** A cached filter is only used without first reading the last page of
+** the segment if the client snapshot has not changed since it was loaded
+** (iSnap is equal to the id of the current client snapshot). Otherwise,
+** the header on the last page is reread and compared with the iId, nByte 
+** and nHash fields before the filter is used.
+*/
+struct Bloom {
+  Pgno iLastPg;                   /* Last page of segment */
+  i64 iId;                        /* Snapshot id stored in filter header */
+  i64 iSnap;                      /* Client snapshot id when last verified */
+  int nHash;                      /* Number of hash functions */
+  int nByte;                      /* Size of aBit[] in bytes (or 0) */
+  u8 *aBit;                       /* Filter data */
+  Bloom *pNext;                   /* Next filter in lsm_db.pBloom */
+};
+
+/*
+** Return a 32-bit hash of the key passed as the only argument. This is
+** FNV-1a followed by the murmur3 finalizer.
+*/
+static u32 sortedBloomHash(const u8 *aKey, int nKey){
+  u32 h = 0x811C9DC5;
+  int i;
+  for(i=0; i<nKey; i++){
+    h = (h ^ aKey[i]) * 0x01000193;
+  }
+  h ^= h >> 16;
+  h *= 0x85EBCA6B;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35;
+  h ^= h >> 16;
+  return h;
+}
+
+/*
+** Set (if bSet is true) or test (if bSet is false) the nHash bits of 
+** filter aBit[] corresponding to key hash h. When testing, return true if
+** all bits are set, or false if the key is definitely not in the filter.
+** The nHash bit positions are derived from h by double hashing.
+*/
+static int sortedBloomBits(u8 *aBit, int nByte, int nHash, u32 h, int bSet){
+  u32 nBit = (u32)nByte * 8;
+  u32 delta = (h >> 17) | (h << 15);
+  int i;
+  for(i=0; i<nHash; i++){
+    u32 iBit = h % nBit;
+    if( bSet ){
+      aBit[iBit/8] |= (u8)(1 << (iBit%8));
+    }else if( (aBit[iBit/8] & (1 << (iBit%8)))==0 ){
+      return 0;
+    }
+    h += delta;
+  }
+  return 1;
+}
+
+/*
+** Free all Bloom filters and filter construction objects belonging to 
+** connection pDb.
+*/
+void lsmSortedFreeBloom(lsm_db *pDb){
+  Bloom *p;
+  Bloom *pNext;
+  BloomBuild *pBuild;
+  BloomBuild *pBuildNext;
+
+  for(p=pDb->pBloom; p; p=pNext){
+    pNext = p->pNext;
+    lsmFree(pDb->pEnv, p->aBit);
+    lsmFree(pDb->pEnv, p);
+  }
+  pDb->pBloom = 0;
+
+  for(pBuild=pDb->pBloomBuild; pBuild; pBuild=pBuildNext){
+    pBuildNext = pBuild->pNext;
+    lsmFree(pDb->pEnv, pBuild->aBit);
+    lsmFree(pDb->pEnv, pBuild);
+  }
+  pDb->pBloomBuild = 0;
+}
+
+/*
+** Remove all filters from the lsm_db.pBloom cache that do not correspond
+** to the last page of any segment in snapshot pSnap.
+*/
+static void sortedBloomPurge(lsm_db *pDb, Snapshot *pSnap){
+  Bloom **pp = &pDb->pBloom;
+  while( *pp ){
+    Bloom *p = *pp;
+    Level *pLvl;
+    int bKeep = 0;
+    for(pLvl=pSnap->pLevel; pLvl && bKeep==0; pLvl=pLvl->pNext){
+      int i;
+      if( pLvl->lhs.iLastPg==p->iLastPg ) bKeep = 1;
+      for(i=0; i<pLvl->nRight; i++){
+        if( pLvl->aRhs[i].iLastPg==p->iLastPg ) bKeep = 1;
+      }
+    }
+    if( bKeep ){
+      pp = &p->pNext;
+    }else{
+      *pp = p->pNext;
+      lsmFree(pDb->pEnv, p->aBit);
+      lsmFree(pDb->pEnv, p);
+    }
+  }
+}
+
+/*
+** Read the Bloom filter data from segment pSeg into buffer aBit[], which
+** is nByte bytes in size. Page pLast is the last page of the segment. 
+** Parameter iFirst is the page number of the first filter page, or 0 if
+** the entire filter is stored on pLast.
+*/
+static int sortedBloomRead(
+  FileSystem *pFS,
+  Segment *pSeg,
+  Page *pLast,
+  Pgno iFirst,
+  u8 *aBit,
+  int nByte
+){
+  int rc = LSM_OK;
+  Page *pPg = 0;
+  int iOff = 0;
+
+  if( iFirst==0 ){
+    pPg = pLast;
+    lsmFsPageRef(pPg);
+  }else{
+    rc = lsmFsDbPageGet(pFS, pSeg, iFirst, &pPg);
+  }
+
+  while( rc==LSM_OK && pPg ){
+    Page *pNext = 0;
+    u8 *aData;
+    int nData;
+    int nAvail;
+    int nCopy;
+    int bLast = (lsmFsPageNumber(pPg)==lsmFsPageNumber(pLast));
+
+    aData = fsPageData(pPg, &nData);
+    nAvail = SEGMENT_EOF(nData, 0);
+    if( (pageGetFlags(aData, nData) & SEGMENT_BLOOM_FLAG)==0 ){
+      rc = LSM_CORRUPT_BKPT;
+      break;
+    }
+    if( bLast ){
+      nCopy = nByte - iOff;
+      if( nCopy>nAvail-SEGMENT_BLOOM_HDR ) rc = LSM_CORRUPT_BKPT;
+    }else{
+      nCopy = LSM_MIN(nByte - iOff, nAvail);
+      rc = lsmFsDbPageNext(pSeg, pPg, 1, &pNext);
+    }
+    if( rc==LSM_OK ){
+      memcpy(&aBit[iOff], aData, nCopy);
+      iOff += nCopy;
+    }
+    lsmFsPageRelease(pPg);
+    pPg = (bLast ? 0 : pNext);
+  }
+
+  if( rc==LSM_OK && iOff!=nByte ) rc = LSM_CORRUPT_BKPT;
+  return rc;
+}
+
+/*
+** Set *ppBloom to point to the Bloom filter object for segment pSeg of
+** the current client snapshot, loading it from disk if necessary. If the
+** segment has no filter, the nByte field of the returned object is zero.
+*/
+static int sortedBloomLoad(lsm_db *pDb, Segment *pSeg, Bloom **ppBloom){
+  FileSystem *pFS = pDb->pFS;
+  i64 iSnap = pDb->pClient->iId;
+  Page *pLast = 0;
+  Bloom *p;
+  int rc;
+
+  if( pDb->iBloomSnap!=iSnap ){
+    sortedBloomPurge(pDb, pDb->pClient);
+    pDb->iBloomSnap = iSnap;
+  }
+  for(p=pDb->pBloom; p && p->iLastPg!=pSeg->iLastPg; p=p->pNext);
+  if( p && p->iSnap==iSnap ){
+    *ppBloom = p;
+    return LSM_OK;
+  }
+
+  if( p==0 ){
+    p = (Bloom *)lsmMallocZero(pDb->pEnv, sizeof(Bloom));
+    if( p==0 ) return LSM_NOMEM_BKPT;
+    p->iLastPg = pSeg->iLastPg;
+    p->pNext = pDb->pBloom;
+    pDb->pBloom = p;
+  }
+
+  rc = lsmFsDbPageLast(pFS, pSeg, &pLast);
+  if( rc==LSM_OK ){
+    i64 iId = 0;
+    int nByte = 0;
+    int nHash = 0;
+    Pgno iFirst = 0;
+    u8 *aData;
+    int nData;
+
+    aData = fsPageData(pLast, &nData);
+    if( pageGetFlags(aData, nData) & SEGMENT_BLOOM_FLAG ){
+      u8 *aHdr = &aData[SEGMENT_EOF(nData, 0) - SEGMENT_BLOOM_HDR];
+      iId = (i64)lsmGetU64(aHdr);
+      nByte = (int)lsmGetU32(&aHdr[8]);
+      nHash = (int)lsmGetU32(&aHdr[12]);
+      iFirst = pageGetPtr(aData, nData);
+      if( nByte<=0 || nHash<=0 ) rc = LSM_CORRUPT_BKPT;
+    }
+
+    if( rc==LSM_OK && (p->iId!=iId || p->nByte!=nByte || p->nHash!=nHash) ){
+      lsmFree(pDb->pEnv, p->aBit);
+      p->aBit = 0;
+      p->nByte = 0;
+      p->iId = 0;
+      if( nByte>0 ){
+        p->aBit = (u8 *)lsmMalloc(pDb->pEnv, nByte);
+        if( p->aBit==0 ){
+          rc = LSM_NOMEM_BKPT;
+        }else{
+          rc = sortedBloomRead(pFS, pSeg, pLast, iFirst, p->aBit, nByte);
+        }
+        if( rc==LSM_OK ){
+          p->iId = iId;
+          p->nByte = nByte;
+          p->nHash = nHash;
+        }else{
+          lsmFree(pDb->pEnv, p->aBit);
+          p->aBit = 0;
+        }
+      }
+    }
+    lsmFsPageRelease(pLast);
+  }
+
+  if( rc==LSM_OK ){
+    p->iSnap = iSnap;
+    *ppBloom = p;
+  }
+  return rc;
+}
+
+/*
+** This function is called at the start of an LSM_SEEK_EQ seek for user key
+** pKey/nKey. It sets the SegmentPtr.bSkip flag on each segment pointer that
+** the seek may skip because the segment's Bloom filter excludes the key.
+**
+** Even if a segment does not contain the key, it may not be skipped if
+** the next segment searched by the seek has no b-tree of its own (because
+** its separators have been merged into the segment above it) and is not
+** itself skipped. Such a segment requires the fractional-cascading pointer
+** that can only be read from the segment above it. The segment that 
+** consumes the pointer output by aPtr[i] is aPtr[i+1], unless aPtr[i+1]
+** is the lhs of a level undergoing a merge. In that case it is the first
+** rhs of the same level, aPtr[i+2]. See seekInLevel().
+**
+** The left-hand segment of a level undergoing a merge is incomplete and 
+** so has no filter. Segments with block redirections (see 
+** sortedMoveBlock()) are never skipped either.
+*/
+static int sortedBloomSkip(MultiCursor *pCsr, void *pKey, int nKey){
+  lsm_db *pDb = pCsr->pDb;
+  int rc = LSM_OK;
+  u32 h;
+  int i;
+
+  assert( pDb->pClient );
+  h = sortedBloomHash((const u8 *)pKey, nKey);
+
+  for(i=pCsr->nPtr-1; i>=0 && rc==LSM_OK; i--){
+    SegmentPtr *pPtr = &pCsr->aPtr[i];
+    Level *pLvl = pPtr->pLevel;
+    Segment *pSeg = pPtr->pSeg;
+    int iNext = i+1;              /* Index of segment consuming pointer */
+    Bloom *pBloom = 0;
+
+    pPtr->bSkip = 0;
+    if( (pSeg==&pLvl->lhs && pLvl->nRight) || pSeg->pRedirect ) continue;
+
+    if( iNext<pCsr->nPtr ){
+      Level *pNextLvl = pCsr->aPtr[iNext].pLevel;
+      if( pCsr->aPtr[iNext].pSeg==&pNextLvl->lhs && pNextLvl->nRight ){
+        iNext++;
+      }
+    }
+    if( iNext<pCsr->nPtr ){
+      SegmentPtr *pNext = &pCsr->aPtr[iNext];
+      if( pNext->pSeg->iRoot==0 && pNext->bSkip==0 ) continue;
+    }
+
+    rc = sortedBloomLoad(pDb, pSeg, &pBloom);
+    if( rc==LSM_OK && pBloom->nByte
+     && 0==sortedBloomBits(pBloom->aBit, pBloom->nByte, pBloom->nHash, h, 0)
+    ){
+      pPtr->bSkip = 1;
+    }
+  }
+
+  return rc;
+}
+
 static int seekInSegment(
   MultiCursor *pCsr, 
   SegmentPtr *pPtr,
@@ -1850,6 +2479,12 @@ static int seekInSegment(
   int iPtr = iPg;
   int rc = LSM_OK;
 
+  if( eSeek==LSM_SEEK_EQ && pPtr->bSkip ){
+    segmentPtrReset(pPtr);
+    *piPtr = 0;
+    return LSM_OK;
+  }
+
   if( pPtr->pSeg->iRoot ){
     Page *pPg;
     assert( pPtr->pSeg->iRoot!=0 );
@@ -2293,6 +2928,7 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
       /* Free the allocation used to cache the current key, if any. */
       sortedBlobFree(&pCsr->key);
       sortedBlobFree(&pCsr->val);
+      sortedBlobFree(&pCsr->range);
 
       /* Free the component cursors */
       mcursorFreeComponents(pCsr);
@@ -2548,8 +3184,11 @@ static int multiCursorGetVal(
       if( iPtr<pCsr->nPtr ){
         SegmentPtr *pPtr = &pCsr->aPtr[iPtr];
         if( pPtr->pPg ){
-          *ppVal = pPtr->pVal;
-          *pnVal = pPtr->nVal;
+          rc = segmentPtrLoadVal(pPtr);
+          if( rc==LSM_OK ){
+            *ppVal = pPtr->pVal;
+            *pnVal = pPtr->nVal;
+          }
         }
       }
     }
@@ -3053,6 +3692,12 @@ int lsmMCursorSeek(
     rc = treeCursorSeek(pCsr, pCsr->apTreeCsr[1], pKey, nKey, eESeek, &bStop);
   }
 
+  /* For a point lookup of a user key, use the Bloom filters to determine
+  ** which segments may be skipped.  */
+  if( rc==LSM_OK && bStop==0 && eESeek==LSM_SEEK_EQ && iTopic==0 ){
+    rc = sortedBloomSkip(pCsr, pKey, nKey);
+  }
+
   /* Seek all segment pointers. */
   for(iPtr=0; iPtr<pCsr->nPtr && rc==LSM_OK && bStop==0; iPtr++){
     SegmentPtr *pPtr = &pCsr->aPtr[iPtr];
@@ -3320,6 +3965,77 @@ int lsmMCursorValue(MultiCursor *pCsr, void **ppVal, int *pnVal){
   return rc;
 }
 
+/*
+** Set *ppVal to point to a buffer containing nByte bytes of the value that
+** the cursor currently points to, starting at byte offset iOff, and *pnVal
+** to the number of bytes in the buffer. If the value is smaller than
+** (iOff+nByte) bytes, *pnVal is set to the number of bytes following
+** offset iOff.
+**
+** If the value is stored in a segment and spans more than one page, only
+** the pages that contain the requested bytes are read. Unless they all 
+** lie on the first page of the value, they are copied into a buffer owned
+** by the cursor. Otherwise, the entire remainder of the value is returned
+** and *ppVal points directly into the page, in-memory tree or buffer that
+** the value is stored in. Either way, the buffer is valid until the next 
+** call to this function or until the cursor is moved.
+*/
+int lsmMCursorValueRange(
+  MultiCursor *pCsr,              /* Cursor handle */
+  int iOff,                       /* Offset of first byte to read */
+  int nByte,                      /* Number of bytes requested */
+  void **ppVal,                   /* OUT: Pointer to buffer */
+  int *pnVal                      /* OUT: Size of buffer in bytes */
+){
+  void *pVal = 0;
+  int nVal = 0;
+  int rc = LSM_OK;
+
+  if( (pCsr->flags & CURSOR_SEEK_EQ) || pCsr->aTree==0 ){
+    nVal = pCsr->val.nData;
+    pVal = pCsr->val.pData;
+    iOff = LSM_MIN(iOff, nVal);
+    if( pVal ) pVal = &((u8 *)pVal)[iOff];
+    nVal -= iOff;
+  }else{
+    SegmentPtr *pPtr = 0;
+    int iPtr = pCsr->aTree[1] - CURSOR_DATA_SEGMENT;
+    int bSpan = 0;                /* True if value spans pages */
+
+    assert( mcursorLocationOk(pCsr, (pCsr->flags & CURSOR_IGNORE_DELETE)) );
+    if( iPtr>=0 && iPtr<pCsr->nPtr ){
+      pPtr = &pCsr->aPtr[iPtr];
+      if( pPtr->pPg && pPtr->pVal==0 && rtIsWrite(pPtr->eType) ){
+        int nData;
+        fsPageData(pPtr->pPg, &nData);
+        bSpan = (pPtr->iValOff+pPtr->nVal > SEGMENT_EOF(nData, pPtr->nCell));
+      }
+    }
+
+    if( bSpan ){
+      iOff = LSM_MIN(iOff, pPtr->nVal);
+      nVal = LSM_MIN(nByte, pPtr->nVal - iOff);
+      rc = sortedReadData(pPtr->pSeg, pPtr->pPg, 
+          pPtr->iValOff + iOff, nVal, &pVal, &pCsr->range
+      );
+    }else{
+      rc = multiCursorGetVal(pCsr, pCsr->aTree[1], &pVal, &nVal);
+      iOff = LSM_MIN(iOff, nVal);
+      if( pVal ) pVal = &((u8 *)pVal)[iOff];
+      nVal -= iOff;
+    }
+
+    if( rc!=LSM_OK ){
+      pVal = 0;
+      nVal = 0;
+    }
+  }
+
+  *ppVal = pVal;
+  *pnVal = nVal;
+  return rc;
+}
+
 int lsmMCursorType(MultiCursor *pCsr, int *peType){
   assert( pCsr->aTree );
   multiCursorGetKey(pCsr, pCsr->aTree[1], peType, 0, 0);
@@ -3804,8 +4520,9 @@ static int mergeWorkerPersistAndRelease(MergeWorker *pMW){
 /*
 ** Advance to the next page of an output run being populated by merge-worker
 ** pMW. The footer of the new page is initialized to indicate that it contains
-** zero records. The flags field is cleared. The page footer pointer field
-** is set to iFPtr.
+** zero records. The flags field is cleared, except for SEGMENT_PREFIX_FLAG,
+** which is set if the database file-format supports prefix-compressed pages.
+** The page footer pointer field is set to iFPtr.
 **
 ** If successful, LSM_OK is returned. Otherwise, an error code.
 */
@@ -3830,7 +4547,9 @@ static int mergeWorkerNextPage(
     pMW->pLevel->pMerge->iOutputOff = 0;
     aData = fsPageData(pNext, &nData);
     lsmPutU16(&aData[SEGMENT_NRECORD_OFFSET(nData)], 0);
-    lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], 0);
+    lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], 
+        (pDb->pWorker->iFormat>=2 ? SEGMENT_PREFIX_FLAG : 0)
+    );
     lsmPutU64(&aData[SEGMENT_POINTER_OFFSET(nData)], iFPtr);
     pMW->nWork++;
   }
@@ -3922,6 +4641,243 @@ static int mergeWorkerFirstPage(MergeWorker *pMW){
   return rc;
 }
 
+/*
+** Free a BloomBuild object.
+*/
+static void sortedBloomBuildFree(lsm_env *pEnv, BloomBuild *p){
+  if( p ){
+    lsmFree(pEnv, p->aBit);
+    lsmFree(pEnv, p);
+  }
+}
+
+/*
+** Set *pnKey to an estimate of the number of keys stored in segment pSeg.
+** If the segment has a filter, this is the key count from the filter
+** header. Otherwise, it is the number of records on the first page of the
+** segment multiplied by the number of pages in the segment.
+*/
+static int sortedBloomSegmentKeys(lsm_db *pDb, Segment *pSeg, i64 *pnKey){
+  FileSystem *pFS = pDb->pFS;
+  Page *pPg = 0;
+  int rc;
+
+  rc = lsmFsDbPageLast(pFS, pSeg, &pPg);
+  if( rc==LSM_OK ){
+    int nData;
+    u8 *aData = fsPageData(pPg, &nData);
+    if( pageGetFlags(aData, nData) & SEGMENT_BLOOM_FLAG ){
+      u8 *aHdr = &aData[SEGMENT_EOF(nData, 0) - SEGMENT_BLOOM_HDR];
+      *pnKey = (i64)lsmGetU32(&aHdr[16]);
+      lsmFsPageRelease(pPg);
+      return LSM_OK;
+    }
+    lsmFsPageRelease(pPg);
+    pPg = 0;
+    rc = lsmFsDbPageGet(pFS, pSeg, pSeg->iFirst, &pPg);
+  }
+  if( rc==LSM_OK ){
+    int nData;
+    u8 *aData = fsPageData(pPg, &nData);
+    *pnKey = (i64)LSM_MAX(1, pageGetNRec(aData, nData)) * pSeg->nSize;
+    lsmFsPageRelease(pPg);
+  }
+  return rc;
+}
+
+/*
+** Set *pnKey to an upper bound on the number of keys that the merge 
+** that writes to level pLevel may write to its output segment - the sum
+** of the key counts of each input segment.
+*/
+static int sortedBloomMergeKeys(lsm_db *pDb, Level *pLevel, i64 *pnKey){
+  int rc = LSM_OK;
+  i64 nKey = 0;
+  int i;
+
+  for(i=0; rc==LSM_OK && i<pLevel->nRight; i++){
+    i64 n = 0;
+    rc = sortedBloomSegmentKeys(pDb, &pLevel->aRhs[i], &n);
+    nKey += n;
+  }
+  *pnKey = nKey;
+  return rc;
+}
+
+/*
+** Set *pnKey to the number of entries in the tree cursors opened by 
+** multiCursorAddTree() on multi-cursor pCsr.
+*/
+static int sortedBloomTreeKeys(MultiCursor *pCsr, i64 *pnKey){
+  int rc = LSM_OK;
+  i64 nKey = 0;
+  int i;
+
+  for(i=0; rc==LSM_OK && i<(int)array_size(pCsr->apTreeCsr); i++){
+    TreeCursor *pTreeCsr = pCsr->apTreeCsr[i];
+    if( pTreeCsr ){
+      for(rc=lsmTreeCursorEnd(pTreeCsr, 0);
+          rc==LSM_OK && lsmTreeCursorValid(pTreeCsr);
+          rc=lsmTreeCursorNext(pTreeCsr)
+      ){
+        nKey++;
+      }
+    }
+  }
+  *pnKey = nKey;
+  return rc;
+}
+
+/*
+** This function is called when a merge-worker is initialized to attach 
+** a BloomBuild object to it (by setting MergeWorker.pBloom). If the output
+** segment is still empty, a new object is allocated with a filter sized
+** for nKey keys. Otherwise, the object saved when the previous incremental
+** step of the same merge finished is used and nKey is ignored. If there is
+** no such object, or if the segment has been modified by some other 
+** connection since it was saved, MergeWorker.pBloom is left set to NULL 
+** and no filter is written for the segment.
+*/
+static void sortedBloomBegin(MergeWorker *pMW, i64 nKey){
+  lsm_db *pDb = pMW->pDb;
+  Segment *pSeg = &pMW->pLevel->lhs;
+  BloomBuild **pp;
+  BloomBuild *p = 0;
+
+  for(pp=&pDb->pBloomBuild; *pp; pp=&(*pp)->pNext){
+    if( (*pp)->iFirst==pSeg->iFirst ){
+      p = *pp;
+      *pp = p->pNext;
+      p->pNext = 0;
+      break;
+    }
+  }
+
+  if( pSeg->iFirst==0 ){
+    i64 nByte = (nKey * LSM_BLOOM_BITS_PER_KEY + 7) / 8;
+    sortedBloomBuildFree(pDb->pEnv, p);
+    p = 0;
+    nByte = LSM_MAX(nByte, 8);
+    if( nByte<=0x7FFFFFFF ){
+      p = (BloomBuild *)lsmMallocZero(pDb->pEnv, sizeof(BloomBuild));
+    }
+    if( p ){
+      p->nByte = (int)nByte;
+      p->nHash = LSM_MAX(1, (LSM_BLOOM_BITS_PER_KEY * 69) / 100);
+      p->aBit = (u8 *)lsmMallocZero(pDb->pEnv, p->nByte);
+      if( p->aBit==0 ){
+        sortedBloomBuildFree(pDb->pEnv, p);
+        p = 0;
+      }
+    }
+  }else if( p && (p->iLastPg!=pSeg->iLastPg || p->nSize!=pSeg->nSize) ){
+    sortedBloomBuildFree(pDb->pEnv, p);
+    p = 0;
+  }
+  pMW->pBloom = p;
+}
+
+/*
+** Stop building a Bloom filter for the segment being written by pMW.
+*/
+static void sortedBloomAbandon(MergeWorker *pMW){
+  sortedBloomBuildFree(pMW->pDb->pEnv, pMW->pBloom);
+  pMW->pBloom = 0;
+}
+
+/*
+** Add the key of a record of type eType written to the output segment 
+** by mergeWorkerWrite() to the filter under construction, if any.
+*/
+static void sortedBloomAdd(MergeWorker *pMW, int eType, void *pKey, int nKey){
+  BloomBuild *p = pMW->pBloom;
+  if( p ){
+    if( eType & (LSM_START_DELETE|LSM_END_DELETE) ){
+      /* The filter cannot represent range-deletes. */
+      sortedBloomAbandon(pMW);
+    }else if( rtTopic(eType)==0 && rtIsSeparator(eType)==0
+           && (eType & (LSM_INSERT|LSM_POINT_DELETE))
+    ){
+      u32 h = sortedBloomHash((const u8 *)pKey, nKey);
+      sortedBloomBits(p->aBit, p->nByte, p->nHash, h, 1);
+      p->nKey++;
+    }
+  }
+}
+
+/*
+** Append the Bloom filter accumulated by pMW->pBloom to the output segment.
+** The output segment must be otherwise complete (b-tree included). See 
+** "BLOOM FILTERS" at the top of this file for the format.
+*/
+static int sortedBloomWrite(MergeWorker *pMW){
+  lsm_db *pDb = pMW->pDb;
+  BloomBuild *p = pMW->pBloom;
+  int rc = LSM_OK;
+  int nByte = p->nByte;           /* Size of filter in bytes */
+  u8 *aBit = p->aBit;             /* Filter data */
+  int iOff = 0;                   /* Bytes of aBit[] written so far */
+  Pgno iFirst = 0;                /* First page of filter (if not last) */
+
+  while( rc==LSM_OK ){
+    Page *pPg = 0;
+    u8 *aData;                    /* Page data */
+    int nData;                    /* Size of aData[] in bytes */
+    int nAvail;                   /* Bytes available for filter data */
+    int nCopy;                    /* Bytes of filter data on this page */
+    int bLast;                    /* True if this is the last page */
+
+    rc = lsmFsSortedAppend(pDb->pFS, pDb->pWorker, pMW->pLevel, 0, &pPg);
+    if( rc!=LSM_OK ) break;
+
+    aData = fsPageData(pPg, &nData);
+    memset(aData, 0, nData);
+    nAvail = SEGMENT_EOF(nData, 0);
+    bLast = (nByte-iOff <= nAvail-SEGMENT_BLOOM_HDR);
+    nCopy = (bLast ? nByte-iOff : LSM_MIN(nByte-iOff, nAvail));
+    memcpy(aData, &aBit[iOff], nCopy);
+    iOff += nCopy;
+    lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], SEGMENT_BLOOM_FLAG);
+    if( bLast ){
+      u8 *aHdr = &aData[nAvail - SEGMENT_BLOOM_HDR];
+      lsmPutU64(aHdr, (u64)pDb->pWorker->iId);
+      lsmPutU32(&aHdr[8], (u32)nByte);
+      lsmPutU32(&aHdr[12], (u32)p->nHash);
+      lsmPutU32(&aHdr[16], (u32)p->nKey);
+      lsmPutU64(&aData[SEGMENT_POINTER_OFFSET(nData)], iFirst);
+    }
+
+    rc = lsmFsPagePersist(pPg);
+    if( iFirst==0 ) iFirst = lsmFsPageNumber(pPg);
+    lsmFsPageRelease(pPg);
+    pMW->nWork++;
+    if( bLast ) break;
+  }
+
+  return rc;
+}
+
+/*
+** This is called at the end of mergeWorkerShutdown() to deal with the
+** filter under construction, if any. If the merge is not finished (bDone
+** is false) and no error has occurred, the BloomBuild object is stored in
+** the lsm_db.pBloomBuild list so that it may be picked up by the next call
+** to sortedBloomBegin() for the same segment. Otherwise it is discarded.
+*/
+static void sortedBloomSave(MergeWorker *pMW, int bDone, int rc){
+  BloomBuild *p = pMW->pBloom;
+  if( p && rc==LSM_OK && bDone==0 ){
+    Segment *pSeg = &pMW->pLevel->lhs;
+    p->iFirst = pSeg->iFirst;
+    p->iLastPg = pSeg->iLastPg;
+    p->nSize = pSeg->nSize;
+    p->pNext = pMW->pDb->pBloomBuild;
+    pMW->pDb->pBloomBuild = p;
+    pMW->pBloom = 0;
+  }
+  sortedBloomAbandon(pMW);
+}
+
 static int mergeWorkerWrite(
   MergeWorker *pMW,               /* Merge worker object to write into */
   int eType,                      /* One of SORTED_SEPARATOR, WRITE or DELETE */
@@ -3942,9 +4898,12 @@ static int mergeWorkerWrite(
   Segment *pSeg;                  /* Segment being written */
   int flags = 0;                  /* If != 0, flags value for page footer */
   int bFirst = 0;                 /* True for first key of output run */
+  int bPrefix;                    /* True to write a prefix-compressed key */
+  int nPrefix = 0;                /* Bytes of key shared with previous key */
 
   pMerge = pMW->pLevel->pMerge;    
   pSeg = &pMW->pLevel->lhs;
+  bPrefix = (pMW->pDb->pWorker->iFormat>=2);
 
   if( pSeg->iFirst==0 && pMW->pPage==0 ){
     rc = mergeWorkerFirstPage(pMW);
@@ -3971,9 +4930,21 @@ static int mergeWorkerWrite(
   **     2) Page-pointer-offset - 1 varint
   **     3) Key size - 1 varint
   **     4) Value size - 1 varint (only if LSM_INSERT flag is set)
+  **
+  ** Or, for prefix-compressed pages, the key size field is replaced by
+  ** the size of the prefix shared with the previous key on the page and
+  ** the number of remaining key bytes - 2 varints. 
   */
   if( rc==LSM_OK ){
-    nHdr = 1 + lsmVarintLen32(iRPtr) + lsmVarintLen32(nKey);
+    if( bPrefix && pPg && nRec>0 && (nRec % LSM_PREFIX_RESTART)!=0 ){
+      u8 *aPrev = (u8 *)pMW->prevKey.pData;
+      int nMax = LSM_MIN(nKey, pMW->prevKey.nData);
+      while( nPrefix<nMax && aPrev[nPrefix]==((u8 *)pKey)[nPrefix] ){
+        nPrefix++;
+      }
+    }
+    nHdr = 1 + lsmVarintLen32(iRPtr) + lsmVarintLen32(nKey-nPrefix);
+    if( bPrefix ) nHdr += lsmVarintLen32(nPrefix);
     if( rtIsWrite(eType) ) nHdr += lsmVarintLen32(nVal);
 
     /* If the entire header will not fit on page pPg, or if page pPg is 
@@ -3984,6 +4955,7 @@ static int mergeWorkerWrite(
       iRPtr = iPtr - iFPtr;
       iOff = 0;
       nRec = 0;
+      nPrefix = 0;
       rc = mergeWorkerNextPage(pMW, iFPtr);
       pPg = pMW->pPage;
     }
@@ -4011,23 +4983,37 @@ static int mergeWorkerWrite(
 
   /* Update the output segment */
   if( rc==LSM_OK ){
+    sortedBloomAdd(pMW, eType, pKey, nKey);
     aData = fsPageData(pPg, &nData);
 
     /* Update the page footer. */
     lsmPutU16(&aData[SEGMENT_NRECORD_OFFSET(nData)], nRec+1);
     lsmPutU16(&aData[SEGMENT_CELLPTR_OFFSET(nData, nRec)], iOff);
-    if( flags ) lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], flags);
+    if( flags ){
+      flags |= pageGetFlags(aData, nData);
+      lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], flags);
+    }
 
     /* Write the entry header into the current page. */
     aData[iOff++] = eType;                                               /* 1 */
     iOff += lsmVarintPut32(&aData[iOff], iRPtr);                         /* 2 */
-    iOff += lsmVarintPut32(&aData[iOff], nKey);                          /* 3 */
+    if( bPrefix ) iOff += lsmVarintPut32(&aData[iOff], nPrefix);
+    iOff += lsmVarintPut32(&aData[iOff], nKey-nPrefix);                  /* 3 */
     if( rtIsWrite(eType) ) iOff += lsmVarintPut32(&aData[iOff], nVal);   /* 4 */
     pMerge->iOutputOff = iOff;
 
+    /* Save a copy of the key for use by the next record on the same page. */
+    if( bPrefix ){
+      rc = sortedBlobSet(pMW->pDb->pEnv, &pMW->prevKey, pKey, nKey);
+    }
+
     /* Write the key and data into the segment. */
     assert( iFPtr==pageGetPtr(aData, nData) );
-    rc = mergeWorkerData(pMW, 0, iFPtr+iRPtr, pKey, nKey);
+    if( rc==LSM_OK ){
+      rc = mergeWorkerData(pMW, 0, iFPtr+iRPtr, &((u8 *)pKey)[nPrefix], 
+          nKey-nPrefix
+      );
+    }
     if( rc==LSM_OK && rtIsWrite(eType) ){
       if( rc==LSM_OK ){
         rc = mergeWorkerData(pMW, 0, iFPtr+iRPtr, pVal, nVal);
@@ -4046,6 +5032,7 @@ static void mergeWorkerShutdown(MergeWorker *pMW, int *pRc){
   int i;                          /* Iterator variable */
   int rc = *pRc;
   MultiCursor *pCsr = pMW->pCsr;
+  int bDone = (pCsr==0 || lsmMCursorValid(pCsr)==0);
 
   /* Unless the merge has finished, save the cursor position in the
   ** Merge.aInput[] array. See function mergeWorkerInit() for the 
@@ -4091,11 +5078,16 @@ static void mergeWorkerShutdown(MergeWorker *pMW, int *pRc){
   if( rc==LSM_OK ) rc = mergeWorkerPersistAndRelease(pMW);
   if( rc==LSM_OK ) rc = mergeWorkerBtreeIndirect(pMW);
   if( rc==LSM_OK ) rc = mergeWorkerFinishHierarchy(pMW);
+  if( rc==LSM_OK && bDone && pMW->pBloom && pMW->pLevel->lhs.iFirst ){
+    rc = sortedBloomWrite(pMW);
+  }
   if( rc==LSM_OK ) rc = mergeWorkerAddPadding(pMW);
   lsmFsFlushWaiting(pMW->pDb->pFS, &rc);
   mergeWorkerReleaseAll(pMW);
+  sortedBloomSave(pMW, bDone, rc);
 
   lsmFree(pMW->pDb->pEnv, pMW->aGobble);
+  sortedBlobFree(&pMW->prevKey);
   pMW->aGobble = 0;
   pMW->pCsr = 0;
 
@@ -4350,6 +5342,11 @@ static int sortedNewToplevel(
 
     /* Mark the separators array for the new level as a "phantom". */
     mergeworker.bFlush = 1;
+    if( rc==LSM_OK ){
+      i64 nKey = 0;
+      rc = sortedBloomTreeKeys(pCsr, &nKey);
+      if( rc==LSM_OK ) sortedBloomBegin(&mergeworker, nKey);
+    }
 
     /* Do the work to create the new merged segment on disk */
     if( rc==LSM_OK ) rc = lsmMCursorFirst(pCsr);
@@ -4402,12 +5399,107 @@ static int sortedNewToplevel(
 
   if( pnWrite ) *pnWrite = nWrite;
   pDb->pWorker->nWrite += nWrite;
+  if( nWrite ) lsmDbRecordWrite(pDb, (eTree!=TREE_NONE), nWrite);
   pDb->pFreelist = 0;
   pDb->bUseFreelist = 0;
   lsmFree(pDb->pEnv, freelist.aEntry);
   return rc;
 }
 
+/*
+** Write the key-value pairs returned by the xNext callback to a new segment
+** and add it to the top of the worker snapshot. See lsm_bulk_load() for
+** the xNext protocol. Unlike sortedNewToplevel(), no other data is merged
+** into the new segment, and no page pointers into the next level down are
+** written. Keys must be returned in strictly increasing order, otherwise
+** LSM_MISUSE is returned.
+*/
+static int sortedNewBulkLevel(
+  lsm_db *pDb,                    /* Connection handle */
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx,                     /* First argument passed to xNext */
+  int *pnWrite                    /* OUT: Number of database pages written */
+){
+  int rc = LSM_OK;                /* Return Code */
+  MultiCursor *pCsr = 0;          /* Empty cursor used by the merge-worker */
+  Level *pNext;                   /* The current top level */
+  Level *pNew;                    /* The new level itself */
+  Blob prev;                      /* Copy of the previous key */
+  int bFirst = 1;                 /* True until the first key is written */
+  int nWrite = 0;                 /* Number of database pages written */
+
+  memset(&prev, 0, sizeof(Blob));
+  pNext = lsmDbSnapshotLevel(pDb->pWorker);
+  pNew = (Level *)lsmMallocZeroRc(pDb->pEnv, sizeof(Level), &rc);
+  if( pNew ){
+    pNew->pNext = pNext;
+    lsmDbSnapshotSetLevel(pDb->pWorker, pNew);
+    pCsr = multiCursorNew(pDb, &rc);
+  }
+
+  if( pCsr ){
+    Pgno iLeftPtr = 0;
+    Merge merge;                  /* Merge object used to create new level */
+    MergeWorker mergeworker;      /* MergeWorker object for the same purpose */
+
+    memset(&merge, 0, sizeof(Merge));
+    memset(&mergeworker, 0, sizeof(MergeWorker));
+
+    pNew->pMerge = &merge;
+    pNew->flags |= LEVEL_INCOMPLETE;
+    mergeworker.pDb = pDb;
+    mergeworker.pLevel = pNew;
+    mergeworker.pCsr = pCsr;
+    pCsr->pPrevMergePtr = &iLeftPtr;
+
+    while( rc==LSM_OK ){
+      const void *pKey = 0; int nKey = 0;
+      const void *pVal = 0; int nVal = 0;
+
+      rc = xNext(pCtx, &pKey, &nKey, &pVal, &nVal);
+      if( rc!=LSM_OK || pKey==0 ) break;
+      if( nKey<0 || nVal<0 || (bFirst==0 
+       && pDb->xCmp(prev.pData, prev.nData, (void *)pKey, nKey)>=0)
+      ){
+        rc = LSM_MISUSE_BKPT;
+      }else{
+        rc = mergeWorkerWrite(&mergeworker, LSM_INSERT, 
+            (void *)pKey, nKey, (void *)pVal, nVal, 0
+        );
+      }
+      if( rc==LSM_OK ){
+        rc = sortedBlobSet(pDb->pEnv, &prev, (void *)pKey, nKey);
+      }
+      bFirst = 0;
+    }
+
+    mergeWorkerShutdown(&mergeworker, &rc);
+    if( rc==LSM_OK && pNew->lhs.iFirst ){
+      rc = lsmFsSortedFinish(pDb->pFS, &pNew->lhs);
+    }
+    nWrite = mergeworker.nWork;
+    pNew->flags &= ~LEVEL_INCOMPLETE;
+    pNew->pMerge = 0;
+  }
+
+  if( pNew && (rc!=LSM_OK || pNew->lhs.iFirst==0) ){
+    lsmDbSnapshotSetLevel(pDb->pWorker, pNext);
+    sortedFreeLevel(pDb->pEnv, pNew);
+  }else if( pNew ){
+#if LSM_LOG_STRUCTURE
+    lsmSortedDumpStructure(pDb, pDb->pWorker, LSM_LOG_DATA, 0, "bulk-load");
+#endif
+    assertBtreeOk(pDb, &pNew->lhs);
+    sortedInvokeWorkHook(pDb);
+  }
+
+  if( pnWrite ) *pnWrite = nWrite;
+  pDb->pWorker->nWrite += nWrite;
+  if( nWrite ) lsmDbRecordWrite(pDb, 1, nWrite);
+  sortedBlobFree(&prev);
+  return rc;
+}
+
 /*
 ** The nMerge levels in the LSM beginning with pLevel consist of a
 ** left-hand-side segment only. Replace these levels with a single new
@@ -4541,6 +5633,11 @@ static int mergeWorkerInit(
 
   /* Load the b-tree hierarchy into memory. */
   if( rc==LSM_OK ) rc = mergeWorkerLoadHierarchy(pMW);
+  if( rc==LSM_OK ){
+    i64 nKey = 0;
+    if( pLevel->lhs.iFirst==0 ) rc = sortedBloomMergeKeys(pDb, pLevel, &nKey);
+    if( rc==LSM_OK ) sortedBloomBegin(pMW, nKey);
+  }
   if( rc==LSM_OK && pMW->hier.nHier==0 ){
     pMW->aSave[0].iPgno = pLevel->lhs.iFirst;
   }
@@ -4633,6 +5730,75 @@ static int sortedCountLevels(Level *p){
   return nRet;
 }
 
+static int sortedDbIsFull(lsm_db *pDb){
+  Level *pTop = lsmDbSnapshotLevel(pDb->pWorker);
+
+  if( lsmDatabaseFull(pDb) ) return 1;
+  if( pTop && pTop->iAge==0
+   && (pTop->nRight || sortedCountLevels(pTop)>=pDb->nMerge)
+  ){
+    return 1;
+  }
+  return 0;
+}
+
+/*
+** Return true if level p is "closed" under the LSM_MERGE_WINDOW merge
+** policy - if it is not the output of a flush and is already at least 
+** LSM_CONFIG_MERGE_WINDOW bytes in size. Closed levels are not merged 
+** with any other levels unless the database is full.
+*/
+static int sortedLevelIsClosed(lsm_db *pDb, Level *p){
+  i64 nByte = (i64)p->lhs.nSize * lsmFsPageSize(pDb->pFS);
+  assert( p->nRight==0 );
+  return (p->iAge>0 && nByte>=pDb->nMergeWindow);
+}
+
+/*
+** Select a run of levels to merge according to the LSM_MERGE_LEVELED
+** policy. If a merge is already underway, continue it. Otherwise, find the
+** first level p for which the combined size of p and the levels following
+** it is at least 1/nFanout of the size of the next level, and merge all 
+** such levels together.
+**
+** If a run of levels to merge is found, set *ppBest to point to the first
+** level in the run and *pnBest to the number of levels (or, if a merge is
+** already underway, to the number of right-hand segments). Otherwise, leave
+** both output variables unmodified.
+*/
+static void sortedSelectLeveled(
+  Level *pTopLevel,               /* Top level of worker snapshot */
+  int nFanout,                    /* Size ratio between adjacent levels */
+  Level **ppBest,                 /* OUT: First level to merge */
+  int *pnBest                     /* OUT: Number of levels to merge */
+){
+  Level *p;
+
+  for(p=pTopLevel; p; p=p->pNext){
+    if( p->nRight ){
+      *ppBest = p;
+      *pnBest = p->nRight;
+      return;
+    }
+  }
+
+  for(p=pTopLevel; p && p->pNext; p=p->pNext){
+    i64 nTotal = p->lhs.nSize;
+    int n = 1;
+    Level *pNext;
+    for(pNext=p->pNext; pNext; pNext=pNext->pNext){
+      if( nTotal*nFanout < pNext->lhs.nSize ) break;
+      nTotal += pNext->lhs.nSize;
+      n++;
+    }
+    if( n>1 ){
+      *ppBest = p;
+      *pnBest = n;
+      return;
+    }
+  }
+}
+
 static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
   Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
   int rc = LSM_OK;
@@ -4641,42 +5807,65 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
   int nBest;                    /* Number of segments merged at pBest */
   Level *pThis = 0;             /* First in run of levels with age=iAge */
   int nThis = 0;                /* Number of levels starting at pThis */
+  int ePolicy = pDb->eMergePolicy;
+  int bWindow = 0;              /* True to skip "closed" levels */
 
   assert( nMerge>=1 );
   nBest = LSM_MAX(1, nMerge-1);
 
-  /* Find the longest contiguous run of levels not currently undergoing a 
-  ** merge with the same age in the structure. Or the level being merged
-  ** with the largest number of right-hand segments. Work on it. */
-  for(pLevel=pTopLevel; pLevel; pLevel=pLevel->pNext){
-    if( pLevel->nRight==0 && pThis && pLevel->iAge==pThis->iAge ){
-      nThis++;
-    }else{
-      if( nThis>nBest ){
-        if( (pLevel->iAge!=pThis->iAge+1)
-         || (pLevel->nRight==0 && sortedCountLevels(pLevel)<=pDb->nMerge)
-        ){
-          pBest = pThis;
-          nBest = nThis;
+  /* If lsm_work() was called with nMerge==1 or the database is full, fall 
+  ** back to the default policy. This guarantees that enough work is done
+  ** to allow the next in-memory tree to be flushed.  */
+  if( nMerge==1 || (ePolicy==LSM_MERGE_LEVELED && sortedDbIsFull(pDb)) ){
+    ePolicy = LSM_MERGE_TIERED;
+  }
+  if( ePolicy==LSM_MERGE_WINDOW && lsmDatabaseFull(pDb)==0 ){
+    bWindow = 1;
+  }
+
+  if( ePolicy==LSM_MERGE_LEVELED ){
+    sortedSelectLeveled(pTopLevel, nMerge, &pBest, &nBest);
+  }else{
+    /* Find the longest contiguous run of levels not currently undergoing a 
+    ** merge with the same age in the structure. Or the level being merged
+    ** with the largest number of right-hand segments. Work on it. */
+    for(pLevel=pTopLevel; pLevel; pLevel=pLevel->pNext){
+      int bClosed = (bWindow && !pLevel->nRight 
+                  && sortedLevelIsClosed(pDb, pLevel));
+      if( pLevel->nRight==0 && !bClosed && pThis 
+       && pLevel->iAge==pThis->iAge 
+      ){
+        nThis++;
+      }else{
+        if( nThis>nBest ){
+          if( bWindow || (pLevel->iAge!=pThis->iAge+1)
+           || (pLevel->nRight==0 && sortedCountLevels(pLevel)<=pDb->nMerge)
+          ){
+            pBest = pThis;
+            nBest = nThis;
+          }
         }
-      }
-      if( pLevel->nRight ){
-        if( pLevel->nRight>nBest ){
-          nBest = pLevel->nRight;
-          pBest = pLevel;
+        if( pLevel->nRight ){
+          if( pLevel->nRight>nBest ){
+            nBest = pLevel->nRight;
+            pBest = pLevel;
+          }
+          nThis = 0;
+          pThis = 0;
+        }else if( bClosed ){
+          nThis = 0;
+          pThis = 0;
+        }else{
+          pThis = pLevel;
+          nThis = 1;
         }
-        nThis = 0;
-        pThis = 0;
-      }else{
-        pThis = pLevel;
-        nThis = 1;
       }
     }
-  }
-  if( nThis>nBest ){
-    assert( pThis );
-    pBest = pThis;
-    nBest = nThis;
+    if( nThis>nBest ){
+      assert( pThis );
+      pBest = pThis;
+      nBest = nThis;
+    }
   }
 
   if( pBest==0 && nMerge==1 ){
@@ -4707,18 +5896,6 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
   return rc;
 }
 
-static int sortedDbIsFull(lsm_db *pDb){
-  Level *pTop = lsmDbSnapshotLevel(pDb->pWorker);
-
-  if( lsmDatabaseFull(pDb) ) return 1;
-  if( pTop && pTop->iAge==0
-   && (pTop->nRight || sortedCountLevels(pTop)>=pDb->nMerge)
-  ){
-    return 1;
-  }
-  return 0;
-}
-
 typedef struct MoveBlockCtx MoveBlockCtx;
 struct MoveBlockCtx {
   int iSeen;                      /* Previous free block on list */
@@ -5077,6 +6254,7 @@ static int sortedWork(
 
   if( pnWrite ) *pnWrite = (nWork - nRemaining);
   pWorker->nWrite += (nWork - nRemaining);
+  if( nWork>nRemaining ) lsmDbRecordWrite(pDb, 0, nWork - nRemaining);
 
 #ifdef LSM_LOG_WORK
   lsmLogMessage(pDb, rc, "sortedWork(): %d pages", (nWork-nRemaining));
@@ -5339,6 +6517,38 @@ int lsm_flush(lsm_db *db){
   return rc;
 }
 
+int lsm_bulk_load(
+  lsm_db *db,
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx
+){
+  int rc;
+
+  if( db->nTransOpen>0 || db->pCsr ) return LSM_MISUSE_BKPT;
+
+  /* Move the contents of the in-memory tree to disk first, so that the
+  ** new segment is more recent than anything written before this call. */
+  rc = lsm_flush(db);
+
+  if( rc==LSM_OK ){
+    rc = lsmBeginWork(db);
+    while( rc==LSM_OK && sortedDbIsFull(db) ){
+      rc = sortedWork(db, 256, db->nMerge, 1, 0);
+    }
+    if( rc==LSM_OK ){
+      rc = sortedNewBulkLevel(db, xNext, pCtx, 0);
+    }
+    lsmFinishWork(db, 0, &rc);
+  }
+
+  /* The new segment was not written to the log file. Checkpoint the 
+  ** snapshot that contains it before returning. */
+  if( rc==LSM_OK ){
+    rc = lsmCheckpointWrite(db, 0, 0);
+  }
+  return rc;
+}
+
 /*
 ** This function is called in auto-work mode to perform merging work on
 ** the data structure. It performs enough merging work to prevent the
@@ -5484,6 +6694,69 @@ static int fileToString(
   return i;
 }
 
+/*
+** Cell iCell of page pPg is a record on a prefix-compressed leaf page. Copy
+** its key into buffer pBlob, followed immediately by its value (if any). 
+** Set *pnKey and *pnVal to the sizes of the key and value and return a
+** pointer to the start of the buffer. This is used by the functions that
+** dump page contents for debugging.
+*/
+static u8 *sortedPrefixCellData(
+  Segment *pSeg,                  /* Segment pPg belongs to */
+  Page *pPg,                      /* Page to read from */
+  int iCell,                      /* Index of cell on page to read */
+  int *pnKey,                     /* OUT: Size of key in bytes */
+  int *pnVal,                     /* OUT: Size of value in bytes */
+  Blob *pBlob                     /* Buffer to copy key and value to */
+){
+  Blob key = {0, 0, 0, 0};
+  Blob tmp = {0, 0, 0, 0};
+  u8 *aData; int nData;
+  u8 *aCell;
+  u8 *aKey;
+  u8 *aBody = 0;
+  int nKey = 0;
+  int nVal = 0;
+  int nPrefix, nSuffix;
+  int nDummy;
+  int eType;
+  int iTopic;
+  int rc;
+
+  aData = fsPageData(pPg, &nData);
+  aCell = pageGetCell(aData, nData, iCell);
+  eType = *aCell++;
+  aCell += lsmVarintGet32(aCell, &nDummy);
+  aCell += lsmVarintGet32(aCell, &nPrefix);
+  aCell += lsmVarintGet32(aCell, &nSuffix);
+  if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nVal);
+
+  aKey = pageGetKey(pSeg, pPg, iCell, &iTopic, &nKey, &key);
+  rc = (aKey ? LSM_OK : LSM_NOMEM_BKPT);
+  if( rc==LSM_OK ){
+    rc = sortedReadData(
+        pSeg, pPg, aCell-aData, nSuffix+nVal, (void **)&aBody, &tmp
+    );
+  }
+  if( rc==LSM_OK ){
+    rc = sortedBlobGrow(lsmPageEnv(pPg), pBlob, nKey+nVal);
+  }
+  if( rc==LSM_OK ){
+    u8 *aOut = (u8 *)pBlob->pData;
+    memcpy(aOut, aKey, nKey);
+    memcpy(&aOut[nKey], &aBody[nSuffix], nVal);
+    pBlob->nData = nKey+nVal;
+  }else{
+    nKey = nVal = 0;
+  }
+
+  sortedBlobFree(&key);
+  sortedBlobFree(&tmp);
+  *pnKey = nKey;
+  *pnVal = nVal;
+  return (u8 *)pBlob->pData;
+}
+
 void sortedDumpPage(lsm_db *pDb, Segment *pRun, Page *pPg, int bVals){
   Blob blob = {0, 0, 0};         /* Blob used for keys */
   LsmString s;
@@ -5525,6 +6798,10 @@ void sortedDumpPage(lsm_db *pDb, Segment *pRun, Page *pPg, int bVals){
       aCell += lsmVarintGet64(aCell, &iRef);
       lsmFsDbPageGet(pDb->pFS, pRun, iRef, &pRef);
       aKey = pageGetKey(pRun, pRef, 0, &iTopic, &nKey, &blob);
+    }else if( flags & SEGMENT_PREFIX_FLAG ){
+      aKey = sortedPrefixCellData(pRun, pPg, i, &nKey, &nVal, &blob);
+      aVal = &aKey[nKey];
+      iTopic = eType;
     }else{
       aCell += lsmVarintGet32(aCell, &nKey);
       if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nVal);
@@ -5595,6 +6872,9 @@ static void infoCellDump(
       aKey = (u8 *)"<indirect>";
       nKey = 11;
     }
+  }else if( pageGetFlags(aData, nData) & SEGMENT_PREFIX_FLAG ){
+    aKey = sortedPrefixCellData(pSeg, pPg, iCell, &nKey, &nVal, pBlob);
+    aVal = &aKey[nKey];
   }else{
     aCell += lsmVarintGet32(aCell, &nKey);
     if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nVal);
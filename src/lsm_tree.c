@@ -1437,6 +1437,60 @@ static int treePrevIsStartDelete(lsm_db *db, TreeCursor *pCsr){
   return 0;
 }
 
+/*
+** Keys are often inserted into the tree in ascending order. This function
+** checks if key pKey/nKey is larger than all keys currently in the tree.
+** If so, cursor pCsr is left pointing to the largest key in the tree, as
+** it would be by lsmTreeCursorSeek(), and 1 is returned. Otherwise, 0 is
+** returned and the cursor should be repositioned by the caller.
+**
+** Unlike lsmTreeCursorSeek(), this function does not compare any keys on
+** the way down the tree. It follows the right-most child pointer of each
+** interior node to the right-most leaf, then compares the new key with
+** the last key on that leaf only.
+**
+** After a key that is not larger than all others is inserted, the next
+** TREE_APPEND_SKIP calls to this function return 0 without searching the
+** tree. This limits the cost of the check for other workloads.
+*/
+#define TREE_APPEND_SKIP 16
+static int treeSeekAppend(
+  lsm_db *pDb,                    /* Database handle */
+  TreeCursor *pCsr,               /* Cursor to position */
+  void *pKey,                     /* Pointer to key data */
+  int nKey,                       /* Size of key data in bytes */
+  int *pRc                        /* IN/OUT: Error code */
+){
+  TreeRoot *pRoot = pCsr->pRoot;
+  u32 iNodePtr = pRoot->iRoot;
+  int iNode;
+  TreeKey *pLast;
+
+  if( pDb->nTreeAppendSkip>0 ){
+    pDb->nTreeAppendSkip--;
+    return 0;
+  }
+
+  for(iNode=0; iNode<pRoot->nHeight; iNode++){
+    TreeNode *pNode = (TreeNode *)treeShmptrUnsafe(pDb, iNodePtr);
+    int iCell = (pNode->aiKeyPtr[2] ? 2 : 1);
+    pCsr->apTreeNode[iNode] = pNode;
+    if( iNode<(pRoot->nHeight-1) ){
+      pCsr->aiCell[iNode] = iCell+1;
+      iNodePtr = getChildPtr(pNode, pRoot->iTransId, iCell+1);
+    }else{
+      pCsr->aiCell[iNode] = iCell;
+    }
+  }
+  pCsr->iNode = pRoot->nHeight-1;
+
+  pLast = csrGetKey(pCsr, &pCsr->blob, pRc);
+  if( *pRc!=LSM_OK ) return 0;
+  if( treeKeycmp(TKV_KEY(pLast), pLast->nKey, pKey, nKey)<0 ) return 1;
+
+  pDb->nTreeAppendSkip = TREE_APPEND_SKIP;
+  return 0;
+}
 
 static int treeInsertEntry(
   lsm_db *pDb,                    /* Database handle */
@@ -1468,7 +1522,11 @@ static int treeInsertEntry(
     treeCursorInit(pDb, 0, &csr);
 
     /* Seek to the leaf (or internal node) that the new key belongs on */
-    rc = lsmTreeCursorSeek(&csr, pKey, nKey, &res);
+    if( treeSeekAppend(pDb, &csr, pKey, nKey, &rc) ){
+      res = -1;
+    }else if( rc==LSM_OK ){
+      rc = lsmTreeCursorSeek(&csr, pKey, nKey, &res);
+    }
     pRes = csrGetKey(&csr, &csr.blob, &rc);
     if( rc!=LSM_OK ) return rc;
 
@@ -36,6 +36,7 @@
 #include <errno.h>
 
 #include <sys/mman.h>
+#include <sys/time.h>
 #include "lsmInt.h"
 
 /* There is no fdatasync() call on Android */
@@ -690,6 +691,265 @@ static int lsmPosixOsMutexNotHeld(lsm_mutex *pMutex){
 /***************************************************************************/
 #endif /* else LSM_MUTEX_NONE */
 
+#ifdef LSM_MUTEX_PTHREADS
+/*************************************************************************
+** Background threads for pthreads based systems. These are used to run
+** the worker thread configured by LSM_CONFIG_WORKER_THREAD. If 
+** LSM_MUTEX_PTHREADS is not defined, lsmThreadStart() always fails.
+*/
+struct LsmThread {
+  lsm_env *pEnv;                  /* Environment used to allocate this */
+  pthread_t thread;               /* Thread handle */
+  pthread_mutex_t mutex;          /* Mutex protecting bSignal and bStop */
+  pthread_cond_t cond;            /* Signalled when bSignal or bStop is set */
+  pthread_cond_t progress;        /* Broadcast when iProgress or bExit change */
+  int bSignal;                    /* Set by lsmThreadSignal() */
+  int bStop;                      /* Set by lsmThreadStop() */
+  int bExit;                      /* Set once xMain has returned */
+  int iProgress;                  /* Incremented by lsmThreadProgress() */
+  void (*xMain)(LsmThread *, void *);
+  void *pArg;                     /* Second argument passed to xMain */
+};
+
+static void *lsmPosixThreadMain(void *pCtx){
+  LsmThread *p = (LsmThread *)pCtx;
+  p->xMain(p, p->pArg);
+  pthread_mutex_lock(&p->mutex);
+  p->bExit = 1;
+  pthread_cond_broadcast(&p->progress);
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+/*
+** Set *pUntil to the absolute time nMs milliseconds from now.
+*/
+static void lsmPosixDeadline(int nMs, struct timespec *pUntil){
+  struct timeval now;
+  gettimeofday(&now, 0);
+  pUntil->tv_sec = now.tv_sec + nMs/1000;
+  pUntil->tv_nsec = ((long)now.tv_usec + (nMs%1000)*1000) * 1000;
+  if( pUntil->tv_nsec>=1000000000 ){
+    pUntil->tv_sec++;
+    pUntil->tv_nsec -= 1000000000;
+  }
+}
+
+/*
+** Start a new thread that runs xMain(pThread, pArg). If successful, set
+** *ppThread to point to the new thread handle and return LSM_OK. Otherwise,
+** set *ppThread to NULL and return an LSM error code.
+*/
+int lsmThreadStart(
+  lsm_env *pEnv,
+  void (*xMain)(LsmThread *, void *),
+  void *pArg,
+  LsmThread **ppThread
+){
+  LsmThread *p;
+
+  *ppThread = 0;
+  p = (LsmThread *)lsmMallocZero(pEnv, sizeof(LsmThread));
+  if( p==0 ) return LSM_NOMEM_BKPT;
+  p->pEnv = pEnv;
+  p->xMain = xMain;
+  p->pArg = pArg;
+  pthread_mutex_init(&p->mutex, 0);
+  pthread_cond_init(&p->cond, 0);
+  pthread_cond_init(&p->progress, 0);
+  if( pthread_create(&p->thread, 0, lsmPosixThreadMain, (void *)p) ){
+    pthread_cond_destroy(&p->progress);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    lsmFree(pEnv, p);
+    return lsmErrorBkpt(LSM_ERROR);
+  }
+  *ppThread = p;
+  return LSM_OK;
+}
+
+/*
+** Wake up thread p if it is blocked in lsmThreadWait(). If it is not, the
+** next call to lsmThreadWait() returns immediately.
+*/
+void lsmThreadSignal(LsmThread *p){
+  pthread_mutex_lock(&p->mutex);
+  p->bSignal = 1;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/*
+** This function is called by thread p itself. It blocks until either
+** lsmThreadSignal() or lsmThreadStop() is called, or until nMs milliseconds
+** have elapsed. Return non-zero if lsmThreadStop() has been called, or 
+** zero otherwise. If nMs is zero, this function does not block.
+*/
+int lsmThreadWait(LsmThread *p, int nMs){
+  int bStop;
+  pthread_mutex_lock(&p->mutex);
+  if( p->bSignal==0 && p->bStop==0 && nMs>0 ){
+    struct timespec until;
+    lsmPosixDeadline(nMs, &until);
+    pthread_cond_timedwait(&p->cond, &p->mutex, &until);
+  }
+  p->bSignal = 0;
+  bStop = p->bStop;
+  pthread_mutex_unlock(&p->mutex);
+  return bStop;
+}
+
+/*
+** This function is called by thread p itself to report that it has
+** completed a unit of work. Any other thread blocked in 
+** lsmThreadWaitProgress() is woken up.
+*/
+void lsmThreadProgress(LsmThread *p){
+  pthread_mutex_lock(&p->mutex);
+  p->iProgress++;
+  pthread_cond_broadcast(&p->progress);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/*
+** This function is called by any thread other than p. If *piProgress 
+** matches the number of lsmThreadProgress() calls made by thread p so far
+** and p has not exited, block for up to nMs milliseconds waiting for this
+** to change. Before returning, set *piProgress to the current number of 
+** lsmThreadProgress() calls. Return non-zero if thread p has exited, or
+** zero otherwise. If nMs is zero, this function does not block.
+*/
+int lsmThreadWaitProgress(LsmThread *p, int *piProgress, int nMs){
+  int bExit;
+  pthread_mutex_lock(&p->mutex);
+  if( p->iProgress==*piProgress && p->bExit==0 && nMs>0 ){
+    struct timespec until;
+    lsmPosixDeadline(nMs, &until);
+    while( p->iProgress==*piProgress && p->bExit==0 ){
+      if( pthread_cond_timedwait(&p->progress, &p->mutex, &until) ) break;
+    }
+  }
+  *piProgress = p->iProgress;
+  bExit = p->bExit;
+  pthread_mutex_unlock(&p->mutex);
+  return bExit;
+}
+
+/*
+** Ask thread p to stop, wait for it to do so, and free the thread handle.
+*/
+void lsmThreadStop(LsmThread *p){
+  if( p ){
+    pthread_mutex_lock(&p->mutex);
+    p->bStop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->thread, 0);
+    pthread_cond_destroy(&p->progress);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    lsmFree(p->pEnv, p);
+  }
+}
+
+/*
+** Condition variables. An LsmCond counts the calls made to
+** lsmCondBroadcast(). lsmCondWait() blocks until that count differs from
+** a value read earlier by the caller. A broadcast made after the
+** caller read the count therefore always wakes it, even if the caller is
+** not blocked yet.
+*/
+struct LsmCond {
+  lsm_env *pEnv;                  /* Environment used to allocate this */
+  pthread_mutex_t mutex;          /* Mutex protecting iSeq */
+  pthread_cond_t cond;            /* Broadcast when iSeq changes */
+  int iSeq;                       /* Incremented by lsmCondBroadcast() */
+};
+
+/*
+** Allocate a new condition variable. If successful, set *ppCond to point
+** to it and return LSM_OK. Otherwise, set *ppCond to NULL and return an
+** LSM error code.
+*/
+int lsmCondNew(lsm_env *pEnv, LsmCond **ppCond){
+  LsmCond *p;
+  *ppCond = p = (LsmCond *)lsmMallocZero(pEnv, sizeof(LsmCond));
+  if( p==0 ) return LSM_NOMEM_BKPT;
+  p->pEnv = pEnv;
+  pthread_mutex_init(&p->mutex, 0);
+  pthread_cond_init(&p->cond, 0);
+  return LSM_OK;
+}
+
+/*
+** Free a condition variable allocated by lsmCondNew().
+*/
+void lsmCondDel(LsmCond *p){
+  if( p ){
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    lsmFree(p->pEnv, p);
+  }
+}
+
+/*
+** Wake up all threads blocked in lsmCondWait() on condition variable p.
+*/
+void lsmCondBroadcast(LsmCond *p){
+  pthread_mutex_lock(&p->mutex);
+  p->iSeq++;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/*
+** If *piSeq matches the number of lsmCondBroadcast() calls made on p so
+** far, block for up to nMs milliseconds waiting for this to change. Before
+** returning, set *piSeq to the current number of lsmCondBroadcast() calls.
+** If nMs is zero, this function does not block.
+*/
+void lsmCondWait(LsmCond *p, int *piSeq, int nMs){
+  pthread_mutex_lock(&p->mutex);
+  if( p->iSeq==*piSeq && nMs>0 ){
+    struct timespec until;
+    lsmPosixDeadline(nMs, &until);
+    while( p->iSeq==*piSeq ){
+      if( pthread_cond_timedwait(&p->cond, &p->mutex, &until) ) break;
+    }
+  }
+  *piSeq = p->iSeq;
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/*
+** End of pthreads thread implementation.
+*************************************************************************/
+#else
+int lsmThreadStart(
+  lsm_env *pEnv,
+  void (*xMain)(LsmThread *, void *),
+  void *pArg,
+  LsmThread **ppThread
+){
+  *ppThread = 0;
+  return LSM_MISUSE_BKPT;
+}
+void lsmThreadSignal(LsmThread *p){ }
+int lsmThreadWait(LsmThread *p, int nMs){ return 1; }
+void lsmThreadProgress(LsmThread *p){ }
+int lsmThreadWaitProgress(LsmThread *p, int *piProgress, int nMs){ return 1; }
+void lsmThreadStop(LsmThread *p){ }
+
+/* Without pthreads, there are no condition variables. Callers poll. */
+int lsmCondNew(lsm_env *pEnv, LsmCond **ppCond){
+  *ppCond = 0;
+  return LSM_OK;
+}
+void lsmCondDel(LsmCond *p){ }
+void lsmCondBroadcast(LsmCond *p){ }
+void lsmCondWait(LsmCond *p, int *piSeq, int nMs){ }
+#endif
+
 /* Without LSM_DEBUG, the MutexHeld tests are never called */
 #ifndef LSM_DEBUG
 # define lsmPosixOsMutexHeld    0
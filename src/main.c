@@ -160,6 +160,22 @@ int sqlite4_db_config(sqlite4 *db, int op, ...){
       rc = setupLookaside(db, pBuf, sz, cnt);
       break;
     }
+    case SQLITE4_DBCONFIG_PARSE_ARENA: {
+      int nByte = va_arg(ap, int);
+      sqlite4_mutex_enter(db->mutex);
+      rc = sqlite4ArenaSetup(db, nByte);
+      sqlite4_mutex_leave(db->mutex);
+      break;
+    }
+    case SQLITE4_DBCONFIG_STMT_CACHE: {
+      int nStmt = va_arg(ap, int);
+      sqlite4_mutex_enter(db->mutex);
+      sqlite4StmtCacheFlush(db);
+      db->stmtcache.nMax = (nStmt>0 ? nStmt : 0);
+      sqlite4_mutex_leave(db->mutex);
+      rc = SQLITE4_OK;
+      break;
+    }
     default: {
       static const struct {
         int op;      /* The opcode */
@@ -367,6 +383,9 @@ int sqlite4_close(sqlite4 *db, unsigned int flags){
   }
   sqlite4_mutex_enter(db->mutex);
 
+  /* Discard any statements in the statement cache */
+  sqlite4StmtCacheFlush(db);
+
   /* Force xDestroy calls on all virtual tables */
   sqlite4ResetInternalSchema(db, -1);
 
@@ -438,6 +457,7 @@ int sqlite4_close(sqlite4 *db, unsigned int flags){
     sqlite4DbFree(db, pColl);
   }
   sqlite4HashClear(&db->aCollSeq);
+  sqlite4HashClear(&db->stmtcache.hash);
 #ifndef SQLITE4_OMIT_VIRTUALTABLE
   for(i=sqliteHashFirst(&db->aModule); i; i=sqliteHashNext(i)){
     Module *pMod = (Module *)sqliteHashData(i);
@@ -462,6 +482,8 @@ int sqlite4_close(sqlite4 *db, unsigned int flags){
   if( db->lookaside.bMalloced ){
     sqlite4_free(db->pEnv, db->lookaside.pStart);
   }
+  assert( db->arena.nRef==0 );
+  sqlite4_free(db->pEnv, db->arena.pStart);
   sqlite4_free(db->pEnv, db);
   return SQLITE4_OK;
 }
@@ -1147,12 +1169,16 @@ static int openDatabase(
   memcpy(db->aLimit, aHardLimit, sizeof(db->aLimit));
   db->nextAutovac = -1;
   db->nextPagesize = 0;
+  db->nSorterMem = SQLITE4_DEFAULT_SORTER_MEMORY;
+  db->nWorker = SQLITE4_DEFAULT_WORKER_THREADS;
   db->flags |=  SQLITE4_AutoIndex
                  | SQLITE4_EnableTrigger
                  | SQLITE4_ForeignKeys
             ;
 
   sqlite4HashInit(pEnv, &db->aCollSeq, 0);
+  sqlite4HashInit(pEnv, &db->stmtcache.hash, 1);
+  db->stmtcache.nMax = SQLITE4_DEFAULT_STMT_CACHE;
 #ifndef SQLITE4_OMIT_VIRTUALTABLE
   sqlite4HashInit(pEnv, &db->aModule, 0);
 #endif
@@ -1240,6 +1266,7 @@ static int openDatabase(
   /* Enable the lookaside-malloc subsystem */
   setupLookaside(db, 0, pEnv->szLookaside,
                         pEnv->nLookaside);
+  sqlite4ArenaSetup(db, SQLITE4_DEFAULT_PARSE_ARENA);
 
 opendb_out:
   sqlite4_free(pEnv, zOpen);
@@ -80,6 +80,14 @@ static int isLookaside(sqlite4 *db, void *p){
 #define isLookaside(A,B) 0
 #endif
 
+/*
+** TRUE if p is a parse arena allocation from db. Each arena allocation is
+** preceded by 8 bytes, the first 4 of which hold its size in bytes.
+*/
+#define isArena(db, p) \
+  ((u8*)(p)>=(db)->arena.pStart && (u8*)(p)<(db)->arena.pEnd)
+#define arenaSize(p) (*(int*)&((u8*)(p))[-8])
+
 /*
 ** Return the size of a memory allocation previously obtained from
 ** sqlite4Malloc() or sqlite4_malloc().
@@ -95,6 +103,8 @@ int sqlite4DbMallocSize(sqlite4 *db, void *p){
   assert( db==0 || sqlite4_mutex_held(db->mutex) );
   if( db && isLookaside(db, p) ){
     return db->lookaside.sz;
+  }else if( db && isArena(db, p) ){
+    return arenaSize(p);
   }else{
     return sqlite4MallocSize(sqlite4_db_env(db), p);
   }
@@ -130,6 +140,9 @@ void sqlite4DbFree(sqlite4 *db, void *p){
       db->lookaside.nOut--;
       return;
     }
+    if( isArena(db, p) ){
+      return;
+    }
   }
   assert( sqlite4MemdebugHasType(p, MEMTYPE_DB) );
   assert( sqlite4MemdebugHasType(p, MEMTYPE_LOOKASIDE|MEMTYPE_HEAP) );
@@ -252,6 +265,84 @@ void *sqlite4DbMallocRaw(sqlite4 *db, int n){
   return p;
 }
 
+/*
+** Allocate and zero memory for a parse tree or where-planner object. While
+** a statement is being prepared, the memory is taken from the parse arena
+** of the connection. It is reclaimed all at once by sqlite4ArenaEnd(), so
+** passing it to sqlite4DbFree() is a no-op. Otherwise, or if the arena is
+** full, this routine is the same as sqlite4DbMallocZero().
+**
+** Objects that may outlive the call to sqlite4Prepare() must not be
+** allocated using this routine. This is why the sqlite4ExprDup() family
+** of functions, used to make copies of parse trees that are stored in the
+** schema, always allocate from the heap.
+*/
+void *sqlite4DbMallocNode(sqlite4 *db, int n){
+  if( db && db->arena.nRef && db->init.busy==0 && db->mallocFailed==0 ){
+    ParseArena *pArena = &db->arena;
+    int nByte = ROUND8(n);
+    if( n>0 && nByte+8<=pArena->pEnd-pArena->pFree ){
+      u8 *p = &pArena->pFree[8];
+      pArena->pFree += (nByte + 8);
+      if( (pArena->pFree - pArena->pStart)>pArena->mxUsed ){
+        pArena->mxUsed = (int)(pArena->pFree - pArena->pStart);
+      }
+      arenaSize(p) = nByte;
+      memset(p, 0, n);
+      return (void*)p;
+    }
+    if( pArena->pStart ) pArena->nMiss++;
+  }
+  return sqlite4DbMallocZero(db, n);
+}
+
+/*
+** Replace the parse arena buffer of connection db with a new buffer of
+** nByte bytes obtained from sqlite4Malloc(). If nByte is zero, the arena
+** is disabled. Return SQLITE4_BUSY if a statement is being prepared, or
+** SQLITE4_OK otherwise. A failure to allocate the buffer is not an error -
+** the arena is simply disabled.
+*/
+int sqlite4ArenaSetup(sqlite4 *db, int nByte){
+  ParseArena *pArena = &db->arena;
+  assert( sqlite4_mutex_held(db->mutex) );
+  if( pArena->nRef ) return SQLITE4_BUSY;
+  sqlite4_free(db->pEnv, pArena->pStart);
+  memset(pArena, 0, sizeof(ParseArena));
+  nByte = ROUNDDOWN8(nByte);
+  if( nByte>0 ){
+    sqlite4BeginBenignMalloc(db->pEnv);
+    pArena->pStart = (u8*)sqlite4Malloc(db->pEnv, nByte);
+    sqlite4EndBenignMalloc(db->pEnv);
+    if( pArena->pStart ){
+      pArena->pEnd = &pArena->pStart[nByte];
+      pArena->pFree = pArena->pStart;
+    }
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** Called at the start and end of each call to sqlite4Prepare(). When the
+** outermost call ends, all parse arena memory is reclaimed.
+*/
+void sqlite4ArenaBegin(sqlite4 *db){
+  db->arena.nRef++;
+}
+void sqlite4ArenaEnd(sqlite4 *db){
+  ParseArena *pArena = &db->arena;
+  assert( pArena->nRef>0 );
+  pArena->nRef--;
+  if( pArena->nRef==0 ){
+#ifdef SQLITE4_DEBUG
+    /* Overwrite the memory so that any use of an object that should not
+    ** have been allocated from the arena is likely to cause a failure. */
+    memset(pArena->pStart, 0x55, pArena->pFree - pArena->pStart);
+#endif
+    pArena->pFree = pArena->pStart;
+  }
+}
+
 /*
 ** Resize the block of memory pointed to by p to n bytes. If the
 ** resize fails, set the mallocFailed flag in the connection object.
@@ -264,7 +355,24 @@ void *sqlite4DbRealloc(sqlite4 *db, void *p, int n){
     if( p==0 ){
       return sqlite4DbMallocRaw(db, n);
     }
-    if( isLookaside(db, p) ){
+    if( isArena(db, p) ){
+      ParseArena *pArena = &db->arena;
+      int nOld = arenaSize(p);
+      int nNew = ROUND8(n);
+      if( n<=nOld ){
+        return p;
+      }
+      if( (u8*)p+nOld==pArena->pFree && nNew-nOld<=pArena->pEnd-pArena->pFree ){
+        /* p is the most recent arena allocation. Extend it in place. */
+        pArena->pFree += (nNew - nOld);
+        arenaSize(p) = nNew;
+        return p;
+      }
+      pNew = sqlite4DbMallocNode(db, n);
+      if( pNew ){
+        memcpy(pNew, p, nOld);
+      }
+    }else if( isLookaside(db, p) ){
       if( n<=db->lookaside.sz ){
         return p;
       }
@@ -641,6 +641,411 @@ static sqlite4_mm *mmOneszNew(void *pSpace, int sz, int cnt){
   return &pOnesz->base;
 }
 
+/*************************************************************************
+** The SQLITE4_MM_SLAB memory allocator.
+**
+** Requests for up to MMSLAB_MAXSZ bytes are rounded up to one of the size
+** classes in mmSlabSize[]. Blocks of each class are carved from large
+** chunks obtained from an underlying allocator and recycled using a free
+** list for each class. Chunks are not returned to the underlying allocator
+** until the SQLITE4_MM_SLAB object is destroyed. Larger requests are passed
+** through to the underlying allocator.
+**
+** To reduce contention between threads, the allocator is divided into
+** MMSLAB_NSHARD shards, each with its own chunks, free lists, statistics
+** and lock. A thread uses the shard selected by a hash of the address of a
+** variable on its stack, so that different threads tend to use different
+** shards. If that shard is locked by another thread, the next is tried,
+** and so on. Each block is preceded by an 8-byte header that identifies
+** its size class and the shard it was allocated from, so that it can be
+** returned to the same shard when it is freed.
+**
+** The locks are simple spin-locks built on the GCC __sync builtins or the
+** win32 Interlocked API. If neither is available, the allocator is not
+** threadsafe.
+*/
+#define MMSLAB_NSHARD   8             /* Number of shards */
+#define MMSLAB_CHUNK    (64*1024)     /* Size of chunks in bytes */
+#define MMSLAB_MAXSZ    512           /* Largest request served from chunks */
+#define MMSLAB_LARGE    0xFFFF        /* mmSlabHdr.iClass for large blocks */
+
+static const u16 mmSlabSize[] = {
+    8,  16,  24,  32,  48,  64,  80,  96, 112,
+  128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+#define MMSLAB_NCLASS (int)(sizeof(mmSlabSize)/sizeof(mmSlabSize[0]))
+
+#if SQLITE4_THREADSAFE && defined(__GNUC__)
+# define mmSlabTryLock(p) (__sync_lock_test_and_set(&(p)->bLock, 1)==0)
+# define mmSlabUnlock(p)  __sync_lock_release(&(p)->bLock)
+#elif SQLITE4_THREADSAFE && SQLITE4_OS_WIN
+# define mmSlabTryLock(p) (InterlockedCompareExchange(&(p)->bLock, 1, 0)==0)
+# define mmSlabUnlock(p)  InterlockedExchange(&(p)->bLock, 0)
+#else
+# define mmSlabTryLock(p) 1
+# define mmSlabUnlock(p)
+#endif
+
+/* Header at the start of each block. Must be 8 bytes in size. */
+struct mmSlabHdr {
+  u16 iClass;                     /* Index in mmSlabSize[], or MMSLAB_LARGE */
+  u16 iShard;                     /* Shard block was allocated from */
+  u32 nUnused;                    /* Padding */
+};
+
+/* The payload of a block on a free list */
+struct mmSlabFreeBlock {
+  struct mmSlabFreeBlock *pNext;  /* Next block on the same free list */
+};
+
+struct mmSlabShard {
+  long volatile bLock;            /* True while the shard is locked */
+  u8 *pChunk;                     /* Most recently allocated chunk */
+  u8 *pSpace;                     /* First unused byte of pChunk */
+  u8 *pEnd;                       /* One byte past the end of pChunk */
+  struct mmSlabFreeBlock *apFree[MMSLAB_NCLASS];   /* Free lists */
+
+  i64 nOut;                       /* Bytes outstanding */
+  i64 nOutHw;                     /* Highwater mark of nOut */
+  i64 nUnit;                      /* Allocations outstanding */
+  i64 nUnitHw;                    /* Highwater mark of nUnit */
+  i64 nMaxRequest;                /* Largest request seen so far */
+  i64 nFault;                     /* Number of malloc or realloc failures */
+  i64 aUnit[MMSLAB_NCLASS];       /* Allocations outstanding by class */
+  i64 aUnitHw[MMSLAB_NCLASS];     /* Highwater marks of aUnit[] */
+};
+
+struct mmSlab {
+  sqlite4_mm base;                /* Base class.  Must be first. */
+  sqlite4_mm *p;                  /* Underlying allocator object */
+  u8 aClass[MMSLAB_MAXSZ/8 + 1];  /* Size class for each 8-byte size */
+  struct mmSlabShard aShard[MMSLAB_NSHARD];
+};
+
+/*
+** Lock and return one of the shards of allocator pSlab. The shard selected
+** depends on the calling thread.
+*/
+static struct mmSlabShard *mmSlabEnter(struct mmSlab *pSlab){
+  char c;                         /* Address identifies the calling thread */
+  u32 h = (u32)(SQLITE4_PTR_TO_INT(&c) >> 16) * 0x9E3779B1;
+  int i = (int)((h >> 16) % MMSLAB_NSHARD);
+  while( !mmSlabTryLock(&pSlab->aShard[i]) ){
+    i = (i+1) % MMSLAB_NSHARD;
+  }
+  return &pSlab->aShard[i];
+}
+
+/*
+** Lock the shard that block pHdr was allocated from.
+*/
+static struct mmSlabShard *mmSlabEnterBlock(
+  struct mmSlab *pSlab, 
+  struct mmSlabHdr *pHdr
+){
+  struct mmSlabShard *pShard = &pSlab->aShard[pHdr->iShard];
+  while( !mmSlabTryLock(pShard) );
+  return pShard;
+}
+
+/*
+** Update the statistics of shard pShard to account for an allocation of
+** nByte bytes, or for a failed allocation if nByte is negative.
+*/
+static void mmSlabUpdateStats(struct mmSlabShard *pShard, i64 nByte){
+  if( nByte<0 ){
+    pShard->nFault++;
+  }else{
+    pShard->nOut += nByte;
+    pShard->nUnit++;
+    if( pShard->nOut>pShard->nOutHw ) pShard->nOutHw = pShard->nOut;
+    if( pShard->nUnit>pShard->nUnitHw ) pShard->nUnitHw = pShard->nUnit;
+  }
+}
+
+static void *mmSlabMalloc(sqlite4_mm *pMM, sqlite4_size_t iSz){
+  struct mmSlab *pSlab = (struct mmSlab*)pMM;
+  struct mmSlabShard *pShard;
+  struct mmSlabHdr *pHdr = 0;
+  int iClass = MMSLAB_LARGE;
+  i64 nByte = -1;
+
+  if( iSz<=MMSLAB_MAXSZ ){
+    iClass = pSlab->aClass[(iSz+7)/8];
+  }else{
+    pHdr = (struct mmSlabHdr*)sqlite4_mm_malloc(pSlab->p, iSz + 8);
+    if( pHdr ) nByte = sqlite4_mm_msize(pSlab->p, pHdr) - 8;
+  }
+
+  pShard = mmSlabEnter(pSlab);
+  if( iSz>pShard->nMaxRequest ) pShard->nMaxRequest = iSz;
+  if( iClass!=MMSLAB_LARGE ){
+    struct mmSlabFreeBlock *pFree = pShard->apFree[iClass];
+    int nBlock = mmSlabSize[iClass] + 8;
+    if( pFree ){
+      pShard->apFree[iClass] = pFree->pNext;
+      pHdr = &((struct mmSlabHdr*)pFree)[-1];
+    }else{
+      if( pShard->pSpace+nBlock>pShard->pEnd ){
+        u8 *pChunk = (u8*)sqlite4_mm_malloc(pSlab->p, MMSLAB_CHUNK);
+        if( pChunk ){
+          /* The first 8 bytes of each chunk point to the previous chunk */
+          *(u8**)pChunk = pShard->pChunk;
+          pShard->pChunk = pChunk;
+          pShard->pSpace = &pChunk[8];
+          pShard->pEnd = &pChunk[MMSLAB_CHUNK];
+        }
+      }
+      if( pShard->pSpace+nBlock<=pShard->pEnd ){
+        pHdr = (struct mmSlabHdr*)pShard->pSpace;
+        pShard->pSpace += nBlock;
+      }
+    }
+    if( pHdr ){
+      nByte = mmSlabSize[iClass];
+      pShard->aUnit[iClass]++;
+      if( pShard->aUnit[iClass]>pShard->aUnitHw[iClass] ){
+        pShard->aUnitHw[iClass] = pShard->aUnit[iClass];
+      }
+    }
+  }
+  if( pHdr ){
+    pHdr->iClass = (u16)iClass;
+    pHdr->iShard = (u16)(pShard - pSlab->aShard);
+  }
+  mmSlabUpdateStats(pShard, nByte);
+  mmSlabUnlock(pShard);
+
+  return pHdr ? (void*)&pHdr[1] : 0;
+}
+
+static sqlite4_size_t mmSlabMsize(sqlite4_mm *pMM, void *pOld){
+  struct mmSlab *pSlab = (struct mmSlab*)pMM;
+  struct mmSlabHdr *pHdr;
+  if( pOld==0 ) return 0;
+  pHdr = &((struct mmSlabHdr*)pOld)[-1];
+  if( pHdr->iClass==MMSLAB_LARGE ){
+    return sqlite4_mm_msize(pSlab->p, pHdr) - 8;
+  }
+  return mmSlabSize[pHdr->iClass];
+}
+
+static void mmSlabFree(sqlite4_mm *pMM, void *pOld){
+  struct mmSlab *pSlab = (struct mmSlab*)pMM;
+  struct mmSlabShard *pShard;
+  struct mmSlabHdr *pHdr;
+  int iClass;
+
+  if( pOld==0 ) return;
+  pHdr = &((struct mmSlabHdr*)pOld)[-1];
+  iClass = pHdr->iClass;
+  if( iClass==MMSLAB_LARGE ){
+    i64 nByte = sqlite4_mm_msize(pSlab->p, pHdr) - 8;
+    pShard = mmSlabEnterBlock(pSlab, pHdr);
+    pShard->nOut -= nByte;
+    pShard->nUnit--;
+    mmSlabUnlock(pShard);
+    sqlite4_mm_free(pSlab->p, pHdr);
+  }else{
+    struct mmSlabFreeBlock *pFree = (struct mmSlabFreeBlock*)pOld;
+    pShard = mmSlabEnterBlock(pSlab, pHdr);
+    pFree->pNext = pShard->apFree[iClass];
+    pShard->apFree[iClass] = pFree;
+    pShard->nOut -= mmSlabSize[iClass];
+    pShard->nUnit--;
+    pShard->aUnit[iClass]--;
+    mmSlabUnlock(pShard);
+  }
+}
+
+static void *mmSlabRealloc(sqlite4_mm *pMM, void *pOld, sqlite4_size_t iSz){
+  struct mmSlab *pSlab = (struct mmSlab*)pMM;
+  struct mmSlabHdr *pHdr;
+  sqlite4_size_t nOld;
+  void *pNew;
+
+  if( pOld==0 ) return mmSlabMalloc(pMM, iSz);
+  pHdr = &((struct mmSlabHdr*)pOld)[-1];
+  nOld = mmSlabMsize(pMM, pOld);
+
+  if( pHdr->iClass!=MMSLAB_LARGE && iSz<=nOld ) return pOld;
+  if( pHdr->iClass==MMSLAB_LARGE && iSz>MMSLAB_MAXSZ ){
+    /* Both the old and new allocations are passed through to the
+    ** underlying allocator. Use its realloc() method. */
+    struct mmSlabShard *pShard;
+    struct mmSlabHdr *pNewHdr;
+    pNewHdr = (struct mmSlabHdr*)sqlite4_mm_realloc(pSlab->p, pHdr, iSz+8);
+    pShard = mmSlabEnterBlock(pSlab, pNewHdr ? pNewHdr : pHdr);
+    if( iSz>pShard->nMaxRequest ) pShard->nMaxRequest = iSz;
+    if( pNewHdr ){
+      pShard->nOut += (sqlite4_mm_msize(pSlab->p, pNewHdr) - 8) - nOld;
+      if( pShard->nOut>pShard->nOutHw ) pShard->nOutHw = pShard->nOut;
+    }else{
+      pShard->nFault++;
+    }
+    mmSlabUnlock(pShard);
+    return pNewHdr ? (void*)&pNewHdr[1] : 0;
+  }
+
+  pNew = mmSlabMalloc(pMM, iSz);
+  if( pNew ){
+    memcpy(pNew, pOld, (size_t)(nOld<iSz ? nOld : iSz));
+    mmSlabFree(pMM, pOld);
+  }
+  return pNew;
+}
+
+static void mmSlabBenign(sqlite4_mm *pMM, int bBenign){
+  struct mmSlab *pSlab = (struct mmSlab*)pMM;
+  sqlite4_mm_benign_failures(pSlab->p, bBenign);
+}
+
+/*
+** sqlite4_mm_methods.xStat method.
+**
+** If the eType argument includes an SQLITE4_MMSTAT_CLASS() value, then
+** SQLITE4_MMSTAT_OUT, UNITS and UNITS_HW return values for the specified
+** size class only, and SQLITE4_MMSTAT_SIZE returns the size of its blocks.
+** If the size class does not exist, -1 is returned.
+**
+** Highwater marks are the sum of the highwater marks of all shards. So
+** they may be larger than the true highwater marks if more than one shard
+** is in use.
+*/
+static sqlite4_int64 mmSlabStat(
+  sqlite4_mm *pMM, 
+  unsigned int eType, 
+  unsigned int flags
+){
+  struct mmSlab *pSlab = (struct mmSlab*)pMM;
+  int iClass = (int)(eType >> 8) - 1;
+  int bReset = (flags & SQLITE4_MMSTAT_RESET);
+  i64 iRet = 0;
+  int i;
+
+  eType = (eType & 0xFF);
+  if( iClass>=MMSLAB_NCLASS ) return -1;
+  if( iClass>=0 ){
+    if( eType==SQLITE4_MMSTAT_SIZE ) return mmSlabSize[iClass];
+    if( eType!=SQLITE4_MMSTAT_OUT && eType!=SQLITE4_MMSTAT_UNITS 
+     && eType!=SQLITE4_MMSTAT_UNITS_HW 
+    ){
+      return -1;
+    }
+  }
+
+  for(i=0; i<MMSLAB_NSHARD; i++){
+    struct mmSlabShard *pShard = &pSlab->aShard[i];
+    while( !mmSlabTryLock(pShard) );
+    if( iClass>=0 ){
+      switch( eType ){
+        case SQLITE4_MMSTAT_OUT:
+          iRet += pShard->aUnit[iClass] * mmSlabSize[iClass];
+          break;
+        case SQLITE4_MMSTAT_UNITS:
+          iRet += pShard->aUnit[iClass];
+          break;
+        case SQLITE4_MMSTAT_UNITS_HW:
+          iRet += pShard->aUnitHw[iClass];
+          if( bReset ) pShard->aUnitHw[iClass] = pShard->aUnit[iClass];
+          break;
+      }
+    }else{
+      switch( eType ){
+        case SQLITE4_MMSTAT_OUT:
+          iRet += pShard->nOut;
+          break;
+        case SQLITE4_MMSTAT_OUT_HW:
+          iRet += pShard->nOutHw;
+          if( bReset ) pShard->nOutHw = pShard->nOut;
+          break;
+        case SQLITE4_MMSTAT_UNITS:
+          iRet += pShard->nUnit;
+          break;
+        case SQLITE4_MMSTAT_UNITS_HW:
+          iRet += pShard->nUnitHw;
+          if( bReset ) pShard->nUnitHw = pShard->nUnit;
+          break;
+        case SQLITE4_MMSTAT_SIZE:
+          if( pShard->nMaxRequest>iRet ) iRet = pShard->nMaxRequest;
+          if( bReset ) pShard->nMaxRequest = 0;
+          break;
+        case SQLITE4_MMSTAT_MEMFAULT:
+        case SQLITE4_MMSTAT_FAULT:
+          iRet += pShard->nFault;
+          if( bReset ) pShard->nFault = 0;
+          break;
+        default:
+          iRet = -1;
+          break;
+      }
+    }
+    mmSlabUnlock(pShard);
+  }
+  return iRet;
+}
+
+static int mmSlabCtrl(sqlite4_mm *pMM, unsigned int eType, va_list ap){
+  struct mmSlab *pSlab = (struct mmSlab*)pMM;
+  return sqlite4_mm_control_va(pSlab->p, eType, ap);
+}
+
+/*
+** Destroy the allocator object passed as the first argument. All chunks
+** are returned to the underlying allocator.
+*/
+static void mmSlabFinal(sqlite4_mm *pMM){
+  struct mmSlab *pSlab = (struct mmSlab*)pMM;
+  sqlite4_mm *p = pSlab->p;
+  int i;
+  for(i=0; i<MMSLAB_NSHARD; i++){
+    u8 *pChunk = pSlab->aShard[i].pChunk;
+    while( pChunk ){
+      u8 *pPrev = *(u8**)pChunk;
+      sqlite4_mm_free(p, pChunk);
+      pChunk = pPrev;
+    }
+  }
+  sqlite4_mm_free(p, pSlab);
+  sqlite4_mm_destroy(p);
+}
+
+static const sqlite4_mm_methods mmSlabMethods = {
+  /* iVersion */    1,
+  /* xMalloc  */    mmSlabMalloc,
+  /* xRealloc */    mmSlabRealloc,
+  /* xFree    */    mmSlabFree,
+  /* xMsize   */    mmSlabMsize,
+  /* xMember  */    0,
+  /* xBenign  */    mmSlabBenign,
+  /* xStat    */    mmSlabStat,
+  /* xCtrl    */    mmSlabCtrl,
+  /* xFinal   */    mmSlabFinal
+};
+
+/*
+** Allocate a new slab allocator that obtains memory from allocator p.
+*/
+static sqlite4_mm *mmSlabNew(sqlite4_mm *p){
+  struct mmSlab *pNew;
+
+  assert( sizeof(struct mmSlabHdr)==8 );
+  pNew = (struct mmSlab *)sqlite4_mm_malloc(p, sizeof(*pNew));
+  if( pNew ){
+    int i;
+    int iClass = 0;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->p = p;
+    pNew->base.pMethods = &mmSlabMethods;
+    for(i=0; i<=MMSLAB_MAXSZ/8; i++){
+      while( mmSlabSize[iClass]<i*8 ) iClass++;
+      pNew->aClass[i] = (u8)iClass;
+    }
+  }
+
+  return (sqlite4_mm *)pNew;
+}
+
 /*************************************************************************
 ** Main interfaces.
 */
@@ -722,6 +1127,11 @@ sqlite4_mm *sqlite4_mm_new(sqlite4_mm_type eType, ...){
       pMM = mmStatsNew(p);
       break;
     }
+    case SQLITE4_MM_SLAB: {
+      sqlite4_mm *p = va_arg(ap, sqlite4_mm*);
+      pMM = mmSlabNew(p);
+      break;
+    }
     default: {
       pMM = 0;
       break;
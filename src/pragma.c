@@ -50,7 +50,7 @@ static void returnSingleInt(Parse *pParse, const char *zLabel, i64 value){
   int mem = ++pParse->nMem;
   sqlite4_num *pNum;
 
-  pNum = sqlite4DbMallocRaw(pParse->db, sizeof(value));
+  pNum = sqlite4DbMallocRaw(pParse->db, sizeof(*pNum));
   if( pNum ){
     *pNum = sqlite4_num_from_int64(value);
   }
@@ -841,6 +841,47 @@ void sqlite4Pragma(
     sqlite4_db_release_memory(db);
   }else
 
+  /*
+  **  PRAGMA sorter_memory
+  **  PRAGMA sorter_memory = N
+  **
+  ** Query or set the number of bytes of memory that each sorter (used for
+  ** ORDER BY and GROUP BY processing) may use to buffer keys before
+  ** writing them to a temporary file. If N is zero or negative, sorters
+  ** never use temporary files.
+  */
+  if( sqlite4_stricmp(zPragma, "sorter_memory")==0 ){
+    if( zRight ){
+      i64 nMem = 0;
+      sqlite4Atoi64(zRight, &nMem, sqlite4Strlen30(zRight), SQLITE4_UTF8);
+      db->nSorterMem = nMem;
+    }
+    returnSingleInt(pParse, "sorter_memory", db->nSorterMem);
+  }else
+
+  /*
+  **  PRAGMA threads
+  **  PRAGMA threads = N
+  **
+  ** Query or set the number of background threads that each sorter may
+  ** use to sort and write runs to its temporary file while the VM
+  ** continues to supply new keys. N is clamped to the range
+  ** 0..SQLITE4_MAX_WORKER_THREADS. Each worker thread may hold up to
+  ** "sorter_memory" bytes of keys in addition to those being buffered by
+  ** the sorter itself.
+  */
+  if( sqlite4_stricmp(zPragma, "threads")==0 ){
+    if( zRight ){
+      int nWorker = sqlite4Atoi(zRight);
+      if( nWorker<0 ) nWorker = 0;
+      if( nWorker>SQLITE4_MAX_WORKER_THREADS ){
+        nWorker = SQLITE4_MAX_WORKER_THREADS;
+      }
+      db->nWorker = nWorker;
+    }
+    returnSingleInt(pParse, "threads", db->nWorker);
+  }else
+
   /*
   **  PRAGMA schema_version
   */
@@ -474,6 +474,34 @@ int sqlite4SchemaToIndex(sqlite4 *db, Schema *pSchema){
   return i;
 }
 
+/*
+** Return true if a statement compiled from the nBytes bytes of SQL text
+** at zSql may be added to the statement cache when it is finalized. This
+** requires that the parser consumed the entire input. Only SELECT, VALUES
+** and DML statements are cached. Other statements may have side-effects
+** at compile time (i.e. PRAGMA) or depend on state other than the schema.
+*/
+static int isCacheableSql(Parse *pParse, const char *zSql, int nBytes){
+  const unsigned char *z = (const unsigned char*)zSql;
+  int eType = TK_SPACE;
+  int n = 0;
+
+  if( pParse->explain ) return 0;
+#ifndef SQLITE4_OMIT_AUTHORIZATION
+  if( pParse->db->pAuth ) return 0;
+#endif
+  if( pParse->zTail==0 ) return 0;
+  if( *pParse->zTail!='\0' && (nBytes<0 || pParse->zTail!=&zSql[nBytes]) ){
+    return 0;
+  }
+  while( *z && eType==TK_SPACE ){
+    n = sqlite4GetToken(z, &eType);
+    if( eType==TK_SPACE ) z += n;
+  }
+  return (eType==TK_SELECT || eType==TK_VALUES || eType==TK_INSERT
+       || eType==TK_REPLACE || eType==TK_UPDATE || eType==TK_DELETE);
+}
+
 /*
 ** Compile the UTF-8 encoded SQL statement zSql into a statement handle.
 */
@@ -491,6 +519,7 @@ static int sqlite4Prepare(
   int i;                    /* Loop counter */
 
   /* Allocate the parsing context */
+  sqlite4ArenaBegin(db);
   pParse = sqlite4StackAllocZero(db, sizeof(*pParse));
   if( pParse==0 ){
     rc = SQLITE4_NOMEM;
@@ -574,6 +603,9 @@ static int sqlite4Prepare(
     sqlite4VdbeFinalize(pParse->pVdbe);
     assert(!(*ppStmt));
   }else{
+    if( pParse->pVdbe && isCacheableSql(pParse, zSql, nBytes) ){
+      sqlite4VdbeSetCacheable(pParse->pVdbe);
+    }
     *ppStmt = (sqlite4_stmt*)pParse->pVdbe;
   }
 
@@ -594,6 +626,7 @@ static int sqlite4Prepare(
 end_prepare:
 
   sqlite4StackFree(db, pParse);
+  sqlite4ArenaEnd(db);
   rc = sqlite4ApiExit(db, rc);
   return rc;
 }
@@ -606,6 +639,7 @@ static int sqlite4LockAndPrepare(
   int *pnUsed               /* OUT: Bytes read from zSql */
 ){
   int rc;
+  int bCache = (pOld==0);   /* True to search the statement cache */
   assert( ppStmt!=0 );
   *ppStmt = 0;
   if( pnUsed ){
@@ -615,6 +649,21 @@ static int sqlite4LockAndPrepare(
     return SQLITE4_MISUSE_BKPT;
   }
   sqlite4_mutex_enter(db->mutex);
+#ifndef SQLITE4_OMIT_AUTHORIZATION
+  if( db->pAuth ) bCache = 0;
+#endif
+  if( bCache ){
+    Vdbe *pCached = sqlite4StmtCacheFind(db, zSql, nBytes);
+    if( pCached ){
+      *ppStmt = (sqlite4_stmt*)pCached;
+      if( pnUsed ){
+        *pnUsed = sqlite4Strlen30(sqlite4_stmt_sql((sqlite4_stmt*)pCached));
+      }
+      sqlite4Error(db, SQLITE4_OK, 0);
+      sqlite4_mutex_leave(db->mutex);
+      return SQLITE4_OK;
+    }
+  }
   rc = sqlite4Prepare(db, zSql, nBytes, pOld, ppStmt, pnUsed);
   if( rc==SQLITE4_SCHEMA ){
     sqlite4_finalize(*ppStmt);
@@ -62,7 +62,7 @@ Select *sqlite4SelectNew(
   Select *pNew;
   Select standin;
   sqlite4 *db = pParse->db;
-  pNew = sqlite4DbMallocZero(db, sizeof(*pNew) );
+  pNew = sqlite4DbMallocNode(db, sizeof(*pNew) );
   assert( db->mallocFailed || !pOffset || pLimit ); /* OFFSET implies LIMIT */
   if( pNew==0 ){
     assert( db->mallocFailed );
@@ -73,7 +73,7 @@ Select *sqlite4SelectNew(
     pEList = sqlite4ExprListAppend(pParse, 0, sqlite4Expr(db,TK_ALL,0));
   }
   pNew->pEList = pEList;
-  if( pSrc==0 ) pSrc = sqlite4DbMallocZero(db, sizeof(*pSrc));
+  if( pSrc==0 ) pSrc = sqlite4DbMallocNode(db, sizeof(*pSrc));
   pNew->pSrc = pSrc;
   pNew->pWhere = pWhere;
   pNew->pGroupBy = pGroupBy;
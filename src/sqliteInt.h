@@ -603,9 +603,11 @@ typedef struct LookasideSlot LookasideSlot;
 typedef struct Module Module;
 typedef struct NameContext NameContext;
 typedef struct Parse Parse;
+typedef struct ParseArena ParseArena;
 typedef struct ParseYColCache ParseYColCache;
 typedef struct RowSet RowSet;
 typedef struct Savepoint Savepoint;
+typedef struct StmtCache StmtCache;
 typedef struct Select Select;
 typedef struct Sqlite4InitInfo Sqlite4InitInfo;
 typedef struct SrcList SrcList;
@@ -773,6 +775,46 @@ struct LookasideSlot {
   LookasideSlot *pNext;    /* Next buffer in the list of free buffers */
 };
 
+/*
+** The parse arena is a single buffer from which the parse tree (Expr,
+** ExprList, Select and SrcList objects) and where-planner objects of a
+** statement are allocated while it is being prepared. Allocations are
+** made by advancing ParseArena.pFree and freeing them is a no-op. When
+** the outermost call to sqlite4Prepare() returns, all arena memory is
+** reclaimed at once by resetting pFree to pStart. Allocations that do
+** not fit in the buffer are made from the heap instead.
+**
+** As with lookaside, the arena is not used while parsing schema
+** information (db->init.busy is set), as those objects outlive the
+** call to sqlite4Prepare().
+*/
+struct ParseArena {
+  int nRef;               /* Depth of nested sqlite4Prepare() calls */
+  int mxUsed;             /* Highwater mark for bytes used */
+  int nMiss;              /* Allocations made from the heap (arena full) */
+  u8 *pStart;             /* First byte of the arena buffer */
+  u8 *pEnd;               /* First byte past the end of the buffer */
+  u8 *pFree;              /* First unused byte of the buffer */
+};
+
+/*
+** The statement cache of a database connection holds statements that have
+** been passed to sqlite4_finalize(), so that a later call to sqlite4_prepare()
+** with identical SQL text may reuse them instead of compiling the SQL again.
+** Cached statements are not part of the sqlite4.pVdbe list. Instead, they
+** are linked together in least-recently-used order using their Vdbe.pPrev
+** and Vdbe.pNext fields. See vdbeaux.c for details.
+*/
+struct StmtCache {
+  int nMax;               /* Maximum number of cached statements */
+  int nStmt;              /* Number of statements currently cached */
+  int nHit;               /* Number of times a statement was reused */
+  int nMiss;              /* Number of times a statement was not found */
+  Vdbe *pFirst;           /* Most recently used statement */
+  Vdbe *pLast;            /* Least recently used statement */
+  Hash hash;              /* Cached statements keyed by SQL text */
+};
+
 /*
 ** Information used during initialization.
 */
@@ -817,6 +859,8 @@ struct sqlite4 {
   u8 suppressErr;               /* Do not issue error messages if true */
   u8 vtabOnConflict;            /* Value to return for s3_vtab_on_conflict() */
   int nextPagesize;             /* Pagesize after VACUUM if >0 */
+  i64 nSorterMem;               /* Sorter memory budget (PRAGMA sorter_memory) */
+  int nWorker;                  /* Sorter worker threads (PRAGMA threads) */
   int nTable;                   /* Number of tables in the database */
   CollSeq *pDfltColl;           /* The default collating sequence (BINARY) */
   u32 magic;                    /* Magic number for detect library misuse */
@@ -852,6 +896,8 @@ struct sqlite4 {
     double notUsed1;            /* Spacer */
   } u1;
   Lookaside lookaside;          /* Lookaside malloc configuration */
+  ParseArena arena;             /* Parse arena (see sqlite4DbMallocNode) */
+  StmtCache stmtcache;          /* Cache of finalized statements */
 #ifndef SQLITE4_OMIT_AUTHORIZATION
   Authorizer *pAuth;            /* Head of authorizer callback stack */
 #endif
@@ -2551,6 +2597,10 @@ void *sqlite4Malloc(sqlite4_env*, int);
 void *sqlite4MallocZero(sqlite4_env*, int);
 void *sqlite4DbMallocZero(sqlite4*, int);
 void *sqlite4DbMallocRaw(sqlite4*, int);
+void *sqlite4DbMallocNode(sqlite4*, int);
+int sqlite4ArenaSetup(sqlite4*, int);
+void sqlite4ArenaBegin(sqlite4*);
+void sqlite4ArenaEnd(sqlite4*);
 char *sqlite4DbStrDup(sqlite4*,const char*);
 char *sqlite4DbStrNDup(sqlite4*,const char*, int);
 void *sqlite4Realloc(sqlite4_env*, void*, int);
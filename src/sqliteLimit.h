@@ -108,6 +108,51 @@
 # define SQLITE4_DEFAULT_TEMP_CACHE_SIZE  500
 #endif
 
+/*
+** The default amount of memory, in bytes, that a sorter may use to buffer
+** keys before writing them to a temporary file. This value may be changed
+** at runtime using "PRAGMA sorter_memory".
+*/
+#ifndef SQLITE4_DEFAULT_SORTER_MEMORY
+# define SQLITE4_DEFAULT_SORTER_MEMORY  (16*1024*1024)
+#endif
+
+/*
+** The maximum number of background threads that a single sorter may use
+** to sort and write out runs, and the number used by default. The default
+** may be changed at runtime using "PRAGMA threads". Setting
+** SQLITE4_MAX_WORKER_THREADS to zero disables the use of worker threads.
+*/
+#ifndef SQLITE4_MAX_WORKER_THREADS
+# define SQLITE4_MAX_WORKER_THREADS 8
+#endif
+#ifndef SQLITE4_DEFAULT_WORKER_THREADS
+# define SQLITE4_DEFAULT_WORKER_THREADS 0
+#endif
+#if SQLITE4_DEFAULT_WORKER_THREADS>SQLITE4_MAX_WORKER_THREADS
+# undef SQLITE4_DEFAULT_WORKER_THREADS
+# define SQLITE4_DEFAULT_WORKER_THREADS SQLITE4_MAX_WORKER_THREADS
+#endif
+
+/*
+** The default size in bytes of the parse arena of each database connection,
+** used for the parse tree and where-planner objects of statements while 
+** they are being prepared. This value may be changed at runtime using
+** sqlite4_db_config(SQLITE4_DBCONFIG_PARSE_ARENA). Zero disables the arena.
+*/
+#ifndef SQLITE4_DEFAULT_PARSE_ARENA
+# define SQLITE4_DEFAULT_PARSE_ARENA 32768
+#endif
+
+/*
+** The default maximum number of finalized statements that each database
+** connection retains for reuse by sqlite4_prepare(). This value may be
+** changed at runtime using sqlite4_db_config(SQLITE4_DBCONFIG_STMT_CACHE).
+*/
+#ifndef SQLITE4_DEFAULT_STMT_CACHE
+# define SQLITE4_DEFAULT_STMT_CACHE 32
+#endif
+
 /*
 ** The default number of frames to accumulate in the log file before
 ** checkpointing the database in WAL mode.
@@ -105,6 +105,40 @@ int sqlite4_db_status(
       break;
     }
 
+    case SQLITE4_DBSTATUS_ARENA_USED: {
+      *pCurrent = (int)(db->arena.pFree - db->arena.pStart);
+      *pHighwater = db->arena.mxUsed;
+      if( resetFlag ){
+        db->arena.mxUsed = *pCurrent;
+      }
+      break;
+    }
+
+    case SQLITE4_DBSTATUS_ARENA_MISS: {
+      *pCurrent = 0;
+      *pHighwater = db->arena.nMiss;
+      if( resetFlag ){
+        db->arena.nMiss = 0;
+      }
+      break;
+    }
+
+    /*
+    ** Return the number of calls to sqlite4_prepare() that did and did
+    ** not find a reusable statement in the statement cache.
+    */
+    case SQLITE4_DBSTATUS_STMTCACHE_HIT:
+    case SQLITE4_DBSTATUS_STMTCACHE_MISS: {
+      int *pCount = (op==SQLITE4_DBSTATUS_STMTCACHE_HIT) ?
+          &db->stmtcache.nHit : &db->stmtcache.nMiss;
+      *pCurrent = 0;
+      *pHighwater = *pCount;
+      if( resetFlag ){
+        *pCount = 0;
+      }
+      break;
+    }
+
     /* 
     ** Return an approximation for the amount of memory currently used
     ** by all pagers associated with the given database connection.  The
@@ -171,6 +205,9 @@ int sqlite4_db_status(
       for(pVdbe=db->pVdbe; pVdbe; pVdbe=pVdbe->pNext){
         sqlite4VdbeDeleteObject(db, pVdbe);
       }
+      for(pVdbe=db->stmtcache.pFirst; pVdbe; pVdbe=pVdbe->pNext){
+        sqlite4VdbeDeleteObject(db, pVdbe);
+      }
       db->pnBytesFreed = 0;
 
       *pHighwater = 0;
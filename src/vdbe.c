@@ -489,6 +489,24 @@ static Mem *sqlite4RegisterInRootFrame(Vdbe *p, int i){
   }
 }
 
+/*
+** Register pMem has just been made a shallow copy of another register, or
+** had the content of another register moved into it. If it now refers to
+** the current row of a cursor (see OP_Column), tell the decoder for that
+** cursor, so that the value is copied before the cursor is moved.
+*/
+static void vdbeTrackRef(Vdbe *p, Mem *pMem){
+  if( p->readOnly 
+   && (pMem->flags & MEM_Ephem) && (pMem->flags & (MEM_Str|MEM_Blob)) 
+  ){
+    int i;
+    for(i=0; i<p->nCursor; i++){
+      VdbeCursor *pC = p->apCsr[i];
+      if( pC ) sqlite4VdbeDecoderTrack(pC->pDecoder, pMem);
+    }
+  }
+}
+
 /*
 ** Execute as much of a VDBE program as we can then return.
 **
@@ -1005,6 +1023,7 @@ case OP_Move: {
     zMalloc = pOut->zMalloc;
     pOut->zMalloc = 0;
     sqlite4VdbeMemMove(pOut, pIn1);
+    vdbeTrackRef(p, pOut);
 #ifdef SQLITE4_DEBUG
     if( pOut->pScopyFrom>=&aMem[p1] && pOut->pScopyFrom<&aMem[p1+pOp->p3] ){
       pOut->pScopyFrom += p1 - pOp->p2;
@@ -1052,6 +1071,7 @@ case OP_SCopy: {            /* in1, out2 */
   pOut = &aMem[pOp->p2];
   assert( pOut!=pIn1 );
   sqlite4VdbeMemShallowCopy(pOut, pIn1, MEM_Ephem);
+  vdbeTrackRef(p, pOut);
 #ifdef SQLITE4_DEBUG
   if( pOut->pScopyFrom==0 ) pOut->pScopyFrom = pIn1;
 #endif
@@ -1098,6 +1118,16 @@ case OP_ResultRow: {
   /* Invalidate all ephemeral cursor row caches */
   p->cacheCtr = (p->cacheCtr + 2)|1;
 
+  /* Registers may refer directly to the current rows of cursors (see
+  ** OP_Column). The application may write to the database before the
+  ** next call to sqlite4_step(), so make private copies of any such
+  ** values now.
+  */
+  for(i=0; i<p->nCursor; i++){
+    VdbeCursor *pC = p->apCsr[i];
+    if( pC && sqlite4VdbeDecoderRelease(pC->pDecoder) ) goto no_mem;
+  }
+
   /* Make sure the results of the current row are \000 terminated
   ** and have an assigned type.  The results are de-ephemeralized as
   ** a side effect.
@@ -2095,6 +2125,11 @@ case OP_NotNull: {            /* same as TK_NOTNULL, jump, in1 */
 ** if the P4 argument is a P4_MEM use the value of the P4 argument as
 ** the result.
 **
+** In a read-only statement, a string or blob value may be left pointing
+** into the content of cursor P1 (an ephemeral value) instead of being
+** copied. Such values are copied before the cursor is moved or a result
+** row is returned.
+**
 ** If the OPFLAG_CLEARCACHE bit is set on P5 and P1 is a pseudo-table cursor,
 ** then the cache of the cursor is reset prior to extracting the column.
 ** The first OP_Column against a pseudo-table after the value of the content
@@ -2123,6 +2158,15 @@ case OP_Column: {
     if( pC->pKeyInfo && pC->pKeyInfo->nData ) mxField = pC->pKeyInfo->nData;
     rc = sqlite4VdbeDecoderCreate(db, pC, 0, mxField, &pC->pDecoder);
     pC->rowChnged = 1;
+
+    /* In a read-only statement, the cursor content cannot change until the
+    ** cursor is moved. So string and blob values may refer directly to it
+    ** instead of being copied into the register. Ephemeral tables and
+    ** sorters are excluded, as they may be written while being read. */
+    if( rc==SQLITE4_OK && p->readOnly && pC->pTmpKV==0 ){
+      assert( p->pFrame==0 );
+      rc = sqlite4VdbeDecoderEnableRef(pC->pDecoder, &p->aMem[1], p->nMem);
+    }
   }
   if( rc==SQLITE4_OK ){
     pDefault = (pOp->p4type==P4_MEM) ? pOp->p4.pMem : 0;
@@ -2587,6 +2631,9 @@ case OP_VerifyCookie: {
 ** sequence of the index being opened. Otherwise, if P4 is an integer 
 ** value, it is set to the number of columns in the table.
 **
+** If the statement is read-only, entries are read from the database in
+** batches once the cursor is used to scan through the table or index.
+**
 ** See also OpenWrite.
 */
 /* Opcode: OpenWrite P1 P2 P3 P4 P5
@@ -2661,6 +2708,13 @@ case OP_OpenWrite: {
   pCur->iRoot = p2;
   rc = sqlite4KVStoreOpenCursor(pX, &pCur->pKVCur);
   pCur->pKeyInfo = pKeyInfo;
+
+  /* A cursor opened by a read-only statement is never used to write, so
+  ** it may read ahead. Writes made by other statements while it is open
+  ** are detected by the KV layer.  */
+  if( rc==SQLITE4_OK && pOp->opcode==OP_OpenRead && p->readOnly ){
+    sqlite4KVCursorBatch(pCur->pKVCur);
+  }
   break;
 }
 
@@ -2714,16 +2768,29 @@ case OP_OpenEphemeral: {
   break;
 }
 
-/* Opcode: OpenSorter P1 P2 * P4 *
+/* Opcode: SorterOpen P1 P2 * P4 *
 **
 ** This opcode works like OP_OpenEphemeral except that it opens
 ** a transient index that is specifically designed to sort large
 ** tables using an external merge-sort algorithm.
+**
+** All entries must be written to the sorter using OP_Insert before
+** it is rewound using OP_SorterSort. Thereafter it may only be read
+** in the forward direction using OP_SorterNext.
 */
 case OP_SorterOpen: {
-  /* VdbeCursor *pCx; */
-  pOp->opcode = OP_OpenEphemeral;
-  pc--;
+  VdbeCursor *pCx;
+
+  assert( pOp->p1>=0 );
+  pCx = allocateCursor(p, pOp->p1, pOp->p2, -1, 1);
+  if( pCx==0 ) goto no_mem;
+  pCx->nullRow = 1;
+
+  rc = sqlite4VdbeSorterOpen(db, &pCx->pTmpKV);
+  if( rc==SQLITE4_OK ) rc = sqlite4KVStoreOpenCursor(pCx->pTmpKV, &pCx->pKVCur);
+  if( rc==SQLITE4_OK ) rc = sqlite4KVStoreBegin(pCx->pTmpKV, 2);
+
+  pCx->pKeyInfo = pOp->p4.pKeyInfo;
   break;
 }
 
@@ -2765,6 +2832,7 @@ case OP_SeekPk: {
 
   pPk = p->apCsr[pOp->p1];
   pIdx = p->apCsr[pOp->p3];
+  if( sqlite4VdbeDecoderRelease(pPk->pDecoder) ) goto no_mem;
 
   if( pIdx->pFts ){
     rc = sqlite4Fts5Pk(pIdx->pFts, pPk->iRoot, &aKey, &nKey);
@@ -2853,6 +2921,7 @@ case OP_SeekGt: {       /* jump, in3 */
   KVSize nKey;                    /* Size of aKey[] in bytes */
 
   pC = p->apCsr[pOp->p1];
+  if( sqlite4VdbeDecoderRelease(pC->pDecoder) ) goto no_mem;
   pC->nullRow = 0;
   pC->sSeekKey.n = 0;
   pC->rowChnged = 1;
@@ -2994,6 +3063,7 @@ case OP_Found: {        /* jump, in3 */
   assert( pOp->p1>=0 && pOp->p1<p->nCursor );
   assert( pOp->p4type==P4_INT32 );
   pC = p->apCsr[pOp->p1];
+  if( sqlite4VdbeDecoderRelease(pC->pDecoder) ) goto no_mem;
   pC->sSeekKey.n = 0;
   pC->rowChnged = 1;
   assert( pC!=0 );
@@ -193,6 +193,10 @@ void sqlite4VdbeDelete(Vdbe*);
 void sqlite4VdbeDeleteObject(sqlite4*,Vdbe*);
 void sqlite4VdbeMakeReady(Vdbe*,Parse*);
 int sqlite4VdbeFinalize(Vdbe*);
+int sqlite4VdbeFinalizeCached(Vdbe*);
+void sqlite4VdbeSetCacheable(Vdbe*);
+Vdbe *sqlite4StmtCacheFind(sqlite4*, const char*, int);
+void sqlite4StmtCacheFlush(sqlite4*);
 void sqlite4VdbeResolveLabel(Vdbe*, int);
 int sqlite4VdbeCurrentAddr(Vdbe*);
 #ifdef SQLITE4_DEBUG
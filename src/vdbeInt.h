@@ -60,7 +60,6 @@ struct VdbeCursor {
   Bool nullRow;         /* True if pointing to a row with no data */
   Bool rowChnged;       /* True if row has changed out from under pDecoder */
   i64 seqCount;         /* Sequence counter */
-  VdbeSorter *pSorter;  /* Sorter object for OP_SorterOpen cursors */
   Fts5Cursor *pFts;     /* Fts5 cursor object (or NULL) */
   RowDecoder *pDecoder;              /* Decoder for row content */
   sqlite4_vtab_cursor *pVtabCursor;  /* The cursor for a virtual table */
@@ -75,6 +74,9 @@ int sqlite4VdbeNext(VdbeCursor*);
 int sqlite4VdbePrevious(VdbeCursor*);
 int sqlite4VdbeCursorMoveto(VdbeCursor *);
 
+/* Create a sorter object (see vdbesort.c) */
+int sqlite4VdbeSorterOpen(sqlite4*, KVStore**);
+
 
 /*
 ** When a sub-program is executed (OP_Program), a structure of this type
@@ -302,6 +304,8 @@ struct Vdbe {
   u8 inVtabMethod;        /* See comments above */
   u8 needSavepoint;       /* True if a change might abort and needs savepoint */
   u8 readOnly;            /* True for read-only statements */
+  u8 bCacheable;          /* True if statement may be cached when finalized */
+  u32 iCacheCookie;       /* Schema versions this statement was compiled for */
   int nChange;            /* Number of db changes made since last reset */
   yDbMask stmtTransMask;  /* db->aDb[] entries that have a subtransaction */
   int aCounter[3];        /* Counters used by sqlite4_stmt_status() */
@@ -353,12 +357,21 @@ int sqlite4VdbeDecoderCreate(
   RowDecoder **ppOut          /* The newly generated decoder object */
 );
 int sqlite4VdbeDecoderDestroy(RowDecoder *pDecoder);
+int sqlite4VdbeDecoderEnableRef(RowDecoder *pDecoder, Mem *aReg, int nReg);
+void sqlite4VdbeDecoderTrack(RowDecoder *pDecoder, Mem *pMem);
+int sqlite4VdbeDecoderRelease(RowDecoder *pDecoder);
 int sqlite4VdbeDecoderGetColumn(
   RowDecoder *pDecoder,        /* The decoder for the whole string */
   int iVal,                    /* Index of the value to decode.  First is 0 */
   Mem *pDefault,               /* The default value.  Often NULL */
   Mem *pOut                    /* Write the result here */
 );
+int sqlite4VdbeDecoderGetColumns(
+  RowDecoder *pDecoder,        /* The decoder for the whole string */
+  int iFirst,                  /* Index of first value to decode */
+  int iLast,                   /* Index of last value to decode */
+  Mem *aOut                    /* Write the results here */
+);
 int sqlite4VdbeEncodeData(
   sqlite4 *db,                /* The database connection */
   Mem *aIn,                   /* Array of values to encode */
@@ -64,7 +64,7 @@ int sqlite4_finalize(sqlite4_stmt *pStmt){
     mutex = v->db->mutex;
 #endif
     sqlite4_mutex_enter(mutex);
-    rc = sqlite4VdbeFinalize(v);
+    rc = sqlite4VdbeFinalizeCached(v);
     rc = sqlite4ApiExit(db, rc);
     sqlite4_mutex_leave(mutex);
   }
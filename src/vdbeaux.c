@@ -2125,6 +2125,206 @@ void sqlite4VdbeDelete(Vdbe *p){
   sqlite4VdbeDeleteObject(db, p);
 }
 
+/*
+** Return a value that identifies the current versions of the schemas of
+** all databases attached to connection db. A statement in the statement
+** cache may only be reused if this value has not changed since it was
+** compiled.
+*/
+static u32 vdbeCacheCookie(sqlite4 *db){
+  u32 iCookie = (u32)db->nDb;
+  int i;
+  for(i=0; i<db->nDb; i++){
+    Schema *pSchema = db->aDb[i].pSchema;
+    if( pSchema ){
+      iCookie = (iCookie * 31) + (u32)pSchema->schema_cookie;
+      iCookie = (iCookie * 31) + (u32)pSchema->iGeneration;
+    }
+  }
+  return iCookie;
+}
+
+/*
+** Mark statement p as one that may be added to the statement cache when
+** it is finalized. This is called by the parser for statements whose
+** program depends only on the SQL text and the database schema.
+*/
+void sqlite4VdbeSetCacheable(Vdbe *p){
+  p->bCacheable = 1;
+  p->iCacheCookie = vdbeCacheCookie(p->db);
+}
+
+/*
+** Remove statement p from the statement cache of connection db. This
+** removes it from both the LRU list and the hash table.
+*/
+static void stmtCacheRemove(sqlite4 *db, Vdbe *p){
+  StmtCache *pCache = &db->stmtcache;
+  if( p->pPrev ){
+    p->pPrev->pNext = p->pNext;
+  }else{
+    assert( pCache->pFirst==p );
+    pCache->pFirst = p->pNext;
+  }
+  if( p->pNext ){
+    p->pNext->pPrev = p->pPrev;
+  }else{
+    assert( pCache->pLast==p );
+    pCache->pLast = p->pPrev;
+  }
+  p->pNext = p->pPrev = 0;
+  sqlite4HashInsert(&pCache->hash, p->zSql, sqlite4Strlen30(p->zSql), 0);
+  pCache->nStmt--;
+}
+
+/*
+** Free statement p, which has already been removed from the statement
+** cache and is not linked into the db->pVdbe list.
+*/
+static void stmtCacheDelete(sqlite4 *db, Vdbe *p){
+  p->magic = VDBE_MAGIC_DEAD;
+  p->db = 0;
+  sqlite4VdbeDeleteObject(db, p);
+}
+
+/*
+** Delete all statements in the statement cache of connection db.
+*/
+void sqlite4StmtCacheFlush(sqlite4 *db){
+  StmtCache *pCache = &db->stmtcache;
+  while( pCache->pFirst ){
+    Vdbe *p = pCache->pFirst;
+    stmtCacheRemove(db, p);
+    stmtCacheDelete(db, p);
+  }
+  assert( pCache->nStmt==0 );
+}
+
+/*
+** This routine is called by sqlite4_finalize(). If statement p ran
+** successfully and may be reused, it is reset and added to the statement
+** cache instead of being deleted. Otherwise, it is deleted in the same
+** way as by sqlite4VdbeFinalize(). Either way, the statement handle
+** may not be used by the caller once this function returns.
+*/
+int sqlite4VdbeFinalizeCached(Vdbe *p){
+  sqlite4 *db = p->db;
+  StmtCache *pCache = &db->stmtcache;
+  int rc = SQLITE4_OK;
+  int i;
+
+  if( p->magic==VDBE_MAGIC_RUN || p->magic==VDBE_MAGIC_HALT ){
+    rc = sqlite4VdbeReset(p);
+  }
+  if( rc!=SQLITE4_OK || p->bCacheable==0 || p->expired || p->expmask
+   || pCache->nMax<=0 || p->zSql==0 || db->mallocFailed
+  ){
+    sqlite4VdbeDelete(p);
+    return rc;
+  }
+  assert( p->magic==VDBE_MAGIC_INIT );
+
+  /* Unlink the statement from the db->pVdbe list. */
+  if( p->pPrev ){
+    p->pPrev->pNext = p->pNext;
+  }else{
+    assert( db->pVdbe==p );
+    db->pVdbe = p->pNext;
+  }
+  if( p->pNext ){
+    p->pNext->pPrev = p->pPrev;
+  }
+  p->pNext = p->pPrev = 0;
+
+  /* Clear any bindings so that the cached statement does not pin them. */
+  for(i=0; i<p->nVar; i++){
+    sqlite4VdbeMemRelease(&p->aVar[i]);
+    p->aVar[i].flags = MEM_Null;
+  }
+
+  /* If there is already a statement with the same SQL text in the cache,
+  ** discard it in favour of this one. Then add p to the hash table. If
+  ** this fails because a malloc() fails, just delete p.  */
+  {
+    int nSql = sqlite4Strlen30(p->zSql);
+    Vdbe *pOld = (Vdbe*)sqlite4HashFind(&pCache->hash, p->zSql, nSql);
+    if( pOld ){
+      stmtCacheRemove(db, pOld);
+      stmtCacheDelete(db, pOld);
+    }
+    sqlite4BeginBenignMalloc(db->pEnv);
+    pOld = (Vdbe*)sqlite4HashInsert(&pCache->hash, p->zSql, nSql, p);
+    sqlite4EndBenignMalloc(db->pEnv);
+    if( pOld==p ){
+      stmtCacheDelete(db, p);
+      return rc;
+    }
+    assert( pOld==0 );
+  }
+
+  /* Link p in at the head of the LRU list, then evict the least recently
+  ** used statements until there are no more than nMax in the cache. */
+  p->pNext = pCache->pFirst;
+  if( pCache->pFirst ){
+    pCache->pFirst->pPrev = p;
+  }else{
+    pCache->pLast = p;
+  }
+  pCache->pFirst = p;
+  pCache->nStmt++;
+  while( pCache->nStmt>pCache->nMax ){
+    Vdbe *pLru = pCache->pLast;
+    stmtCacheRemove(db, pLru);
+    stmtCacheDelete(db, pLru);
+  }
+  return rc;
+}
+
+/*
+** Search the statement cache of connection db for a statement compiled
+** from SQL text zSql. Argument nSql is the length of zSql in bytes, or
+** a negative value if zSql is nul-terminated. If a statement compiled
+** for the current schema is found, it is removed from the cache, linked
+** into the db->pVdbe list and returned, ready to run. Otherwise, return
+** NULL.
+*/
+Vdbe *sqlite4StmtCacheFind(sqlite4 *db, const char *zSql, int nSql){
+  StmtCache *pCache = &db->stmtcache;
+  Vdbe *p;
+
+  assert( sqlite4_mutex_held(db->mutex) );
+  if( pCache->nMax<=0 ) return 0;
+  if( nSql<0 ){
+    nSql = sqlite4Strlen30(zSql);
+  }else{
+    int n;
+    for(n=0; n<nSql && zSql[n]; n++);
+    nSql = n;
+  }
+
+  p = (Vdbe*)sqlite4HashFind(&pCache->hash, zSql, nSql);
+  if( p==0 ){
+    pCache->nMiss++;
+    return 0;
+  }
+  stmtCacheRemove(db, p);
+  if( p->expired || p->iCacheCookie!=vdbeCacheCookie(db) ){
+    stmtCacheDelete(db, p);
+    pCache->nMiss++;
+    return 0;
+  }
+  pCache->nHit++;
+
+  if( db->pVdbe ){
+    db->pVdbe->pPrev = p;
+  }
+  p->pNext = db->pVdbe;
+  db->pVdbe = p;
+  memset(p->aCounter, 0, sizeof(p->aCounter));
+  sqlite4VdbeRewind(p);
+  return p;
+}
+
 /*
 ** If we are on an architecture with mixed-endian floating 
 ** points (ex: ARM7) then swap the lower 4 bytes with the 
@@ -2212,6 +2412,7 @@ void sqlite4ExpirePreparedStatements(sqlite4 *db){
   for(p = db->pVdbe; p; p=p->pNext){
     p->expired = 1;
   }
+  sqlite4StmtCacheFlush(db);
 }
 
 /*
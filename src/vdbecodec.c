@@ -28,17 +28,56 @@
 ** try to reuse a single decoder object.  The decoder, therefore, should attempt
 ** to cache any intermediate results that might be useful on later invocations.
 */
+typedef struct DecoderCol DecoderCol;
 struct RowDecoder {
   sqlite4 *db;                /* The database connection */
   VdbeCursor *pCur;           /* The cursor for being decoded */
   KVCursor *pKVCur;           /* Alternative KVCursor if pCur is NULL */
-  const KVByteArray *a;       /* Content to be decoded */
+  const KVByteArray *a;       /* Content to be decoded (or part of it) */
   const KVByteArray *aKey;    /* Key content */
   KVSize n;                   /* Bytes of content in a[] */
+  KVSize iOfst;               /* Offset of a[0] within the content */
+  int bAll;                   /* True if a[] holds all of the content */
   KVSize nKey;                /* Bytes of key content */
   int mxCol;                  /* Maximum number of columns */
+  int iHdr;                   /* Offset of first unparsed header byte, or 0 */
+  int endHdr;                 /* First byte past the header */
+  KVSize ofstNext;            /* Offset of payload for column aCol[nCol] */
+  int nCol;                   /* Number of aCol[] entries that are valid */
+  int nColAlloc;              /* Allocated size of aCol[] */
+  DecoderCol *aCol;           /* Columns parsed from the header of a[] */
+  Mem *aReg;                  /* Registers that may refer to a[], or NULL */
+  int nReg;                   /* Number of entries in aReg[] */
+  const KVByteArray *aRef;    /* Buffer referred to by registers, or NULL */
+  KVSize nRef;                /* Size of buffer aRef[] in bytes */
+  int *aiRef;                 /* Indexes of aReg[] entries that may use aRef */
+  int niRef;                  /* Number of valid entries in aiRef[] */
+  u8 *aRefMask;               /* Bitmask of aReg[] entries in aiRef[] */
 };
 
+/*
+** The header of the current row is parsed incrementally as columns are
+** requested.  For each column parsed, one of the following is added to
+** the RowDecoder.aCol[] array, so that each later request for the same
+** column (or any column to its left) does not need to parse the header
+** again.  The array is discarded each time the decoder loads a new row.
+*/
+struct DecoderCol {
+  sqlite4_uint64 type;        /* Header type code */
+  KVSize ofst;                /* Offset of payload within the content */
+  u32 size;                   /* Bytes of payload */
+};
+
+/*
+** When a decoder associated with a VdbeCursor loads a new row, it requests
+** only this many bytes from the start of the content from the storage
+** engine. If the header or a column lies beyond the bytes returned, the
+** bytes required are requested separately. This way a storage engine that
+** stores large values on overflow pages need not read all of them in order
+** to extract a small column.
+*/
+#define DECODER_PREFIX_SIZE 256
+
 /*
 ** Create an object that can be used to decode fields of the data encoding.
 **
@@ -55,52 +94,220 @@ int sqlite4VdbeDecoderCreate(
 
   assert( pCur==0 || pKVCur==0 );
   assert( pCur!=0 || pKVCur!=0 );
-  p = sqlite4DbMallocZero(db, sizeof(*p));
+  p = sqlite4DbMallocZero(db, sizeof(*p) + (mxCol+1)*sizeof(DecoderCol));
   *ppOut = p;
   if( p==0 ) return SQLITE4_NOMEM;
   p->db = db;
   p->pCur = pCur;
   p->pKVCur = pKVCur;
   p->mxCol = mxCol;
+  p->nColAlloc = mxCol+1;
+  p->aCol = (DecoderCol*)&p[1];
   return SQLITE4_OK;
 }
 
+/*
+** Allow the decoder to return string and blob values that refer directly
+** to the content of the cursor instead of copying it. The values returned
+** are marked MEM_Ephem.
+**
+** Such a value is only valid until the cursor is moved. So before moving
+** the cursor, the caller must invoke sqlite4VdbeDecoderRelease(), which
+** makes a private copy of the content of each register that still refers
+** to the current row. Values are only returned in registers that are part
+** of the aReg[] array, and the decoder keeps track of which of them it
+** has written. If such a value is shallow-copied or moved into another 
+** register of aReg[], the caller must pass that register to
+** sqlite4VdbeDecoderTrack().
+**
+** Return SQLITE4_OK if successful, or SQLITE4_NOMEM if a malloc fails.
+*/
+int sqlite4VdbeDecoderEnableRef(RowDecoder *p, Mem *aReg, int nReg){
+  assert( p->pCur!=0 && p->aiRef==0 );
+  p->aiRef = (int*)sqlite4DbMallocZero(p->db, nReg*sizeof(int) + (nReg+7)/8);
+  if( p->aiRef==0 ) return SQLITE4_NOMEM;
+  p->aRefMask = (u8*)&p->aiRef[nReg];
+  p->aReg = aReg;
+  p->nReg = nReg;
+  return SQLITE4_OK;
+}
+
+/*
+** This is a private method for the RowDecoder object.
+**
+** Add register aReg[iReg] to the set of registers that may refer to the
+** buffer aRef[], unless it is already a member.
+*/
+static void decoderAddRef(RowDecoder *p, int iReg){
+  assert( iReg>=0 && iReg<p->nReg );
+  if( (p->aRefMask[iReg/8] & (1 << (iReg%8)))==0 ){
+    p->aRefMask[iReg/8] |= (1 << (iReg%8));
+    p->aiRef[p->niRef++] = iReg;
+  }
+}
+
+/*
+** Register pMem, which must be one of the registers passed to
+** sqlite4VdbeDecoderEnableRef(), has just been made a shallow copy of 
+** another register, or had the content of another register moved into 
+** it. If it now refers to the current row of the cursor, make sure it is
+** copied by the next call to sqlite4VdbeDecoderRelease(). This is a no-op
+** if p is NULL or if no register may refer to the current row.
+*/
+void sqlite4VdbeDecoderTrack(RowDecoder *p, Mem *pMem){
+  if( p && p->aRef ){
+    const char *zFirst = (const char*)p->aRef;
+    const char *zEnd = (const char*)&p->aRef[p->nRef];
+    if( pMem->z>=zFirst && pMem->z<zEnd ){
+      assert( pMem>=p->aReg && pMem<&p->aReg[p->nReg] );
+      decoderAddRef(p, (int)(pMem - p->aReg));
+    }
+  }
+}
+
+/*
+** Make a private copy of any register content that refers to the current
+** row of the cursor. This must be called before the cursor is moved if
+** sqlite4VdbeDecoderEnableRef() has been called. It is a no-op if p is
+** NULL or if no register may refer to the current row.
+**
+** Return SQLITE4_OK if successful, or SQLITE4_NOMEM if a malloc fails.
+*/
+int sqlite4VdbeDecoderRelease(RowDecoder *p){
+  int rc = SQLITE4_OK;
+  if( p && p->aRef ){
+    const char *zFirst = (const char*)p->aRef;
+    const char *zEnd = (const char*)&p->aRef[p->nRef];
+    int i;
+    for(i=0; i<p->niRef; i++){
+      int iReg = p->aiRef[i];
+      Mem *pMem = &p->aReg[iReg];
+      p->aRefMask[iReg/8] &= ~(1 << (iReg%8));
+      if( (pMem->flags & MEM_Ephem) 
+       && (pMem->flags & (MEM_Str|MEM_Blob)) 
+       && pMem->z>=zFirst && pMem->z<zEnd
+      ){
+        if( sqlite4VdbeMemMakeWriteable(pMem) ) rc = SQLITE4_NOMEM;
+      }
+    }
+    p->niRef = 0;
+    p->aRef = 0;
+  }
+  return rc;
+}
+
 /*
 ** Destroy a decoder object previously created
 ** using sqlite4VdbeCreateDecoder().
 */
 int sqlite4VdbeDecoderDestroy(RowDecoder *p){
   if( p ){
+    sqlite4VdbeDecoderRelease(p);
+    if( p->aCol!=(DecoderCol*)&p[1] ) sqlite4DbFree(p->db, p->aCol);
+    sqlite4DbFree(p->db, p->aiRef);
     sqlite4DbFree(p->db, p);
   }
   return SQLITE4_OK;
 }
 
+static int decoderParseHeader(RowDecoder*, int);
+
+/*
+** This is a private method for the RowDecoder object.
+**
+** Called after the first DECODER_PREFIX_SIZE bytes of a row have been 
+** loaded into a[] by a decoder associated with a VdbeCursor. Make sure a[]
+** contains the entire header, then parse it. It is not possible to parse 
+** the header incrementally in this case, as a[] may later be used to hold
+** some other part of the content.
+*/
+static int decoderLoadHeader(RowDecoder *p){
+  sqlite4_uint64 nHdr;
+  int n;
+  int rc;
+
+  assert( p->iOfst==0 && p->bAll==0 );
+  n = sqlite4GetVarint64(p->a, p->n, &nHdr);
+  if( n==0 || nHdr>SQLITE4_MAX_LENGTH ) return SQLITE4_CORRUPT;
+  if( nHdr+n>p->n ){
+    KVSize nReq = (KVSize)nHdr + n;
+    rc = sqlite4KVCursorData(p->pCur->pKVCur, 0, nReq, &p->a, &p->n);
+    if( rc ) return rc;
+    if( p->n<nReq ) return SQLITE4_CORRUPT;
+  }
+  return decoderParseHeader(p, p->mxCol);
+}
+
 /*
-** Make sure the p->a and p->n fields are valid and current.
+** Make sure the p->a and p->n fields are valid and current. If new content
+** is loaded, the parsed header of the previous row is discarded.
 */
 static int decoderFetchData(RowDecoder *p){
   VdbeCursor *pCur = p->pCur;
   int rc;
   if( pCur==0 ){
+    p->iHdr = 0;
+    p->iOfst = 0;
+    p->bAll = 1;
     rc = sqlite4KVCursorData(p->pKVCur, 0, -1, &p->a, &p->n);
     return rc;
   }
   if( pCur->rowChnged ){
+    rc = sqlite4VdbeDecoderRelease(p);
+    if( rc ) return rc;
     p->a = 0;
     p->aKey = 0;
-    pCur->rowChnged = 0;
   }
   if( p->a ) return SQLITE4_OK;
+  p->iHdr = 0;
   rc = sqlite4VdbeCursorMoveto(pCur);
   if( rc ) return rc;
+  pCur->rowChnged = 0;
   if( pCur->nullRow ){
     p->a = 0;
     p->n = 0;
     return SQLITE4_OK;
   }
   assert( pCur->pKVCur!=0 );
-  return sqlite4KVCursorData(pCur->pKVCur, 0, -1, &p->a, &p->n);
+  p->iOfst = 0;
+  rc = sqlite4KVCursorData(pCur->pKVCur, 0, DECODER_PREFIX_SIZE, &p->a, &p->n);
+  if( rc==SQLITE4_OK && p->a ){
+    p->bAll = (p->n<DECODER_PREFIX_SIZE);
+    if( p->bAll==0 ) rc = decoderLoadHeader(p);
+  }
+  if( rc ) p->a = 0;
+  return rc;
+}
+
+/*
+** This is a private method for the RowDecoder object.
+**
+** Set *pa to point to the nByte bytes of content that begin at offset
+** ofst. If they are not all in a[], they are requested from the storage
+** engine first, replacing the current content of a[].
+*/
+static int decoderFetchRange(
+  RowDecoder *p,               /* The decoder */
+  KVSize ofst,                 /* Offset of first byte required */
+  u32 nByte,                   /* Number of bytes required */
+  const KVByteArray **pa       /* OUT: Pointer to required bytes */
+){
+  if( ofst<p->iOfst || ofst+nByte>p->iOfst+p->n ){
+    int rc;
+    assert( p->bAll==0 && p->pCur!=0 );
+    rc = sqlite4VdbeDecoderRelease(p);
+    if( rc==SQLITE4_OK ){
+      rc = sqlite4KVCursorData(p->pCur->pKVCur, ofst, nByte, &p->a, &p->n);
+    }
+    if( rc==SQLITE4_OK && p->n<nByte ) rc = SQLITE4_CORRUPT;
+    if( rc ){
+      p->a = 0;
+      return rc;
+    }
+    p->iOfst = ofst;
+  }
+  *pa = &p->a[ofst - p->iOfst];
+  return SQLITE4_OK;
 }
 
 /*
@@ -406,47 +613,48 @@ static int decoderFromKey(
 }
 
 /*
-** Decode a single column from a key/value pair taken from the storage
-** engine.  The key/value pair to be decoded is the one that the VdbeCursor
-** or KVCursor is currently pointing to.
-**
-** iVal is the column index of the value.  0 is the first column of the
-** value.  If N is the number of columns in the value and iVal>=N then
-** the result is pDefault.  Write the result into pOut.  Return SQLITE4_OK
-** on success or an appropriate error code on failure.
+** This is a private method for the RowDecoder object.
 **
-** The key is referenced only if the iVal-th column in the value is either
-** the 22 or 23 header code which indicates that the value is stored in the
-** key instead.
+** Parse the header of the current row until either entry iVal has been
+** added to the p->aCol[] array or the end of the header is reached. Return
+** SQLITE4_OK if successful, or an error code otherwise.
 */
-int sqlite4VdbeDecoderGetColumn(
-  RowDecoder *p,             /* The decoder for the whole string */
-  int iVal,                    /* Index of the value to decode.  First is 0 */
-  Mem *pDefault,               /* The default value.  Often NULL */
-  Mem *pOut                    /* Write the result here */
-){
-  u32 size;                    /* Size of a field */
-  sqlite4_uint64 ofst;         /* Offset to the payload */
+static int decoderParseHeader(RowDecoder *p, int iVal){
   sqlite4_uint64 type;         /* Datatype */
   sqlite4_uint64 subtype;      /* Subtype for a typed blob */
+  u32 size;                    /* Size of a field */
   int cclass;                  /* class of content */
   int n;                       /* Offset into the header */
-  int i;                       /* Loop counter */
   int sz;                      /* Size of a varint */
-  int endHdr;                  /* First byte past header */
-  int rc;                      /* Return code */
 
-  sqlite4VdbeMemSetNull(pOut);
-  assert( iVal<=p->mxCol );
-  rc = decoderFetchData(p);
-  if( rc ) return rc;
-  if( p->a==0 ) return SQLITE4_OK;
-  n = sqlite4GetVarint64(p->a, p->n, &ofst);
-  if( n==0 ) return SQLITE4_CORRUPT;
-  ofst += n;
-  endHdr = ofst;
-  if( endHdr>p->n ) return SQLITE4_CORRUPT;
-  for(i=0; i<=iVal && n<endHdr; i++){
+  if( p->iHdr==0 ){
+    sqlite4_uint64 nHdr;
+    n = sqlite4GetVarint64(p->a, p->n, &nHdr);
+    if( n==0 || nHdr+n>p->n ) return SQLITE4_CORRUPT;
+    p->iHdr = n;
+    p->endHdr = n + (int)nHdr;
+    p->ofstNext = p->endHdr;
+    p->nCol = 0;
+  }
+
+  n = p->iHdr;
+  while( p->nCol<=iVal && n<p->endHdr ){
+    DecoderCol *pCol;
+    assert( p->iOfst==0 );
+    if( p->nCol>=p->nColAlloc ){
+      int nNew = p->nColAlloc*2;
+      DecoderCol *aNew;
+      if( p->aCol==(DecoderCol*)&p[1] ){
+        aNew = sqlite4DbMallocRaw(p->db, nNew*sizeof(DecoderCol));
+        if( aNew ) memcpy(aNew, p->aCol, p->nCol*sizeof(DecoderCol));
+      }else{
+        aNew = sqlite4DbRealloc(p->db, p->aCol, nNew*sizeof(DecoderCol));
+      }
+      if( aNew==0 ) return SQLITE4_NOMEM;
+      p->aCol = aNew;
+      p->nColAlloc = nNew;
+    }
+
     sz = sqlite4GetVarint64(p->a+n, p->n-n, &type);
     if( sz==0 ) return SQLITE4_CORRUPT;
     n += sz;
@@ -470,67 +678,196 @@ int sqlite4VdbeDecoderGetColumn(
       assert( type>=11 && type<=21 );  /* NUM */
       size = type - 9;
     }
-    if( i<iVal ){
-      ofst += size;
-    }else if( type==0 ){
-      /* no-op */
-    }else if( type<=2 ){
-      sqlite4VdbeMemSetInt64(pOut, type-1);
-    }else if( type<=10 ){
-      int iByte;
-      sqlite4_int64 v = ((char*)p->a)[ofst];
-      for(iByte=1; iByte<size; iByte++){
-        v = v*256 + p->a[ofst+iByte];
-      }
-      sqlite4VdbeMemSetInt64(pOut, v);
-    }else if( type<=21 ){
-      sqlite4_num num = {0, 0, 0, 0};
-      sqlite4_uint64 x;
-      int e;
+    if( p->bAll && size>p->n-p->ofstNext ) return SQLITE4_CORRUPT;
+
+    pCol = &p->aCol[p->nCol++];
+    pCol->type = type;
+    pCol->ofst = p->ofstNext;
+    pCol->size = size;
+    p->ofstNext += size;
+  }
+  p->iHdr = n;
+  return SQLITE4_OK;
+}
+
+/*
+** This is a private method for the RowDecoder object.
+**
+** Set pOut to the n byte UTF-8 string (if bText is true) or blob (if bText
+** is false) at z. If sqlite4VdbeDecoderEnableRef() has been called, pOut
+** is left pointing to z. Otherwise, a copy is made.
+*/
+static void decoderMemSetStr(
+  RowDecoder *p,
+  const KVByteArray *z,
+  u32 n,
+  int bText,
+  Mem *pOut
+){
+  if( p->aReg==0 ){
+    sqlite4VdbeMemSetStr(pOut, (const char*)z, n, (bText ? SQLITE4_UTF8 : 0),
+                         SQLITE4_TRANSIENT, 0);
+  }else{
+    VdbeMemRelease(pOut);
+    pOut->z = (char*)z;
+    pOut->n = n;
+    pOut->xDel = 0;
+    pOut->flags = MEM_Ephem | (bText ? MEM_Str : MEM_Blob);
+    pOut->enc = SQLITE4_UTF8;
+    pOut->type = (bText ? SQLITE4_TEXT : SQLITE4_BLOB);
+    assert( p->aRef==0 || p->aRef==p->a );
+    p->aRef = p->a;
+    p->nRef = p->n;
+    decoderAddRef(p, (int)(pOut - p->aReg));
+  }
+}
+
+/*
+** This is a private method for the RowDecoder object.
+**
+** Write the value of the column described by pCol into pOut.
+*/
+static int decoderColumnValue(RowDecoder *p, DecoderCol *pCol, Mem *pOut){
+  sqlite4_uint64 type = pCol->type;
+  u32 size = pCol->size;
+  const KVByteArray *a = 0;    /* Payload of the column */
+
+  if( size>0 ){
+    int rc = decoderFetchRange(p, pCol->ofst, size, &a);
+    if( rc ) return rc;
+  }
 
-      n = sqlite4GetVarint64(p->a+ofst, p->n-ofst, &x);
-      e = (int)x;
-      n += sqlite4GetVarint64(p->a+ofst+n, p->n-(ofst+n), &x);
-      if( n!=size ) return SQLITE4_CORRUPT;
-
-      num.m = x;
-      num.e = (e >> 2);
-      if( e & 0x02 ) num.e = -1 * num.e;
-      if( e & 0x01 ) num.sign = 1;
-      pOut->u.num = num;
-      MemSetTypeFlag(pOut, MEM_Real);
-    }else if( cclass==0 ){
+  if( type==0 ){
+    /* no-op */
+  }else if( type<=2 ){
+    sqlite4VdbeMemSetInt64(pOut, type-1);
+  }else if( type<=10 ){
+    int iByte;
+    sqlite4_int64 v = ((char*)a)[0];
+    for(iByte=1; iByte<size; iByte++){
+      v = v*256 + a[iByte];
+    }
+    sqlite4VdbeMemSetInt64(pOut, v);
+  }else if( type<=21 ){
+    sqlite4_num num = {0, 0, 0, 0};
+    sqlite4_uint64 x;
+    int e;
+    int n;
+
+    n = sqlite4GetVarint64(a, size, &x);
+    e = (int)x;
+    n += sqlite4GetVarint64(a+n, size-n, &x);
+    if( n!=size ) return SQLITE4_CORRUPT;
+
+    num.m = x;
+    num.e = (e >> 2);
+    if( e & 0x02 ) num.e = -1 * num.e;
+    if( e & 0x01 ) num.sign = 1;
+    pOut->u.num = num;
+    MemSetTypeFlag(pOut, MEM_Real);
+  }else{
+    int cclass = (type-22)%4;
+    if( cclass==0 ){
       if( size==0 ){
         sqlite4VdbeMemSetStr(pOut, "", 0, SQLITE4_UTF8, SQLITE4_TRANSIENT, 0);
-      }else if( p->a[ofst]>0x02 ){
-        sqlite4VdbeMemSetStr(pOut, (char*)(p->a+ofst), size, 
-                             SQLITE4_UTF8, SQLITE4_TRANSIENT, 0);
+      }else if( a[0]>0x02 ){
+        decoderMemSetStr(p, a, size, 1, pOut);
       }else{
         static const u8 enc[] = {SQLITE4_UTF8,SQLITE4_UTF16LE,SQLITE4_UTF16BE };
-        sqlite4VdbeMemSetStr(pOut, (char*)(p->a+ofst+1), size-1, 
-                             enc[p->a[ofst]], SQLITE4_TRANSIENT, 0);
+        sqlite4VdbeMemSetStr(pOut, (char*)(a+1), size-1, 
+                             enc[a[0]], SQLITE4_TRANSIENT, 0);
       }
     }else if( cclass==2 ){
       unsigned int k = (type - 24)/4;
       return decoderFromKey(p, (k&1)!=0, k/2, pOut);
     }else{
-      sqlite4VdbeMemSetStr(pOut, (char*)(p->a+ofst), size, 0,
-                           SQLITE4_TRANSIENT, 0);
+      decoderMemSetStr(p, a, size, 0, pOut);
       pOut->enc = ENC(p->db);
     }
   }
-  testcase( i==iVal );
-  testcase( i==iVal+1 );
-  if( i<=iVal ){
-    if( pDefault ){
-      sqlite4VdbeMemShallowCopy(pOut, pDefault, MEM_Static);
-    }else{
-      sqlite4VdbeMemSetNull(pOut);
-    }
+  return SQLITE4_OK;
+}
+
+/*
+** Decode a single column from a key/value pair taken from the storage
+** engine.  The key/value pair to be decoded is the one that the VdbeCursor
+** or KVCursor is currently pointing to.
+**
+** iVal is the column index of the value.  0 is the first column of the
+** value.  If N is the number of columns in the value and iVal>=N then
+** the result is pDefault.  Write the result into pOut.  Return SQLITE4_OK
+** on success or an appropriate error code on failure.
+**
+** The key is referenced only if the iVal-th column in the value is either
+** the 22 or 23 header code which indicates that the value is stored in the
+** key instead.
+**
+** If the decoder is associated with a VdbeCursor, the offsets of columns
+** found while parsing the header are retained until the cursor moves to
+** a different row, so that extracting several columns from one row only
+** parses the header once.
+*/
+int sqlite4VdbeDecoderGetColumn(
+  RowDecoder *p,             /* The decoder for the whole string */
+  int iVal,                    /* Index of the value to decode.  First is 0 */
+  Mem *pDefault,               /* The default value.  Often NULL */
+  Mem *pOut                    /* Write the result here */
+){
+  int rc;                      /* Return code */
+
+  sqlite4VdbeMemSetNull(pOut);
+  assert( iVal<=p->mxCol );
+  rc = decoderFetchData(p);
+  if( rc ) return rc;
+  if( p->a==0 ) return SQLITE4_OK;
+  if( iVal>=p->nCol || p->iHdr==0 ){
+    rc = decoderParseHeader(p, iVal);
+    if( rc ) return rc;
+  }
+  testcase( iVal==p->nCol );
+  testcase( iVal==p->nCol-1 );
+  if( iVal<p->nCol ){
+    return decoderColumnValue(p, &p->aCol[iVal], pOut);
+  }
+  if( pDefault ){
+    sqlite4VdbeMemShallowCopy(pOut, pDefault, MEM_Static);
   }
   return SQLITE4_OK; 
 }
 
+/*
+** Decode columns iFirst through iLast, inclusive, of the current row into
+** the array of registers aOut[]. Column iFirst is written to aOut[0],
+** iFirst+1 to aOut[1], and so on. Any columns not present in the row are
+** set to NULL. Return SQLITE4_OK on success or an error code otherwise.
+**
+** This is equivalent to calling sqlite4VdbeDecoderGetColumn() once for
+** each column, except that the content of the row is loaded and the
+** header parsed only once, even if the decoder is associated with a
+** KVCursor instead of a VdbeCursor.
+*/
+int sqlite4VdbeDecoderGetColumns(
+  RowDecoder *p,               /* The decoder for the whole string */
+  int iFirst,                  /* Index of first value to decode */
+  int iLast,                   /* Index of last value to decode */
+  Mem *aOut                    /* Write the results here */
+){
+  int rc;                      /* Return code */
+  int i;                       /* Loop counter */
+
+  assert( iFirst>=0 && iLast<=p->mxCol );
+  for(i=iFirst; i<=iLast; i++){
+    sqlite4VdbeMemSetNull(&aOut[i-iFirst]);
+  }
+  rc = decoderFetchData(p);
+  if( rc || p->a==0 ) return rc;
+  rc = decoderParseHeader(p, iLast);
+  for(i=iFirst; rc==SQLITE4_OK && i<=iLast && i<p->nCol; i++){
+    rc = decoderColumnValue(p, &p->aCol[i], &aOut[i-iFirst]);
+  }
+  return rc;
+}
+
 /*
 ** Return the number of bytes needed to represent a 64-bit signed integer.
 */
@@ -38,6 +38,8 @@ int sqlite4VdbeSeekEnd(VdbeCursor *pC, int iEnd){
   KVByteArray aProbe[16];
 
   assert( iEnd==(+1) || iEnd==(-1) || iEnd==(-2) );  
+  rc = sqlite4VdbeDecoderRelease(pC->pDecoder);
+  if( rc!=SQLITE4_OK ) return rc;
   if( pC->iRoot==KVSTORE_ROOT ){
     if( iEnd>0 ){
       rc = sqlite4KVCursorSeek(pCur, (const KVByteArray *)"\00", 1, iEnd);
@@ -79,6 +81,8 @@ int sqlite4VdbeNext(VdbeCursor *pC){
   int rc;
   sqlite4_uint64 iTabno;
 
+  rc = sqlite4VdbeDecoderRelease(pC->pDecoder);
+  if( rc!=SQLITE4_OK ) return rc;
   rc = sqlite4KVCursorNext(pCur);
   if( rc==SQLITE4_OK && pC->iRoot!=KVSTORE_ROOT ){
     rc = sqlite4KVCursorKey(pCur, &aKey, &nKey);
@@ -103,6 +107,8 @@ int sqlite4VdbePrevious(VdbeCursor *pC){
   int rc;
   sqlite4_uint64 iTabno;
 
+  rc = sqlite4VdbeDecoderRelease(pC->pDecoder);
+  if( rc!=SQLITE4_OK ) return rc;
   rc = sqlite4KVCursorPrev(pCur);
   if( rc==SQLITE4_OK && pC->iRoot!=KVSTORE_ROOT ){
     rc = sqlite4KVCursorKey(pCur, &aKey, &nKey);
@@ -125,6 +131,10 @@ void sqlite4VdbeFreeCursor(VdbeCursor *pCx){
   if( pCx==0 ){
     return;
   }
+  if( pCx->pDecoder ){
+    sqlite4VdbeDecoderDestroy(pCx->pDecoder);
+    pCx->pDecoder = 0;
+  }
   sqlite4Fts5Close(pCx->pFts);
   if( pCx->pKVCur ){
     sqlite4KVCursorClose(pCx->pKVCur);
@@ -132,10 +142,6 @@ void sqlite4VdbeFreeCursor(VdbeCursor *pCx){
   if( pCx->pTmpKV ){
     sqlite4KVStoreClose(pCx->pTmpKV);
   }
-  if( pCx->pDecoder ){
-    sqlite4VdbeDecoderDestroy(pCx->pDecoder);
-    pCx->pDecoder = 0;
-  }
   sqlite4_buffer_clear(&pCx->sSeekKey);
 #ifndef SQLITE4_OMIT_VIRTUALTABLE
   if( pCx->pVtabCursor ){
@@ -161,6 +167,8 @@ int sqlite4VdbeCursorMoveto(VdbeCursor *pPk){
   int rc = SQLITE4_OK;            /* Return code */
   if( pPk->sSeekKey.n!=0 ){
     assert( pPk->pKeyInfo->nPK==0 );
+    rc = sqlite4VdbeDecoderRelease(pPk->pDecoder);
+    if( rc!=SQLITE4_OK ) return rc;
     rc = sqlite4KVCursorSeek(pPk->pKVCur, pPk->sSeekKey.p, pPk->sSeekKey.n, 0);
     if( rc==SQLITE4_NOTFOUND ){
       rc = SQLITE4_CORRUPT_BKPT;
@@ -0,0 +1,1139 @@
+/*
+** 2013 November 4
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** This file contains code for the VdbeSorter object, used by OP_SorterOpen
+** cursors to sort large numbers of keys (as may be required, for example,
+** by ORDER BY or GROUP BY processing).
+**
+** A VdbeSorter is a subclass of KVStore. This allows a VdbeCursor opened
+** on a sorter to be used with OP_Insert, OP_Column, OP_SorterData and so
+** on exactly as if it were an ephemeral table. However, a sorter supports
+** only a restricted subset of the KVStore interface:
+**
+**   * Entries are added using xReplace. All entries must be added before
+**     the first call to xSeek. Keys are assumed to be unique (keys written
+**     by the VDBE always end with a sequence number).
+**
+**   * Once all entries have been added, the sorted entries may be read
+**     by calling xSeek with a positive dir argument, followed by any number
+**     of calls to xNext. A cursor may be rewound using xSeek any number
+**     of times. xPrev and xDelete are not supported.
+**
+** Entries are accumulated in memory until the size of the buffered keys
+** and values exceeds the budget configured using "PRAGMA sorter_memory".
+** At that point the buffered entries are sorted and written to a temporary
+** file as a single sorted "run". When the sorter is rewound, any entries
+** still held in memory are sorted and then merged with the runs on disk
+** as the cursor is advanced. If there are more than SORTER_MAX_MERGE_COUNT
+** runs on disk, groups of runs are first merged together into larger
+** runs (also written to the temporary file) until there are not.
+**
+** If the connection is configured to use worker threads ("PRAGMA threads"),
+** then each time the memory budget is exceeded the buffered entries are
+** handed to a background thread to be sorted and written out, while the
+** VM continues to add entries to a new, empty buffer. Each worker thread
+** writes its runs to a temporary file of its own, and performs no memory
+** allocation - all resources it uses are allocated and freed by the thread
+** that owns the sorter. If every worker thread is busy when the buffer
+** next fills up, the owner waits for the oldest one to finish.
+**
+** Within the temporary file, each run is a contiguous series of records.
+** Each record is formatted as follows:
+**
+**     * The size of the key in bytes, as a varint.
+**     * The size of the value in bytes, as a varint.
+**     * The key.
+**     * The value.
+*/
+#include "sqliteInt.h"
+#include "vdbeInt.h"
+#include "bt.h"
+
+#if SQLITE4_THREADSAFE && SQLITE4_OS_UNIX && SQLITE4_MAX_WORKER_THREADS>0
+# include <pthread.h>
+# define SORTER_THREADS 1
+#else
+# define SORTER_THREADS 0
+#endif
+
+/*
+** Maximum number of runs merged together in a single pass.
+*/
+#define SORTER_MAX_MERGE_COUNT 16
+
+/*
+** Size of the buffers used to read and write runs, and the minimum size
+** of each chunk of memory used to store buffered records.
+*/
+#define SORTER_BUFFER_SIZE (64*1024)
+#define SORTER_CHUNK_SIZE  (64*1024)
+
+typedef struct SorterChunk SorterChunk;
+typedef struct SorterCursor SorterCursor;
+typedef struct SorterIter SorterIter;
+typedef struct SorterRecord SorterRecord;
+typedef struct SorterRun SorterRun;
+typedef struct SorterTask SorterTask;
+typedef struct SorterWriter SorterWriter;
+
+/*
+** Records buffered in memory are allocated from a list of large chunks
+** so that the entire buffer may be released in a single pass once it
+** has been written to disk.
+*/
+struct SorterChunk {
+  SorterChunk *pNext;             /* Next chunk in list */
+  int nByte;                      /* Size of chunk content in bytes */
+  int nUsed;                      /* Bytes of content already allocated */
+  /* Content follows */
+};
+
+/*
+** A single key/value pair buffered in memory. The key and value are
+** stored immediately following this structure in memory.
+*/
+struct SorterRecord {
+  SorterRecord *pNext;            /* Next record in list */
+  int nKey;                       /* Size of key in bytes */
+  int nData;                      /* Size of value in bytes */
+};
+#define SRKEY(p) ((u8*)&(p)[1])
+#define SRDATA(p) (&SRKEY(p)[(p)->nKey])
+
+/*
+** Location of a sorted run within a temporary file.
+*/
+struct SorterRun {
+  bt_file *pFd;                   /* Temp file containing run */
+  i64 iOff;                       /* Offset of first byte of run */
+  i64 nByte;                      /* Size of run in bytes */
+};
+
+/*
+** An iterator used to read the entries of a single sorted run (or of the
+** sorted list of records still held in memory) in order. These are the
+** inputs to a merge.
+*/
+struct SorterIter {
+  bt_file *pFd;                   /* File to read from (NULL for in-memory) */
+  i64 iReadOff;                   /* Offset of next byte to read */
+  i64 iEof;                       /* Offset of first byte past end of run */
+  i64 iBufOff;                    /* File offset of aBuffer[0] */
+  int nBufData;                   /* Valid bytes in aBuffer[] */
+  u8 *aBuffer;                    /* Read buffer (SORTER_BUFFER_SIZE bytes) */
+  int nAlloc;                     /* Allocated size of aAlloc[] */
+  u8 *aAlloc;                     /* Space for records larger than aBuffer */
+  SorterRecord *pRecord;          /* Next in-memory record to visit */
+  int bEof;                       /* True once iterator is at EOF */
+  const u8 *aKey;                 /* Current key */
+  int nKey;                       /* Size of aKey[] in bytes */
+  const u8 *aData;                /* Current value */
+  int nData;                      /* Size of aData[] in bytes */
+};
+
+/*
+** Each sorter has one or more of the following objects. aTask[0] is used
+** by the thread that owns the sorter, and the others by worker threads.
+** Each task has its own temporary file and write buffer.
+**
+** While a worker thread is running (while bRunning is true), it has
+** exclusive access to all fields of the task except pSorter and bRunning.
+** The owner thread collects the results once it has joined the worker.
+*/
+struct SorterTask {
+  VdbeSorter *pSorter;            /* Sorter that owns this task */
+  int bRunning;                   /* True while a worker thread is running */
+#if SORTER_THREADS
+  pthread_t tid;                  /* Worker thread (if bRunning) */
+#endif
+  bt_file *pFd;                   /* Temp file (or NULL) */
+  i64 iWriteOff;                  /* Offset of end of temp file */
+  u8 *aBuffer;                    /* SORTER_BUFFER_SIZE byte write buffer */
+  SorterChunk *pChunk;            /* Memory used by pList */
+  SorterRecord *pList;            /* Unsorted records to write as a run */
+  SorterRun run;                  /* Run written by most recent flush */
+  int rc;                         /* Result of most recent flush */
+};
+
+/*
+** Buffered writer used to append a run to a task's temporary file.
+*/
+struct SorterWriter {
+  SorterTask *pTask;              /* Task that owns the temp file */
+  int rc;                         /* Error code (if any) */
+  i64 iStart;                     /* Offset at which run begins */
+  i64 iWriteOff;                  /* Offset of aBuffer[0] in file */
+  int nBufData;                   /* Bytes of data in aBuffer[] */
+  u8 *aBuffer;                    /* Write buffer (owned by pTask) */
+};
+
+/*
+** The sorter object. This is a subclass of KVStore.
+*/
+struct VdbeSorter {
+  KVStore base;                   /* Base class, must be first */
+  i64 mxMemory;                   /* Spill to disk after this many bytes */
+  i64 nMemory;                    /* Bytes of record data buffered */
+  SorterChunk *pChunk;            /* Chunks holding buffered records */
+  SorterRecord *pRecord;          /* Buffered records (sorted if bSorted) */
+  int bSorted;                    /* True once the input phase is finished */
+  int nCursor;                    /* Number of open cursors */
+
+  /* Tasks, temporary files and list of runs written to them */
+  bt_env *pVfs;                   /* Environment used for temp files */
+  int nTask;                      /* Number of entries in aTask[] */
+  int iNextTask;                  /* Worker task to use for next flush */
+  SorterTask *aTask;              /* aTask[0] is for the owner thread */
+  int nRun;                       /* Number of runs in aRun[] */
+  int nRunAlloc;                  /* Allocated size of aRun[] */
+  SorterRun *aRun;                /* Runs written to temp files */
+
+  /* State of the current merge */
+  int nIter;                      /* Number of entries in aIter[] */
+  SorterIter *aIter;              /* Merge inputs */
+  int nHeap;                      /* Number of non-EOF iterators in aHeap */
+  int *aHeap;                     /* Min-heap of indexes into aIter[] */
+};
+
+/*
+** A cursor open on a VdbeSorter. The merge state is stored in the sorter
+** object itself, so there may only be one such cursor open at a time.
+*/
+struct SorterCursor {
+  KVCursor base;                  /* Base class. Must be first */
+  VdbeSorter *pSorter;            /* Sorter that owns this cursor */
+};
+
+/*
+** Compare key (a1, n1) with key (a2, n2) using the KVStore ordering -
+** memcmp() order with shorter keys appearing first.
+*/
+static int sorterCompare(const u8 *a1, int n1, const u8 *a2, int n2){
+  int res = memcmp(a1, a2, (n1<n2 ? n1 : n2));
+  if( res==0 ) res = n1 - n2;
+  return res;
+}
+
+/*
+** Return the number of bytes in the varint that begins with byte c.
+*/
+static int sorterVarintLen(u8 c){
+  if( c<=240 ) return 1;
+  if( c<=248 ) return 2;
+  return c - 246;
+}
+
+/*
+** Allocate nByte bytes of space for a buffered record. Return NULL if
+** an OOM occurs.
+*/
+static void *sorterChunkAlloc(VdbeSorter *p, int nByte){
+  SorterChunk *pChunk = p->pChunk;
+  void *pRet;
+
+  nByte = ROUND8(nByte);
+  if( pChunk==0 || (pChunk->nByte - pChunk->nUsed)<nByte ){
+    int nChunk = (nByte>SORTER_CHUNK_SIZE ? nByte : SORTER_CHUNK_SIZE);
+    pChunk = (SorterChunk*)sqlite4_malloc(p->base.pEnv,
+        ROUND8(sizeof(SorterChunk)) + nChunk
+    );
+    if( pChunk==0 ) return 0;
+    pChunk->nByte = nChunk;
+    pChunk->nUsed = 0;
+    pChunk->pNext = p->pChunk;
+    p->pChunk = pChunk;
+  }
+
+  pRet = &((u8*)pChunk)[ROUND8(sizeof(SorterChunk)) + pChunk->nUsed];
+  pChunk->nUsed += nByte;
+  return pRet;
+}
+
+/*
+** Free a list of chunks of buffered record memory.
+*/
+static void sorterChunkFree(sqlite4_env *pEnv, SorterChunk *pChunk){
+  SorterChunk *pNext;
+  for(; pChunk; pChunk=pNext){
+    pNext = pChunk->pNext;
+    sqlite4_free(pEnv, pChunk);
+  }
+}
+
+/*
+** Free all chunks of buffered record memory owned by the sorter itself.
+*/
+static void sorterChunkFreeAll(VdbeSorter *p){
+  sorterChunkFree(p->base.pEnv, p->pChunk);
+  p->pChunk = 0;
+  p->pRecord = 0;
+  p->nMemory = 0;
+}
+
+/*
+** Merge the two sorted lists p1 and p2 into a single list.
+*/
+static SorterRecord *sorterMergeLists(SorterRecord *p1, SorterRecord *p2){
+  SorterRecord *pFinal = 0;
+  SorterRecord **pp = &pFinal;
+
+  while( p1 && p2 ){
+    int res = sorterCompare(SRKEY(p1), p1->nKey, SRKEY(p2), p2->nKey);
+    if( res<=0 ){
+      *pp = p1;
+      pp = &p1->pNext;
+      p1 = p1->pNext;
+    }else{
+      *pp = p2;
+      pp = &p2->pNext;
+      p2 = p2->pNext;
+    }
+  }
+  *pp = (p1 ? p1 : p2);
+  return pFinal;
+}
+
+/*
+** Sort the linked list of records headed at pList using a bottom-up
+** merge-sort. Return the sorted list.
+*/
+static SorterRecord *sorterSortList(SorterRecord *pList){
+  SorterRecord *aSlot[64];
+  SorterRecord *p;
+  int i;
+
+  memset(aSlot, 0, sizeof(aSlot));
+  p = pList;
+  while( p ){
+    SorterRecord *pNext = p->pNext;
+    p->pNext = 0;
+    for(i=0; aSlot[i]; i++){
+      p = sorterMergeLists(aSlot[i], p);
+      aSlot[i] = 0;
+    }
+    aSlot[i] = p;
+    p = pNext;
+  }
+
+  p = 0;
+  for(i=0; i<ArraySize(aSlot); i++){
+    p = sorterMergeLists(aSlot[i], p);
+  }
+  return p;
+}
+
+/*
+** Open the temporary file used by task pTask, if it is not already open,
+** and allocate its write buffer. This is always called by the thread that
+** owns the sorter.
+*/
+static int sorterTaskPrepare(SorterTask *pTask){
+  VdbeSorter *p = pTask->pSorter;
+  sqlite4_env *pEnv = p->base.pEnv;
+  int rc = SQLITE4_OK;
+
+  if( pTask->pFd==0 ){
+    rc = p->pVfs->xOpen(pEnv, p->pVfs, 0, BT_OPEN_TEMP, &pTask->pFd);
+    if( rc!=SQLITE4_OK ) return rc;
+  }
+
+  if( pTask->aBuffer==0 ){
+    pTask->aBuffer = (u8*)sqlite4_malloc(pEnv, SORTER_BUFFER_SIZE);
+    if( pTask->aBuffer==0 ) rc = SQLITE4_NOMEM;
+  }
+  return rc;
+}
+
+/*
+** Initialize a writer that will append a new run to the temp file
+** belonging to task pTask. sorterTaskPrepare() must already have been
+** called on the task.
+*/
+static void sorterWriterInit(SorterTask *pTask, SorterWriter *pWriter){
+  assert( pTask->pFd && pTask->aBuffer );
+  memset(pWriter, 0, sizeof(SorterWriter));
+  pWriter->pTask = pTask;
+  pWriter->aBuffer = pTask->aBuffer;
+  pWriter->iStart = pWriter->iWriteOff = pTask->iWriteOff;
+}
+
+/*
+** Write any buffered data to the temp file.
+*/
+static void sorterWriterFlush(SorterWriter *pWriter){
+  if( pWriter->rc==SQLITE4_OK && pWriter->nBufData>0 ){
+    SorterTask *pTask = pWriter->pTask;
+    pWriter->rc = pTask->pSorter->pVfs->xWrite(
+        pTask->pFd, pWriter->iWriteOff, pWriter->aBuffer, pWriter->nBufData
+    );
+    pWriter->iWriteOff += pWriter->nBufData;
+    pWriter->nBufData = 0;
+  }
+}
+
+/*
+** Append n bytes of data from buffer a[] to the run being written.
+*/
+static void sorterWriterWrite(SorterWriter *pWriter, const u8 *a, int n){
+  while( n>0 && pWriter->rc==SQLITE4_OK ){
+    int nCopy = SORTER_BUFFER_SIZE - pWriter->nBufData;
+    if( nCopy>n ) nCopy = n;
+    memcpy(&pWriter->aBuffer[pWriter->nBufData], a, nCopy);
+    pWriter->nBufData += nCopy;
+    a += nCopy;
+    n -= nCopy;
+    if( pWriter->nBufData==SORTER_BUFFER_SIZE ) sorterWriterFlush(pWriter);
+  }
+}
+
+/*
+** Append a single record to the run being written.
+*/
+static void sorterWriterRecord(
+  SorterWriter *pWriter,
+  const u8 *aKey, int nKey,
+  const u8 *aData, int nData
+){
+  u8 aVarint[18];
+  int nVarint;
+  nVarint = sqlite4PutVarint64(aVarint, nKey);
+  nVarint += sqlite4PutVarint64(&aVarint[nVarint], nData);
+  sorterWriterWrite(pWriter, aVarint, nVarint);
+  sorterWriterWrite(pWriter, aKey, nKey);
+  sorterWriterWrite(pWriter, aData, nData);
+}
+
+/*
+** Finish writing a run. If successful, populate *pRun with the location
+** of the new run and return SQLITE4_OK. Otherwise, return an error code.
+*/
+static int sorterWriterFinish(SorterWriter *pWriter, SorterRun *pRun){
+  SorterTask *pTask = pWriter->pTask;
+
+  sorterWriterFlush(pWriter);
+  if( pWriter->rc==SQLITE4_OK ){
+    pRun->pFd = pTask->pFd;
+    pRun->iOff = pWriter->iStart;
+    pRun->nByte = pWriter->iWriteOff - pWriter->iStart;
+    pTask->iWriteOff = pWriter->iWriteOff;
+  }
+  return pWriter->rc;
+}
+
+/*
+** Append run *pRun to the sorter's aRun[] array.
+*/
+static int sorterAddRun(VdbeSorter *p, SorterRun *pRun){
+  if( p->nRun>=p->nRunAlloc ){
+    int nNew = (p->nRunAlloc ? p->nRunAlloc*2 : 16);
+    SorterRun *aNew = (SorterRun*)sqlite4_realloc(
+        p->base.pEnv, p->aRun, nNew*sizeof(SorterRun)
+    );
+    if( aNew==0 ) return SQLITE4_NOMEM;
+    p->aRun = aNew;
+    p->nRunAlloc = nNew;
+  }
+  p->aRun[p->nRun++] = *pRun;
+  return SQLITE4_OK;
+}
+
+/*
+** Sort the list of records pTask->pList and write them to the task's temp
+** file as a new run. The result is left in pTask->rc and pTask->run. This
+** function may be called by a worker thread, so it must not allocate or
+** free memory or modify the sorter object.
+*/
+static void sorterTaskRun(SorterTask *pTask){
+  SorterWriter writer;
+  SorterRecord *pRec;
+
+  sorterWriterInit(pTask, &writer);
+  for(pRec=sorterSortList(pTask->pList); pRec; pRec=pRec->pNext){
+    sorterWriterRecord(
+        &writer, SRKEY(pRec), pRec->nKey, SRDATA(pRec), pRec->nData
+    );
+  }
+  pTask->pList = 0;
+  pTask->rc = sorterWriterFinish(&writer, &pTask->run);
+}
+
+#if SORTER_THREADS
+/*
+** Worker thread entry point.
+*/
+static void *sorterTaskMain(void *pCtx){
+  sorterTaskRun((SorterTask*)pCtx);
+  return 0;
+}
+#endif
+
+/*
+** Run task pTask. If bBackground is true, try to do so in a worker thread.
+** If a thread cannot be started, or if bBackground is false, the task is
+** run by the current thread before this function returns.
+*/
+static void sorterTaskStart(SorterTask *pTask, int bBackground){
+  assert( pTask->bRunning==0 );
+#if SORTER_THREADS
+  if( bBackground
+   && pthread_create(&pTask->tid, 0, sorterTaskMain, (void*)pTask)==0
+  ){
+    pTask->bRunning = 1;
+    return;
+  }
+#endif
+  sorterTaskRun(pTask);
+}
+
+/*
+** Wait for task pTask to finish, if it is running. Then free the records
+** it has written out and add the new run (if any) to the sorter. Return
+** the task's error code.
+*/
+static int sorterTaskCollect(SorterTask *pTask){
+  VdbeSorter *p = pTask->pSorter;
+  int rc;
+
+#if SORTER_THREADS
+  if( pTask->bRunning ){
+    pthread_join(pTask->tid, 0);
+    pTask->bRunning = 0;
+  }
+#endif
+  assert( pTask->bRunning==0 );
+
+  if( pTask->pChunk==0 ) return SQLITE4_OK;
+  sorterChunkFree(p->base.pEnv, pTask->pChunk);
+  pTask->pChunk = 0;
+  pTask->pList = 0;
+  rc = pTask->rc;
+  if( rc==SQLITE4_OK ) rc = sorterAddRun(p, &pTask->run);
+  return rc;
+}
+
+/*
+** Wait for all running worker threads to finish and collect their results.
+*/
+static int sorterCollectAll(VdbeSorter *p){
+  int rc = SQLITE4_OK;
+  int i;
+  for(i=0; i<p->nTask; i++){
+    int rc2 = sorterTaskCollect(&p->aTask[i]);
+    if( rc==SQLITE4_OK ) rc = rc2;
+  }
+  return rc;
+}
+
+/*
+** Sort the records currently buffered in memory and write them to a
+** temp file as a new run, either in a worker thread or by the current
+** thread. The sorter is left with an empty buffer.
+*/
+static int sorterFlush(VdbeSorter *p){
+  SorterTask *pTask;
+  int rc;
+
+  if( p->nTask>1 ){
+    /* Use the worker tasks in round-robin order. If the next task is still
+    ** running, this waits for it to finish. */
+    pTask = &p->aTask[1 + p->iNextTask];
+    p->iNextTask = (p->iNextTask + 1) % (p->nTask - 1);
+  }else{
+    pTask = &p->aTask[0];
+  }
+
+  rc = sorterTaskCollect(pTask);
+  if( rc==SQLITE4_OK ) rc = sorterTaskPrepare(pTask);
+  if( rc==SQLITE4_OK ){
+    pTask->pChunk = p->pChunk;
+    pTask->pList = p->pRecord;
+    p->pChunk = 0;
+    p->pRecord = 0;
+    p->nMemory = 0;
+    sorterTaskStart(pTask, pTask!=&p->aTask[0]);
+    if( pTask->bRunning==0 ) rc = sorterTaskCollect(pTask);
+  }
+  return rc;
+}
+
+/*
+** Read the next n bytes from the run that iterator pIter is reading.
+** If successful, set *pa to point to a buffer containing the data and
+** return SQLITE4_OK. The buffer remains valid until the next call to this
+** function on the same iterator.
+*/
+static int sorterIterRead(
+  VdbeSorter *p,
+  SorterIter *pIter,
+  int n,
+  const u8 **pa
+){
+  int rc = SQLITE4_OK;
+
+  if( pIter->iReadOff+n > pIter->iEof ) return SQLITE4_CORRUPT_BKPT;
+  if( pIter->iReadOff+n > pIter->iBufOff+pIter->nBufData ){
+    if( n>SORTER_BUFFER_SIZE ){
+      /* Record is too large for aBuffer[]. Read it directly into aAlloc. */
+      if( n>pIter->nAlloc ){
+        u8 *aNew = (u8*)sqlite4_realloc(p->base.pEnv, pIter->aAlloc, n);
+        if( aNew==0 ) return SQLITE4_NOMEM;
+        pIter->aAlloc = aNew;
+        pIter->nAlloc = n;
+      }
+      rc = p->pVfs->xRead(pIter->pFd, pIter->iReadOff, pIter->aAlloc, n);
+      *pa = pIter->aAlloc;
+      pIter->iReadOff += n;
+      return rc;
+    }else{
+      i64 nAvail = pIter->iEof - pIter->iReadOff;
+      int nRead = (nAvail<SORTER_BUFFER_SIZE ? (int)nAvail:SORTER_BUFFER_SIZE);
+      rc = p->pVfs->xRead(pIter->pFd, pIter->iReadOff, pIter->aBuffer, nRead);
+      pIter->iBufOff = pIter->iReadOff;
+      pIter->nBufData = nRead;
+    }
+  }
+
+  *pa = &pIter->aBuffer[pIter->iReadOff - pIter->iBufOff];
+  pIter->iReadOff += n;
+  return rc;
+}
+
+/*
+** Read a varint from the run that iterator pIter is reading.
+*/
+static int sorterIterVarint(VdbeSorter *p, SorterIter *pIter, u64 *piVal){
+  u8 aVarint[9];
+  const u8 *a;
+  int nVarint;
+  int rc;
+
+  rc = sorterIterRead(p, pIter, 1, &a);
+  if( rc==SQLITE4_OK ){
+    aVarint[0] = a[0];
+    nVarint = sorterVarintLen(aVarint[0]);
+    if( nVarint>1 ){
+      rc = sorterIterRead(p, pIter, nVarint-1, &a);
+      if( rc==SQLITE4_OK ) memcpy(&aVarint[1], a, nVarint-1);
+    }
+  }
+  if( rc==SQLITE4_OK ){
+    sqlite4GetVarint64(aVarint, nVarint, piVal);
+  }
+  return rc;
+}
+
+/*
+** Advance iterator pIter to its next entry. Set pIter->bEof if there
+** are no more entries.
+*/
+static int sorterIterNext(VdbeSorter *p, SorterIter *pIter){
+  int rc = SQLITE4_OK;
+
+  if( pIter->pFd==0 ){
+    SorterRecord *pRec = pIter->pRecord;
+    if( pRec==0 ){
+      pIter->bEof = 1;
+    }else{
+      pIter->aKey = SRKEY(pRec);
+      pIter->nKey = pRec->nKey;
+      pIter->aData = SRDATA(pRec);
+      pIter->nData = pRec->nData;
+      pIter->pRecord = pRec->pNext;
+    }
+  }else if( pIter->iReadOff>=pIter->iEof ){
+    pIter->bEof = 1;
+  }else{
+    u64 nKey = 0;
+    u64 nData = 0;
+    const u8 *a;
+
+    rc = sorterIterVarint(p, pIter, &nKey);
+    if( rc==SQLITE4_OK ) rc = sorterIterVarint(p, pIter, &nData);
+    if( rc==SQLITE4_OK ) rc = sorterIterRead(p, pIter, (int)(nKey+nData), &a);
+    if( rc==SQLITE4_OK ){
+      pIter->aKey = a;
+      pIter->nKey = (int)nKey;
+      pIter->aData = &a[nKey];
+      pIter->nData = (int)nData;
+    }
+  }
+  return rc;
+}
+
+/*
+** Free all resources associated with the current merge.
+*/
+static void sorterMergeFree(VdbeSorter *p){
+  int i;
+  for(i=0; i<p->nIter; i++){
+    sqlite4_free(p->base.pEnv, p->aIter[i].aBuffer);
+    sqlite4_free(p->base.pEnv, p->aIter[i].aAlloc);
+  }
+  sqlite4_free(p->base.pEnv, p->aIter);
+  sqlite4_free(p->base.pEnv, p->aHeap);
+  p->aIter = 0;
+  p->aHeap = 0;
+  p->nIter = 0;
+  p->nHeap = 0;
+}
+
+/*
+** Return true if the current entry of iterator aIter[i1] should be
+** returned before that of iterator aIter[i2]. If the two keys are equal,
+** the entry from the older input (the one with the smaller index) is
+** returned first.
+*/
+static int sorterIterLess(VdbeSorter *p, int i1, int i2){
+  SorterIter *p1 = &p->aIter[i1];
+  SorterIter *p2 = &p->aIter[i2];
+  int res = sorterCompare(p1->aKey, p1->nKey, p2->aKey, p2->nKey);
+  return (res<0 || (res==0 && i1<i2));
+}
+
+/*
+** Restore the heap property for the sub-tree rooted at aHeap[i].
+*/
+static void sorterHeapDown(VdbeSorter *p, int i){
+  int *aHeap = p->aHeap;
+  int iTmp;
+  while( 1 ){
+    int iMin = i;
+    int iLeft = 2*i + 1;
+    int iRight = iLeft + 1;
+    if( iLeft<p->nHeap && sorterIterLess(p, aHeap[iLeft], aHeap[iMin]) ){
+      iMin = iLeft;
+    }
+    if( iRight<p->nHeap && sorterIterLess(p, aHeap[iRight], aHeap[iMin]) ){
+      iMin = iRight;
+    }
+    if( iMin==i ) break;
+    iTmp = aHeap[i];
+    aHeap[i] = aHeap[iMin];
+    aHeap[iMin] = iTmp;
+    i = iMin;
+  }
+}
+
+/*
+** Begin a merge of runs aRun[iFirst] to aRun[iFirst+nMerge-1]. If
+** parameter pList is not NULL, it is a sorted list of in-memory records
+** to include in the merge as well.
+**
+** If successful, the merge is left pointing to its first (smallest)
+** entry, or at EOF if there are no entries at all.
+*/
+static int sorterMergeInit(
+  VdbeSorter *p,
+  int iFirst,
+  int nMerge,
+  SorterRecord *pList
+){
+  sqlite4_env *pEnv = p->base.pEnv;
+  int nIter = nMerge + (pList ? 1 : 0);
+  int rc = SQLITE4_OK;
+  int i;
+
+  sorterMergeFree(p);
+  p->aIter = (SorterIter*)sqlite4_malloc(pEnv, (nIter+1)*sizeof(SorterIter));
+  p->aHeap = (int*)sqlite4_malloc(pEnv, (nIter+1)*sizeof(int));
+  if( p->aIter==0 || p->aHeap==0 ) return SQLITE4_NOMEM;
+  memset(p->aIter, 0, nIter*sizeof(SorterIter));
+  p->nIter = nIter;
+
+  for(i=0; rc==SQLITE4_OK && i<nIter; i++){
+    SorterIter *pIter = &p->aIter[i];
+    if( i<nMerge ){
+      SorterRun *pRun = &p->aRun[iFirst+i];
+      pIter->pFd = pRun->pFd;
+      pIter->iReadOff = pIter->iBufOff = pRun->iOff;
+      pIter->iEof = pRun->iOff + pRun->nByte;
+      pIter->aBuffer = (u8*)sqlite4_malloc(pEnv, SORTER_BUFFER_SIZE);
+      if( pIter->aBuffer==0 ){
+        rc = SQLITE4_NOMEM;
+        break;
+      }
+    }else{
+      pIter->pRecord = pList;
+    }
+    rc = sorterIterNext(p, pIter);
+    if( rc==SQLITE4_OK && pIter->bEof==0 ){
+      p->aHeap[p->nHeap++] = i;
+    }
+  }
+
+  for(i=p->nHeap/2-1; i>=0; i--){
+    sorterHeapDown(p, i);
+  }
+  return rc;
+}
+
+/*
+** Return a pointer to the iterator holding the current entry of the
+** merge, or NULL if the merge is at EOF.
+*/
+static SorterIter *sorterMergeCurrent(VdbeSorter *p){
+  return (p->nHeap>0 ? &p->aIter[p->aHeap[0]] : 0);
+}
+
+/*
+** Advance the merge to its next entry.
+*/
+static int sorterMergeNext(VdbeSorter *p){
+  int rc;
+  SorterIter *pIter;
+
+  assert( p->nHeap>0 );
+  pIter = &p->aIter[p->aHeap[0]];
+  rc = sorterIterNext(p, pIter);
+  if( rc==SQLITE4_OK ){
+    if( pIter->bEof ){
+      p->aHeap[0] = p->aHeap[--p->nHeap];
+    }
+    sorterHeapDown(p, 0);
+  }
+  return rc;
+}
+
+/*
+** Merge groups of up to SORTER_MAX_MERGE_COUNT runs together until there
+** are no more than SORTER_MAX_MERGE_COUNT runs remaining. The merged
+** runs are appended to the temp file belonging to aTask[0].
+*/
+static int sorterReduceRuns(VdbeSorter *p){
+  SorterTask *pTask = &p->aTask[0];
+  int rc = SQLITE4_OK;
+
+  if( p->nRun>SORTER_MAX_MERGE_COUNT ) rc = sorterTaskPrepare(pTask);
+
+  while( rc==SQLITE4_OK && p->nRun>SORTER_MAX_MERGE_COUNT ){
+    int nOld = p->nRun;
+    int iFirst;
+    int i;
+
+    for(iFirst=0; rc==SQLITE4_OK && iFirst<nOld;
+        iFirst += SORTER_MAX_MERGE_COUNT
+    ){
+      SorterWriter writer;
+      SorterRun run;
+      int nMerge = nOld - iFirst;
+      if( nMerge>SORTER_MAX_MERGE_COUNT ) nMerge = SORTER_MAX_MERGE_COUNT;
+
+      rc = sorterMergeInit(p, iFirst, nMerge, 0);
+      if( rc!=SQLITE4_OK ) break;
+      sorterWriterInit(pTask, &writer);
+      while( rc==SQLITE4_OK && writer.rc==SQLITE4_OK ){
+        SorterIter *pIter = sorterMergeCurrent(p);
+        if( pIter==0 ) break;
+        sorterWriterRecord(&writer,
+            pIter->aKey, pIter->nKey, pIter->aData, pIter->nData
+        );
+        rc = sorterMergeNext(p);
+      }
+      if( rc==SQLITE4_OK ) rc = sorterWriterFinish(&writer, &run);
+      if( rc==SQLITE4_OK ) rc = sorterAddRun(p, &run);
+    }
+    sorterMergeFree(p);
+
+    /* Discard the runs that have just been merged. */
+    if( rc==SQLITE4_OK ){
+      for(i=nOld; i<p->nRun; i++) p->aRun[i-nOld] = p->aRun[i];
+      p->nRun -= nOld;
+    }
+  }
+  return rc;
+}
+
+/*
+** Finish the input phase of sorter p. Sort any records buffered in
+** memory and, if required, merge runs on disk together so that they may
+** all be merged in a single pass.
+*/
+static int sorterFinish(VdbeSorter *p){
+  int rc;
+  assert( p->bSorted==0 );
+  p->bSorted = 1;
+  p->pRecord = sorterSortList(p->pRecord);
+  rc = sorterCollectAll(p);
+  if( rc==SQLITE4_OK ) rc = sorterReduceRuns(p);
+  return rc;
+}
+
+/*
+** Implementation of the xReplace method. Buffer the new entry in memory,
+** spilling the buffered entries to disk if the memory budget is exceeded.
+*/
+static int sorterReplace(
+  KVStore *pKVStore,
+  const KVByteArray *aKey, KVSize nKey,
+  const KVByteArray *aData, KVSize nData
+){
+  VdbeSorter *p = (VdbeSorter*)pKVStore;
+  SorterRecord *pRec;
+  int nByte;
+
+  if( p->bSorted ) return SQLITE4_MISUSE_BKPT;
+
+  nByte = sizeof(SorterRecord) + nKey + nData;
+  pRec = (SorterRecord*)sorterChunkAlloc(p, nByte);
+  if( pRec==0 ) return SQLITE4_NOMEM;
+  pRec->nKey = nKey;
+  pRec->nData = nData;
+  memcpy(SRKEY(pRec), aKey, nKey);
+  if( nData>0 ) memcpy(SRDATA(pRec), aData, nData);
+  pRec->pNext = p->pRecord;
+  p->pRecord = pRec;
+  p->nMemory += nByte;
+
+  if( p->mxMemory>0 && p->nMemory>p->mxMemory ){
+    return sorterFlush(p);
+  }
+  return SQLITE4_OK;
+}
+
+static int sorterOpenCursor(KVStore *pKVStore, KVCursor **ppKVCursor){
+  VdbeSorter *p = (VdbeSorter*)pKVStore;
+  SorterCursor *pCur;
+
+  assert( p->nCursor==0 );
+  pCur = (SorterCursor*)sqlite4_malloc(p->base.pEnv, sizeof(SorterCursor));
+  if( pCur==0 ){
+    *ppKVCursor = 0;
+    return SQLITE4_NOMEM;
+  }
+  memset(pCur, 0, sizeof(SorterCursor));
+  pCur->pSorter = p;
+  pCur->base.pStore = pKVStore;
+  pCur->base.pStoreVfunc = pKVStore->pStoreVfunc;
+  pCur->base.pEnv = pKVStore->pEnv;
+  p->nCursor++;
+  *ppKVCursor = (KVCursor*)pCur;
+  return SQLITE4_OK;
+}
+
+/*
+** Implementation of the xSeek method. The first call to this method
+** ends the input phase. The cursor is left pointing to the smallest key
+** that is greater than or equal to (aKey/nKey). Only positive values of
+** dir are supported.
+*/
+static int sorterSeek(
+  KVCursor *pKVCursor,
+  const KVByteArray *aKey, KVSize nKey,
+  int dir
+){
+  VdbeSorter *p = ((SorterCursor*)pKVCursor)->pSorter;
+  SorterIter *pIter;
+  int rc = SQLITE4_OK;
+
+  if( dir<=0 ) return SQLITE4_MISUSE_BKPT;
+  if( p->bSorted==0 ) rc = sorterFinish(p);
+  if( rc==SQLITE4_OK ) rc = sorterMergeInit(p, 0, p->nRun, p->pRecord);
+
+  while( rc==SQLITE4_OK && (pIter = sorterMergeCurrent(p)) ){
+    int res = sorterCompare(pIter->aKey, pIter->nKey, aKey, nKey);
+    if( res>=0 ) return (res==0 ? SQLITE4_OK : SQLITE4_INEXACT);
+    rc = sorterMergeNext(p);
+  }
+
+  return (rc==SQLITE4_OK ? SQLITE4_NOTFOUND : rc);
+}
+
+static int sorterNext(KVCursor *pKVCursor){
+  VdbeSorter *p = ((SorterCursor*)pKVCursor)->pSorter;
+  int rc;
+  if( sorterMergeCurrent(p)==0 ) return SQLITE4_NOTFOUND;
+  rc = sorterMergeNext(p);
+  if( rc==SQLITE4_OK && sorterMergeCurrent(p)==0 ) rc = SQLITE4_NOTFOUND;
+  return rc;
+}
+
+static int sorterPrev(KVCursor *pKVCursor){
+  return SQLITE4_MISUSE_BKPT;
+}
+
+static int sorterDelete(KVCursor *pKVCursor){
+  return SQLITE4_MISUSE_BKPT;
+}
+
+static int sorterKey(
+  KVCursor *pKVCursor,
+  const KVByteArray **paKey,
+  KVSize *pnKey
+){
+  SorterIter *pIter = sorterMergeCurrent(((SorterCursor*)pKVCursor)->pSorter);
+  if( pIter==0 ){
+    *paKey = 0;
+    *pnKey = 0;
+    return SQLITE4_DONE;
+  }
+  *paKey = pIter->aKey;
+  *pnKey = pIter->nKey;
+  return SQLITE4_OK;
+}
+
+static int sorterData(
+  KVCursor *pKVCursor,
+  KVSize ofst,
+  KVSize n,
+  const KVByteArray **paData,
+  KVSize *pnData
+){
+  SorterIter *pIter = sorterMergeCurrent(((SorterCursor*)pKVCursor)->pSorter);
+  if( pIter==0 ){
+    *paData = 0;
+    *pnData = 0;
+    return SQLITE4_DONE;
+  }
+  *paData = &pIter->aData[ofst];
+  *pnData = pIter->nData - ofst;
+  return SQLITE4_OK;
+}
+
+static int sorterReset(KVCursor *pKVCursor){
+  return SQLITE4_OK;
+}
+
+static int sorterCloseCursor(KVCursor *pKVCursor){
+  SorterCursor *pCur = (SorterCursor*)pKVCursor;
+  if( pCur ){
+    pCur->pSorter->nCursor--;
+    sqlite4_free(pCur->base.pEnv, pCur);
+  }
+  return SQLITE4_OK;
+}
+
+/*
+** A sorter is never part of a transaction. The following methods just
+** track the transaction level, as required by the KVStore interface.
+*/
+static int sorterBegin(KVStore *pKVStore, int iLevel){
+  pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int sorterCommitPhaseOne(KVStore *pKVStore, int iLevel){
+  return SQLITE4_OK;
+}
+static int sorterCommitPhaseTwo(KVStore *pKVStore, int iLevel){
+  pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int sorterRollback(KVStore *pKVStore, int iLevel){
+  pKVStore->iTransLevel = iLevel;
+  return SQLITE4_OK;
+}
+static int sorterRevert(KVStore *pKVStore, int iLevel){
+  return SQLITE4_OK;
+}
+
+/*
+** Destructor for the sorter object.
+*/
+static int sorterClose(KVStore *pKVStore){
+  VdbeSorter *p = (VdbeSorter*)pKVStore;
+  if( p ){
+    sqlite4_env *pEnv = p->base.pEnv;
+    int i;
+    assert( p->nCursor==0 );
+    sorterMergeFree(p);
+    sorterChunkFreeAll(p);
+    sorterCollectAll(p);
+    for(i=0; i<p->nTask; i++){
+      SorterTask *pTask = &p->aTask[i];
+      if( pTask->pFd ) p->pVfs->xClose(pTask->pFd);
+      sqlite4_free(pEnv, pTask->aBuffer);
+    }
+    sqlite4_free(pEnv, p->aRun);
+    sqlite4_free(pEnv, p);
+  }
+  return SQLITE4_OK;
+}
+
+static int sorterControl(KVStore *pKVStore, int op, void *pArg){
+  return SQLITE4_NOTFOUND;
+}
+
+static int sorterGetMeta(KVStore *pKVStore, unsigned int *piVal){
+  *piVal = 0;
+  return SQLITE4_OK;
+}
+
+static int sorterPutMeta(KVStore *pKVStore, unsigned int iVal){
+  return SQLITE4_OK;
+}
+
+/* Virtual methods for the sorter */
+static const KVStoreMethods sorterMethods = {
+  1,                        /* iVersion */
+  sizeof(KVStoreMethods),   /* szSelf */
+  sorterReplace,            /* xReplace */
+  sorterOpenCursor,         /* xOpenCursor */
+  sorterSeek,               /* xSeek */
+  sorterNext,               /* xNext */
+  sorterPrev,               /* xPrev */
+  sorterDelete,             /* xDelete */
+  sorterKey,                /* xKey */
+  sorterData,               /* xData */
+  sorterReset,              /* xReset */
+  sorterCloseCursor,        /* xCloseCursor */
+  sorterBegin,              /* xBegin */
+  sorterCommitPhaseOne,     /* xCommitPhaseOne */
+  sorterCommitPhaseTwo,     /* xCommitPhaseTwo */
+  sorterRollback,           /* xRollback */
+  sorterRevert,             /* xRevert */
+  sorterClose,              /* xClose */
+  sorterControl,            /* xControl */
+  sorterGetMeta,            /* xGetMeta */
+  sorterPutMeta             /* xPutMeta */
+};
+
+/*
+** Create a new sorter object for use by database connection db. If
+** successful, set *ppKVStore to point to the new object and return
+** SQLITE4_OK. Otherwise, set *ppKVStore to NULL and return an error code.
+*/
+int sqlite4VdbeSorterOpen(sqlite4 *db, KVStore **ppKVStore){
+  sqlite4_env *pEnv = db->pEnv;
+  VdbeSorter *pNew;
+  int nTask;
+  int nByte;
+  int i;
+
+  /* Worker threads are only useful if runs are written to disk */
+  nTask = 1;
+  if( SORTER_THREADS && db->nSorterMem>0 ) nTask += db->nWorker;
+
+  *ppKVStore = 0;
+  nByte = sizeof(VdbeSorter) + nTask*sizeof(SorterTask);
+  pNew = (VdbeSorter*)sqlite4_malloc(pEnv, nByte);
+  if( pNew==0 ) return SQLITE4_NOMEM;
+  memset(pNew, 0, nByte);
+  pNew->base.pStoreVfunc = &sorterMethods;
+  pNew->base.pEnv = pEnv;
+  pNew->mxMemory = db->nSorterMem;
+  pNew->nTask = nTask;
+  pNew->aTask = (SorterTask*)&pNew[1];
+  for(i=0; i<nTask; i++) pNew->aTask[i].pSorter = pNew;
+
+  /* Temp files are opened using the bt_env of the main database, if it
+  ** is a bt database. Otherwise, the default bt_env is used.  */
+  if( db->aDb[0].pKV ){
+    KVStore *pKV = db->aDb[0].pKV;
+    pKV->pStoreVfunc->xControl(pKV, BT_CONTROL_GETVFS, (void*)&pNew->pVfs);
+  }
+  if( pNew->pVfs==0 ) pNew->pVfs = sqlite4BtEnvDefault();
+
+  sqlite4_randomness(pEnv, sizeof(pNew->base.kvId), &pNew->base.kvId);
+  sqlite4_snprintf(pNew->base.zKVName, sizeof(pNew->base.zKVName), "sorter");
+  pNew->base.fTrace = (db->flags & SQLITE4_KvTrace)!=0;
+  *ppKVStore = (KVStore*)pNew;
+  return SQLITE4_OK;
+}
@@ -4127,7 +4127,7 @@ static int whereLoopResize(sqlite4 *db, WhereLoop *p, int n){
   WhereTerm **paNew;
   if( p->nLSlot>=n ) return SQLITE4_OK;
   n = (n+7)&~7;
-  paNew = sqlite4DbMallocRaw(db, sizeof(p->aLTerm[0])*n);
+  paNew = sqlite4DbMallocNode(db, sizeof(p->aLTerm[0])*n);
   if( paNew==0 ) return SQLITE4_NOMEM;
   memcpy(paNew, p->aLTerm, sizeof(p->aLTerm[0])*p->nLSlot);
   if( p->aLTerm!=p->aLTermSpace ) sqlite4DbFree(db, p->aLTerm);
@@ -4299,7 +4299,7 @@ static int whereLoopInsert(WhereLoopBuilder *pBuilder, WhereLoop *pTemplate){
   }
 #endif
   if( p==0 ){
-    p = sqlite4DbMallocRaw(db, sizeof(WhereLoop));
+    p = sqlite4DbMallocNode(db, sizeof(WhereLoop));
     if( p==0 ) return SQLITE4_NOMEM;
     whereLoopInit(p);
   }
@@ -5794,7 +5794,7 @@ WhereInfo *sqlite4WhereBegin(
   ** some architectures. Hence the ROUND8() below.
   */
   nByteWInfo = ROUND8(sizeof(WhereInfo)+(nTabList-1)*sizeof(WhereLevel));
-  pWInfo = sqlite4DbMallocZero(db, nByteWInfo + sizeof(WhereLoop));
+  pWInfo = sqlite4DbMallocNode(db, nByteWInfo + sizeof(WhereLoop));
   if( db->mallocFailed ){
     sqlite4DbFree(db, pWInfo);
     pWInfo = 0;
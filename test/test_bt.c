@@ -630,12 +630,588 @@ static int test_btenv(
   return TCL_OK;
 }
 
+/*
+** Context object for the recovery progress callback installed by the 
+** [btrecover] command. There is one per interpreter.
+*/
+typedef struct BtRecoverCb BtRecoverCb;
+struct BtRecoverCb {
+  Tcl_Interp *interp;             /* Interpreter to evaluate script in */
+  Tcl_Obj *pScript;               /* Script to evaluate */
+};
+
+static void test_btrecover_cb(void *pCtx, int nFrame, int nTotal){
+  BtRecoverCb *p = (BtRecoverCb*)pCtx;
+  Tcl_Obj *pEval;
+
+  pEval = Tcl_DuplicateObj(p->pScript);
+  Tcl_IncrRefCount(pEval);
+  Tcl_ListObjAppendElement(p->interp, pEval, Tcl_NewIntObj(nFrame));
+  Tcl_ListObjAppendElement(p->interp, pEval, Tcl_NewIntObj(nTotal));
+  if( Tcl_EvalObjEx(p->interp, pEval, TCL_EVAL_GLOBAL)!=TCL_OK ){
+    Tcl_BackgroundError(p->interp);
+  }
+  Tcl_DecrRefCount(pEval);
+}
+
+static void test_btrecover_del(ClientData clientData, Tcl_Interp *interp){
+  BtRecoverCb *p = (BtRecoverCb*)clientData;
+  if( p->pScript ) Tcl_DecrRefCount(p->pScript);
+  ckfree(p);
+}
+
+/*
+** Tcl command: btrecover DBCMD NTHREAD ?SCRIPT?
+**
+** Configure recovery for the bt database opened by DBCMD. This must be
+** called before the database is first read. NTHREAD is passed to 
+** BT_CONTROL_RECOVER_THREADS. If SCRIPT is specified, it is invoked with
+** the number of frames recovered and the number of frames the log has 
+** space for appended each time recovery reports progress. The result is
+** the new BT_CONTROL_RECOVER_THREADS value.
+*/
+static int test_btrecover(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  sqlite4 *db = 0;
+  int nThread = 0;
+  int rc;
+
+  if( objc!=3 && objc!=4 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "DBCMD NTHREAD ?SCRIPT?");
+    return TCL_ERROR;
+  }
+  if( sqlite4TestDbHandle(interp, objv[1], &db)
+   || Tcl_GetIntFromObj(interp, objv[2], &nThread)
+  ){
+    return TCL_ERROR;
+  }
+
+  rc = sqlite4_kvstore_control(
+      db, "main", BT_CONTROL_RECOVER_THREADS, (void*)&nThread
+  );
+  if( rc==SQLITE4_NOTFOUND ){
+    Tcl_AppendResult(interp, "not a bt database", 0);
+    return TCL_ERROR;
+  }
+
+  if( objc==4 ){
+    BtRecoverCb *p;
+    bt_recovercb cb;
+
+    p = (BtRecoverCb*)Tcl_GetAssocData(interp, "btrecover", 0);
+    if( p==0 ){
+      p = (BtRecoverCb*)ckalloc(sizeof(BtRecoverCb));
+      memset(p, 0, sizeof(BtRecoverCb));
+      p->interp = interp;
+      Tcl_SetAssocData(interp, "btrecover", test_btrecover_del, (void*)p);
+    }
+    if( p->pScript ) Tcl_DecrRefCount(p->pScript);
+    p->pScript = objv[3];
+    Tcl_IncrRefCount(p->pScript);
+
+    cb.pCtx = (void*)p;
+    cb.xRecover = test_btrecover_cb;
+    sqlite4_kvstore_control(db, "main", BT_CONTROL_RECOVERCB, (void*)&cb);
+  }
+
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(nThread));
+  return TCL_OK;
+}
+
+/*
+** An instance of the following object is created by each invocation of
+** the [btfast] command.
+*/
+typedef struct BtFast BtFast;
+struct BtFast {
+  bt_db *db;                      /* Database handle */
+  bt_cursor *pCsr;                /* Cursor opened by [$db csr open] */
+};
+
+/*
+** Options that may be passed to [btfast] or [$db config], and the 
+** BT_CONTROL_XXX operation used to set each.
+*/
+static const struct BtFastOption {
+  const char *zOpt;
+  int op;
+} aBtFastOption[] = {
+  { "blksz",         BT_CONTROL_BLKSZ },
+  { "pagesz",        BT_CONTROL_PAGESZ },
+  { "autockpt",      BT_CONTROL_AUTOCKPT },
+  { "merge_thread",  BT_CONTROL_MERGE_THREAD },
+  { "merge_backlog", BT_CONTROL_MERGE_BACKLOG },
+  { 0, 0 }
+};
+
+/*
+** Set or query option pOpt of database db. If pVal is not NULL, it is 
+** the new value. The Tcl result is set to the value of the option 
+** before returning.
+*/
+static int test_btfast_config(
+  Tcl_Interp *interp, 
+  bt_db *db, 
+  Tcl_Obj *pOpt, 
+  Tcl_Obj *pVal
+){
+  int iOpt;
+  int iVal = -1;
+  int rc;
+
+  rc = Tcl_GetIndexFromObjStruct(interp, pOpt, 
+      aBtFastOption, sizeof(aBtFastOption[0]), "option", 0, &iOpt
+  );
+  if( rc!=TCL_OK ) return rc;
+  if( pVal && Tcl_GetIntFromObj(interp, pVal, &iVal) ) return TCL_ERROR;
+
+  rc = sqlite4BtControl(db, aBtFastOption[iOpt].op, (void*)&iVal);
+  if( rc!=SQLITE4_OK ){
+    sqlite4TestSetResult(interp, rc);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp, Tcl_NewIntObj(iVal));
+  return TCL_OK;
+}
+
+/*
+** Open a fast-insert cursor on database db.
+*/
+static int btFastCsrOpen(bt_db *db, bt_cursor **ppCsr){
+  sqlite4BtControl(db, BT_CONTROL_FAST_INSERT_OP, 0);
+  return sqlite4BtCsrOpen(db, 0, ppCsr);
+}
+
+/*
+** Append the key and value that cursor pCsr points to to list pList.
+*/
+static int btFastAppendEntry(bt_cursor *pCsr, Tcl_Obj *pList){
+  const void *pK; int nK;
+  const void *pV; int nV;
+  int rc;
+
+  rc = sqlite4BtCsrKey(pCsr, &pK, &nK);
+  if( rc==SQLITE4_OK ){
+    Tcl_ListObjAppendElement(0, pList, Tcl_NewByteArrayObj(pK, nK));
+    rc = sqlite4BtCsrData(pCsr, 0, -1, &pV, &nV);
+  }
+  if( rc==SQLITE4_OK ){
+    Tcl_ListObjAppendElement(0, pList, Tcl_NewByteArrayObj(pV, nV));
+  }
+  return rc;
+}
+
+/*
+** Destructor for object created by tcl [btfast] command.
+*/
+static void test_btfast_del(void *ctx){
+  BtFast *p = (BtFast*)ctx;
+  sqlite4BtCsrClose(p->pCsr);
+  sqlite4BtClose(p->db);
+  ckfree(p);
+}
+
+/*
+** Tcl command: BTFAST method ...
+**
+** All keys are written to and read from the database using fast-insert
+** operations. Read methods other than [csr] open and close a read 
+** transaction around the operation if no transaction is open.
+*/
+static int test_btfast_cmd(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  BtFast *p = (BtFast*)clientData;
+  bt_db *db = p->db;
+
+  enum BtfastCmdSymbol {
+    BFC_BEGIN,
+    BFC_COMMIT,
+    BFC_ROLLBACK,
+    BFC_REPLACE,
+    BFC_DELETE,
+    BFC_FETCH,
+    BFC_SCAN,
+    BFC_RSCAN,
+    BFC_CSR,
+    BFC_CONFIG,
+    BFC_HDR,
+    BFC_SUMMARY,
+    BFC_CHECKPOINT,
+    BFC_CLOSE,
+  };
+  struct BtfastCmd {
+    const char *zOpt;
+    int eOpt;
+    int nMin;
+    int nMax;
+    const char *zErr;
+  } aCmd[] = {
+    { "begin",      BFC_BEGIN,      3, 3, "LEVEL" },
+    { "commit",     BFC_COMMIT,     3, 3, "LEVEL" },
+    { "rollback",   BFC_ROLLBACK,   3, 3, "LEVEL" },
+    { "replace",    BFC_REPLACE,    4, 4, "KEY VALUE" },
+    { "delete",     BFC_DELETE,     3, 3, "KEY" },
+    { "fetch",      BFC_FETCH,      3, 3, "KEY" },
+    { "scan",       BFC_SCAN,       2, 3, "?KEY?" },
+    { "rscan",      BFC_RSCAN,      2, 3, "?KEY?" },
+    { "csr",        BFC_CSR,        3, 5, "METHOD ?ARGS?" },
+    { "config",     BFC_CONFIG,     3, 4, "OPTION ?VALUE?" },
+    { "hdr",        BFC_HDR,        2, 2, "" },
+    { "summary",    BFC_SUMMARY,    2, 2, "" },
+    { "checkpoint", BFC_CHECKPOINT, 2, 2, "" },
+    { "close",      BFC_CLOSE,      2, 2, "" },
+    { 0, 0 }
+  };
+  int rc = SQLITE4_OK;
+  int bRead = 0;                  /* True if read transaction opened */
+  int iOpt;
+
+  if( objc<2 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "sub-command ...");
+    return TCL_ERROR;
+  }
+  if( Tcl_GetIndexFromObjStruct(
+      interp, objv[1], aCmd, sizeof(aCmd[0]), "sub-command", 0, &iOpt
+  ) ){
+    return TCL_ERROR;
+  }
+  if( objc<aCmd[iOpt].nMin || objc>aCmd[iOpt].nMax ){
+    Tcl_WrongNumArgs(interp, 2, objv, aCmd[iOpt].zErr);
+    return TCL_ERROR;
+  }
+
+  switch( aCmd[iOpt].eOpt ){
+    case BFC_FETCH:
+    case BFC_SCAN:
+    case BFC_RSCAN:
+      if( sqlite4BtTransactionLevel(db)==0 ){
+        rc = sqlite4BtBegin(db, 1);
+        bRead = (rc==SQLITE4_OK);
+      }
+      break;
+  }
+  if( rc!=SQLITE4_OK ) goto btfast_out;
+
+  switch( aCmd[iOpt].eOpt ){
+    case BFC_BEGIN:
+    case BFC_COMMIT:
+    case BFC_ROLLBACK: {
+      int iLevel;
+      if( Tcl_GetIntFromObj(interp, objv[2], &iLevel) ) return TCL_ERROR;
+      if( aCmd[iOpt].eOpt==BFC_BEGIN ){
+        rc = sqlite4BtBegin(db, iLevel);
+      }else if( aCmd[iOpt].eOpt==BFC_COMMIT ){
+        rc = sqlite4BtCommit(db, iLevel);
+      }else{
+        rc = sqlite4BtRollback(db, iLevel);
+      }
+      break;
+    }
+
+    case BFC_REPLACE:
+    case BFC_DELETE: {
+      int nK; 
+      const u8 *pK = Tcl_GetByteArrayFromObj(objv[2], &nK);
+      int nV = -1;
+      const u8 *pV = 0;
+      if( aCmd[iOpt].eOpt==BFC_REPLACE ){
+        pV = Tcl_GetByteArrayFromObj(objv[3], &nV);
+      }
+      sqlite4BtControl(db, BT_CONTROL_FAST_INSERT_OP, 0);
+      rc = sqlite4BtReplace(db, pK, nK, pV, nV);
+      break;
+    }
+
+    case BFC_FETCH: {
+      bt_cursor *pCsr = 0;
+      int nK; 
+      const u8 *pK = Tcl_GetByteArrayFromObj(objv[2], &nK);
+      rc = btFastCsrOpen(db, &pCsr);
+      if( rc==SQLITE4_OK ){
+        rc = sqlite4BtCsrSeek(pCsr, pK, nK, BT_SEEK_EQ);
+      }
+      if( rc==SQLITE4_OK ){
+        const void *pV; int nV;
+        rc = sqlite4BtCsrData(pCsr, 0, -1, &pV, &nV);
+        if( rc==SQLITE4_OK ){
+          Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(pV, nV));
+        }
+      }
+      if( rc==SQLITE4_NOTFOUND ) rc = SQLITE4_OK;
+      sqlite4BtCsrClose(pCsr);
+      break;
+    }
+
+    case BFC_SCAN:
+    case BFC_RSCAN: {
+      int bRev = (aCmd[iOpt].eOpt==BFC_RSCAN);
+      bt_cursor *pCsr = 0;
+      Tcl_Obj *pRet = Tcl_NewObj();
+
+      Tcl_IncrRefCount(pRet);
+      rc = btFastCsrOpen(db, &pCsr);
+      if( rc==SQLITE4_OK ){
+        if( objc==3 ){
+          int nK; 
+          const u8 *pK = Tcl_GetByteArrayFromObj(objv[2], &nK);
+          rc = sqlite4BtCsrSeek(pCsr, pK, nK, bRev ? BT_SEEK_LE : BT_SEEK_GE);
+          if( rc==SQLITE4_INEXACT ) rc = SQLITE4_OK;
+        }else if( bRev ){
+          rc = sqlite4BtCsrLast(pCsr);
+        }else{
+          rc = sqlite4BtCsrFirst(pCsr);
+        }
+      }
+      while( rc==SQLITE4_OK ){
+        rc = btFastAppendEntry(pCsr, pRet);
+        if( rc==SQLITE4_OK ){
+          rc = (bRev ? sqlite4BtCsrPrev(pCsr) : sqlite4BtCsrNext(pCsr));
+        }
+      }
+      if( rc==SQLITE4_NOTFOUND ){
+        rc = SQLITE4_OK;
+        Tcl_SetObjResult(interp, pRet);
+      }
+      Tcl_DecrRefCount(pRet);
+      sqlite4BtCsrClose(pCsr);
+      break;
+    }
+
+    case BFC_CSR: {
+      const char *aMethod[] = {
+        "open", "close", "first", "last", "next", "prev", "seek", "entry",
+        "delete", 0
+      };
+      const char *aSeek[] = { "le", "eq", "ge", 0 };
+      int iMethod;
+      if( Tcl_GetIndexFromObj(interp, objv[2], aMethod, "method", 0, &iMethod) ){
+        return TCL_ERROR;
+      }
+      if( (iMethod==6)!=(objc==5) ){
+        Tcl_WrongNumArgs(interp, 3, objv, iMethod==6 ? "KEY le|eq|ge" : "");
+        return TCL_ERROR;
+      }
+      if( iMethod!=0 && p->pCsr==0 ){
+        Tcl_AppendResult(interp, "no open cursor", 0);
+        return TCL_ERROR;
+      }
+
+      switch( iMethod ){
+        case 0:                   /* open */
+          sqlite4BtCsrClose(p->pCsr);
+          p->pCsr = 0;
+          rc = btFastCsrOpen(db, &p->pCsr);
+          break;
+        case 1:                   /* close */
+          sqlite4BtCsrClose(p->pCsr);
+          p->pCsr = 0;
+          break;
+        case 2: rc = sqlite4BtCsrFirst(p->pCsr); break;
+        case 3: rc = sqlite4BtCsrLast(p->pCsr); break;
+        case 4: rc = sqlite4BtCsrNext(p->pCsr); break;
+        case 5: rc = sqlite4BtCsrPrev(p->pCsr); break;
+        case 6: {                 /* seek */
+          int nK; 
+          const u8 *pK = Tcl_GetByteArrayFromObj(objv[3], &nK);
+          int iSeek;
+          if( Tcl_GetIndexFromObj(interp, objv[4], aSeek, "mode", 0, &iSeek) ){
+            return TCL_ERROR;
+          }
+          rc = sqlite4BtCsrSeek(p->pCsr, pK, nK, iSeek-1);
+          break;
+        }
+        case 7: {                 /* entry */
+          Tcl_Obj *pRet = Tcl_NewObj();
+          Tcl_IncrRefCount(pRet);
+          rc = btFastAppendEntry(p->pCsr, pRet);
+          if( rc==SQLITE4_OK ) Tcl_SetObjResult(interp, pRet);
+          Tcl_DecrRefCount(pRet);
+          break;
+        }
+        case 8:                   /* delete */
+          rc = sqlite4BtDelete(p->pCsr);
+          break;
+      }
+
+      /* The result of a seek or step is the name of the return code, 
+      ** which may be SQLITE4_NOTFOUND or SQLITE4_INEXACT. */
+      if( iMethod>=2 && iMethod<=6 ){
+        if( rc==SQLITE4_OK || rc==SQLITE4_NOTFOUND || rc==SQLITE4_INEXACT ){
+          sqlite4TestSetResult(interp, rc);
+          rc = SQLITE4_OK;
+        }
+      }
+      break;
+    }
+
+    case BFC_CONFIG: {
+      return test_btfast_config(interp, db, objv[2], objc==4 ? objv[3] : 0);
+    }
+
+    case BFC_HDR:
+    case BFC_SUMMARY: {
+      bt_info info;
+      memset(&info, 0, sizeof(info));
+      info.eType = (aCmd[iOpt].eOpt==BFC_HDR ? BT_INFO_HDRDUMP:BT_INFO_SUMMARY);
+      sqlite4_buffer_init(&info.output, 0);
+      rc = sqlite4BtControl(db, BT_CONTROL_INFO, (void*)&info);
+      if( rc==SQLITE4_OK ){
+        Tcl_SetObjResult(interp, 
+            Tcl_NewStringObj((char*)info.output.p, info.output.n)
+        );
+      }
+      sqlite4_buffer_clear(&info.output);
+      break;
+    }
+
+    case BFC_CHECKPOINT: {
+      bt_checkpoint ckpt;
+      memset(&ckpt, 0, sizeof(ckpt));
+      rc = sqlite4BtControl(db, BT_CONTROL_CHECKPOINT, (void*)&ckpt);
+      if( rc==SQLITE4_OK ){
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(ckpt.nCkpt));
+      }
+      break;
+    }
+
+    case BFC_CLOSE: {
+      Tcl_DeleteCommand(interp, Tcl_GetString(objv[0]));
+      break;
+    }
+
+    default:
+      assert( 0 );
+      break;
+  }
+
+ btfast_out:
+  if( bRead ){
+    int rc2 = sqlite4BtCommit(db, 0);
+    if( rc==SQLITE4_OK ) rc = rc2;
+  }
+  if( rc!=SQLITE4_OK ){
+    sqlite4TestSetResult(interp, rc);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+/*
+** Tcl command: btfast NAME FILENAME ?CONFIG?
+**
+** Open a bt database and create a Tcl command named NAME that reads and
+** writes it using fast-insert operations. CONFIG is a list of option and
+** value pairs (see aBtFastOption[]) applied before the database is opened.
+*/
+static int test_btfast(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  BtFast *p;
+  const char *zName;
+  Tcl_Obj **apCfg = 0;
+  int nCfg = 0;
+  int rc;
+  int i;
+
+  if( objc!=3 && objc!=4 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "NAME FILENAME ?CONFIG?");
+    return TCL_ERROR;
+  }
+  if( objc==4 && Tcl_ListObjGetElements(interp, objv[3], &nCfg, &apCfg) ){
+    return TCL_ERROR;
+  }
+  if( nCfg%2 ){
+    Tcl_AppendResult(interp, "CONFIG must be a list of option/value pairs", 0);
+    return TCL_ERROR;
+  }
+  zName = Tcl_GetString(objv[1]);
+
+  p = ckalloc(sizeof(BtFast));
+  memset(p, 0, sizeof(BtFast));
+  rc = sqlite4BtNew(sqlite4_env_default(), 0, &p->db);
+  for(i=0; rc==SQLITE4_OK && i<nCfg; i+=2){
+    if( test_btfast_config(interp, p->db, apCfg[i], apCfg[i+1]) ){
+      test_btfast_del((void*)p);
+      return TCL_ERROR;
+    }
+  }
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4BtOpen(p->db, Tcl_GetString(objv[2]));
+  }
+  if( rc!=SQLITE4_OK ){
+    test_btfast_del((void*)p);
+    sqlite4TestSetResult(interp, rc);
+    return TCL_ERROR;
+  }
+
+  Tcl_CreateObjCommand(interp, zName, test_btfast_cmd, (void*)p, test_btfast_del);
+  Tcl_SetObjResult(interp, Tcl_NewStringObj(zName, -1));
+  return TCL_OK;
+}
+
+/*
+** Tcl command: btcrc32c IMPL DATA ?CRC?
+**
+** Return the CRC32C of byte-array DATA, as 8 hexadecimal digits, computed
+** by extending CRC (default 0). IMPL must be "sw" to use the portable
+** implementation, or "hw" to use the hardware implementation. If there is
+** no hardware implementation available, an empty string is returned.
+*/
+static int test_btcrc32c(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  const char *azImpl[] = { "sw", "hw", 0 };
+  int iImpl = 0;
+  Tcl_WideInt iCrc = 0;
+  unsigned int iRes;
+  unsigned char *aData;
+  int nData;
+  int rc;
+
+  if( objc!=3 && objc!=4 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "IMPL DATA ?CRC?");
+    return TCL_ERROR;
+  }
+  if( Tcl_GetIndexFromObj(interp, objv[1], azImpl, "impl", 0, &iImpl)
+   || (objc==4 && Tcl_GetWideIntFromObj(interp, objv[3], &iCrc))
+  ){
+    return TCL_ERROR;
+  }
+  aData = Tcl_GetByteArrayFromObj(objv[2], &nData);
+
+  iRes = (unsigned int)iCrc;
+  rc = sqlite4BtCrc32cTest(iImpl, aData, nData, &iRes);
+  if( rc==SQLITE4_OK ){
+    char zRes[16];
+    sqlite4_snprintf(zRes, sizeof(zRes), "%08X", iRes);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(zRes, -1));
+  }
+  return TCL_OK;
+}
+
 int SqlitetestBt_Init(Tcl_Interp *interp){
   struct SyscallCmd {
     const char *zName;
     Tcl_ObjCmdProc *xCmd;
   } aCmd[] = {
     { "btenv",                  test_btenv },
+    { "btrecover",              test_btrecover },
+    { "btfast",                 test_btfast },
+    { "btcrc32c",               test_btcrc32c },
   };
   int i;
 
@@ -13,10 +13,14 @@
 ** Code for testing the storage subsystem using the Storage interface.
 */
 #include "sqliteInt.h"
+#include "vdbeInt.h"
 
 /* Defined in test1.c */
 extern void *sqlite4TestTextToPtr(const char*);
 
+/* Defined in test_main.c */
+extern int sqlite4TestDbHandle(Tcl_Interp *, Tcl_Obj *, sqlite4 **);
+
 /* Defined in test_hexio.c */
 extern void sqlite4TestBinToHex(unsigned char*,int);
 extern int sqlite4TestHexToBin(const unsigned char *in,int,unsigned char *out);
@@ -458,6 +462,89 @@ static int test_storage_data(
 }
 
 
+/*
+** TCLCMD:    storage_decode DB CURSOR IFIRST ILAST
+**
+** Decode columns IFIRST through ILAST of the record that CURSOR points to
+** using sqlite4VdbeDecoderGetColumns(). Return a list containing a 
+** {TYPE VALUE} pair for each column, where TYPE is one of "null",
+** "integer", "real", "text" or "blob" and VALUE is the text of the value
+** (or hex encoding, for a blob). If an error occurs, the result is the
+** name of the error code.
+*/
+static int test_storage_decode(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  static const char *azType[] = { 0, "integer", "real", "text", "blob", "null" };
+  sqlite4 *db = 0;
+  KVCursor *pCsr = 0;
+  RowDecoder *pCodec = 0;
+  Mem *aOut = 0;
+  int iFirst, iLast;
+  int nCol;
+  int i;
+  int rc;
+
+  if( objc!=5 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "DB CURSOR IFIRST ILAST");
+    return TCL_ERROR;
+  }
+  if( sqlite4TestDbHandle(interp, objv[1], &db)
+   || Tcl_GetIntFromObj(interp, objv[3], &iFirst)
+   || Tcl_GetIntFromObj(interp, objv[4], &iLast)
+  ){
+    return TCL_ERROR;
+  }
+  pCsr = sqlite4TestTextToPtr(Tcl_GetString(objv[2]));
+  nCol = iLast - iFirst + 1;
+
+  aOut = (Mem*)ckalloc(sizeof(Mem) * nCol);
+  memset(aOut, 0, sizeof(Mem) * nCol);
+  for(i=0; i<nCol; i++){
+    aOut[i].db = db;
+    aOut[i].flags = MEM_Null;
+  }
+
+  rc = sqlite4VdbeDecoderCreate(db, 0, pCsr, iLast, &pCodec);
+  if( rc==SQLITE4_OK ){
+    rc = sqlite4VdbeDecoderGetColumns(pCodec, iFirst, iLast, aOut);
+  }
+  sqlite4VdbeDecoderDestroy(pCodec);
+
+  if( rc==SQLITE4_OK ){
+    Tcl_Obj *pRet = Tcl_NewObj();
+    for(i=0; i<nCol; i++){
+      Tcl_Obj *pVal = Tcl_NewObj();
+      int eType = sqlite4_value_type(&aOut[i]);
+      Tcl_ListObjAppendElement(interp, pVal, Tcl_NewStringObj(azType[eType], -1));
+      if( eType==SQLITE4_BLOB ){
+        int nBlob;
+        const u8 *aBlob = (const u8*)sqlite4_value_blob(&aOut[i], &nBlob);
+        char *zHex = ckalloc(nBlob*2 + 1);
+        memcpy(zHex, aBlob, nBlob);
+        sqlite4TestBinToHex((unsigned char*)zHex, nBlob);
+        Tcl_ListObjAppendElement(interp, pVal, Tcl_NewStringObj(zHex, -1));
+        ckfree(zHex);
+      }else if( eType!=SQLITE4_NULL ){
+        const char *z = sqlite4_value_text(&aOut[i], 0);
+        Tcl_ListObjAppendElement(interp, pVal, Tcl_NewStringObj(z, -1));
+      }else{
+        Tcl_ListObjAppendElement(interp, pVal, Tcl_NewObj());
+      }
+      Tcl_ListObjAppendElement(interp, pRet, pVal);
+    }
+    Tcl_SetObjResult(interp, pRet);
+  }else{
+    storageSetTclErrorName(interp, rc);
+  }
+
+  for(i=0; i<nCol; i++) sqlite4VdbeMemRelease(&aOut[i]);
+  ckfree((char*)aOut);
+  return (rc==SQLITE4_OK ? TCL_OK : TCL_ERROR);
+}
 
 /*
 ** Register the TCL commands defined above with the TCL interpreter.
@@ -485,6 +572,7 @@ int Sqliteteststorage_Init(Tcl_Interp *interp){
     { "storage_reset",        test_storage_reset           },
     { "storage_key",          test_storage_key             },
     { "storage_data",         test_storage_data            },
+    { "storage_decode",       test_storage_decode          },
   };
   int i;
 
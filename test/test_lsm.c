@@ -261,6 +261,11 @@ static int testConfigureLsm(
     { "set_compression",         LSM_CONFIG_SET_COMPRESSION,         0 },
     { "set_compression_factory", LSM_CONFIG_SET_COMPRESSION_FACTORY, 0 },
     { "readonly",                LSM_CONFIG_READONLY,                1 },
+    { "worker_thread",           LSM_CONFIG_WORKER_THREAD,           1 },
+    { "page_cache",              LSM_CONFIG_PAGE_CACHE,              1 },
+    { "merge_policy",            LSM_CONFIG_MERGE_POLICY,            1 },
+    { "merge_window",            LSM_CONFIG_MERGE_WINDOW,            1 },
+    { "commit_delay",            LSM_CONFIG_COMMIT_DELAY,            1 },
     { 0, 0, 0 }
   };
   int i;
@@ -506,6 +511,8 @@ typedef struct TclLsm TclLsm;
 
 struct TclLsm {
   lsm_db *db;
+  Tcl_Obj *pLog;                  /* List of messages passed to xLog() */
+  Tcl_ThreadId iThread;           /* Thread that opened the connection */
 };
 
 struct TclLsmCursor {
@@ -536,6 +543,7 @@ static void test_lsm_del(void *ctx){
   TclLsm *p = (TclLsm *)ctx;
   if( p ){
     lsm_close(p->db);
+    Tcl_DecrRefCount(p->pLog);
     ckfree((char *)p);
   }
 }
@@ -546,6 +554,13 @@ static int testInfoLsm(Tcl_Interp *interp, lsm_db *db, Tcl_Obj *pObj){
     int eOpt;
   } aInfo[] = {
     { "compression_id",          LSM_INFO_COMPRESSION_ID },
+    { "nread",                   LSM_INFO_NREAD },
+    { "nwrite",                  LSM_INFO_NWRITE },
+    { "page_cache_hit",          LSM_INFO_PAGE_CACHE_HIT },
+    { "page_cache_miss",         LSM_INFO_PAGE_CACHE_MISS },
+    { "write_amp",               LSM_INFO_WRITE_AMP },
+    { "space_amp",               LSM_INFO_SPACE_AMP },
+    { "tree_size",               LSM_INFO_TREE_SIZE },
     { 0, 0 }
   };
   int rc;
@@ -566,6 +581,35 @@ static int testInfoLsm(Tcl_Interp *interp, lsm_db *db, Tcl_Obj *pObj){
         }
         break;
       }
+      case LSM_INFO_TREE_SIZE: {
+        int nOld = 0;
+        int nNew = 0;
+        rc = lsm_info(db, LSM_INFO_TREE_SIZE, &nOld, &nNew);
+        if( rc==LSM_OK ){
+          Tcl_Obj *pRet = Tcl_NewObj();
+          Tcl_ListObjAppendElement(interp, pRet, Tcl_NewIntObj(nOld));
+          Tcl_ListObjAppendElement(interp, pRet, Tcl_NewIntObj(nNew));
+          Tcl_SetObjResult(interp, pRet);
+        }else{
+          test_lsm_error(interp, "lsm_info", rc);
+        }
+        break;
+      }
+      case LSM_INFO_NREAD:
+      case LSM_INFO_NWRITE:
+      case LSM_INFO_PAGE_CACHE_HIT:
+      case LSM_INFO_PAGE_CACHE_MISS:
+      case LSM_INFO_WRITE_AMP:
+      case LSM_INFO_SPACE_AMP: {
+        int nRead = 0;
+        rc = lsm_info(db, aInfo[iOpt].eOpt, &nRead);
+        if( rc==LSM_OK ){
+          Tcl_SetObjResult(interp, Tcl_NewIntObj(nRead));
+        }else{
+          test_lsm_error(interp, "lsm_info", rc);
+        }
+        break;
+      }
     }
   }
 
@@ -691,6 +735,33 @@ static int test_lsm_cursor_cmd(
   return TCL_ERROR;
 }
 
+/*
+** Context object for testBulkLoadNext(), the xNext callback used by the
+** [DB bulk_load] sub-command to read key-value pairs from a Tcl list.
+*/
+typedef struct TestBulkLoad TestBulkLoad;
+struct TestBulkLoad {
+  Tcl_Obj **apObj;                /* List elements (keys and values) */
+  int nObj;                       /* Size of apObj[] */
+  int iObj;                       /* Index of next key in apObj[] */
+};
+
+static int testBulkLoadNext(
+  void *pCtx, 
+  const void **ppKey, int *pnKey, 
+  const void **ppVal, int *pnVal
+){
+  TestBulkLoad *p = (TestBulkLoad *)pCtx;
+  if( p->iObj+1<p->nObj ){
+    *ppKey = Tcl_GetStringFromObj(p->apObj[p->iObj], pnKey);
+    *ppVal = Tcl_GetStringFromObj(p->apObj[p->iObj+1], pnVal);
+    p->iObj += 2;
+  }else{
+    *ppKey = 0;
+  }
+  return LSM_OK;
+}
+
 /*
 ** Usage: DB sub-command ...
 */
@@ -718,6 +789,8 @@ static int test_lsm_cmd(
     /* 10 */ {"config",       1, "LIST"},
     /* 11 */ {"checkpoint",   0, ""},
     /* 12 */ {"info",         1, "OPTION"},
+    /* 13 */ {"bulk_load",    1, "LIST"},
+    /* 14 */ {"log",          0, ""},
     {0, 0, 0}
   };
   int iCmd;
@@ -862,6 +935,25 @@ static int test_lsm_cmd(
       return testInfoLsm(interp, p->db, objv[2]);
     }
 
+    case 13: assert( 0==strcmp(aCmd[13].zCmd, "bulk_load") ); {
+      TestBulkLoad ctx;
+      memset(&ctx, 0, sizeof(TestBulkLoad));
+      rc = Tcl_ListObjGetElements(interp, objv[2], &ctx.nObj, &ctx.apObj);
+      if( rc!=TCL_OK ) return rc;
+      rc = lsm_bulk_load(p->db, testBulkLoadNext, (void *)&ctx);
+      return test_lsm_error(interp, "lsm_bulk_load", rc);
+    }
+
+    /* Return the list of messages logged since the connection was opened
+    ** or since the previous [DB log] command, then clear it.  */
+    case 14: assert( 0==strcmp(aCmd[14].zCmd, "log") ); {
+      Tcl_SetObjResult(interp, p->pLog);
+      Tcl_DecrRefCount(p->pLog);
+      p->pLog = Tcl_NewObj();
+      Tcl_IncrRefCount(p->pLog);
+      return TCL_OK;
+    }
+
     default:
       assert( 0 );
   }
@@ -871,8 +963,14 @@ static int test_lsm_cmd(
 }
 
 static void xLog(void *pCtx, int rc, const char *z){
+  TclLsm *p = (TclLsm *)pCtx;
   (void)(rc);
-  (void)(pCtx);
+
+  /* Messages logged by a background worker thread are not collected, as
+  ** Tcl objects may only be used by the thread that created them.  */
+  if( p->iThread==Tcl_GetCurrentThread() ){
+    Tcl_ListObjAppendElement(0, p->pLog, Tcl_NewStringObj(z, -1));
+  }
   fprintf(stderr, "%s\n", z);
   fflush(stderr);
 }
@@ -900,6 +998,9 @@ static int test_lsm_open(
   zFile = Tcl_GetString(objv[2]);
 
   p = (TclLsm *)ckalloc(sizeof(TclLsm));
+  p->pLog = Tcl_NewObj();
+  Tcl_IncrRefCount(p->pLog);
+  p->iThread = Tcl_GetCurrentThread();
   rc = lsm_new(0, &p->db);
   if( rc!=LSM_OK ){
     test_lsm_del((void *)p);
@@ -920,7 +1021,7 @@ static int test_lsm_open(
     }
   }
 
-  lsm_config_log(p->db, xLog, 0);
+  lsm_config_log(p->db, xLog, (void *)p);
 
   rc = lsm_open(p->db, zFile);
   if( rc!=LSM_OK ){
@@ -1973,6 +1973,121 @@ static int test_stmt_status(
   return TCL_OK;
 }
 
+/*
+** Usage:  sqlite4_db_status  DB  PARAMETER  RESETFLAG
+**
+** Return a list of three elements: the result of sqlite4_db_status()
+** and the current and highwater values of the status parameter.
+*/
+static int test_db_status(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  int rc, iValue, mxValue;
+  int i, op, resetFlag;
+  const char *zOpName;
+  sqlite4 *db;
+  Tcl_Obj *pResult;
+
+  static const struct {
+    const char *zName;
+    int op;
+  } aOp[] = {
+    { "SQLITE4_DBSTATUS_LOOKASIDE_USED",    SQLITE4_DBSTATUS_LOOKASIDE_USED    },
+    { "SQLITE4_DBSTATUS_CACHE_USED",        SQLITE4_DBSTATUS_CACHE_USED        },
+    { "SQLITE4_DBSTATUS_SCHEMA_USED",       SQLITE4_DBSTATUS_SCHEMA_USED       },
+    { "SQLITE4_DBSTATUS_STMT_USED",         SQLITE4_DBSTATUS_STMT_USED         },
+    { "SQLITE4_DBSTATUS_LOOKASIDE_HIT",     SQLITE4_DBSTATUS_LOOKASIDE_HIT     },
+    { "SQLITE4_DBSTATUS_LOOKASIDE_MISS_SIZE",
+                                       SQLITE4_DBSTATUS_LOOKASIDE_MISS_SIZE    },
+    { "SQLITE4_DBSTATUS_LOOKASIDE_MISS_FULL",
+                                       SQLITE4_DBSTATUS_LOOKASIDE_MISS_FULL    },
+    { "SQLITE4_DBSTATUS_CACHE_HIT",         SQLITE4_DBSTATUS_CACHE_HIT         },
+    { "SQLITE4_DBSTATUS_CACHE_MISS",        SQLITE4_DBSTATUS_CACHE_MISS        },
+    { "SQLITE4_DBSTATUS_ARENA_USED",        SQLITE4_DBSTATUS_ARENA_USED        },
+    { "SQLITE4_DBSTATUS_ARENA_MISS",        SQLITE4_DBSTATUS_ARENA_MISS        },
+    { "SQLITE4_DBSTATUS_STMTCACHE_HIT",     SQLITE4_DBSTATUS_STMTCACHE_HIT     },
+    { "SQLITE4_DBSTATUS_STMTCACHE_MISS",    SQLITE4_DBSTATUS_STMTCACHE_MISS    },
+  };
+  if( objc!=4 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "DB PARAMETER RESETFLAG");
+    return TCL_ERROR;
+  }
+  if( getDbPointer(interp, Tcl_GetString(objv[1]), &db) ) return TCL_ERROR;
+  zOpName = Tcl_GetString(objv[2]);
+  for(i=0; i<ArraySize(aOp); i++){
+    if( strcmp(aOp[i].zName, zOpName)==0 ){
+      op = aOp[i].op;
+      break;
+    }
+  }
+  if( i>=ArraySize(aOp) ){
+    if( Tcl_GetIntFromObj(interp, objv[2], &op) ) return TCL_ERROR;
+  }
+  if( Tcl_GetBooleanFromObj(interp, objv[3], &resetFlag) ) return TCL_ERROR;
+  iValue = 0;
+  mxValue = 0;
+  rc = sqlite4_db_status(db, op, &iValue, &mxValue, resetFlag);
+  pResult = Tcl_NewObj();
+  Tcl_ListObjAppendElement(0, pResult, Tcl_NewIntObj(rc));
+  Tcl_ListObjAppendElement(0, pResult, Tcl_NewIntObj(iValue));
+  Tcl_ListObjAppendElement(0, pResult, Tcl_NewIntObj(mxValue));
+  Tcl_SetObjResult(interp, pResult);
+  return TCL_OK;
+}
+
+/*
+** Usage:  sqlite4_db_config_parse_arena  DB  NBYTE
+**
+** Set the size of the parse arena of database connection DB to NBYTE
+** bytes using sqlite4_db_config(SQLITE4_DBCONFIG_PARSE_ARENA).
+*/
+static int test_db_config_parse_arena(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  int rc;
+  int nByte;
+  sqlite4 *db;
+  if( objc!=3 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "DB NBYTE");
+    return TCL_ERROR;
+  }
+  if( getDbPointer(interp, Tcl_GetString(objv[1]), &db) ) return TCL_ERROR;
+  if( Tcl_GetIntFromObj(interp, objv[2], &nByte) ) return TCL_ERROR;
+  rc = sqlite4_db_config(db, SQLITE4_DBCONFIG_PARSE_ARENA, nByte);
+  return sqlite4TestSetResult(interp, rc);
+}
+
+/*
+** Usage:  sqlite4_db_config_stmt_cache  DB  NSTMT
+**
+** Set the size of the statement cache of database connection DB to NSTMT
+** statements using sqlite4_db_config(SQLITE4_DBCONFIG_STMT_CACHE).
+*/
+static int test_db_config_stmt_cache(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  int rc;
+  int nStmt;
+  sqlite4 *db;
+  if( objc!=3 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "DB NSTMT");
+    return TCL_ERROR;
+  }
+  if( getDbPointer(interp, Tcl_GetString(objv[1]), &db) ) return TCL_ERROR;
+  if( Tcl_GetIntFromObj(interp, objv[2], &nStmt) ) return TCL_ERROR;
+  rc = sqlite4_db_config(db, SQLITE4_DBCONFIG_STMT_CACHE, nStmt);
+  return sqlite4TestSetResult(interp, rc);
+}
+
 /*
 ** Usage:  sqlite4_next_stmt  DB  STMT
 **
@@ -4234,6 +4349,9 @@ int Sqlitetest1_Init(Tcl_Interp *interp){
      { "sqlite4_prepare_tkt3134",       test_prepare_tkt3134, 0},
      { "sqlite4_finalize",              test_finalize      ,0 },
      { "sqlite4_stmt_status",           test_stmt_status   ,0 },
+     { "sqlite4_db_status",             test_db_status     ,0 },
+     { "sqlite4_db_config_parse_arena", test_db_config_parse_arena ,0 },
+     { "sqlite4_db_config_stmt_cache",  test_db_config_stmt_cache  ,0 },
      { "sqlite4_reset",                 test_reset         ,0 },
      { "sqlite4_changes",               test_changes       ,0 },
      { "sqlite4_step",                  test_step          ,0 },
@@ -18,6 +18,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#if SQLITE4_THREADSAFE && SQLITE4_OS_UNIX
+# include <pthread.h>
+#endif
 
 #include "testInt.h"
 
@@ -1330,6 +1333,194 @@ static int test_mm_faultreport(
 }
 
 
+/*
+** Context for one thread of the [test_mm_slab] workload.
+*/
+typedef struct SlabTest SlabTest;
+struct SlabTest {
+  sqlite4_mm *pMM;                /* Allocator to test */
+  int nOp;                        /* Number of operations to run */
+  unsigned int iRand;             /* PRNG state */
+  int nErr;                       /* Number of corrupt allocations seen */
+};
+
+static unsigned int slabTestRandom(SlabTest *p){
+  p->iRand = p->iRand*1103515245 + 12345;
+  return (p->iRand >> 8);
+}
+
+/*
+** Return the byte expected at offset i of an allocation made for slot
+** iSlot with generation iGen.
+*/
+#define SLABTEST_BYTE(iSlot, iGen, i) ((unsigned char)((iSlot)*7+(iGen)+(i)))
+
+static void slabTestFill(unsigned char *a, int n, int iSlot, int iGen){
+  int i;
+  for(i=0; i<n; i++) a[i] = SLABTEST_BYTE(iSlot, iGen, i);
+}
+static int slabTestCheck(unsigned char *a, int n, int iSlot, int iGen){
+  int i;
+  for(i=0; i<n; i++){
+    if( a[i]!=SLABTEST_BYTE(iSlot, iGen, i) ) return 1;
+  }
+  return 0;
+}
+
+/*
+** Run the workload for one thread. Allocations of random sizes, mostly
+** small, are made, resized and freed. The content of each allocation is
+** checked before it is resized or freed.
+*/
+static void *slabTestMain(void *pCtx){
+  SlabTest *p = (SlabTest*)pCtx;
+  unsigned char *apSlot[200];
+  int anSlot[200];
+  int aGen[200];
+  int i;
+
+  memset(apSlot, 0, sizeof(apSlot));
+  memset(aGen, 0, sizeof(aGen));
+  for(i=0; i<p->nOp; i++){
+    int iSlot = slabTestRandom(p) % 200;
+    int nNew = 1 + slabTestRandom(p) % 600;
+    if( (slabTestRandom(p) % 20)==0 ) nNew += slabTestRandom(p) % 5000;
+
+    if( apSlot[iSlot]==0 ){
+      apSlot[iSlot] = sqlite4_mm_malloc(p->pMM, nNew);
+      anSlot[iSlot] = nNew;
+      if( apSlot[iSlot] ) slabTestFill(apSlot[iSlot], nNew, iSlot, aGen[iSlot]);
+    }else{
+      int nOld = anSlot[iSlot];
+      if( slabTestCheck(apSlot[iSlot], nOld, iSlot, aGen[iSlot])
+       || sqlite4_mm_msize(p->pMM, apSlot[iSlot])<nOld
+      ){
+        p->nErr++;
+      }
+      if( slabTestRandom(p) % 2 ){
+        unsigned char *pNew = sqlite4_mm_realloc(p->pMM, apSlot[iSlot], nNew);
+        if( pNew ){
+          int nMin = (nOld<nNew ? nOld : nNew);
+          if( slabTestCheck(pNew, nMin, iSlot, aGen[iSlot]) ) p->nErr++;
+          aGen[iSlot]++;
+          slabTestFill(pNew, nNew, iSlot, aGen[iSlot]);
+          apSlot[iSlot] = pNew;
+          anSlot[iSlot] = nNew;
+        }
+      }else{
+        sqlite4_mm_free(p->pMM, apSlot[iSlot]);
+        apSlot[iSlot] = 0;
+        aGen[iSlot]++;
+      }
+    }
+  }
+
+  for(i=0; i<200; i++){
+    if( apSlot[i] ){
+      if( slabTestCheck(apSlot[i], anSlot[i], i, aGen[i]) ) p->nErr++;
+      sqlite4_mm_free(p->pMM, apSlot[i]);
+    }
+  }
+  return 0;
+}
+
+/*
+** tclcmd: test_mm_slab NTHREAD NOP
+**
+** Create an SQLITE4_MM_SLAB allocator and run a workload of NOP random
+** allocations, reallocations and frees against it in each of NTHREAD
+** concurrent threads. Return a list of the following, in order:
+**
+**   * The number of corrupt allocations detected.
+**   * The SQLITE4_MMSTAT_UNITS_HW statistic.
+**   * The SQLITE4_MMSTAT_OUT and UNITS statistics once all threads have
+**     finished (both should be zero).
+**   * The SQLITE4_MMSTAT_SIZE statistic for each size class. This is
+**     a list of the sizes of the blocks in each class.
+*/
+static int test_mm_slab(
+  void * clientData,
+  Tcl_Interp *interp,
+  int objc,
+  Tcl_Obj *CONST objv[]
+){
+  SlabTest aTest[16];
+  sqlite4_mm *pMM;
+  int nThread;
+  int nOp;
+  int nErr = 0;
+  int i;
+  Tcl_Obj *pRet;
+  Tcl_Obj *pSize;
+
+  if( objc!=3 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "NTHREAD NOP");
+    return TCL_ERROR;
+  }
+  if( Tcl_GetIntFromObj(interp, objv[1], &nThread)
+   || Tcl_GetIntFromObj(interp, objv[2], &nOp)
+  ){
+    return TCL_ERROR;
+  }
+  if( nThread<1 || nThread>16 ){
+    Tcl_AppendResult(interp, "NTHREAD must be between 1 and 16", 0);
+    return TCL_ERROR;
+  }
+
+  pMM = sqlite4_mm_new(SQLITE4_MM_SLAB, sqlite4_mm_default());
+  if( pMM==0 ){
+    Tcl_AppendResult(interp, "sqlite4_mm_new() failed", 0);
+    return TCL_ERROR;
+  }
+
+  for(i=0; i<nThread; i++){
+    aTest[i].pMM = pMM;
+    aTest[i].nOp = nOp;
+    aTest[i].iRand = i+1;
+    aTest[i].nErr = 0;
+  }
+#if SQLITE4_THREADSAFE && SQLITE4_OS_UNIX
+  {
+    pthread_t aThread[16];
+    for(i=0; i<nThread; i++){
+      pthread_create(&aThread[i], 0, slabTestMain, (void*)&aTest[i]);
+    }
+    for(i=0; i<nThread; i++){
+      pthread_join(aThread[i], 0);
+    }
+  }
+#else
+  for(i=0; i<nThread; i++){
+    slabTestMain((void*)&aTest[i]);
+  }
+#endif
+  for(i=0; i<nThread; i++) nErr += aTest[i].nErr;
+
+  pRet = Tcl_NewObj();
+  Tcl_ListObjAppendElement(interp, pRet, Tcl_NewIntObj(nErr));
+  Tcl_ListObjAppendElement(interp, pRet, 
+      Tcl_NewWideIntObj(sqlite4_mm_stat(pMM, SQLITE4_MMSTAT_UNITS_HW, 0))
+  );
+  Tcl_ListObjAppendElement(interp, pRet, 
+      Tcl_NewWideIntObj(sqlite4_mm_stat(pMM, SQLITE4_MMSTAT_OUT, 0))
+  );
+  Tcl_ListObjAppendElement(interp, pRet, 
+      Tcl_NewWideIntObj(sqlite4_mm_stat(pMM, SQLITE4_MMSTAT_UNITS, 0))
+  );
+  pSize = Tcl_NewObj();
+  for(i=0; 1; i++){
+    int eStat = SQLITE4_MMSTAT_SIZE | SQLITE4_MMSTAT_CLASS(i);
+    sqlite4_int64 iSize = sqlite4_mm_stat(pMM, eStat, 0);
+    if( iSize<0 ) break;
+    Tcl_ListObjAppendElement(interp, pSize, Tcl_NewWideIntObj(iSize));
+  }
+  Tcl_ListObjAppendElement(interp, pRet, pSize);
+  sqlite4_mm_destroy(pMM);
+
+  Tcl_SetObjResult(interp, pRet);
+  return TCL_OK;
+}
+
 /*
 ** Register commands with the TCL interpreter.
 */
@@ -1367,6 +1558,7 @@ int Sqlitetest_malloc_Init(Tcl_Interp *interp){
      { "test_mm_report",                 test_mm_report                ,0 },
      { "test_mm_faultconfig",            test_mm_faultconfig           ,0 },
      { "test_mm_faultreport",            test_mm_faultreport           ,0 },
+     { "test_mm_slab",                   test_mm_slab                  ,0 },
   };
   int i;
   for(i=0; i<sizeof(aObjCmd)/sizeof(aObjCmd[0]); i++){
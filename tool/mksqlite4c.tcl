@@ -273,6 +273,7 @@ foreach file {
    vdbeapi.c
    vdbecodec.c
    vdbecursor.c
+   vdbesort.c
    vdbetrace.c
    vdbe.c
 